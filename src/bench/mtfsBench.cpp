@@ -0,0 +1,380 @@
+#include "merkle.hpp"
+#include <benchmark/benchmark.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+/*
+ * Benchmarks for the hashing and build hot paths: run with `make bench`
+ * (pass Google Benchmark flags with BENCH_ARGS, e.g.
+ * BENCH_ARGS=--benchmark_filter=Build). Synthetic trees are written once
+ * under $MTFS_BENCH_DIR (default: the system temp directory) and removed on
+ * exit, so the build benchmarks read from a warm page cache.
+ */
+
+namespace
+{
+    const HashAlgorithm ALGORITHMS[] = {HashAlgorithm::SHA256, HashAlgorithm::BLAKE3, HashAlgorithm::XXH3_128};
+    const IoBackend IO_BACKENDS[] = {IoBackend::STREAM, IoBackend::MMAP, IoBackend::IO_URING};
+
+    /**
+     * @struct TreeShape
+     * @brief Layout of a synthetic directory tree
+     */
+    struct TreeShape
+    {
+        const char *name;   // Directory name, also shown as the benchmark label
+        size_t depth;       // Directory levels below the root
+        size_t fanOut;      // Subdirectories per directory
+        size_t filesPerDir; // Files in every directory
+        size_t fileSize;    // Bytes per file
+    };
+
+    const TreeShape SHAPES[] = {
+        {"deep_narrow", 64, 1, 4, 4096},         // 65 nested directories, 260 files
+        {"flat_wide", 0, 0, 20000, 1024},        // One directory, 20000 files
+        {"many_small", 2, 16, 75, 512},          // 273 directories, 20475 files
+        {"few_huge", 0, 0, 4, 32 * 1024 * 1024}, // 4 files of 32 MiB
+    };
+
+    /**
+     * @brief Get the directory holding the synthetic trees
+     * @return Path of the (created) benchmark directory
+     */
+    const fs::path &benchDirectory()
+    {
+        static const fs::path directory = []()
+        {
+            const char *base = getenv("MTFS_BENCH_DIR");
+            fs::path path = fs::path(base ? base : fs::temp_directory_path().string()) /
+                            ("mtfs_bench_" + to_string(getpid()));
+            fs::create_directories(path);
+            return path;
+        }();
+        return directory;
+    }
+
+    /**
+     * @brief Fill a buffer with reproducible pseudo-random bytes
+     * @param data Buffer to fill
+     * @param length Number of bytes
+     * @param seed Seed; different seeds give different contents
+     */
+    void fillBytes(char *data, size_t length, uint64_t seed)
+    {
+        uint64_t state = seed * 0x9E3779B97F4A7C15ull + 1;
+        for (size_t i = 0; i < length; ++i)
+        {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            data[i] = (char)state;
+        }
+    }
+
+    /**
+     * @brief Write one directory level of a shape
+     * @param path Directory to fill
+     * @param shape Tree layout
+     * @param level Depth of path below the root
+     * @param seed Running seed, so every file has distinct content
+     */
+    void writeLevel(const fs::path &path, const TreeShape &shape, size_t level, uint64_t &seed)
+    {
+        fs::create_directories(path);
+
+        vector<char> content(shape.fileSize);
+        for (size_t i = 0; i < shape.filesPerDir; ++i)
+        {
+            fillBytes(content.data(), content.size(), ++seed);
+            ofstream out(path / ("file" + to_string(i)), ios::binary);
+            if (!out.write(content.data(), content.size()))
+            {
+                throw runtime_error("Cannot write benchmark file under " + path.string());
+            }
+        }
+
+        if (level < shape.depth)
+        {
+            for (size_t i = 0; i < max<size_t>(shape.fanOut, 1); ++i)
+            {
+                writeLevel(path / ("dir" + to_string(i)), shape, level + 1, seed);
+            }
+        }
+    }
+
+    /**
+     * @brief Get the synthetic tree of a shape, writing it on first use
+     * @param shape Tree layout
+     * @return Root directory of the tree
+     */
+    string shapeDirectory(const TreeShape &shape)
+    {
+        fs::path path = benchDirectory() / shape.name;
+        if (!fs::exists(path))
+        {
+            uint64_t seed = 0;
+            writeLevel(path, shape, 0, seed);
+        }
+        return path.string();
+    }
+
+    /**
+     * @brief Restart peak RSS tracking at the current RSS, where the kernel allows it
+     */
+    void resetPeakRss()
+    {
+        ofstream("/proc/self/clear_refs") << "5";
+    }
+
+    /**
+     * @brief Get the peak resident set size since the last resetPeakRss
+     * @return Peak RSS in MiB (process lifetime peak if it cannot be reset)
+     */
+    double peakRssMiB()
+    {
+        ifstream status("/proc/self/status");
+        string line;
+        while (getline(status, line))
+        {
+            if (line.compare(0, 7, "VmHWM:\t") == 0)
+            {
+                return stod(line.substr(7)) / 1024.0; // Reported in kB
+            }
+        }
+
+        rusage usage{};
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_maxrss / 1024.0; // ru_maxrss is in KiB on Linux
+    }
+
+    /**
+     * @brief Get a hash engine, skipping the benchmark if it is not compiled in
+     * @param state Benchmark state
+     * @param algorithm Engine to get
+     * @return The engine, or nullptr if the benchmark was skipped
+     */
+    const HashEngine *engineOrSkip(benchmark::State &state, HashAlgorithm algorithm)
+    {
+        try
+        {
+            return &HashEngine::get(algorithm);
+        }
+        catch (const exception &e)
+        {
+            state.SkipWithError(e.what());
+            return nullptr;
+        }
+    }
+
+    /**
+     * @brief Hash one buffer: args are the algorithm and the buffer size
+     */
+    void BM_Hash(benchmark::State &state)
+    {
+        HashAlgorithm algorithm = ALGORITHMS[state.range(0)];
+        const HashEngine *engine = engineOrSkip(state, algorithm);
+        if (!engine)
+        {
+            return;
+        }
+
+        vector<char> buffer(state.range(1));
+        fillBytes(buffer.data(), buffer.size(), 1);
+        for (auto _ : state)
+        {
+            benchmark::DoNotOptimize(engine->hash(buffer.data(), buffer.size()));
+        }
+
+        state.SetLabel(HashEngine::algorithmName(algorithm));
+        state.SetBytesProcessed(state.iterations() * buffer.size());
+    }
+    BENCHMARK(BM_Hash)->ArgsProduct({{0, 1, 2}, {64, 4 << 10, 64 << 10, 1 << 20}});
+
+    /**
+     * @brief Hash a batch of 64 small buffers with hashMany: args are the algorithm and the buffer size
+     */
+    void BM_HashMany(benchmark::State &state)
+    {
+        HashAlgorithm algorithm = ALGORITHMS[state.range(0)];
+        const HashEngine *engine = engineOrSkip(state, algorithm);
+        if (!engine)
+        {
+            return;
+        }
+
+        const size_t count = 64;
+        vector<char> buffer(count * state.range(1));
+        fillBytes(buffer.data(), buffer.size(), 2);
+
+        vector<HashInput> inputs(count);
+        for (size_t i = 0; i < count; ++i)
+        {
+            inputs[i] = {buffer.data() + i * state.range(1), (size_t)state.range(1)};
+        }
+
+        vector<Digest> digests(count);
+        for (auto _ : state)
+        {
+            engine->hashMany(inputs.data(), count, digests.data());
+            benchmark::DoNotOptimize(digests.data());
+        }
+
+        state.SetLabel(HashEngine::algorithmName(algorithm));
+        state.SetBytesProcessed(state.iterations() * buffer.size());
+        state.counters["files/s"] = benchmark::Counter(state.iterations() * count, benchmark::Counter::kIsRate);
+    }
+    BENCHMARK(BM_HashMany)->ArgsProduct({{0, 1, 2}, {512, 4 << 10}});
+
+    /**
+     * @brief Hash a 64 MiB file with hash_file_content: the arg is the I/O backend
+     */
+    void BM_HashFileContent(benchmark::State &state)
+    {
+        static const string path = []()
+        {
+            string file = (benchDirectory() / "hash_file_content.bin").string();
+            vector<char> content(64 << 20);
+            fillBytes(content.data(), content.size(), 3);
+            ofstream(file, ios::binary).write(content.data(), content.size());
+            return file;
+        }();
+
+        IoBackend backend = IO_BACKENDS[state.range(0)];
+        MerkleTree tree;
+        tree.setIoBackend(backend);
+
+        size_t bytes = 0;
+        try
+        {
+            for (auto _ : state)
+            {
+                auto [contentHash, fileSize, chunkHashes] = tree.hash_file_content(path);
+                benchmark::DoNotOptimize(contentHash);
+                bytes += fileSize;
+            }
+        }
+        catch (const exception &e)
+        {
+            state.SkipWithError(e.what());
+            return;
+        }
+
+        state.SetLabel(ioBackendName(backend));
+        state.SetBytesProcessed(bytes);
+    }
+    BENCHMARK(BM_HashFileContent)->DenseRange(0, 2)->Unit(benchmark::kMillisecond);
+
+    /**
+     * @brief Recompute a directory hash with updateHash: the arg is the number of children
+     */
+    void BM_DirectoryHash(benchmark::State &state)
+    {
+        const HashEngine &engine = HashEngine::get(HashAlgorithm::SHA256);
+
+        MerkleNode directory("dir", false);
+        for (int64_t i = 0; i < state.range(0); ++i)
+        {
+            auto child = make_shared<MerkleNode>("file" + to_string(i), true);
+            child->contentHash = engine.hash(child->name.data(), child->name.size());
+            child->updateHash(engine);
+            directory.addChild(child);
+        }
+
+        for (auto _ : state)
+        {
+            benchmark::DoNotOptimize(directory.updateHash(engine));
+        }
+
+        state.counters["children/s"] =
+            benchmark::Counter(state.iterations() * state.range(0), benchmark::Counter::kIsRate);
+    }
+    BENCHMARK(BM_DirectoryHash)->Arg(10)->Arg(1000)->Arg(100000);
+
+    /**
+     * @brief Recompute every hash of a built tree with calculateHash: the arg is the shape
+     */
+    void BM_CalculateHash(benchmark::State &state)
+    {
+        const TreeShape &shape = SHAPES[state.range(0)];
+        MerkleTree tree;
+        auto root = tree.build_tree(shapeDirectory(shape));
+        const HashEngine &engine = HashEngine::get(tree.getHashAlgorithm());
+
+        auto [files, directories, totalSize] = tree.getTreeStats();
+        for (auto _ : state)
+        {
+            benchmark::DoNotOptimize(root->calculateHash(engine));
+        }
+
+        state.SetLabel(shape.name);
+        state.counters["nodes/s"] =
+            benchmark::Counter(state.iterations() * (files + directories), benchmark::Counter::kIsRate);
+    }
+    BENCHMARK(BM_CalculateHash)->DenseRange(0, 2);
+
+    /**
+     * @brief Export a built tree with exportToJson: the arg is the shape
+     */
+    void BM_ExportJson(benchmark::State &state)
+    {
+        const TreeShape &shape = SHAPES[state.range(0)];
+        MerkleTree tree;
+        tree.build_tree(shapeDirectory(shape));
+
+        size_t bytes = 0;
+        for (auto _ : state)
+        {
+            bytes += tree.exportToJson().size();
+        }
+
+        state.SetLabel(shape.name);
+        state.SetBytesProcessed(bytes);
+    }
+    BENCHMARK(BM_ExportJson)->DenseRange(0, 2)->Unit(benchmark::kMillisecond);
+
+    /**
+     * @brief Build a synthetic tree from disk: args are the shape and the thread count (0 = all cores)
+     *
+     * Reports files/s, bytes/s and the peak RSS while building.
+     */
+    void BM_BuildTree(benchmark::State &state)
+    {
+        const TreeShape &shape = SHAPES[state.range(0)];
+        string directory = shapeDirectory(shape);
+
+        size_t files = 0;
+        size_t bytes = 0;
+        resetPeakRss();
+        for (auto _ : state)
+        {
+            MerkleTree tree(MTFSConstants::DEFAULT_CHUNK_SIZE, state.range(1));
+            tree.build_tree(directory);
+
+            auto [fileCount, directoryCount, totalSize] = tree.getTreeStats();
+            files += fileCount;
+            bytes += totalSize;
+        }
+
+        state.SetLabel(shape.name);
+        state.SetBytesProcessed(bytes);
+        state.counters["files/s"] = benchmark::Counter(files, benchmark::Counter::kIsRate);
+        state.counters["peak_rss_MiB"] = peakRssMiB();
+    }
+    BENCHMARK(BM_BuildTree)->ArgsProduct({{0, 1, 2, 3}, {1, 0}})->Unit(benchmark::kMillisecond)->UseRealTime();
+}
+
+int main(int argc, char **argv)
+{
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+    {
+        return 1;
+    }
+
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+
+    error_code error;
+    fs::remove_all(benchDirectory(), error);
+    return 0;
+}
@@ -0,0 +1,616 @@
+#include "merkle.hpp"
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace
+{
+    // Record kinds of the spill file
+    const uint8_t SPILL_FILE = 0;      // File with its digests
+    const uint8_t SPILL_DIRECTORY = 1; // Directory; the records of its children's subtrees follow
+    const uint8_t SPILL_SEGMENT = 2;   // Subtree spilled earlier, by the offset of its records
+
+    /**
+     * @brief A subtree written to the spill file, whose root stays in its parent
+     */
+    struct SpilledSubtree
+    {
+        uint64_t offset;       // Offset of its records in the spill file
+        SnapshotTotals totals; // Its totals, counting its root
+    };
+
+    /**
+     * @brief A hashed directory whose parent is still being walked
+     */
+    struct FinishedDirectory
+    {
+        MerkleNode *node; // The directory
+        size_t cost;      // Estimated bytes of its subtree held in memory
+        bool spilled;     // True once only its root is left
+    };
+
+    typedef unordered_map<const MerkleNode *, SpilledSubtree> SpilledMap;
+
+    /**
+     * @class SpillFile
+     * @brief Temporary file the spilled subtrees are appended to
+     *
+     * The file is unlinked as soon as it is created, so it goes away with
+     * the descriptor even if the build fails.
+     */
+    class SpillFile
+    {
+    public:
+        /**
+         * @brief Create the file
+         * @param directory Directory to create it in ("" for the working directory)
+         * @throws runtime_error If the file cannot be created
+         */
+        explicit SpillFile(const fs::path &directory) : fd(-1), written(0)
+        {
+            string pattern = ((directory.empty() ? fs::path(".") : directory) / ".mtfs-spill-XXXXXX").string();
+            fd = ::mkostemp(pattern.data(), O_CLOEXEC);
+            if (fd < 0)
+            {
+                throw runtime_error("Cannot create spill file in " + directory.string());
+            }
+            ::unlink(pattern.c_str());
+        }
+
+        ~SpillFile()
+        {
+            ::close(fd);
+        }
+
+        SpillFile(const SpillFile &) = delete;
+        SpillFile &operator=(const SpillFile &) = delete;
+
+        /**
+         * @brief Get the size of the file, including buffered bytes
+         * @return Offset the next append goes to
+         */
+        uint64_t size() const
+        {
+            return written + buffer.size();
+        }
+
+        /**
+         * @brief Append bytes, writing them out when the buffer fills
+         * @param data Bytes to append
+         * @param length Number of bytes
+         * @throws runtime_error If a write fails
+         */
+        void append(const void *data, size_t length)
+        {
+            const char *bytes = static_cast<const char *>(data);
+            buffer.insert(buffer.end(), bytes, bytes + length);
+            if (buffer.size() >= MTFSConstants::SPILL_BUFFER_SIZE)
+            {
+                flush();
+            }
+        }
+
+        /**
+         * @brief Write the buffered bytes
+         * @throws runtime_error If a write fails
+         */
+        void flush()
+        {
+            size_t done = 0;
+            while (done < buffer.size())
+            {
+                ssize_t count = ::pwrite(fd, buffer.data() + done, buffer.size() - done, written + done);
+                if (count < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (count <= 0)
+                {
+                    throw runtime_error("Error writing spill file");
+                }
+                done += count;
+            }
+
+            written += done;
+            buffer.clear();
+        }
+
+        /**
+         * @brief Read written bytes
+         * @param offset Offset of the bytes (below size() once flushed)
+         * @param data Receives the bytes
+         * @param length Number of bytes
+         * @throws runtime_error If a read fails or ends early
+         */
+        void readAt(uint64_t offset, void *data, size_t length) const
+        {
+            char *bytes = static_cast<char *>(data);
+            while (length > 0)
+            {
+                ssize_t count = ::pread(fd, bytes, length, offset);
+                if (count < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (count <= 0)
+                {
+                    throw runtime_error("Error reading spill file");
+                }
+                bytes += count;
+                offset += count;
+                length -= count;
+            }
+        }
+
+    private:
+        int fd;              // Descriptor of the unlinked file
+        uint64_t written;    // Bytes written to the file
+        vector<char> buffer; // Bytes appended but not yet written
+    };
+
+    /**
+     * @class SpillReader
+     * @brief Reads the records of a spilled subtree in order, through a buffer
+     */
+    class SpillReader
+    {
+    public:
+        /**
+         * @brief Start reading at an offset
+         * @param file Spill file, flushed
+         * @param offset Offset of the first record
+         */
+        SpillReader(const SpillFile &file, uint64_t offset) : file(&file), offset(offset), position(0)
+        {
+        }
+
+        /**
+         * @brief Read the next bytes
+         * @param data Receives the bytes
+         * @param length Number of bytes
+         * @throws runtime_error If the spill file ends early
+         */
+        void read(void *data, size_t length)
+        {
+            char *bytes = static_cast<char *>(data);
+            while (length > 0)
+            {
+                if (position == buffer.size())
+                {
+                    size_t count = min<uint64_t>(MTFSConstants::SPILL_BUFFER_SIZE, file->size() - offset);
+                    if (count == 0)
+                    {
+                        throw runtime_error("Spill file ended early");
+                    }
+                    buffer.resize(count);
+                    file->readAt(offset, buffer.data(), count);
+                    offset += count;
+                    position = 0;
+                }
+
+                size_t count = min(length, buffer.size() - position);
+                memcpy(bytes, buffer.data() + position, count);
+                position += count;
+                bytes += count;
+                length -= count;
+            }
+        }
+
+        /**
+         * @brief Read a value
+         * @return The value
+         */
+        template <typename T> T read()
+        {
+            T value;
+            read(&value, sizeof(value));
+            return value;
+        }
+
+    private:
+        const SpillFile *file; // File read from
+        uint64_t offset;       // Offset of the next bytes to buffer
+        vector<char> buffer;   // Buffered bytes
+        size_t position;       // Next unread byte of the buffer
+    };
+
+    /**
+     * @brief Estimate the memory held by a node
+     * @param node Node of the tree being built
+     * @return Bytes of the node, its name (also the key in its parent) and chunk hashes
+     */
+    size_t nodeCost(const MerkleNode &node)
+    {
+        return sizeof(MerkleNode) + 2 * node.name.size() + node.chunkHashes.size() * sizeof(Digest) +
+               MTFSConstants::BOUNDED_NODE_OVERHEAD;
+    }
+
+    /**
+     * @brief Get the totals of a file
+     * @param file File node
+     * @return Its totals
+     */
+    SnapshotTotals fileTotals(const MerkleNode &file)
+    {
+        SnapshotTotals totals;
+        totals.nodes = 1;
+        totals.digests = 1 + file.chunkHashes.size();
+        totals.nameBytes = file.name.size();
+        totals.files = 1;
+        totals.size = file.fileSize;
+        return totals;
+    }
+
+    /**
+     * @brief Add a child's subtree to the totals of its directory
+     * @param directory Totals of the directory
+     * @param child Totals of the child
+     */
+    void addTotals(SnapshotTotals &directory, const SnapshotTotals &child)
+    {
+        directory.nodes += child.nodes;
+        directory.childEntries += child.childEntries;
+        directory.digests += child.digests;
+        directory.nameBytes += child.nameBytes;
+        directory.files += child.files;
+        directory.directories += child.directories;
+        directory.size += child.size;
+        directory.depth = max(directory.depth, child.depth + 1);
+    }
+
+    /**
+     * @brief Get the totals of every directory of a subtree held in memory
+     * @param top Root of the subtree (a directory)
+     * @param spilled Subtrees already spilled, whose roots are left in the subtree
+     * @return Totals per directory held in memory, including top
+     */
+    unordered_map<const MerkleNode *, SnapshotTotals> directoryTotals(const MerkleNode &top, const SpilledMap &spilled)
+    {
+        unordered_map<const MerkleNode *, SnapshotTotals> totals;
+
+        // Post-order, so children are summed before their parent
+        vector<pair<const MerkleNode *, bool>> stack{{&top, false}};
+        while (!stack.empty())
+        {
+            const MerkleNode *node = stack.back().first;
+            if (!stack.back().second)
+            {
+                stack.back().second = true;
+                for (const auto &child : node->children)
+                {
+                    if (!child.second->isFile && !spilled.count(child.second.get()))
+                    {
+                        stack.emplace_back(child.second.get(), false);
+                    }
+                }
+                continue;
+            }
+            stack.pop_back();
+
+            SnapshotTotals &directory = totals[node];
+            directory.nodes = 1;
+            directory.childEntries = node->children.size();
+            directory.nameBytes = node->name.size();
+            directory.directories = 1;
+            for (const auto &child : node->children)
+            {
+                const MerkleNode *childNode = child.second.get();
+                if (childNode->isFile)
+                {
+                    addTotals(directory, fileTotals(*childNode));
+                    continue;
+                }
+
+                auto it = spilled.find(childNode);
+                addTotals(directory, it != spilled.end() ? it->second.totals : totals.at(childNode));
+            }
+        }
+
+        return totals;
+    }
+
+    /**
+     * @brief Append the fields every node record starts with
+     * @param spill Spill file
+     * @param kind SPILL_FILE or SPILL_DIRECTORY
+     * @param node Node of the record
+     * @throws runtime_error If the name is too long for the snapshot format
+     */
+    void spillNode(SpillFile &spill, uint8_t kind, const MerkleNode &node)
+    {
+        if (node.name.length() > UINT16_MAX)
+        {
+            throw runtime_error("Name too long for the snapshot format: " + node.name);
+        }
+
+        uint16_t nameLength = node.name.length();
+        spill.append(&kind, sizeof(kind));
+        spill.append(&nameLength, sizeof(nameLength));
+        spill.append(node.name.data(), nameLength);
+        spill.append(&node.hash, sizeof(node.hash));
+        spill.append(&node.fileStat, sizeof(node.fileStat));
+    }
+
+    /**
+     * @brief Write a hashed subtree to the spill file in pre-order
+     * @param spill Spill file
+     * @param top Root of the subtree (a hashed directory)
+     * @param spilled Subtrees already spilled; those inside top become references and are dropped
+     * @return Offset and totals of the subtree
+     * @throws runtime_error If a name is too long or a write fails
+     */
+    SpilledSubtree spillSubtree(SpillFile &spill, const MerkleNode &top, SpilledMap &spilled)
+    {
+        auto totals = directoryTotals(top, spilled);
+        SpilledSubtree subtree{spill.size(), totals.at(&top)};
+
+        vector<const MerkleNode *> stack{&top};
+        vector<uint64_t> childNodes;
+        while (!stack.empty())
+        {
+            const MerkleNode *node = stack.back();
+            stack.pop_back();
+
+            auto it = node == &top ? spilled.end() : spilled.find(node);
+            if (it != spilled.end())
+            {
+                spill.append(&SPILL_SEGMENT, sizeof(SPILL_SEGMENT));
+                spill.append(&it->second.offset, sizeof(it->second.offset));
+                spilled.erase(it);
+                continue;
+            }
+
+            if (node->isFile)
+            {
+                uint64_t fileSize = node->fileSize;
+                uint32_t chunkCount = node->chunkHashes.size();
+                spillNode(spill, SPILL_FILE, *node);
+                spill.append(&fileSize, sizeof(fileSize));
+                spill.append(&node->contentHash, sizeof(node->contentHash));
+                spill.append(&chunkCount, sizeof(chunkCount));
+                spill.append(node->chunkHashes.data(), chunkCount * sizeof(Digest));
+                continue;
+            }
+
+            childNodes.clear();
+            for (const auto &child : node->children)
+            {
+                const MerkleNode *childNode = child.second.get();
+                auto spilledChild = spilled.find(childNode);
+                childNodes.push_back(childNode->isFile               ? 1
+                                     : spilledChild != spilled.end() ? spilledChild->second.totals.nodes
+                                                                     : totals.at(childNode).nodes);
+            }
+
+            uint32_t childCount = childNodes.size();
+            spillNode(spill, SPILL_DIRECTORY, *node);
+            spill.append(&childCount, sizeof(childCount));
+            spill.append(childNodes.data(), childCount * sizeof(uint64_t));
+
+            for (auto child = node->children.rbegin(); child != node->children.rend(); ++child)
+            {
+                stack.push_back(child->second.get());
+            }
+        }
+
+        return subtree;
+    }
+
+    /**
+     * @brief Stream a spilled tree into a snapshot
+     * @param writer Snapshot receiving the nodes
+     * @param spill Spill file, flushed
+     * @param offset Offset of the root's records
+     * @throws runtime_error If the spill file cannot be read or the snapshot written
+     *
+     * The records are already in pre-order; a reference to an earlier
+     * spilled subtree is replaced by its records, read through a reader of
+     * its own.
+     */
+    void streamSnapshot(SnapshotWriter &writer, const SpillFile &spill, uint64_t offset)
+    {
+        vector<SpillReader> readers{SpillReader(spill, offset)};
+        vector<size_t> readerLevels{0};
+        vector<uint64_t> pending{1}; // Subtrees left to read per open directory
+        vector<uint64_t> childNodes;
+        vector<Digest> chunks;
+        string name;
+
+        while (!pending.empty())
+        {
+            if (pending.back() == 0)
+            {
+                pending.pop_back();
+                if (readerLevels.back() == pending.size())
+                {
+                    readers.pop_back();
+                    readerLevels.pop_back();
+                }
+                continue;
+            }
+            pending.back()--;
+
+            SpillReader &reader = readers.back();
+            uint8_t kind = reader.read<uint8_t>();
+            if (kind == SPILL_SEGMENT)
+            {
+                uint64_t segment = reader.read<uint64_t>();
+                readerLevels.push_back(pending.size());
+                readers.emplace_back(spill, segment);
+                pending.push_back(1);
+                continue;
+            }
+
+            name.resize(reader.read<uint16_t>());
+            reader.read(name.data(), name.size());
+            Digest hash = reader.read<Digest>();
+            FileStat fileStat = reader.read<FileStat>();
+
+            if (kind == SPILL_FILE)
+            {
+                uint64_t fileSize = reader.read<uint64_t>();
+                Digest contentHash = reader.read<Digest>();
+                chunks.resize(reader.read<uint32_t>());
+                reader.read(chunks.data(), chunks.size() * sizeof(Digest));
+                writer.addFile(name, hash, fileStat, fileSize, contentHash, chunks.data(), chunks.size());
+                continue;
+            }
+
+            childNodes.resize(reader.read<uint32_t>());
+            reader.read(childNodes.data(), childNodes.size() * sizeof(uint64_t));
+            writer.addDirectory(name, hash, fileStat, childNodes);
+            pending.push_back(childNodes.size());
+        }
+    }
+}
+
+/**
+ * @brief Build the tree of a directory within a memory budget, straight into a snapshot
+ * @param directory_path Path to the directory to process
+ * @param snapshotPath Snapshot file receiving the tree
+ * @param memoryBudget Bytes of finished nodes kept in memory before subtrees are spilled
+ * @return What was spilled
+ * @throws runtime_error If directory path is invalid, or the spill or snapshot file
+ *         cannot be written
+ */
+BoundedBuildStats MerkleTree::buildBounded(const string &directory_path, const string &snapshotPath,
+                                           size_t memoryBudget)
+{
+    ProfiledRun run("bounded build", directory_path);
+
+    EntryType rootType = statEntry(directory_path, true, &rootDevice);
+    walkRoot = directory_path;
+    if (rootType == EntryType::MISSING)
+    {
+        throw runtime_error("Directory does not exist: " + directory_path);
+    }
+
+    if (rootType != EntryType::DIRECTORY)
+    {
+        throw runtime_error("Path is not a directory: " + directory_path);
+    }
+
+    // Clear previous tree data
+    root = nullptr;
+    clear_index();
+    flatTree.reset();
+    clear_linked_files();
+    rootPath = directory_path;
+    builtChunking = getChunking();
+
+    SpillFile spill(fs::path(snapshotPath).parent_path());
+    SpilledMap spilled;
+    vector<FinishedDirectory> finished; // In finish order: a directory's children are the entries above it
+    BoundedBuildStats stats;
+    size_t resident = 0;
+
+    FileBatch batch(*hashEngine, builtChunking, ioBackend, hashCache.get());
+    auto top = make_shared<MerkleNode>(fs::path(directory_path).filename().string(), false);
+
+    auto finish = [&](MerkleNode &directory)
+    {
+        // Every file queued so far is filled, including this directory's
+        batch.flush();
+        for (const auto &file : batch.takeFailures())
+        {
+            cerr << "Warning: Skipping " << file.path << " - Error processing file " << file.path << ": "
+                 << file.error << endl;
+            if (file.node->parent)
+            {
+                file.node->parent->removeChild(file.node->name);
+            }
+        }
+
+        // Subdirectories that were walked are hashed already; spilled ones keep their hash
+        size_t cost = nodeCost(directory);
+        for (const auto &child : directory.children)
+        {
+            MerkleNode &node = *child.second;
+            if (node.isFile)
+            {
+                node.updateHash(*hashEngine);
+                cost += nodeCost(node);
+            }
+            else if (node.children.empty() && !spilled.count(&node))
+            {
+                node.updateHash(*hashEngine);
+            }
+        }
+        directory.updateHash(*hashEngine);
+        resident += cost;
+
+        while (!finished.empty() && finished.back().node->parent == &directory)
+        {
+            cost += finished.back().cost;
+            finished.pop_back();
+        }
+        finished.push_back({&directory, cost, false});
+        stats.peakResident = max(stats.peakResident, resident);
+
+        if (resident <= memoryBudget)
+        {
+            return;
+        }
+
+        // Largest subtrees first, down to half the budget so spills stay few and large
+        vector<FinishedDirectory *> candidates;
+        for (auto &entry : finished)
+        {
+            if (!entry.spilled)
+            {
+                candidates.push_back(&entry);
+            }
+        }
+        sort(candidates.begin(), candidates.end(),
+             [](const FinishedDirectory *a, const FinishedDirectory *b) { return a->cost > b->cost; });
+
+        for (FinishedDirectory *entry : candidates)
+        {
+            size_t stubCost = nodeCost(*entry->node) + sizeof(SpilledSubtree) + MTFSConstants::BOUNDED_NODE_OVERHEAD;
+            if (resident <= memoryBudget / 2 || entry->cost <= stubCost)
+            {
+                break;
+            }
+
+            uint64_t start = spill.size();
+            SpilledSubtree subtree = spillSubtree(spill, *entry->node, spilled);
+            entry->node->clearChildren();
+            spilled[entry->node] = subtree;
+
+            resident = resident - entry->cost + stubCost;
+            entry->cost = stubCost;
+            entry->spilled = true;
+            stats.spilledSubtrees++;
+            stats.spilledBytes += spill.size() - start;
+        }
+    };
+
+    {
+        TraceSpan walkSpan("bounded walk");
+        walk_directory(top, fs::path(directory_path), batch, finish);
+    }
+
+    if (hashCache)
+    {
+        hashCache->flush();
+    }
+
+    // The root is written out last, so the snapshot can be read from the spill file alone
+    auto it = spilled.find(top.get());
+    SpilledSubtree whole = it != spilled.end() ? it->second : spillSubtree(spill, *top, spilled);
+    top.reset();
+    finished.clear();
+    spill.flush();
+
+    {
+        TraceSpan writeSpan("snapshot write", snapshotPath);
+        SnapshotWriter writer(snapshotPath, directory_path, builtChunking, hashEngine->algorithm(), whole.totals);
+        streamSnapshot(writer, spill, whole.offset);
+        writer.finish();
+    }
+
+    // Nothing is spilled before a directory finishes, so a wide one shows up here
+    stats.budgetOvershoot = stats.peakResident > memoryBudget ? stats.peakResident - memoryBudget : 0;
+
+    load(snapshotPath);
+    return stats;
+}
@@ -0,0 +1,238 @@
+#include "merkle.hpp"
+
+namespace
+{
+    /**
+     * @struct GearTable
+     * @brief Random 64-bit value per byte, used by the Gear fingerprint
+     */
+    struct GearTable
+    {
+        uint64_t values[256];
+    };
+
+    /**
+     * @brief Generate the Gear table with splitmix64
+     * @return Table of 256 pseudo-random values
+     *
+     * The values decide where chunks are cut, so they are part of the
+     * chunk format and must never change.
+     */
+    constexpr GearTable makeGearTable()
+    {
+        GearTable table{};
+        uint64_t state = 0;
+        for (int i = 0; i < 256; ++i)
+        {
+            state += 0x9e3779b97f4a7c15ULL;
+            uint64_t z = state;
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            table.values[i] = z ^ (z >> 31);
+        }
+        return table;
+    }
+
+    constexpr GearTable GEAR = makeGearTable();
+
+    // Buffers with shorter lane segments are scanned by a single chain
+    const size_t MIN_LANE_SEGMENT = 4096;
+
+    /**
+     * @brief Build a mask of the top bits of a fingerprint
+     * @param bits Number of bits
+     * @return Mask with the highest bits set
+     *
+     * The high bits of a Gear fingerprint depend on the most window bytes.
+     */
+    uint64_t topBits(int bits)
+    {
+        return bits <= 0 ? 0 : ~0ULL << (64 - bits);
+    }
+}
+
+/**
+ * @brief Start chunking a stream
+ * @param minSize Smallest chunk but the last
+ * @param averageSize Expected chunk size
+ * @param maxSize Largest chunk
+ */
+CdcChunker::CdcChunker(size_t minSize, size_t averageSize, size_t maxSize)
+    : minSize(minSize), averageSize(averageSize), maxSize(maxSize), fingerprint(0), chunkLength(0)
+{
+    // Normalized chunking (level 1): one bit stricter below the average, one looser above
+    int bits = 63 - __builtin_clzll(averageSize);
+    strictMask = topBits(bits + 1);
+    looseMask = topBits(bits - 1);
+}
+
+/**
+ * @brief Find the chunk ends in the next bytes of the stream
+ * @param data Pointer to the bytes
+ * @param length Number of bytes
+ * @param cuts Receives the end offsets (relative to data) of the chunks that end in the bytes
+ */
+void CdcChunker::scan(const uint8_t *data, size_t length, vector<size_t> &cuts)
+{
+    cuts.clear();
+    find_candidates(data, length);
+
+    // Offsets relative to data; the open chunk may have started in an earlier call
+    size_t start = 0;
+    size_t carried = chunkLength;
+    size_t next = 0;
+
+    while (true)
+    {
+        size_t chunkStart = start - carried; // Wraps for a carried chunk, but differences stay exact
+        size_t cut = SIZE_MAX;
+
+        for (; next < candidates.size(); ++next)
+        {
+            size_t end = (candidates[next] >> 1) + 1;
+            size_t chunk = end - chunkStart;
+            if (chunk < minSize)
+            {
+                continue;
+            }
+            if (chunk > maxSize)
+            {
+                break;
+            }
+            if (chunk >= averageSize || (candidates[next] & 1))
+            {
+                cut = end;
+                ++next;
+                break;
+            }
+        }
+
+        if (cut == SIZE_MAX)
+        {
+            if (maxSize - carried > length - start)
+            {
+                break;
+            }
+            cut = start + (maxSize - carried);
+        }
+
+        cuts.push_back(cut);
+        start = cut;
+        carried = 0;
+    }
+
+    chunkLength = carried + (length - start);
+}
+
+/**
+ * @brief Collect the cut candidates of a buffer, in order
+ * @param data Pointer to the bytes
+ * @param length Number of bytes
+ *
+ * The buffer is split into CDC_SCAN_LANES segments whose fingerprint
+ * chains are advanced together, so the CPU overlaps their latencies.
+ * A lane starts CDC_WINDOW_SIZE bytes before its segment: after that many
+ * steps every older byte has been shifted out, so its fingerprint equals
+ * the one of a serial scan.
+ */
+void CdcChunker::find_candidates(const uint8_t *data, size_t length)
+{
+    candidates.clear();
+    size_t segment = length / CDC_SCAN_LANES;
+
+    if (segment < MIN_LANE_SEGMENT)
+    {
+        uint64_t fp = fingerprint;
+        for (size_t i = 0; i < length; ++i)
+        {
+            fp = (fp << 1) + GEAR.values[data[i]];
+            if (!(fp & looseMask))
+            {
+                candidates.push_back(i << 1 | !(fp & strictMask));
+            }
+        }
+        fingerprint = fp;
+        return;
+    }
+
+    uint64_t fp[CDC_SCAN_LANES];
+    fp[0] = fingerprint;
+    for (size_t lane = 1; lane < CDC_SCAN_LANES; ++lane)
+    {
+        fp[lane] = 0;
+        for (size_t i = lane * segment - MTFSConstants::CDC_WINDOW_SIZE; i < lane * segment; ++i)
+        {
+            fp[lane] = (fp[lane] << 1) + GEAR.values[data[i]];
+        }
+        laneCandidates[lane].clear();
+    }
+    laneCandidates[0].clear();
+
+    for (size_t offset = 0; offset < segment; ++offset)
+    {
+#pragma GCC unroll 4
+        for (size_t lane = 0; lane < CDC_SCAN_LANES; ++lane)
+        {
+            size_t i = lane * segment + offset;
+            fp[lane] = (fp[lane] << 1) + GEAR.values[data[i]];
+            if (__builtin_expect(!(fp[lane] & looseMask), 0))
+            {
+                laneCandidates[lane].push_back(i << 1 | !(fp[lane] & strictMask));
+            }
+        }
+    }
+
+    // Bytes left over by the division belong to the last lane
+    size_t last = CDC_SCAN_LANES - 1;
+    for (size_t i = CDC_SCAN_LANES * segment; i < length; ++i)
+    {
+        fp[last] = (fp[last] << 1) + GEAR.values[data[i]];
+        if (!(fp[last] & looseMask))
+        {
+            laneCandidates[last].push_back(i << 1 | !(fp[last] & strictMask));
+        }
+    }
+    fingerprint = fp[last];
+
+    for (const auto &lane : laneCandidates)
+    {
+        candidates.insert(candidates.end(), lane.begin(), lane.end());
+    }
+}
+
+/**
+ * @brief Get the canonical name of a chunking mode
+ * @param mode Chunking mode
+ * @return Mode name ("fixed" or "cdc")
+ */
+string chunkingModeName(ChunkingMode mode)
+{
+    switch (mode)
+    {
+    case ChunkingMode::FIXED:
+        return "fixed";
+    case ChunkingMode::CDC:
+        return "cdc";
+    }
+
+    return "unknown";
+}
+
+/**
+ * @brief Parse a chunking mode name
+ * @param name Mode name as returned by chunkingModeName
+ * @return Parsed mode
+ * @throws runtime_error If the name is unknown
+ */
+ChunkingMode parseChunkingMode(const string &name)
+{
+    for (ChunkingMode mode : {ChunkingMode::FIXED, ChunkingMode::CDC})
+    {
+        if (name == chunkingModeName(mode))
+        {
+            return mode;
+        }
+    }
+
+    throw runtime_error("Unknown chunking mode: " + name);
+}
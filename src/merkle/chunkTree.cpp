@@ -0,0 +1,205 @@
+#include "merkle.hpp"
+
+namespace
+{
+    // Prefixes of the leaf and inner node records: the preimages of the two
+    // differ in their first byte and length, so a node cannot pass for a leaf
+    const uint8_t LEAF_NODE_PREFIX = 0x00;
+    const uint8_t INNER_NODE_PREFIX = 0x01;
+
+    // Size of a leaf record: prefix and chunk hash
+    const size_t LEAF_RECORD_SIZE = 1 + sizeof(Digest);
+
+    // Size of an inner node record: prefix and two child hashes
+    const size_t INNER_RECORD_SIZE = 1 + 2 * sizeof(Digest);
+}
+
+/**
+ * @brief Compute the root of a chunk tree
+ * @param engine Hash engine of the tree
+ * @param chunkHashes Leaves (at least one)
+ * @return Root hash
+ * @throws runtime_error If there are no chunk hashes
+ */
+Digest ChunkTree::root(const HashEngine &engine, const vector<Digest> &chunkHashes)
+{
+    if (chunkHashes.empty())
+    {
+        throw runtime_error("Chunk tree needs at least one chunk");
+    }
+
+    // A file of one chunk is hashed as a leaf too, never as its bare content hash
+    vector<Digest> level = hash_leaves(engine, chunkHashes);
+    while (level.size() > 1)
+    {
+        hash_level(engine, level);
+    }
+
+    return level[0];
+}
+
+/**
+ * @brief Build the inclusion proof of one chunk
+ * @param engine Hash engine of the tree
+ * @param chunkHashes Leaves of the chunk tree
+ * @param chunkIndex Chunk to prove
+ * @return Proof of the chunk
+ * @throws runtime_error If the index is out of range
+ */
+ChunkProof ChunkTree::prove(const HashEngine &engine, const vector<Digest> &chunkHashes, size_t chunkIndex)
+{
+    if (chunkIndex >= chunkHashes.size())
+    {
+        throw runtime_error("Chunk index " + to_string(chunkIndex) + " out of range (file has " +
+                            to_string(chunkHashes.size()) + " chunks)");
+    }
+
+    ChunkProof proof{chunkIndex, chunkHashes.size(), {}};
+
+    vector<Digest> level = hash_leaves(engine, chunkHashes);
+    size_t index = chunkIndex;
+    while (level.size() > 1)
+    {
+        // The last node of an odd level has no sibling and moves up as is
+        size_t sibling = index ^ 1;
+        if (sibling < level.size())
+        {
+            proof.siblings.push_back(level[sibling]);
+        }
+
+        hash_level(engine, level);
+        index /= 2;
+    }
+
+    return proof;
+}
+
+/**
+ * @brief Check a chunk hash against the root of a chunk tree
+ * @param engine Hash engine of the tree
+ * @param root Trusted root (the file node's hash)
+ * @param chunkHash Hash of the chunk to check
+ * @param proof Inclusion proof of the chunk
+ * @return True if the proof leads from the chunk hash to the root
+ */
+bool ChunkTree::verify(const HashEngine &engine, const Digest &root, const Digest &chunkHash, const ChunkProof &proof)
+{
+    if (proof.chunkIndex >= proof.chunkCount)
+    {
+        return false;
+    }
+
+    Digest current = leaf(engine, chunkHash);
+    uint64_t index = proof.chunkIndex;
+    uint64_t levelSize = proof.chunkCount;
+    size_t used = 0;
+
+    while (levelSize > 1)
+    {
+        uint64_t sibling = index ^ 1;
+        if (sibling < levelSize)
+        {
+            if (used == proof.siblings.size())
+            {
+                return false;
+            }
+
+            const Digest &other = proof.siblings[used++];
+            current = (index & 1) ? combine(engine, other, current) : combine(engine, current, other);
+        }
+
+        index /= 2;
+        levelSize = (levelSize + 1) / 2;
+    }
+
+    return used == proof.siblings.size() && current == root;
+}
+
+/**
+ * @brief Hash a chunk hash into its leaf node
+ * @param engine Hash engine of the tree
+ * @param chunkHash Hash of the chunk
+ * @return Leaf hash
+ */
+Digest ChunkTree::leaf(const HashEngine &engine, const Digest &chunkHash)
+{
+    uint8_t record[LEAF_RECORD_SIZE];
+    record[0] = LEAF_NODE_PREFIX;
+    memcpy(record + 1, chunkHash.data(), chunkHash.size());
+    return engine.hash(record, sizeof(record));
+}
+
+/**
+ * @brief Hash two sibling nodes into their parent
+ * @param engine Hash engine of the tree
+ * @param left Left child
+ * @param right Right child
+ * @return Parent hash
+ */
+Digest ChunkTree::combine(const HashEngine &engine, const Digest &left, const Digest &right)
+{
+    uint8_t record[INNER_RECORD_SIZE];
+    record[0] = INNER_NODE_PREFIX;
+    memcpy(record + 1, left.data(), left.size());
+    memcpy(record + 1 + left.size(), right.data(), right.size());
+    return engine.hash(record, sizeof(record));
+}
+
+/**
+ * @brief Hash the chunk hashes of a file into the leaf level
+ * @param engine Hash engine of the tree
+ * @param chunkHashes Hashes of the chunks
+ * @return Leaf hashes, in chunk order
+ *
+ * Leaves are independent, so they are hashed together with
+ * HashEngine::hashMany.
+ */
+vector<Digest> ChunkTree::hash_leaves(const HashEngine &engine, const vector<Digest> &chunkHashes)
+{
+    vector<uint8_t> records(chunkHashes.size() * LEAF_RECORD_SIZE);
+    vector<HashInput> inputs(chunkHashes.size());
+    for (size_t i = 0; i < chunkHashes.size(); ++i)
+    {
+        uint8_t *record = records.data() + i * LEAF_RECORD_SIZE;
+        record[0] = LEAF_NODE_PREFIX;
+        memcpy(record + 1, chunkHashes[i].data(), sizeof(Digest));
+        inputs[i] = {record, LEAF_RECORD_SIZE};
+    }
+
+    vector<Digest> leaves(chunkHashes.size());
+    engine.hashMany(inputs.data(), inputs.size(), leaves.data());
+    return leaves;
+}
+
+/**
+ * @brief Replace a level of the tree by the level above it
+ * @param engine Hash engine of the tree
+ * @param level Node hashes of one level (at least two)
+ *
+ * All pairs of a level are independent, so they are hashed together with
+ * HashEngine::hashMany.
+ */
+void ChunkTree::hash_level(const HashEngine &engine, vector<Digest> &level)
+{
+    size_t pairs = level.size() / 2;
+
+    vector<uint8_t> records(pairs * INNER_RECORD_SIZE);
+    vector<HashInput> inputs(pairs);
+    for (size_t i = 0; i < pairs; ++i)
+    {
+        uint8_t *record = records.data() + i * INNER_RECORD_SIZE;
+        record[0] = INNER_NODE_PREFIX;
+        memcpy(record + 1, level[2 * i].data(), sizeof(Digest));
+        memcpy(record + 1 + sizeof(Digest), level[2 * i + 1].data(), sizeof(Digest));
+        inputs[i] = {record, INNER_RECORD_SIZE};
+    }
+
+    vector<Digest> parents(pairs + level.size() % 2);
+    engine.hashMany(inputs.data(), pairs, parents.data());
+    if (level.size() % 2)
+    {
+        parents[pairs] = level.back();
+    }
+
+    level.swap(parents);
+}
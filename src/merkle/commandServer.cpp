@@ -0,0 +1,1574 @@
+#include "merkle.hpp"
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace
+{
+    /**
+     * @class ArgsParser
+     * @brief Recursive-descent parser for a flat JSON object of scalars
+     */
+    class ArgsParser
+    {
+    public:
+        explicit ArgsParser(string_view text) : text(text), position(0)
+        {
+        }
+
+        CommandArgs parse()
+        {
+            CommandArgs args;
+            expect('{');
+            if (!consume('}'))
+            {
+                do
+                {
+                    string name = parseString();
+                    expect(':');
+                    args[name] = parseScalar();
+                } while (consume(','));
+                expect('}');
+            }
+
+            skipSpace();
+            if (position != text.size())
+            {
+                fail("trailing characters");
+            }
+            return args;
+        }
+
+    private:
+        string_view text; // Request text
+        size_t position;  // Characters consumed so far
+
+        [[noreturn]] void fail(const string &problem) const
+        {
+            throw runtime_error("Malformed request: " + problem + " at offset " + to_string(position));
+        }
+
+        void skipSpace()
+        {
+            while (position < text.size() && strchr(" \t\r\n", text[position]) && text[position] != '\0')
+            {
+                ++position;
+            }
+        }
+
+        bool consume(char expected)
+        {
+            skipSpace();
+            if (position < text.size() && text[position] == expected)
+            {
+                ++position;
+                return true;
+            }
+            return false;
+        }
+
+        void expect(char expected)
+        {
+            if (!consume(expected))
+            {
+                fail(string("expected '") + expected + "'");
+            }
+        }
+
+        string parseScalar()
+        {
+            skipSpace();
+            if (position < text.size() && text[position] == '"')
+            {
+                return parseString();
+            }
+            if (position < text.size() && (text[position] == '{' || text[position] == '['))
+            {
+                fail("nested values are not supported");
+            }
+
+            // Numbers, true, false and null are kept as written
+            size_t start = position;
+            while (position < text.size() && (isalnum((unsigned char)text[position]) || strchr("+-.", text[position])))
+            {
+                ++position;
+            }
+            if (start == position)
+            {
+                fail("expected a value");
+            }
+            return string(text.substr(start, position - start));
+        }
+
+        unsigned parseHex4()
+        {
+            if (text.size() - position < 4)
+            {
+                fail("truncated escape");
+            }
+
+            unsigned value = 0;
+            for (int i = 0; i < 4; ++i)
+            {
+                char c = text[position++];
+                value <<= 4;
+                if (c >= '0' && c <= '9')
+                {
+                    value |= c - '0';
+                }
+                else if (c >= 'a' && c <= 'f')
+                {
+                    value |= c - 'a' + 10;
+                }
+                else if (c >= 'A' && c <= 'F')
+                {
+                    value |= c - 'A' + 10;
+                }
+                else
+                {
+                    fail("bad escape");
+                }
+            }
+            return value;
+        }
+
+        static void appendUtf8(string &out, unsigned codePoint)
+        {
+            if (codePoint < 0x80)
+            {
+                out += (char)codePoint;
+            }
+            else if (codePoint < 0x800)
+            {
+                out += (char)(0xC0 | codePoint >> 6);
+                out += (char)(0x80 | (codePoint & 0x3F));
+            }
+            else if (codePoint < 0x10000)
+            {
+                out += (char)(0xE0 | codePoint >> 12);
+                out += (char)(0x80 | (codePoint >> 6 & 0x3F));
+                out += (char)(0x80 | (codePoint & 0x3F));
+            }
+            else
+            {
+                out += (char)(0xF0 | codePoint >> 18);
+                out += (char)(0x80 | (codePoint >> 12 & 0x3F));
+                out += (char)(0x80 | (codePoint >> 6 & 0x3F));
+                out += (char)(0x80 | (codePoint & 0x3F));
+            }
+        }
+
+        string parseString()
+        {
+            expect('"');
+
+            string out;
+            while (true)
+            {
+                if (position == text.size())
+                {
+                    fail("unterminated string");
+                }
+
+                char c = text[position++];
+                if (c == '"')
+                {
+                    return out;
+                }
+                if ((unsigned char)c < 0x20)
+                {
+                    fail("control character in string");
+                }
+                if (c != '\\')
+                {
+                    out += c;
+                    continue;
+                }
+
+                if (position == text.size())
+                {
+                    fail("unterminated string");
+                }
+                char escape = text[position++];
+                switch (escape)
+                {
+                case '"':
+                case '\\':
+                case '/':
+                    out += escape;
+                    break;
+                case 'b':
+                    out += '\b';
+                    break;
+                case 'f':
+                    out += '\f';
+                    break;
+                case 'n':
+                    out += '\n';
+                    break;
+                case 'r':
+                    out += '\r';
+                    break;
+                case 't':
+                    out += '\t';
+                    break;
+                case 'u':
+                {
+                    unsigned codePoint = parseHex4();
+                    if (codePoint >= 0xD800 && codePoint <= 0xDBFF)
+                    {
+                        // A high surrogate must be followed by an escaped low one
+                        if (text.substr(position, 2) != "\\u")
+                        {
+                            fail("unpaired surrogate");
+                        }
+                        position += 2;
+                        unsigned low = parseHex4();
+                        if (low < 0xDC00 || low > 0xDFFF)
+                        {
+                            fail("unpaired surrogate");
+                        }
+                        codePoint = 0x10000 + ((codePoint - 0xD800) << 10) + (low - 0xDC00);
+                    }
+                    else if (codePoint >= 0xDC00 && codePoint <= 0xDFFF)
+                    {
+                        fail("unpaired surrogate");
+                    }
+                    appendUtf8(out, codePoint);
+                    break;
+                }
+                default:
+                    fail("bad escape");
+                }
+            }
+        }
+    };
+
+    /**
+     * @brief Hex-encode bytes
+     * @param bytes Bytes to encode
+     * @return Lowercase hexadecimal string
+     */
+    string hexBytes(const vector<uint8_t> &bytes)
+    {
+        static const char HEX_DIGITS[] = "0123456789abcdef";
+
+        string hex;
+        hex.reserve(bytes.size() * 2);
+        for (uint8_t byte : bytes)
+        {
+            hex += HEX_DIGITS[byte >> 4];
+            hex += HEX_DIGITS[byte & 0xF];
+        }
+        return hex;
+    }
+
+    /**
+     * @brief Decode a hexadecimal string
+     * @param hex Hexadecimal string
+     * @return Decoded bytes
+     * @throws runtime_error If the string is not valid hex
+     */
+    vector<uint8_t> bytesFromHex(const string &hex)
+    {
+        if (hex.size() % 2 != 0 || hex.find_first_not_of("0123456789abcdefABCDEF") != string::npos)
+        {
+            throw runtime_error("Invalid hex string");
+        }
+
+        vector<uint8_t> bytes(hex.size() / 2);
+        for (size_t i = 0; i < bytes.size(); ++i)
+        {
+            bytes[i] = (uint8_t)stoul(hex.substr(2 * i, 2), nullptr, 16);
+        }
+        return bytes;
+    }
+
+    /**
+     * @brief Parse an unsigned number argument
+     * @param value Argument text
+     * @param name Argument name, for the error message
+     * @return Parsed value
+     * @throws runtime_error If the text is not an unsigned number
+     */
+    size_t parseCount(const string &value, const string &name)
+    {
+        if (value.empty() || value.find_first_not_of("0123456789") != string::npos || value.size() > 18)
+        {
+            throw runtime_error("Invalid " + name + ": " + value);
+        }
+        return stoull(value);
+    }
+
+    /**
+     * @brief Split a multi-line argument into its non-empty lines
+     * @param value Lines separated by newlines
+     * @return Lines, in order
+     */
+    vector<string> parseLines(const string &value)
+    {
+        vector<string> result;
+        istringstream lines(value);
+        string line;
+        while (getline(lines, line))
+        {
+            if (!line.empty())
+            {
+                result.push_back(line);
+            }
+        }
+        return result;
+    }
+
+    /**
+     * @brief Parse the shards of a merge
+     * @param value One MOUNT=SNAPSHOT entry per line; a line without '=' is the base tree
+     * @return Shards in the given order
+     */
+    vector<TreeShard> parseShards(const string &value)
+    {
+        vector<TreeShard> shards;
+        for (const auto &line : parseLines(value))
+        {
+            size_t separator = line.find('=');
+            if (separator == string::npos)
+            {
+                shards.push_back({"", line});
+            }
+            else
+            {
+                shards.push_back({line.substr(0, separator), line.substr(separator + 1)});
+            }
+        }
+        return shards;
+    }
+
+    /**
+     * @brief Describe the problems found by verifyContents as a JSON object
+     * @param issues Problems, in path order
+     * @return JSON object with an "issues" array
+     */
+    string issuesJson(const vector<IntegrityIssue> &issues)
+    {
+        ostringstream out;
+        JsonWriter writer(out);
+        writer.raw("{\"issues\": [");
+        for (size_t i = 0; i < issues.size(); ++i)
+        {
+            writer.raw(i > 0 ? ", " : "").raw("{\"path\": ").quoted(issues[i].path);
+            writer.raw(", \"problem\": ").quoted(issues[i].problem).raw("}");
+        }
+        writer.raw("]}");
+        writer.flush();
+        return out.str();
+    }
+
+    /**
+     * @brief Describe the progress of a job as a JSON object
+     * @param progress Progress to describe
+     * @return JSON object with the counters, throughput and estimated time left
+     *
+     * The estimate assumes the bytes left go as fast as the bytes done; it
+     * is null while nothing is done or the total is unknown or exceeded.
+     */
+    string progressJson(const JobProgress &progress)
+    {
+        ostringstream out;
+        JsonWriter writer(out);
+        writer.raw("{\"files_done\": ").number(progress.filesDone);
+        writer.raw(", \"bytes_done\": ").number(progress.bytesDone);
+        writer.raw(", \"files_expected\": ").number(progress.filesExpected);
+        writer.raw(", \"bytes_expected\": ").number(progress.bytesExpected);
+        writer.raw(", \"elapsed_ns\": ").number(progress.elapsedNs);
+
+        double seconds = progress.elapsedNs / 1e9;
+        writer.raw(", \"bytes_per_second\": ").number(seconds > 0 ? (uint64_t)(progress.bytesDone / seconds) : 0);
+        writer.raw(", \"eta_ns\": ");
+        if (progress.bytesDone > 0 && progress.bytesExpected > progress.bytesDone)
+        {
+            double left = (double)(progress.bytesExpected - progress.bytesDone) / progress.bytesDone;
+            writer.number((uint64_t)(left * progress.elapsedNs));
+        }
+        else
+        {
+            writer.raw("null");
+        }
+        writer.raw("}");
+        writer.flush();
+        return out.str();
+    }
+
+    /**
+     * @brief Describe a node as a JSON object
+     * @param node Node to describe
+     * @return JSON object with the name, type, hash and (files) size
+     */
+    string nodeJson(const MerkleNode &node)
+    {
+        ostringstream out;
+        JsonWriter writer(out);
+        writer.raw("{\"name\": ").quoted(node.name);
+        writer.raw(", \"type\": ").raw(node.isFile ? "\"file\"" : "\"directory\"");
+        writer.raw(", \"hash\": ").quoted(node.hash);
+        if (node.isFile)
+        {
+            writer.raw(", \"size\": ").number(node.fileSize);
+        }
+        writer.raw("}");
+        writer.flush();
+        return out.str();
+    }
+
+    /**
+     * @brief Read exactly a number of bytes
+     * @param fd Descriptor to read from
+     * @param data Destination
+     * @param length Number of bytes
+     * @return False on end of file before the first byte
+     * @throws runtime_error On a read error or an end of file inside the bytes
+     */
+    bool readFully(int fd, void *data, size_t length)
+    {
+        size_t done = 0;
+        while (done < length)
+        {
+            ssize_t count = ::read(fd, static_cast<char *>(data) + done, length - done);
+            if (count < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (count < 0)
+            {
+                throw runtime_error(string("Error reading from client: ") + strerror(errno));
+            }
+            if (count == 0)
+            {
+                if (done == 0)
+                {
+                    return false;
+                }
+                throw runtime_error("Client closed the connection inside a frame");
+            }
+            done += count;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Send bytes, without raising SIGPIPE if the client went away
+     * @param fd Socket to write to
+     * @param data Bytes to send
+     * @param length Number of bytes
+     * @return False if the client went away
+     */
+    bool sendFully(int fd, const void *data, size_t length)
+    {
+        size_t done = 0;
+        while (done < length)
+        {
+            ssize_t count = ::send(fd, static_cast<const char *>(data) + done, length - done, MSG_NOSIGNAL);
+            if (count < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (count <= 0)
+            {
+                return false;
+            }
+            done += count;
+        }
+        return true;
+    }
+}
+
+/**
+ * @brief Parse a flat JSON object of scalars into command arguments
+ * @param text JSON text
+ * @return Member names to values (strings unescaped, other scalars as written)
+ * @throws runtime_error If the text is not such an object
+ */
+CommandArgs parseCommandArgs(string_view text)
+{
+    return ArgsParser(text).parse();
+}
+
+/**
+ * @brief Serve commands for a tree
+ * @param tree Tree the commands operate on (outlives the processor)
+ */
+CommandProcessor::CommandProcessor(MerkleTree &tree) : tree(tree), hasTree(false), nextJobId(1), buildJob(0)
+{
+}
+
+/**
+ * @struct CommandProcessor::Job
+ * @brief One background job: its threads, progress and outcome
+ *
+ * The threads only hold a plain pointer to the job, so the last reference
+ * is never dropped by the job itself; the destructor joins them.
+ */
+struct CommandProcessor::Job
+{
+    enum class State
+    {
+        RUNNING,
+        DONE,
+        FAILED,
+        CANCELLED
+    };
+
+    uint64_t id;                 // Id returned by startJob
+    string operation;            // Operation it runs
+    JobControl control;          // Progress and cancellation
+    EventSink events;            // Receives its events; dropped after the final one
+    mutex stateLock;             // Guards state, result and error
+    condition_variable finished; // Signalled when state leaves RUNNING
+    State state;                 // RUNNING until the operation returns or throws
+    string result;               // JSON result once DONE
+    string error;                // Error message once FAILED
+    thread worker;               // Runs the operation
+    thread reporter;             // Sends the events, when there is a sink
+
+    Job(uint64_t id, const string &operation, const EventSink &events)
+        : id(id), operation(operation), events(events), state(State::RUNNING)
+    {
+    }
+
+    ~Job()
+    {
+        if (worker.joinable())
+        {
+            worker.join();
+        }
+        if (reporter.joinable())
+        {
+            reporter.join();
+        }
+    }
+
+    /**
+     * @brief Name a state in job descriptions
+     * @param state State to name
+     * @return "running", "done", "failed" or "cancelled"
+     */
+    static const char *stateName(State state)
+    {
+        switch (state)
+        {
+        case State::RUNNING:
+            return "running";
+        case State::DONE:
+            return "done";
+        case State::FAILED:
+            return "failed";
+        default:
+            return "cancelled";
+        }
+    }
+};
+
+/**
+ * @brief Cancel the running jobs and wait for them
+ */
+CommandProcessor::~CommandProcessor()
+{
+    map<uint64_t, shared_ptr<Job>> stopping;
+    {
+        lock_guard<mutex> guard(jobsLock);
+        for (const auto &entry : jobs)
+        {
+            entry.second->control.cancel();
+        }
+        stopping.swap(jobs);
+    }
+
+    // Each job joins its threads as it is destroyed, with no lock held
+    stopping.clear();
+}
+
+/**
+ * @brief Run one command
+ * @param args Command arguments, including "op"
+ * @param events Receives the events of a job started by this command, or nullptr for none
+ * @return JSON value with the result
+ * @throws runtime_error If the command is unknown, malformed or fails
+ */
+string CommandProcessor::execute(const CommandArgs &args, const EventSink &events)
+{
+    const string &op = require(args, "op");
+
+    if (is_job_op(op))
+    {
+        return run_job_op(op, args, events);
+    }
+
+    if (changes_tree(op))
+    {
+        unique_lock<shared_mutex> exclusive(lock);
+        if (op != "configure")
+        {
+            // Its tree would replace this one when it finishes
+            lock_guard<mutex> guard(jobsLock);
+            if (buildJob)
+            {
+                throw runtime_error("A build job is running: wait for it or cancel it first");
+            }
+        }
+        return run_change(op, args);
+    }
+
+    shared_lock<shared_mutex> shared(lock);
+    return run_query(op, args);
+}
+
+/**
+ * @brief Apply a batch of changed paths to the tree
+ * @param paths Changed paths, as returned by TreeWatcher::wait
+ * @return JSON object describing the updated tree, as the stats command
+ * @throws runtime_error If there is no tree or the update fails
+ */
+string CommandProcessor::update(const vector<string> &paths)
+{
+    unique_lock<shared_mutex> exclusive(lock);
+    if (!hasTree)
+    {
+        throw runtime_error("No tree: send a build or load command first");
+    }
+
+    tree.update(paths);
+    {
+        // The build job may have walked these paths before they changed
+        lock_guard<mutex> guard(jobsLock);
+        if (buildJob)
+        {
+            missedUpdates.insert(missedUpdates.end(), paths.begin(), paths.end());
+        }
+    }
+
+    return summary();
+}
+
+/**
+ * @brief Start a background job
+ * @param args Command arguments: "job" names the operation (build, verify,
+ *        verify_contents or export), the others are its own
+ * @param events Receives the events of the job, or nullptr
+ * @return Id of the job
+ * @throws runtime_error If the operation cannot run as a job, or a build job is already running
+ */
+uint64_t CommandProcessor::startJob(const CommandArgs &args, const EventSink &events)
+{
+    const string &operation = require(args, "job");
+    if (operation != "build" && operation != "verify" && operation != "verify_contents" && operation != "export")
+    {
+        throw runtime_error("Cannot run as a job: " + operation);
+    }
+    if (operation == "build" || operation == "export")
+    {
+        require(args, "path");
+    }
+
+    vector<shared_ptr<Job>> dropped;
+    lock_guard<mutex> guard(jobsLock);
+    if (operation == "build")
+    {
+        if (buildJob)
+        {
+            throw runtime_error("A build job is already running");
+        }
+        missedUpdates.clear();
+    }
+
+    // Finished jobs past the history are forgotten, oldest first; destroyed once the lock is released
+    size_t finishedCount = 0;
+    for (auto it = jobs.rbegin(); it != jobs.rend(); ++it)
+    {
+        lock_guard<mutex> stateGuard(it->second->stateLock);
+        if (it->second->state != Job::State::RUNNING && ++finishedCount > MTFSConstants::JOB_HISTORY_SIZE)
+        {
+            dropped.push_back(it->second);
+        }
+    }
+    for (const auto &job : dropped)
+    {
+        jobs.erase(job->id);
+    }
+
+    uint64_t id = nextJobId++;
+    auto job = make_shared<Job>(id, operation, events);
+    jobs[id] = job;
+    if (operation == "build")
+    {
+        buildJob = id;
+    }
+
+    job->worker = thread([this, job = job.get(), args]()
+                         {
+                             Job::State state = Job::State::DONE;
+                             string result;
+                             string error;
+                             try
+                             {
+                                 result = run_job(*job, args);
+                             }
+                             catch (const OperationCancelled &)
+                             {
+                                 state = Job::State::CANCELLED;
+                             }
+                             catch (const exception &e)
+                             {
+                                 state = Job::State::FAILED;
+                                 error = e.what();
+                             }
+
+                             {
+                                 lock_guard<mutex> stateGuard(job->stateLock);
+                                 job->state = state;
+                                 job->result = move(result);
+                                 job->error = move(error);
+                             }
+                             job->finished.notify_all();
+                         });
+
+    if (events)
+    {
+        // Progress at most every interval, then the outcome; all from this thread, so in order
+        job->reporter = thread([job = job.get()]()
+                               {
+                                   unique_lock<mutex> stateGuard(job->stateLock);
+                                   auto done = [job]() { return job->state != Job::State::RUNNING; };
+                                   auto interval = chrono::milliseconds(MTFSConstants::JOB_PROGRESS_INTERVAL_MS);
+                                   while (!job->finished.wait_for(stateGuard, interval, done))
+                                   {
+                                       stateGuard.unlock();
+                                       job->events(job_json(*job, "progress"));
+                                       stateGuard.lock();
+                                   }
+                                   const char *outcome = Job::stateName(job->state);
+                                   stateGuard.unlock();
+
+                                   job->events(job_json(*job, outcome));
+                                   job->events = nullptr;
+                               });
+    }
+
+    return id;
+}
+
+/**
+ * @brief Wait for a job to finish
+ * @param id Job id, as returned by startJob
+ * @return JSON result of the job, as the command it runs would return
+ * @throws runtime_error If there is no such job, or it failed or was cancelled
+ */
+string CommandProcessor::awaitJob(uint64_t id)
+{
+    auto job = find_job({{"job", to_string(id)}});
+
+    unique_lock<mutex> stateGuard(job->stateLock);
+    job->finished.wait(stateGuard, [&job]() { return job->state != Job::State::RUNNING; });
+    if (job->state == Job::State::CANCELLED)
+    {
+        throw runtime_error("Job " + to_string(id) + " was cancelled");
+    }
+    if (job->state == Job::State::FAILED)
+    {
+        throw runtime_error(job->error);
+    }
+    return job->result;
+}
+
+/**
+ * @brief Get a required argument
+ * @param args Command arguments
+ * @param name Argument name
+ * @return Argument value
+ * @throws runtime_error If the argument is missing
+ */
+const string &CommandProcessor::require(const CommandArgs &args, const string &name)
+{
+    auto it = args.find(name);
+    if (it == args.end())
+    {
+        throw runtime_error("Missing argument: " + name);
+    }
+    return it->second;
+}
+
+/**
+ * @brief Describe the current tree
+ * @return JSON object with the root hash, counts and settings
+ */
+string CommandProcessor::summary() const
+{
+    auto [files, directories, totalSize] = tree.getTreeStats();
+    DedupeStats dedupe = tree.getDedupeStats();
+
+    ostringstream out;
+    JsonWriter writer(out);
+    writer.raw("{\"root_hash\": ").quoted(tree.getRootHash());
+    writer.raw(", \"files\": ").number(files);
+    writer.raw(", \"directories\": ").number(directories);
+    writer.raw(", \"size\": ").number(totalSize);
+    writer.raw(", \"depth\": ").number(tree.getTreeDepth());
+    writer.raw(", \"hash_algorithm\": ").quoted(HashEngine::algorithmName(tree.getHashAlgorithm()));
+    writer.raw(", \"chunking\": ").quoted(chunkingModeName(tree.getChunkingMode()));
+    writer.raw(", \"unique_files\": ").number(dedupe.uniqueFiles);
+    writer.raw(", \"unique_file_bytes\": ").number(dedupe.uniqueFileBytes);
+    writer.raw(", \"chunks\": ").number(dedupe.chunks);
+    writer.raw(", \"unique_chunks\": ").number(dedupe.uniqueChunks);
+    writer.raw(", \"unique_chunk_bytes\": ").number(dedupe.uniqueChunkBytes);
+    writer.raw(", \"unsized_chunks\": ").number(dedupe.unsizedChunks);
+    writer.raw("}");
+    writer.flush();
+    return out.str();
+}
+
+/**
+ * @brief Check whether an operation changes the tree or its settings
+ * @param op Operation name
+ * @return True if the operation needs the exclusive lock
+ */
+bool CommandProcessor::changes_tree(const string &op)
+{
+    return op == "build" || op == "load" || op == "merge" || op == "configure";
+}
+
+/**
+ * @brief Run a command that changes the tree or its settings
+ * @param op Operation name
+ * @param args Command arguments
+ * @return JSON result
+ */
+string CommandProcessor::run_change(const string &op, const CommandArgs &args)
+{
+    if (op == "configure")
+    {
+        if (args.count("chunk_size"))
+        {
+            tree.setChunkSize(parseCount(args.at("chunk_size"), "chunk size"));
+        }
+        if (args.count("threads"))
+        {
+            tree.setThreadCount(parseCount(args.at("threads"), "thread count"));
+        }
+        if (args.count("chunking"))
+        {
+            tree.setChunkingMode(parseChunkingMode(args.at("chunking")));
+        }
+        if (args.count("io"))
+        {
+            tree.setIoBackend(parseIoBackend(args.at("io")));
+        }
+        if (args.count("hash_cache"))
+        {
+            // An empty path turns the cache off
+            const string &path = args.at("hash_cache");
+            tree.setHashCache(path.empty() ? nullptr : HashCache::open(path));
+        }
+
+        WalkPolicy walkPolicy = tree.getWalkPolicy();
+        if (args.count("symlinks"))
+        {
+            walkPolicy.symlinks = parseSymlinkPolicy(args.at("symlinks"));
+        }
+        if (args.count("hardlinks"))
+        {
+            walkPolicy.hardlinks = parseHardlinkPolicy(args.at("hardlinks"));
+        }
+        if (args.count("one_file_system"))
+        {
+            walkPolicy.oneFileSystem = args.at("one_file_system") == "true";
+        }
+        if (args.count("exclude"))
+        {
+            // One path per line; an empty value excludes nothing
+            walkPolicy.excluded = parseLines(args.at("exclude"));
+        }
+        tree.setWalkPolicy(walkPolicy);
+
+        // Probes only record while profiling, so turning it on covers the next build
+        if (args.count("profile"))
+        {
+            bool profile = args.at("profile") == "true";
+            if (profile && !BuildProfiler::enabled())
+            {
+                BuildProfiler::start(false);
+            }
+            else if (!profile && BuildProfiler::enabled())
+            {
+                BuildProfiler::stop();
+            }
+        }
+        return "{}";
+    }
+
+    // A failed build or load leaves no usable tree
+    hasTree = false;
+    if (op == "build")
+    {
+        // Unchanged files are reused when the same directory is rebuilt
+        tree.rebuild(require(args, "path"));
+    }
+    else if (op == "merge")
+    {
+        tree.mergeShards(require(args, "path"), parseShards(require(args, "shards")));
+    }
+    else
+    {
+        tree.load(require(args, "path"));
+    }
+
+    hasTree = true;
+
+    return summary();
+}
+
+/**
+ * @brief Run a command that only reads the tree
+ * @param op Operation name
+ * @param args Command arguments
+ * @return JSON result
+ * @throws runtime_error If the operation is unknown
+ */
+string CommandProcessor::run_query(const string &op, const CommandArgs &args)
+{
+    if (op == "ping")
+    {
+        return "{}";
+    }
+
+    if (op == "verify_proof")
+    {
+        Digest rootHash = fromHex(require(args, "root"));
+        vector<uint8_t> proof;
+        if (args.count("proof"))
+        {
+            proof = bytesFromHex(args.at("proof"));
+        }
+        else
+        {
+            ifstream in(require(args, "proof_file"), ios::binary);
+            if (!in)
+            {
+                throw runtime_error("Cannot open proof file: " + args.at("proof_file"));
+            }
+            proof.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+        }
+        return verifyProof(rootHash, proof) ? "{\"valid\": true}" : "{\"valid\": false}";
+    }
+
+    if (op == "profile")
+    {
+        // Covers the last build, rebuild or update, while profiling (--profile)
+        if (!BuildProfiler::enabled())
+        {
+            throw runtime_error("Profiling is off: start with --profile");
+        }
+        if (args.count("trace"))
+        {
+            ofstream trace(args.at("trace"));
+            if (!trace)
+            {
+                throw runtime_error("Cannot create trace file: " + args.at("trace"));
+            }
+            BuildProfiler::writeTrace(trace);
+        }
+        return profileJson(BuildProfiler::report());
+    }
+
+    if (!hasTree)
+    {
+        throw runtime_error("No tree: send a build or load command first");
+    }
+
+    ostringstream out;
+    JsonWriter writer(out);
+
+    if (op == "stats")
+    {
+        return summary();
+    }
+    else if (op == "save")
+    {
+        tree.save(require(args, "path"));
+        return "{}";
+    }
+    else if (op == "verify")
+    {
+        return tree.verifyTreeIntegrity() ? "{\"valid\": true}" : "{\"valid\": false}";
+    }
+    else if (op == "verify_contents")
+    {
+        return issuesJson(tree.verifyContents());
+    }
+    else if (op == "diff")
+    {
+        // The snapshot is the older tree: changes are what happened since
+        MerkleTree snapshot;
+        snapshot.load(require(args, "snapshot"));
+
+        writer.raw("{\"changes\": [");
+        vector<TreeChange> changes = snapshot.diff(tree);
+        for (size_t i = 0; i < changes.size(); ++i)
+        {
+            const TreeChange &change = changes[i];
+            writer.raw(i > 0 ? ", " : "").raw("{\"type\": ").quoted(changeTypeName(change.type));
+            writer.raw(", \"path\": ").quoted(change.path);
+            writer.raw(", \"is_file\": ").raw(change.isFile ? "true" : "false").raw("}");
+        }
+        writer.raw("]}");
+    }
+    else if (op == "sync_plan")
+    {
+        // The snapshot is the receiver's tree: the plan turns it into this one
+        MerkleTree remote;
+        remote.load(require(args, "snapshot"));
+        SyncPlan plan = tree.planSync(remote);
+
+        if (args.count("stream"))
+        {
+            int fd = ::open(args.at("stream").c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fd < 0)
+            {
+                throw runtime_error("Cannot create chunk stream: " + args.at("stream"));
+            }
+            try
+            {
+                tree.sendChunks(plan, fd);
+            }
+            catch (...)
+            {
+                ::close(fd);
+                throw;
+            }
+            ::close(fd);
+        }
+
+        auto writePaths = [&writer](const char *name, const vector<string> &paths)
+        {
+            writer.raw(", \"").raw(name).raw("\": [");
+            for (size_t i = 0; i < paths.size(); ++i)
+            {
+                writer.raw(i > 0 ? ", " : "").quoted(paths[i]);
+            }
+            writer.raw("]");
+        };
+
+        writer.raw("{\"file_bytes\": ").number(plan.fileBytes);
+        writer.raw(", \"sent_bytes\": ").number(plan.sentBytes);
+        writer.raw(", \"sent_chunks\": ").number(plan.sentChunks);
+        writePaths("directories", plan.directories);
+        writePaths("removed", plan.removed);
+        writer.raw(", \"files\": [");
+        for (size_t i = 0; i < plan.files.size(); ++i)
+        {
+            const SyncFile &file = plan.files[i];
+            writer.raw(i > 0 ? ", " : "").raw("{\"path\": ").quoted(file.path);
+            writer.raw(", \"size\": ").number(file.fileSize);
+            writer.raw(", \"content_hash\": ").quoted(file.contentHash);
+
+            // Each chunk is [hash, length, sent]; offsets follow from the lengths
+            writer.raw(", \"chunks\": [");
+            for (size_t c = 0; c < file.chunks.size(); ++c)
+            {
+                const SyncChunk &chunk = file.chunks[c];
+                writer.raw(c > 0 ? ", [" : "[").quoted(chunk.hash).raw(", ").number(chunk.length);
+                writer.raw(chunk.sent ? ", true]" : ", false]");
+            }
+            writer.raw("]}");
+        }
+        writer.raw("]}");
+    }
+    else if (op == "prove")
+    {
+        vector<uint8_t> proof = tree.prove(require(args, "path"));
+        if (args.count("out"))
+        {
+            ofstream file(args.at("out"), ios::binary);
+            if (!file.write(reinterpret_cast<const char *>(proof.data()), proof.size()))
+            {
+                throw runtime_error("Cannot write proof file: " + args.at("out"));
+            }
+        }
+        writer.raw("{\"root_hash\": ").quoted(tree.getRootHash());
+        writer.raw(", \"proof\": ").quoted(hexBytes(proof)).raw("}");
+    }
+    else if (op == "find")
+    {
+        if (args.count("path"))
+        {
+            auto node = tree.findPath(args.at("path"));
+            return node ? nodeJson(*node) : "null";
+        }
+
+        writer.raw("[");
+        vector<shared_ptr<MerkleNode>> nodes = tree.findNodes(require(args, "name"));
+        for (size_t i = 0; i < nodes.size(); ++i)
+        {
+            writer.raw(i > 0 ? ", " : "").raw(nodeJson(*nodes[i]));
+        }
+        writer.raw("]");
+    }
+    else if (op == "export")
+    {
+        writer.flush();
+        tree.exportJson(out);
+    }
+    else
+    {
+        throw runtime_error("Unknown command: " + op);
+    }
+
+    writer.flush();
+    return out.str();
+}
+
+/**
+ * @brief Check whether an operation manages background jobs
+ * @param op Operation name
+ * @return True for start, job, jobs, cancel and wait
+ */
+bool CommandProcessor::is_job_op(const string &op)
+{
+    return op == "start" || op == "job" || op == "jobs" || op == "cancel" || op == "wait";
+}
+
+/**
+ * @brief Run a command that manages background jobs
+ * @param op Operation name
+ * @param args Command arguments
+ * @param events Receives the events of a started job, or nullptr
+ * @return JSON result
+ * @throws runtime_error If the job is unknown or cannot be started
+ */
+string CommandProcessor::run_job_op(const string &op, const CommandArgs &args, const EventSink &events)
+{
+    if (op == "start")
+    {
+        return "{\"job\": " + to_string(startJob(args, events)) + "}";
+    }
+
+    if (op == "jobs")
+    {
+        ostringstream out;
+        JsonWriter writer(out);
+        writer.raw("[");
+        lock_guard<mutex> guard(jobsLock);
+        for (auto it = jobs.begin(); it != jobs.end(); ++it)
+        {
+            writer.raw(it != jobs.begin() ? ", " : "").raw(job_json(*it->second, nullptr));
+        }
+        writer.raw("]");
+        writer.flush();
+        return out.str();
+    }
+
+    auto job = find_job(args);
+    if (op == "cancel")
+    {
+        // The job stops at its next check; wait or the final event tell when
+        job->control.cancel();
+    }
+    else if (op == "wait")
+    {
+        unique_lock<mutex> stateGuard(job->stateLock);
+        job->finished.wait(stateGuard, [&job]() { return job->state != Job::State::RUNNING; });
+    }
+    return job_json(*job, nullptr);
+}
+
+/**
+ * @brief Run the operation of a job, on its thread
+ * @param job Job to run
+ * @param args Command arguments of the job
+ * @return JSON result
+ * @throws OperationCancelled If the job was cancelled
+ * @throws runtime_error If the operation fails
+ */
+string CommandProcessor::run_job(Job &job, const CommandArgs &args)
+{
+    if (job.operation == "build")
+    {
+        try
+        {
+            return build_in_background(args.at("path"), job.control);
+        }
+        catch (...)
+        {
+            lock_guard<mutex> guard(jobsLock);
+            buildJob = 0;
+            missedUpdates.clear();
+            throw;
+        }
+    }
+
+    shared_lock<shared_mutex> shared(lock);
+    if (!hasTree)
+    {
+        throw runtime_error("No tree: send a build or load command first");
+    }
+    job.control.checkCancelled();
+
+    if (job.operation == "verify")
+    {
+        auto [files, directories, totalSize] = tree.getTreeStats();
+        bool valid = tree.verifyTreeIntegrity();
+        job.control.advance(files, totalSize);
+        return valid ? "{\"valid\": true}" : "{\"valid\": false}";
+    }
+    if (job.operation == "verify_contents")
+    {
+        return issuesJson(tree.verifyContents(&job.control));
+    }
+
+    // An export is written to a file rather than returned, and removed if it is cut short
+    const string &path = args.at("path");
+    JsonFormat format = args.count("format") ? parseJsonFormat(args.at("format")) : JsonFormat::TREE;
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        throw runtime_error("Cannot create export file: " + path);
+    }
+    try
+    {
+        tree.exportJson(fd, format, &job.control);
+    }
+    catch (...)
+    {
+        ::close(fd);
+        ::unlink(path.c_str());
+        throw;
+    }
+    ::close(fd);
+    return "{}";
+}
+
+/**
+ * @brief Rebuild a copy of the tree and swap it in
+ * @param path Directory to build
+ * @param control Progress and cancellation of the build
+ * @return JSON object describing the new tree, as the stats command
+ * @throws OperationCancelled If the build was cancelled (the current tree is kept)
+ * @throws runtime_error If the build fails (the current tree is kept)
+ */
+string CommandProcessor::build_in_background(const string &path, JobControl &control)
+{
+    MerkleTree next;
+    {
+        shared_lock<shared_mutex> shared(lock);
+        next.cloneFrom(tree);
+    }
+
+    // The slow part: readers keep the current tree meanwhile
+    next.rebuild(path, &control);
+
+    // Released before next, which then holds the previous tree, is destroyed
+    unique_lock<shared_mutex> exclusive(lock);
+    vector<string> missed;
+    {
+        lock_guard<mutex> guard(jobsLock);
+        missed.swap(missedUpdates);
+        buildJob = 0;
+    }
+
+    bool replay = hasTree && !missed.empty() && tree.getRootPath() == next.getRootPath();
+    tree.swapTree(next);
+    hasTree = true;
+    if (replay)
+    {
+        try
+        {
+            tree.update(missed);
+        }
+        catch (const exception &e)
+        {
+            cerr << "Warning: Cannot apply changes made during the build - " << e.what() << endl;
+        }
+    }
+
+    return summary();
+}
+
+/**
+ * @brief Find the job named by a command
+ * @param args Command arguments with a "job" id
+ * @return The job
+ * @throws runtime_error If there is no such job
+ */
+shared_ptr<CommandProcessor::Job> CommandProcessor::find_job(const CommandArgs &args)
+{
+    const string &id = require(args, "job");
+    lock_guard<mutex> guard(jobsLock);
+    auto it = jobs.find(parseCount(id, "job id"));
+    if (it == jobs.end())
+    {
+        throw runtime_error("No such job: " + id);
+    }
+    return it->second;
+}
+
+/**
+ * @brief Describe a job
+ * @param job Job to describe
+ * @param event Event name to describe it as, or nullptr for a status object
+ * @return JSON object with the job's state and progress, and its result or error once finished
+ */
+string CommandProcessor::job_json(Job &job, const char *event)
+{
+    ostringstream out;
+    JsonWriter writer(out);
+    writer.raw("{");
+    if (event)
+    {
+        writer.raw("\"event\": ").quoted(event).raw(", ");
+    }
+    writer.raw("\"job\": ").number(job.id);
+    writer.raw(", \"operation\": ").quoted(job.operation);
+
+    lock_guard<mutex> stateGuard(job.stateLock);
+    writer.raw(", \"state\": ").quoted(Job::stateName(job.state));
+    writer.raw(", \"progress\": ").raw(progressJson(job.control.progress()));
+    if (job.state == Job::State::DONE)
+    {
+        writer.raw(", \"result\": ").raw(job.result);
+    }
+    else if (job.state == Job::State::FAILED)
+    {
+        writer.raw(", \"error\": ").quoted(job.error);
+    }
+    writer.raw("}");
+    writer.flush();
+    return out.str();
+}
+
+/**
+ * @struct CommandServer::Connection
+ * @brief One client socket; closed when the last pending request is answered
+ */
+struct CommandServer::Connection
+{
+    int fd;          // Client socket
+    mutex sendLock;  // Keeps response frames whole
+
+    explicit Connection(int fd) : fd(fd)
+    {
+    }
+
+    ~Connection()
+    {
+        ::close(fd);
+    }
+
+    /**
+     * @brief Send one frame
+     * @param payload Frame payload
+     */
+    void sendFrame(const string &payload)
+    {
+        uint8_t header[4] = {(uint8_t)(payload.size() >> 24), (uint8_t)(payload.size() >> 16),
+                             (uint8_t)(payload.size() >> 8), (uint8_t)payload.size()};
+
+        // A client that went away just misses its responses
+        lock_guard<mutex> guard(sendLock);
+        if (sendFully(fd, header, sizeof(header)))
+        {
+            sendFully(fd, payload.data(), payload.size());
+        }
+    }
+};
+
+/**
+ * @brief Listen on a Unix socket
+ * @param processor Processor running the commands
+ * @param socketPath Filesystem path of the socket (replaced if it exists)
+ * @param workerCount Threads running commands
+ * @throws runtime_error If the socket cannot be created
+ */
+CommandServer::CommandServer(CommandProcessor &processor, const string &socketPath, size_t workerCount)
+    : processor(processor), socketPath(socketPath), listenFd(-1), workers(workerCount), stopping(false)
+{
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path))
+    {
+        throw runtime_error("Socket path too long: " + socketPath);
+    }
+    memcpy(address.sun_path, socketPath.c_str(), socketPath.size() + 1);
+
+    listenFd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listenFd < 0)
+    {
+        throw runtime_error(string("Cannot create socket: ") + strerror(errno));
+    }
+
+    ::unlink(socketPath.c_str());
+    if (::bind(listenFd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0 ||
+        ::listen(listenFd, SOMAXCONN) < 0)
+    {
+        string error = strerror(errno);
+        ::close(listenFd);
+        throw runtime_error("Cannot listen on " + socketPath + ": " + error);
+    }
+}
+
+/**
+ * @brief Close the socket and remove its path
+ */
+CommandServer::~CommandServer()
+{
+    ::close(listenFd);
+    ::unlink(socketPath.c_str());
+}
+
+/**
+ * @brief Accept connections until a client sends "shutdown"
+ */
+void CommandServer::run()
+{
+    vector<weak_ptr<Connection>> connections;
+
+    while (!stopping)
+    {
+        int clientFd = ::accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (clientFd < 0)
+        {
+            // "shutdown" shuts the listening socket down, which fails accept
+            if (errno == EINTR || (!stopping && errno == ECONNABORTED))
+            {
+                continue;
+            }
+            if (!stopping)
+            {
+                throw runtime_error(string("Error accepting connection: ") + strerror(errno));
+            }
+            break;
+        }
+
+        auto connection = make_shared<Connection>(clientFd);
+        connections.erase(remove_if(connections.begin(), connections.end(),
+                                    [](const weak_ptr<Connection> &weak) { return weak.expired(); }),
+                          connections.end());
+        connections.push_back(connection);
+
+        lock_guard<mutex> guard(readersLock);
+        readers.emplace_back([this, connection] { serve_connection(connection); });
+    }
+
+    // Answer what is queued, then wake the readers still blocked on their clients
+    workers.wait();
+    for (const auto &weak : connections)
+    {
+        if (auto connection = weak.lock())
+        {
+            ::shutdown(connection->fd, SHUT_RD);
+        }
+    }
+
+    lock_guard<mutex> guard(readersLock);
+    for (auto &reader : readers)
+    {
+        reader.join();
+    }
+    readers.clear();
+}
+
+/**
+ * @brief Read the frames of one connection and queue their requests
+ * @param connection Client connection
+ */
+void CommandServer::serve_connection(const shared_ptr<Connection> &connection)
+{
+    try
+    {
+        while (!stopping)
+        {
+            uint8_t header[4];
+            if (!readFully(connection->fd, header, sizeof(header)))
+            {
+                return;
+            }
+
+            uint32_t length = (uint32_t)header[0] << 24 | (uint32_t)header[1] << 16 | (uint32_t)header[2] << 8 |
+                              header[3];
+            if (length > MTFSConstants::MAX_FRAME_SIZE)
+            {
+                connection->sendFrame("{\"id\": null, \"ok\": false, \"error\": \"Request too large\"}");
+                return;
+            }
+
+            string frame(length, '\0');
+            if (length > 0 && !readFully(connection->fd, &frame[0], length))
+            {
+                return;
+            }
+
+            workers.submit([this, connection, frame] { handle_request(connection, frame); });
+        }
+    }
+    catch (const exception &e)
+    {
+        cerr << "Warning: Dropping client - " << e.what() << endl;
+    }
+}
+
+/**
+ * @brief Run one request and send its response
+ * @param connection Client connection
+ * @param frame Request frame payload
+ */
+void CommandServer::handle_request(const shared_ptr<Connection> &connection, const string &frame)
+{
+    string id = "null";
+    string result;
+    string error;
+
+    try
+    {
+        CommandArgs args = parseCommandArgs(frame);
+
+        // Numeric ids are echoed as numbers, others as strings
+        auto it = args.find("id");
+        if (it != args.end())
+        {
+            ostringstream quoted;
+            JsonWriter writer(quoted);
+            bool numeric = !it->second.empty() && it->second.find_first_not_of("0123456789") == string::npos;
+            numeric ? writer.raw(it->second) : writer.quoted(it->second);
+            writer.flush();
+            id = quoted.str();
+        }
+
+        if (args.count("op") && args.at("op") == "shutdown")
+        {
+            stopping = true;
+            ::shutdown(listenFd, SHUT_RDWR);
+            result = "{}";
+        }
+        else
+        {
+            // Events of a job started here go to this connection, between the responses
+            result = processor.execute(args, [connection](const string &event) { connection->sendFrame(event); });
+        }
+    }
+    catch (const exception &e)
+    {
+        error = e.what();
+    }
+
+    ostringstream response;
+    JsonWriter writer(response);
+    writer.raw("{\"id\": ").raw(id);
+    if (error.empty())
+    {
+        writer.raw(", \"ok\": true, \"result\": ").raw(result).raw("}");
+    }
+    else
+    {
+        writer.raw(", \"ok\": false, \"error\": ").quoted(error).raw("}");
+    }
+    writer.flush();
+
+    connection->sendFrame(response.str());
+}
@@ -0,0 +1,291 @@
+#include "merkle.hpp"
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+    /**
+     * @brief Get the entry type of a stat mode
+     * @param mode st_mode of the entry
+     * @return Entry type
+     */
+    EntryType typeOfMode(mode_t mode)
+    {
+        if (S_ISREG(mode))
+        {
+            return EntryType::FILE;
+        }
+        if (S_ISLNK(mode))
+        {
+            return EntryType::SYMLINK;
+        }
+        return S_ISDIR(mode) ? EntryType::DIRECTORY : EntryType::OTHER;
+    }
+
+    /**
+     * @brief Type an entry whose d_type is a symlink or unknown
+     * @param directoryFd Descriptor of the directory holding the entry
+     * @param entry Entry to type; error is set if the stat fails
+     * @param followSymlinks Type a symlink by its target rather than as SYMLINK
+     */
+    void statScanned(int directoryFd, ScannedEntry &entry, bool followSymlinks)
+    {
+        PhaseTimer timer(ProfilePhase::STAT);
+        BuildProfiler::count(ProfileCounter::STAT_CALLS);
+
+        struct stat st;
+        if (::fstatat(directoryFd, entry.name.c_str(), &st, followSymlinks ? 0 : AT_SYMLINK_NOFOLLOW) != 0)
+        {
+            entry.type = EntryType::MISSING;
+            entry.error = errno;
+            return;
+        }
+        entry.type = typeOfMode(st.st_mode);
+    }
+
+    /**
+     * @brief Read the entries of a directory, typing those d_type covers
+     * @param fd Descriptor of the directory
+     * @param path Path of the directory, for error messages
+     * @param entries Receives the entries other than "." and ".."
+     * @param untyped Receives the indexes of entries that still need a stat
+     * @param followSymlinks Stat symlinks for their target; otherwise they are typed SYMLINK
+     * @throws runtime_error If reading fails
+     */
+    void readEntries(int fd, const fs::path &path, vector<ScannedEntry> &entries, vector<size_t> &untyped,
+                     bool followSymlinks)
+    {
+        // Kept per thread, so large directories take few calls without an allocation per directory
+        thread_local vector<char> buffer(MTFSConstants::DIRENT_BUFFER_SIZE);
+
+        PhaseTimer timer(ProfilePhase::LIST);
+        while (true)
+        {
+            ssize_t length = ::getdents64(fd, buffer.data(), buffer.size());
+            if (length < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (length < 0)
+            {
+                throw runtime_error("Cannot list directory: " + path.string() + " - " + strerror(errno));
+            }
+            if (length == 0)
+            {
+                return;
+            }
+
+            for (ssize_t position = 0; position < length;)
+            {
+                const dirent64 *entry = reinterpret_cast<const dirent64 *>(buffer.data() + position);
+                position += entry->d_reclen;
+
+                const char *name = entry->d_name;
+                if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+                {
+                    continue;
+                }
+
+                EntryType type = EntryType::OTHER;
+                switch (entry->d_type)
+                {
+                case DT_REG:
+                    type = EntryType::FILE;
+                    break;
+                case DT_DIR:
+                    type = EntryType::DIRECTORY;
+                    break;
+                case DT_LNK:
+                    if (!followSymlinks)
+                    {
+                        type = EntryType::SYMLINK;
+                        break;
+                    }
+                    untyped.push_back(entries.size());
+                    break;
+                case DT_UNKNOWN:
+                    untyped.push_back(entries.size());
+                    break;
+                default:
+                    break;
+                }
+                entries.push_back({name, type, 0});
+            }
+        }
+    }
+}
+
+/**
+ * @brief List a directory with getdents64, typing entries without a stat where possible
+ * @param path Directory to list
+ * @param followSymlinks Type symlinks by their target (as fs::status does) rather than as SYMLINK
+ * @return Identity and entries of the directory, entries in directory order
+ * @throws PathTooLong If the path is longer than the kernel accepts
+ * @throws runtime_error If the directory cannot be opened or read
+ *
+ * The whole listing is read before the descriptor is closed, so a walk
+ * holds no directory open while it descends.
+ */
+DirectoryListing scanDirectory(const fs::path &path, bool followSymlinks)
+{
+    BuildProfiler::count(ProfileCounter::DIRECTORIES_LISTED);
+
+    DirectoryListing listing;
+    int fd;
+    {
+        PhaseTimer timer(ProfilePhase::LIST);
+        fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    if (fd < 0 && errno == ENAMETOOLONG)
+    {
+        throw PathTooLong(path);
+    }
+    if (fd < 0)
+    {
+        throw runtime_error("Cannot open directory: " + path.string() + " - " + strerror(errno));
+    }
+
+    vector<size_t> untyped;
+    try
+    {
+        // The descriptor names the directory actually opened, so the identity is exact across mounts and symlinks
+        struct stat st;
+        if (::fstat(fd, &st) != 0)
+        {
+            throw runtime_error("Cannot stat directory: " + path.string() + " - " + strerror(errno));
+        }
+        listing.id = {st.st_dev, st.st_ino};
+
+        readEntries(fd, path, listing.entries, untyped, followSymlinks);
+    }
+    catch (const exception &)
+    {
+        ::close(fd);
+        throw;
+    }
+
+    for (size_t index : untyped)
+    {
+        statScanned(fd, listing.entries[index], followSymlinks);
+    }
+
+    ::close(fd);
+    return listing;
+}
+
+/**
+ * @brief Create the error of a path that is too long to open
+ * @param path The path
+ */
+PathTooLong::PathTooLong(const fs::path &path)
+    : runtime_error("Path too long: " + path.string() + " - " + strerror(ENAMETOOLONG) +
+                    " (the tree is deeper than full paths can reach)")
+{
+}
+
+/**
+ * @brief Get the type of a path with one stat
+ * @param path Path to look up
+ * @param followSymlinks Type a symlink by its target rather than as SYMLINK
+ * @param device Receives the device of the path when not nullptr
+ * @return Type of the path (MISSING if it does not exist)
+ * @throws runtime_error If the path exists but cannot be stat'ed
+ */
+EntryType statEntry(const fs::path &path, bool followSymlinks, uint64_t *device)
+{
+    PhaseTimer timer(ProfilePhase::STAT);
+    BuildProfiler::count(ProfileCounter::STAT_CALLS);
+
+    struct stat st;
+    int result = followSymlinks ? ::stat(path.c_str(), &st) : ::lstat(path.c_str(), &st);
+    if (result != 0)
+    {
+        if (errno == ENOENT || errno == ENOTDIR)
+        {
+            return EntryType::MISSING;
+        }
+        throw runtime_error("Cannot stat " + path.string() + ": " + strerror(errno));
+    }
+
+    if (device)
+    {
+        *device = st.st_dev;
+    }
+    return typeOfMode(st.st_mode);
+}
+
+/**
+ * @brief Get the canonical name of a symlink policy
+ * @param policy Symlink policy
+ * @return Policy name ("follow" or "skip")
+ */
+string symlinkPolicyName(SymlinkPolicy policy)
+{
+    switch (policy)
+    {
+    case SymlinkPolicy::FOLLOW:
+        return "follow";
+    case SymlinkPolicy::SKIP:
+        return "skip";
+    }
+
+    return "unknown";
+}
+
+/**
+ * @brief Parse a symlink policy name
+ * @param name Policy name as returned by symlinkPolicyName
+ * @return Parsed policy
+ * @throws runtime_error If the name is unknown
+ */
+SymlinkPolicy parseSymlinkPolicy(const string &name)
+{
+    for (SymlinkPolicy policy : {SymlinkPolicy::FOLLOW, SymlinkPolicy::SKIP})
+    {
+        if (name == symlinkPolicyName(policy))
+        {
+            return policy;
+        }
+    }
+
+    throw runtime_error("Unknown symlink policy: " + name);
+}
+
+/**
+ * @brief Get the canonical name of a hard link policy
+ * @param policy Hard link policy
+ * @return Policy name ("each" or "share")
+ */
+string hardlinkPolicyName(HardlinkPolicy policy)
+{
+    switch (policy)
+    {
+    case HardlinkPolicy::HASH_EACH:
+        return "each";
+    case HardlinkPolicy::SHARE:
+        return "share";
+    }
+
+    return "unknown";
+}
+
+/**
+ * @brief Parse a hard link policy name
+ * @param name Policy name as returned by hardlinkPolicyName
+ * @return Parsed policy
+ * @throws runtime_error If the name is unknown
+ */
+HardlinkPolicy parseHardlinkPolicy(const string &name)
+{
+    for (HardlinkPolicy policy : {HardlinkPolicy::HASH_EACH, HardlinkPolicy::SHARE})
+    {
+        if (name == hardlinkPolicyName(policy))
+        {
+            return policy;
+        }
+    }
+
+    throw runtime_error("Unknown hard link policy: " + name);
+}
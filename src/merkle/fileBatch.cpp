@@ -0,0 +1,316 @@
+#include "merkle.hpp"
+#include <fcntl.h>
+#include <unistd.h>
+
+/**
+ * @brief Create an empty batch
+ * @param engine Hash engine of the tree
+ * @param chunking Chunking of the tree
+ * @param backend How file contents are read
+ * @param cache Cache the hashed files are recorded in, or nullptr
+ */
+FileBatch::FileBatch(const HashEngine &engine, const ChunkingConfig &chunking, IoBackend backend, HashCache *cache)
+    : engine(engine), chunking(chunking),
+      sizeLimit(min(chunking.singleChunkLimit(), MTFSConstants::SMALL_FILE_SIZE)),
+      deferredReads(backend == IoBackend::IO_URING && IoRing::forThread() != nullptr), cache(cache), used(0)
+{
+}
+
+/**
+ * @brief Close the descriptors of files that were never flushed
+ */
+FileBatch::~FileBatch()
+{
+    for (const auto &file : pending)
+    {
+        if (file.fd >= 0)
+        {
+            ::close(file.fd);
+        }
+    }
+}
+
+/**
+ * @brief Get the largest file size accepted by add()
+ * @return Size limit in bytes
+ */
+size_t FileBatch::getSizeLimit() const
+{
+    return sizeLimit;
+}
+
+/**
+ * @brief Queue a file
+ * @param node File node to fill on flush (its fileStat must be set)
+ * @param path Filesystem path of the file
+ * @return False (and nothing queued) if the file is larger than the limit
+ * @throws runtime_error If the file cannot be opened or read
+ *
+ * One byte more than the limit is requested, so a file that grew since it
+ * was stat'ed is noticed and left to the streaming path.
+ */
+bool FileBatch::add(const shared_ptr<MerkleNode> &node, const string &path)
+{
+    int fd;
+    {
+        PhaseTimer timer(ProfilePhase::OPEN);
+        BuildProfiler::count(ProfileCounter::OPEN_CALLS);
+        fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    }
+    if (fd < 0)
+    {
+        throw runtime_error("Cannot open file: " + path);
+    }
+
+    if (deferredReads)
+    {
+        pending.push_back({node, path, fd, nullptr, 0, 0, false, 0});
+        return true;
+    }
+
+    if (buffer.size() < used + sizeLimit + 1)
+    {
+        buffer.resize(max(buffer.size() * 2, used + sizeLimit + 1));
+    }
+
+    uint64_t readStart = BuildProfiler::enabled() ? BuildProfiler::now() : 0;
+    size_t length = 0;
+    while (length <= sizeLimit)
+    {
+        ssize_t bytesRead;
+        {
+            PhaseTimer timer(ProfilePhase::READ);
+            bytesRead = ::read(fd, buffer.data() + used + length, sizeLimit + 1 - length);
+        }
+        if (bytesRead < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            ::close(fd);
+            throw runtime_error("Error reading file: " + path + " - " + strerror(errno));
+        }
+        if (bytesRead == 0)
+        {
+            break;
+        }
+        length += bytesRead;
+    }
+    ::close(fd);
+    BuildProfiler::count(ProfileCounter::READ_BYTES, length);
+
+    if (length > sizeLimit)
+    {
+        return false;
+    }
+
+    uint64_t readNs = readStart != 0 ? BuildProfiler::now() - readStart : 0;
+    pending.push_back({node, string(), -1, nullptr, used, length, false, readNs});
+    used += length;
+    return true;
+}
+
+/**
+ * @brief Check whether the batch should be flushed
+ * @return True once HASH_BATCH_SIZE files are queued
+ */
+bool FileBatch::full() const
+{
+    return pending.size() >= MTFSConstants::HASH_BATCH_SIZE;
+}
+
+/**
+ * @brief Hash the queued files and fill their nodes
+ * @return The filled nodes, in the order they were added
+ */
+vector<shared_ptr<MerkleNode>> FileBatch::flush()
+{
+    TraceSpan span("batch");
+
+    if (deferredReads)
+    {
+        read_queued(*IoRing::forThread());
+    }
+    else
+    {
+        for (auto &file : pending)
+        {
+            file.data = buffer.data() + file.offset;
+        }
+    }
+
+    vector<PendingFile *> ready;
+    for (auto &file : pending)
+    {
+        if (file.data)
+        {
+            ready.push_back(&file);
+        }
+    }
+
+    vector<HashInput> inputs;
+    inputs.reserve(ready.size());
+    size_t totalBytes = 0;
+    for (const PendingFile *file : ready)
+    {
+        inputs.push_back({file->data, file->length});
+        totalBytes += file->length;
+    }
+
+    vector<Digest> digests(ready.size());
+    uint64_t hashStart = BuildProfiler::enabled() ? BuildProfiler::now() : 0;
+    {
+        PhaseTimer timer(ProfilePhase::HASH);
+        engine.hashMany(inputs.data(), inputs.size(), digests.data());
+    }
+    BuildProfiler::count(ProfileCounter::HASH_BYTES, totalBytes);
+
+    if (hashStart != 0)
+    {
+        // The files are hashed together, so each is charged an equal share of the hash time
+        uint64_t hashShare = ready.empty() ? 0 : (BuildProfiler::now() - hashStart) / ready.size();
+        for (const auto &file : pending)
+        {
+            if (file.data || file.streamed)
+            {
+                BuildProfiler::count(ProfileCounter::FILES_HASHED);
+                BuildProfiler::record(ProfileHistogram::FILE_SIZE, file.node->fileStat.size);
+                BuildProfiler::record(ProfileHistogram::FILE_LATENCY, file.readNs + (file.data ? hashShare : 0));
+            }
+        }
+    }
+
+    for (size_t i = 0; i < ready.size(); ++i)
+    {
+        MerkleNode &node = *ready[i]->node;
+        node.contentHash = digests[i];
+        node.fileSize = ready[i]->length;
+
+        // Same chunk list as hash_file_content: none for an empty file
+        node.chunkHashes.clear();
+        if (ready[i]->length > 0)
+        {
+            node.chunkHashes.push_back(digests[i]);
+        }
+
+        // A file whose length no longer matches its stat changed while queued
+        if (cache && node.fileSize == node.fileStat.size)
+        {
+            cache->store(node, engine.algorithm(), chunking);
+        }
+    }
+
+    vector<shared_ptr<MerkleNode>> filled;
+    for (auto &file : pending)
+    {
+        if (file.data || file.streamed)
+        {
+            filled.push_back(move(file.node));
+        }
+    }
+
+    pending.clear();
+    used = 0;
+    return filled;
+}
+
+/**
+ * @brief Take the files that failed in previous flushes
+ * @return Failed files, in the order they were added
+ */
+vector<FileBatch::FailedFile> FileBatch::takeFailures()
+{
+    return move(failures);
+}
+
+/**
+ * @brief Read all queued files on the thread's io_uring
+ * @param ring Ring of the calling thread
+ *
+ * Every file gets a slot of sizeLimit + 1 bytes in the registered buffer
+ * and all reads are submitted together. A short read is completed with
+ * pread; a file that no longer fits its slot is hashed by streaming it.
+ */
+void FileBatch::read_queued(IoRing &ring)
+{
+    size_t slotSize = sizeLimit + 1;
+    for (size_t i = 0; i < pending.size(); ++i)
+    {
+        ring.read(pending[i].fd, ring.buffer() + i * slotSize, slotSize, 0, i);
+    }
+
+    vector<int> results(pending.size());
+    uint64_t readStart = BuildProfiler::enabled() ? BuildProfiler::now() : 0;
+    {
+        PhaseTimer timer(ProfilePhase::READ);
+        for (size_t completed = 0; completed < pending.size(); ++completed)
+        {
+            uint64_t tag;
+            int result = ring.wait(tag);
+            results[tag] = result;
+        }
+    }
+    uint64_t readShare = readStart != 0 && !pending.empty() ? (BuildProfiler::now() - readStart) / pending.size() : 0;
+
+    for (size_t i = 0; i < pending.size(); ++i)
+    {
+        PendingFile &file = pending[i];
+        char *slot = ring.buffer() + i * slotSize;
+        ssize_t length = results[i];
+        uint64_t fileStart = readStart != 0 ? BuildProfiler::now() : 0;
+
+        // Finish short reads until EOF or the slot is full
+        while (length >= 0 && (size_t)length < file.node->fileStat.size && (size_t)length < slotSize)
+        {
+            ssize_t bytesRead;
+            {
+                PhaseTimer timer(ProfilePhase::READ);
+                bytesRead = ::pread(file.fd, slot + length, slotSize - length, length);
+            }
+            if (bytesRead < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (bytesRead <= 0)
+            {
+                length = bytesRead < 0 ? -errno : length;
+                break;
+            }
+            length += bytesRead;
+        }
+
+        try
+        {
+            if (length < 0)
+            {
+                throw runtime_error("Error reading file: " + file.path + " - " + strerror((int)-length));
+            }
+
+            if ((size_t)length > sizeLimit)
+            {
+                // Grew since it was stat'ed: no longer a single small chunk
+                auto [contentHash, fileSize, chunkHashes] = ChunkHasher::hashDescriptor(engine, chunking, file.fd);
+                file.node->contentHash = contentHash;
+                file.node->fileSize = fileSize;
+                file.node->chunkHashes = move(chunkHashes);
+                file.streamed = true;
+            }
+            else
+            {
+                BuildProfiler::count(ProfileCounter::READ_BYTES, length);
+                file.data = slot;
+                file.length = length;
+            }
+        }
+        catch (const exception &e)
+        {
+            failures.push_back({file.node, file.path, e.what()});
+        }
+
+        ::close(file.fd);
+        file.fd = -1;
+        // Its share of the batched reads, plus its own pread or streaming
+        file.readNs = fileStart != 0 ? readShare + BuildProfiler::now() - fileStart : 0;
+    }
+}
@@ -1,6 +1,7 @@
 #include "merkle.hpp"
 #include <iostream>
 #include <string>
+#include <cstring>
 
 using namespace std;
 
@@ -14,14 +15,554 @@ void print_menu()
     cout << "5. Verify tree integrity\n";
     cout << "6. Export tree to JSON\n";
     cout << "7. Set chunk size\n";
-    cout << "8. Exit\n";
+    cout << "8. Set thread count\n";
+    cout << "9. Save tree snapshot\n";
+    cout << "10. Load tree snapshot\n";
+    cout << "11. Write inclusion proof\n";
+    cout << "12. Verify inclusion proof\n";
+    cout << "13. Diff against snapshot\n";
+    cout << "14. Verify contents against disk\n";
+    cout << "15. Show build profile\n";
+    cout << "16. Exit\n";
     cout << "Choose an option: ";
 }
 
-int main() 
+void print_usage(const char *program)
 {
-    MerkleTree mtree;
-    shared_ptr<MerkleNode> root = nullptr;
+    cerr << "Usage: " << program << " [OPTIONS]                 Interactive menu\n"
+         << "       " << program << " [OPTIONS] COMMAND ARGS...    One command, JSON result on stdout\n";
+    cerr << "Commands (SOURCE is a directory to build or a snapshot to load):\n";
+    cerr << "  build DIR [--out SNAPSHOT]        Build a tree, optionally saving a snapshot\n";
+    cerr << "  build DIR --out SNAPSHOT --memory-budget BYTES\n"
+         << "                                    Build into the snapshot, spilling finished subtrees past BYTES\n";
+    cerr << "  merge DIR [MOUNT=]SNAPSHOT... [--out SNAPSHOT]\n"
+         << "                                    Combine shard snapshots into the tree of DIR, reading only\n"
+         << "                                    the entries of DIR that no shard covers\n";
+    cerr << "  stats | verify | verify-contents | export SOURCE\n";
+    cerr << "  find SOURCE NAME                  Nodes with a name\n";
+    cerr << "  diff SNAPSHOT SOURCE              Changes since a snapshot\n";
+    cerr << "  prove SOURCE PATH [--out FILE]    Inclusion proof, as hex and optionally a file\n";
+    cerr << "  sync SNAPSHOT SOURCE [--out FILE] Chunks a receiver holding SNAPSHOT lacks, optionally\n"
+         << "                                    writing their bytes to FILE as a chunk stream\n";
+    cerr << "  verify-proof ROOT_HASH PROOF_FILE\n";
+    cerr << "  profile DIR                       Build with profiling on, then print the profile\n";
+    cerr << "  watch DIR                         Build, then print the stats again after every batch of changes\n";
+    cerr << "  serve SOCKET [DIR]                Answer framed JSON requests on a Unix socket,\n"
+         << "                                    keeping the tree of DIR current if given\n";
+    cerr << "Options:\n";
+    cerr << "  -j, --threads N   Build with N worker threads (1 = serial, 0 = all cores)\n";
+    cerr << "  --compact         Keep built trees in the compact flat node store\n";
+    cerr << "  --hash ALGORITHM  Hash algorithm: sha256 (default), blake3, xxh3-128\n";
+    cerr << "  --io BACKEND      File reading: stream (default), mmap, io_uring\n";
+    cerr << "  --chunking MODE   Chunk boundaries: fixed (default) or cdc (content-defined)\n";
+    cerr << "  --symlinks MODE   Symbolic links: follow (default; loops are skipped) or skip\n";
+    cerr << "  --hardlinks MODE  Files with several links: each (default) or share (read once per build)\n";
+    cerr << "  --one-file-system Keep mount points below the root as empty directories\n";
+    cerr << "  --exclude PATH    Keep PATH (relative to the root) as an empty directory, e.g. a shard\n"
+         << "                    mount point of a merge base (repeatable)\n";
+    cerr << "  --hash-cache FILE Take unchanged files from a hash cache kept in FILE across runs\n";
+    cerr << "  --cdc-sizes MIN:AVG:MAX  Content-defined chunk sizes in bytes (default 16384:65536:262144)\n";
+    cerr << "  --json FORMAT     JSON export layout: tree (default) or ndjson (one node per line)\n";
+    cerr << "  --progress        Print progress events of builds and verifies to stderr, as JSON lines\n";
+    cerr << "  --memory-budget BYTES  Target for the finished nodes a build keeps in memory (build --out only;\n"
+         << "                         a directory's own entries are held until it is hashed)\n";
+    cerr << "  --profile         Count and time the I/O, hashing and indexing of every build\n";
+    cerr << "  --trace FILE      Also record spans, written to FILE as Chrome trace-event JSON\n";
+}
+
+/**
+ * @brief Print the profile of the last build in a readable form
+ * @param report Profile to print
+ */
+void print_profile(const ProfileReport &report)
+{
+    double wallMs = report.wallNs / 1e6;
+    cout << "Wall time: " << wallMs << " ms on " << report.threads << " threads\n";
+
+    cout << "Counters:\n";
+    for (size_t i = 0; i < (size_t)ProfileCounter::COUNT; ++i)
+    {
+        cout << "  " << profileCounterName((ProfileCounter)i) << ": " << report.counters[i] << "\n";
+    }
+
+    // Phases are summed over threads, so with several threads they can exceed the wall time
+    cout << "Phases:\n";
+    for (size_t i = 0; i < (size_t)ProfilePhase::COUNT; ++i)
+    {
+        double phaseMs = report.phaseNs[i] / 1e6;
+        cout << "  " << profilePhaseName((ProfilePhase)i) << ": " << phaseMs << " ms";
+        if (report.wallNs > 0)
+        {
+            cout << " (" << (int)(100.0 * report.phaseNs[i] / report.wallNs) << "% of wall)";
+        }
+        cout << "\n";
+    }
+
+    for (size_t i = 0; i < (size_t)ProfileHistogram::COUNT; ++i)
+    {
+        cout << profileHistogramName((ProfileHistogram)i) << ":\n";
+        const ProfileReport::Buckets &buckets = report.histograms[i];
+        for (size_t bucket = 0; bucket < ProfileReport::BUCKETS; ++bucket)
+        {
+            if (buckets[bucket] == 0)
+            {
+                continue;
+            }
+            uint64_t low = bucket == 0 ? 0 : 1ULL << (bucket - 1);
+            cout << "  >= " << low << ": " << buckets[bucket] << "\n";
+        }
+    }
+
+    if (report.traceEvents > 0 || report.droppedEvents > 0)
+    {
+        cout << "Trace events: " << report.traceEvents << " (" << report.droppedEvents << " dropped)\n";
+    }
+}
+
+/**
+ * @brief Run a command, as a background job printing its events to stderr if asked
+ * @param processor Processor of the tree
+ * @param args Command arguments, including "op" (one startJob accepts when progress is set)
+ * @param progress True to print progress events (--progress)
+ * @return JSON result of the command
+ * @throws runtime_error If the command fails or is cancelled
+ */
+string run_command(CommandProcessor &processor, CommandArgs args, bool progress)
+{
+    if (!progress)
+    {
+        return processor.execute(args);
+    }
+
+    args["job"] = args["op"];
+    args.erase("op");
+    return processor.awaitJob(processor.startJob(args, [](const string &event) { cerr << event << endl; }));
+}
+
+/**
+ * @brief Build or load the tree a batch command operates on
+ * @param processor Processor of the tree
+ * @param source Directory to build, or snapshot to load
+ * @param progress True to print the progress of a build (--progress)
+ */
+void load_source(CommandProcessor &processor, const string &source, bool progress)
+{
+    if (fs::is_directory(source))
+    {
+        run_command(processor, {{"op", "build"}, {"path", source}}, progress);
+        return;
+    }
+    processor.execute({{"op", "load"}, {"path", source}});
+}
+
+/**
+ * @brief Build a directory into a snapshot within a memory budget
+ * @param tree Tree to build (left mapped on the snapshot)
+ * @param directory Directory to build
+ * @param snapshotPath Snapshot to write
+ * @param memoryBudget Bytes of finished nodes kept in memory (--memory-budget)
+ * @return JSON summary of the tree and of what was spilled
+ *
+ * Unlike the build summary this leaves out the dedupe statistics, whose
+ * chunk sets grow with the tree.
+ */
+string build_bounded(MerkleTree &tree, const string &directory, const string &snapshotPath, size_t memoryBudget)
+{
+    BoundedBuildStats stats = tree.buildBounded(directory, snapshotPath, memoryBudget);
+    auto [files, directories, totalSize] = tree.getTreeStats();
+
+    ostringstream out;
+    JsonWriter writer(out);
+    writer.raw("{\"root_hash\": ").quoted(tree.getRootHash());
+    writer.raw(", \"files\": ").number(files);
+    writer.raw(", \"directories\": ").number(directories);
+    writer.raw(", \"size\": ").number(totalSize);
+    writer.raw(", \"depth\": ").number(tree.getTreeDepth());
+    writer.raw(", \"hash_algorithm\": ").quoted(HashEngine::algorithmName(tree.getHashAlgorithm()));
+    writer.raw(", \"chunking\": ").quoted(chunkingModeName(tree.getChunkingMode()));
+    writer.raw(", \"snapshot\": ").quoted(snapshotPath);
+    writer.raw(", \"memory_budget\": ").number(memoryBudget);
+    writer.raw(", \"peak_resident\": ").number(stats.peakResident);
+    writer.raw(", \"budget_overshoot\": ").number(stats.budgetOvershoot);
+    writer.raw(", \"spilled_subtrees\": ").number(stats.spilledSubtrees);
+    writer.raw(", \"spilled_bytes\": ").number(stats.spilledBytes);
+    writer.raw("}");
+    writer.flush();
+    return out.str();
+}
+
+/**
+ * @brief Run one machine-readable command and print its JSON result
+ * @param tree Tree to operate on
+ * @param args Command name and its positional arguments
+ * @param out Value of --out (empty if not given)
+ * @param jsonFormat Layout of the export command
+ * @param threadCount Threads running daemon commands (0 = default)
+ * @param tracePath Value of --trace (empty if not given)
+ * @param progress True to print the progress of builds and verifies (--progress)
+ * @param memoryBudget Value of --memory-budget (0 if not given)
+ * @return Exit status: 0 on success, 1 if a check failed or the command is malformed
+ * @throws runtime_error If the command fails
+ */
+int run_batch(MerkleTree &tree, const vector<string> &args, const string &out, JsonFormat jsonFormat,
+              size_t threadCount, const string &tracePath, bool progress, size_t memoryBudget)
+{
+    const string &command = args[0];
+    CommandProcessor processor(tree);
+
+    auto expectArgs = [&](size_t count)
+    {
+        if (args.size() != count + 1)
+        {
+            throw runtime_error("'" + command + "' takes " + to_string(count) + " arguments");
+        }
+    };
+
+    string result;
+    if (command == "serve")
+    {
+        if (args.size() != 2 && args.size() != 3)
+        {
+            throw runtime_error("'serve' takes a socket path and an optional directory to watch");
+        }
+        size_t workers = threadCount > 0 ? threadCount : MTFSConstants::DEFAULT_SERVER_WORKERS;
+        CommandServer server(processor, args[1], workers);
+
+        // With a directory, the tree is built and kept current while serving
+        unique_ptr<TreeWatcher> watcher;
+        thread watching;
+        if (args.size() == 3)
+        {
+            watcher = make_unique<TreeWatcher>(args[2], MTFSConstants::DEFAULT_WATCH_DEBOUNCE_MS);
+            processor.execute({{"op", "build"}, {"path", args[2]}});
+            watching = thread([&]()
+                              {
+                                  vector<string> paths;
+                                  while (watcher->wait(paths))
+                                  {
+                                      try
+                                      {
+                                          processor.update(paths);
+                                      }
+                                      catch (const exception &e)
+                                      {
+                                          cerr << "Warning: Cannot apply changes - " << e.what() << endl;
+                                      }
+                                  }
+                              });
+        }
+
+        auto stopWatching = [&]()
+        {
+            if (watcher)
+            {
+                watcher->stop();
+                watching.join();
+            }
+        };
+
+        cerr << "Listening on " << args[1] << endl;
+        try
+        {
+            server.run();
+        }
+        catch (const exception &)
+        {
+            stopWatching();
+            throw;
+        }
+        stopWatching();
+        return 0;
+    }
+    else if (command == "watch")
+    {
+        // Watching starts before the build, so changes made during it are not missed
+        expectArgs(1);
+        TreeWatcher watcher(args[1], MTFSConstants::DEFAULT_WATCH_DEBOUNCE_MS);
+        cout << processor.execute({{"op", "build"}, {"path", args[1]}}) << endl;
+
+        vector<string> paths;
+        while (watcher.wait(paths))
+        {
+            cout << processor.update(paths) << endl;
+        }
+        return 0;
+    }
+    else if (command == "build" && memoryBudget > 0)
+    {
+        expectArgs(1);
+        if (out.empty())
+        {
+            throw runtime_error("--memory-budget builds straight into a snapshot: give --out");
+        }
+        result = build_bounded(tree, args[1], out, memoryBudget);
+    }
+    else if (command == "build")
+    {
+        expectArgs(1);
+        result = run_command(processor, {{"op", "build"}, {"path", args[1]}}, progress);
+        if (!out.empty())
+        {
+            processor.execute({{"op", "save"}, {"path", out}});
+        }
+    }
+    else if (command == "merge")
+    {
+        if (args.size() < 3)
+        {
+            throw runtime_error("'merge' takes a directory and at least one shard snapshot");
+        }
+        string shards;
+        for (size_t i = 2; i < args.size(); ++i)
+        {
+            shards += args[i] + "\n";
+        }
+        result = processor.execute({{"op", "merge"}, {"path", args[1]}, {"shards", shards}});
+        if (!out.empty())
+        {
+            processor.execute({{"op", "save"}, {"path", out}});
+        }
+    }
+    else if (command == "profile")
+    {
+        expectArgs(1);
+        if (!BuildProfiler::enabled())
+        {
+            BuildProfiler::start(false);
+        }
+        processor.execute({{"op", "build"}, {"path", args[1]}});
+        CommandArgs request = {{"op", "profile"}};
+        if (!tracePath.empty())
+        {
+            request["trace"] = tracePath;
+        }
+        result = processor.execute(request);
+    }
+    else if (command == "stats" || command == "verify" || command == "verify-contents")
+    {
+        expectArgs(1);
+        load_source(processor, args[1], progress);
+        string op = command == "verify-contents" ? "verify_contents" : command;
+        result = run_command(processor, {{"op", op}}, progress && op != "stats");
+    }
+    else if (command == "export")
+    {
+        // Streamed rather than buffered into a result, so NDJSON is available too
+        expectArgs(1);
+        load_source(processor, args[1], progress);
+        tree.exportJson(cout, jsonFormat);
+        cout << endl;
+        return 0;
+    }
+    else if (command == "find")
+    {
+        expectArgs(2);
+        load_source(processor, args[1], progress);
+        result = processor.execute({{"op", "find"}, {"name", args[2]}});
+    }
+    else if (command == "diff")
+    {
+        expectArgs(2);
+        load_source(processor, args[2], progress);
+        result = processor.execute({{"op", "diff"}, {"snapshot", args[1]}});
+    }
+    else if (command == "sync")
+    {
+        expectArgs(2);
+        load_source(processor, args[2], progress);
+        CommandArgs request = {{"op", "sync_plan"}, {"snapshot", args[1]}};
+        if (!out.empty())
+        {
+            request["stream"] = out;
+        }
+        result = processor.execute(request);
+    }
+    else if (command == "prove")
+    {
+        expectArgs(2);
+        load_source(processor, args[1], progress);
+        CommandArgs request = {{"op", "prove"}, {"path", args[2]}};
+        if (!out.empty())
+        {
+            request["out"] = out;
+        }
+        result = processor.execute(request);
+    }
+    else if (command == "verify-proof")
+    {
+        expectArgs(2);
+        result = processor.execute({{"op", "verify_proof"}, {"root", args[1]}, {"proof_file", args[2]}});
+    }
+    else
+    {
+        throw runtime_error("Unknown command: " + command);
+    }
+
+    cout << result << endl;
+    bool failed = result == "{\"valid\": false}" || (command == "verify-contents" && result != "{\"issues\": []}");
+    return failed ? 1 : 0;
+}
+
+int main(int argc, char *argv[]) 
+{
+    size_t threadCount = MTFSConstants::DEFAULT_THREAD_COUNT;
+    HashAlgorithm algorithm = HashAlgorithm::SHA256;
+    IoBackend ioBackend = IoBackend::STREAM;
+    ChunkingMode chunkingMode = ChunkingMode::FIXED;
+    size_t cdcSizes[3] = {MTFSConstants::DEFAULT_CDC_MIN_SIZE, MTFSConstants::DEFAULT_CDC_AVERAGE_SIZE,
+                          MTFSConstants::DEFAULT_CDC_MAX_SIZE};
+    JsonFormat jsonFormat = JsonFormat::TREE;
+    WalkPolicy walkPolicy;
+    bool compact = false;
+    bool threadsGiven = false;
+    bool profile = false;
+    bool progress = false;
+    size_t memoryBudget = 0;
+    vector<string> command;
+    string outPath;
+    string tracePath;
+    string hashCachePath;
+
+    try 
+    {
+        for (int i = 1; i < argc; ++i) 
+        {
+            if ((strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--threads") == 0) && i + 1 < argc) 
+            {
+                threadCount = stoul(argv[++i]);
+                threadsGiven = true;
+            } 
+            else if (strcmp(argv[i], "--hash") == 0 && i + 1 < argc) 
+            {
+                algorithm = HashEngine::parseAlgorithm(argv[++i]);
+            } 
+            else if (strcmp(argv[i], "--io") == 0 && i + 1 < argc) 
+            {
+                ioBackend = parseIoBackend(argv[++i]);
+            } 
+            else if (strcmp(argv[i], "--chunking") == 0 && i + 1 < argc) 
+            {
+                chunkingMode = parseChunkingMode(argv[++i]);
+            } 
+            else if (strcmp(argv[i], "--cdc-sizes") == 0 && i + 1 < argc) 
+            {
+                if (sscanf(argv[++i], "%zu:%zu:%zu", &cdcSizes[0], &cdcSizes[1], &cdcSizes[2]) != 3)
+                {
+                    throw runtime_error(string("Invalid CDC sizes: ") + argv[i]);
+                }
+            } 
+            else if (strcmp(argv[i], "--symlinks") == 0 && i + 1 < argc) 
+            {
+                walkPolicy.symlinks = parseSymlinkPolicy(argv[++i]);
+            } 
+            else if (strcmp(argv[i], "--hardlinks") == 0 && i + 1 < argc) 
+            {
+                walkPolicy.hardlinks = parseHardlinkPolicy(argv[++i]);
+            } 
+            else if (strcmp(argv[i], "--one-file-system") == 0) 
+            {
+                walkPolicy.oneFileSystem = true;
+            } 
+            else if (strcmp(argv[i], "--exclude") == 0 && i + 1 < argc) 
+            {
+                walkPolicy.excluded.push_back(argv[++i]);
+            } 
+            else if (strcmp(argv[i], "--hash-cache") == 0 && i + 1 < argc) 
+            {
+                hashCachePath = argv[++i];
+            } 
+            else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) 
+            {
+                jsonFormat = parseJsonFormat(argv[++i]);
+            } 
+            else if (strcmp(argv[i], "--compact") == 0) 
+            {
+                compact = true;
+            } 
+            else if (strcmp(argv[i], "--progress") == 0) 
+            {
+                progress = true;
+            } 
+            else if (strcmp(argv[i], "--memory-budget") == 0 && i + 1 < argc) 
+            {
+                memoryBudget = stoull(argv[++i]);
+                if (memoryBudget == 0)
+                {
+                    throw runtime_error("Memory budget must be positive");
+                }
+            } 
+            else if (strcmp(argv[i], "--profile") == 0) 
+            {
+                profile = true;
+            } 
+            else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) 
+            {
+                tracePath = argv[++i];
+                profile = true;
+            } 
+            else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) 
+            {
+                outPath = argv[++i];
+            } 
+            else if (argv[i][0] != '-') 
+            {
+                command.push_back(argv[i]);
+            } 
+            else 
+            {
+                print_usage(argv[0]);
+                return 1;
+            }
+        }
+    } 
+    catch (const exception &e) 
+    {
+        cerr << "Error: " << e.what() << endl;
+        return 1;
+    }
+
+    // The hash algorithm is fixed for the lifetime of the tree
+    unique_ptr<MerkleTree> tree;
+    try 
+    {
+        tree = make_unique<MerkleTree>(MTFSConstants::DEFAULT_CHUNK_SIZE, threadCount, algorithm);
+        tree->setCdcSizes(cdcSizes[0], cdcSizes[1], cdcSizes[2]);
+        tree->setChunkingMode(chunkingMode);
+        tree->setWalkPolicy(walkPolicy);
+        if (!hashCachePath.empty())
+        {
+            tree->setHashCache(HashCache::open(hashCachePath));
+        }
+    } 
+    catch (const exception &e) 
+    {
+        cerr << "Error: " << e.what() << endl;
+        return 1;
+    }
+
+    MerkleTree &mtree = *tree;
+    mtree.setCompactStorage(compact);
+    mtree.setIoBackend(ioBackend);
+
+    if (profile)
+    {
+        BuildProfiler::start(!tracePath.empty());
+    }
+
+    if (!command.empty()) 
+    {
+        try 
+        {
+            return run_batch(mtree, command, outPath, jsonFormat, threadsGiven ? threadCount : 0, tracePath,
+                             progress, memoryBudget);
+        } 
+        catch (const exception &e) 
+        {
+            cerr << "Error: " << e.what() << endl;
+            return 1;
+        }
+    }
+
     string directory;
     bool tree_built = false;
 
@@ -40,7 +581,8 @@ int main()
                 getline(cin, directory);
                 try 
                 {
-                    root = mtree.build_tree(directory);
+                    // Unchanged files are reused when the same directory is rebuilt
+                    mtree.rebuild(directory);
                     tree_built = true;
                     cout << "Merkle tree built successfully.\n";
                 } 
@@ -57,7 +599,7 @@ int main()
                     cout << "Build the tree first (option 1).\n";
                     break;
                 }
-                mtree.print_tree_details(root);
+                mtree.print_tree_details(mtree.getRoot());
                 break;
             }
             case 3: 
@@ -81,8 +623,21 @@ int main()
                 cout << "Total files: " << totalFiles << endl;
                 cout << "Total directories: " << totalDirs << endl;
                 cout << "Total size: " << formatFileSize(totalSize) << endl;
-                cout << "Tree depth: " << root->getDepth() << endl;
-                cout << "Root hash: " << root->hash << endl;
+                cout << "Tree depth: " << mtree.getTreeDepth() << endl;
+                cout << "Root hash: " << toHex(mtree.getRootHash()) << endl;
+                cout << "Hash algorithm: " << HashEngine::algorithmName(mtree.getHashAlgorithm()) << endl;
+                cout << "Chunking: " << chunkingModeName(mtree.getChunkingMode()) << endl;
+                DedupeStats dedupe = mtree.getDedupeStats();
+                cout << "Unique files: " << dedupe.uniqueFiles << " of " << dedupe.files << " ("
+                     << formatFileSize(dedupe.uniqueFileBytes) << " of " << formatFileSize(dedupe.logicalBytes) << ")"
+                     << endl;
+                cout << "Unique chunks: " << dedupe.uniqueChunks << " of " << dedupe.chunks << " ("
+                     << formatFileSize(dedupe.uniqueChunkBytes);
+                if (dedupe.unsizedChunks > 0) 
+                {
+                    cout << " + " << dedupe.unsizedChunks << " chunks of unknown length";
+                }
+                cout << " of " << formatFileSize(dedupe.logicalBytes) << ")" << endl;
                 break;
             }
             case 5: 
@@ -103,8 +658,15 @@ int main()
                     cout << "Build the tree first (option 1).\n";
                     break;
                 }
-                string json = mtree.exportToJson();
-                cout << json << endl;
+                try 
+                {
+                    mtree.exportJson(cout, jsonFormat);
+                    cout << endl;
+                } 
+                catch (const exception &e) 
+                {
+                    cerr << "Error: " << e.what() << endl;
+                }
                 break;
             }
             case 7: 
@@ -122,6 +684,192 @@ int main()
                 break;
             }
             case 8: 
+            {
+                cout << "Enter thread count (0 = all cores): ";
+                size_t threadCount;
+                cin >> threadCount;
+                cin.ignore();
+                try {
+                    mtree.setThreadCount(threadCount);
+                    cout << "Thread count set to " << mtree.getThreadCount() << ".\n";
+                } catch (const exception &e) {
+                    cerr << "Error: " << e.what() << endl;
+                }
+                break;
+            }
+            case 9: 
+            {
+                if (!tree_built) 
+                {
+                    cout << "Build the tree first (option 1).\n";
+                    break;
+                }
+                string path;
+                cout << "Enter snapshot path: ";
+                getline(cin, path);
+                try 
+                {
+                    mtree.save(path);
+                    cout << "Snapshot saved to " << path << ".\n";
+                } 
+                catch (const exception &e) 
+                {
+                    cerr << "Error: " << e.what() << endl;
+                }
+                break;
+            }
+            case 10: 
+            {
+                string path;
+                cout << "Enter snapshot path: ";
+                getline(cin, path);
+                try 
+                {
+                    mtree.load(path);
+                    tree_built = true;
+                    cout << "Snapshot loaded from " << path << ".\n";
+                } 
+                catch (const exception &e) 
+                {
+                    cerr << "Error: " << e.what() << endl;
+                }
+                break;
+            }
+            case 11: 
+            {
+                if (!tree_built) 
+                {
+                    cout << "Build the tree first (option 1).\n";
+                    break;
+                }
+                string path, proofPath;
+                cout << "Enter path in the tree: ";
+                getline(cin, path);
+                cout << "Enter proof output path: ";
+                getline(cin, proofPath);
+                try 
+                {
+                    vector<uint8_t> proof = mtree.prove(path);
+                    ofstream out(proofPath, ios::binary);
+                    if (!out.write(reinterpret_cast<const char *>(proof.data()), proof.size())) 
+                    {
+                        throw runtime_error("Cannot write proof file: " + proofPath);
+                    }
+                    cout << "Proof written to " << proofPath << " (" << proof.size() << " bytes).\n";
+                } 
+                catch (const exception &e) 
+                {
+                    cerr << "Error: " << e.what() << endl;
+                }
+                break;
+            }
+            case 12: 
+            {
+                string rootHex, proofPath;
+                cout << "Enter root hash: ";
+                getline(cin, rootHex);
+                cout << "Enter proof path: ";
+                getline(cin, proofPath);
+                try 
+                {
+                    Digest rootHash = fromHex(rootHex);
+                    ifstream in(proofPath, ios::binary);
+                    if (!in) 
+                    {
+                        throw runtime_error("Cannot open proof file: " + proofPath);
+                    }
+                    vector<uint8_t> proof((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+
+                    if (verifyProof(rootHash, proof)) 
+                    {
+                        InclusionProof decoded = InclusionProof::decode(proof.data(), proof.size());
+                        cout << "Proof verified: " << decoded.path() << " (" << toHex(decoded.nodeHash) << ")\n";
+                    } 
+                    else 
+                    {
+                        cout << "Proof verification FAILED.\n";
+                    }
+                } 
+                catch (const exception &e) 
+                {
+                    cerr << "Error: " << e.what() << endl;
+                }
+                break;
+            }
+            case 13: 
+            {
+                if (!tree_built) 
+                {
+                    cout << "Build the tree first (option 1).\n";
+                    break;
+                }
+                string path;
+                cout << "Enter snapshot path: ";
+                getline(cin, path);
+                try 
+                {
+                    // The snapshot is the older tree: changes are what happened since
+                    MerkleTree snapshot;
+                    snapshot.load(path);
+                    vector<TreeChange> changes = snapshot.diff(mtree);
+                    for (const auto &change : changes) 
+                    {
+                        cout << setw(9) << left << changeTypeName(change.type) << change.path
+                             << (change.isFile ? "" : "/") << "\n";
+                    }
+                    cout << "Diff complete: " << changes.size() << " changes.\n";
+                } 
+                catch (const exception &e) 
+                {
+                    cerr << "Error: " << e.what() << endl;
+                }
+                break;
+            }
+            case 14: 
+            {
+                if (!tree_built) 
+                {
+                    cout << "Build the tree first (option 1).\n";
+                    break;
+                }
+                vector<IntegrityIssue> issues = mtree.verifyContents();
+                for (const auto &issue : issues) 
+                {
+                    cout << issue.path << ": " << issue.problem << "\n";
+                }
+                cout << "Content check complete: " << issues.size() << " issues.\n";
+                break;
+            }
+            case 15: 
+            {
+                if (!BuildProfiler::enabled())
+                {
+                    // Probes only record while profiling, so this covers the next build
+                    BuildProfiler::start(!tracePath.empty());
+                    cout << "Profiling is now on; build the tree (option 1) to record a profile.\n";
+                    break;
+                }
+                print_profile(BuildProfiler::report());
+                if (!tracePath.empty())
+                {
+                    try
+                    {
+                        ofstream trace(tracePath);
+                        if (!trace)
+                        {
+                            throw runtime_error("Cannot create trace file: " + tracePath);
+                        }
+                        BuildProfiler::writeTrace(trace);
+                        cout << "Trace written to " << tracePath << "\n";
+                    }
+                    catch (const exception &e)
+                    {
+                        cerr << "Error: " << e.what() << endl;
+                    }
+                }
+                break;
+            }
+            case 16: 
             {
                 cout << "Exiting.\n";
                 return 0;
@@ -0,0 +1,488 @@
+#include "merkle.hpp"
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <time.h>
+
+namespace
+{
+    const char CACHE_MAGIC[8] = {'M', 'T', 'F', 'S', 'H', 'C', 'H', '\0'};
+    const uint32_t RECORD_MAGIC = 0x52484D4D; // "MMHR"
+    const uint64_t FNV_OFFSET = 14695981039346656037ULL;
+    const uint64_t FNV_PRIME = 1099511628211ULL;
+
+    /**
+     * @struct CacheHeader
+     * @brief First bytes of a hash cache file
+     */
+    struct CacheHeader
+    {
+        char magic[8];       // CACHE_MAGIC
+        uint32_t version;    // HASH_CACHE_VERSION
+        uint32_t headerSize; // sizeof(CacheHeader), where the first record starts
+    };
+
+    /**
+     * @brief Continue an FNV-1a hash over some bytes
+     * @param data Bytes to hash
+     * @param length Number of bytes
+     * @param hash Hash of the preceding bytes
+     * @return Updated hash
+     */
+    uint64_t fnv1a(const void *data, size_t length, uint64_t hash = FNV_OFFSET)
+    {
+        const uint8_t *bytes = static_cast<const uint8_t *>(data);
+        for (size_t i = 0; i < length; ++i)
+        {
+            hash = (hash ^ bytes[i]) * FNV_PRIME;
+        }
+        return hash;
+    }
+
+    /**
+     * @brief Write a whole buffer to a descriptor
+     * @param fd Descriptor
+     * @param data Bytes to write
+     * @param length Number of bytes
+     * @return False on error
+     */
+    bool writeAll(int fd, const char *data, size_t length)
+    {
+        while (length > 0)
+        {
+            ssize_t written = ::write(fd, data, length);
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                return false;
+            }
+            data += written;
+            length -= written;
+        }
+        return true;
+    }
+}
+
+/**
+ * @struct HashCache::Record
+ * @brief One hashed file in the log, followed by its chunk hashes
+ *
+ * Records are multiples of 8 bytes, so every record in the mapping is
+ * aligned.
+ */
+struct HashCache::Record
+{
+    uint32_t magic;       // RECORD_MAGIC
+    uint32_t chunkCount;  // Chunk hashes after the record
+    FileStat fileStat;    // Metadata read before the content was hashed
+    uint32_t algorithm;   // HashAlgorithm
+    uint32_t mode;        // ChunkingMode
+    uint64_t sizes[3];    // Chunk size (fixed), or minimum, average and maximum size (CDC)
+    uint64_t fileSize;    // Size in bytes
+    Digest contentHash;   // Hash of the content
+    uint64_t checksum;    // FNV-1a of the bytes before it and the chunk hashes
+
+    /**
+     * @brief Get the chunk hashes of the record
+     * @return First chunk hash
+     */
+    const Digest *chunks() const
+    {
+        return reinterpret_cast<const Digest *>(this + 1);
+    }
+
+    /**
+     * @brief Compute the checksum of the record
+     * @return Checksum covering the fields and the chunk hashes
+     */
+    uint64_t computeChecksum() const
+    {
+        uint64_t hash = fnv1a(this, offsetof(Record, checksum));
+        return fnv1a(chunks(), chunkCount * sizeof(Digest), hash);
+    }
+};
+
+/**
+ * @brief Open a cache file, creating it if needed
+ * @param path Path of the cache file
+ * @return The cache of that file, shared with its other users in the process
+ * @throws runtime_error If the file cannot be opened or is not a hash cache
+ */
+shared_ptr<HashCache> HashCache::open(const string &path)
+{
+    static mutex registryLock;
+    static map<string, weak_ptr<HashCache>> registry;
+
+    string absolutePath = fs::weakly_canonical(fs::absolute(path)).string();
+
+    lock_guard<mutex> guard(registryLock);
+    weak_ptr<HashCache> &entry = registry[absolutePath];
+    shared_ptr<HashCache> cache = entry.lock();
+    if (!cache)
+    {
+        cache = shared_ptr<HashCache>(new HashCache(absolutePath));
+        entry = cache;
+    }
+    return cache;
+}
+
+/**
+ * @brief Open a cache file
+ * @param path Absolute path of the file
+ * @throws runtime_error If the file cannot be opened or is not a hash cache
+ */
+HashCache::HashCache(const string &path)
+    : path(path), fd(-1), mapping(nullptr), mappingSize(0), recordCount(0)
+{
+    try
+    {
+        open_locked();
+        load();
+
+        if (recordCount >= MTFSConstants::HASH_CACHE_COMPACT_MIN && recordCount > 2 * slots.size())
+        {
+            compact();
+            load();
+        }
+    }
+    catch (...)
+    {
+        if (mapping)
+        {
+            munmap(mapping, mappingSize);
+        }
+        if (fd >= 0)
+        {
+            ::close(fd);
+        }
+        throw;
+    }
+
+    flock(fd, LOCK_UN);
+}
+
+/**
+ * @brief Append the remaining records and close the file
+ */
+HashCache::~HashCache()
+{
+    flush();
+    if (mapping)
+    {
+        munmap(mapping, mappingSize);
+    }
+    ::close(fd);
+}
+
+/**
+ * @brief Get the path of the cache file
+ * @return Absolute path
+ */
+const string &HashCache::getPath() const
+{
+    return path;
+}
+
+/**
+ * @brief Get the number of files in the cache
+ * @return Files with a current record
+ */
+size_t HashCache::size() const
+{
+    shared_lock<shared_mutex> guard(lock);
+    return slots.size();
+}
+
+/**
+ * @brief Fill a file node from its record, if the file is unchanged
+ * @param node File node (its fileStat must be set)
+ * @param algorithm Hash algorithm of the tree
+ * @param chunking Chunking of the tree
+ * @return True if the node was filled
+ */
+bool HashCache::fill(MerkleNode &node, HashAlgorithm algorithm, const ChunkingConfig &chunking) const
+{
+    shared_lock<shared_mutex> guard(lock);
+    auto it = slots.find(make_key(node.fileStat, algorithm, chunking));
+    if (it == slots.end() || it->second.record->fileStat != node.fileStat)
+    {
+        return false;
+    }
+
+    const Record &record = *it->second.record;
+    node.contentHash = record.contentHash;
+    node.fileSize = record.fileSize;
+    node.chunkHashes.assign(record.chunks(), record.chunks() + record.chunkCount);
+    BuildProfiler::count(ProfileCounter::HASH_CACHE_HITS);
+    return true;
+}
+
+/**
+ * @brief Record the hashes of a file node
+ * @param node File node just hashed (fileStat read before its content)
+ * @param algorithm Hash algorithm of the tree
+ * @param chunking Chunking of the tree
+ *
+ * Files changed less than HASH_CACHE_SETTLE_NS ago are not recorded:
+ * a write within the timestamp granularity would leave their metadata
+ * unchanged.
+ */
+void HashCache::store(const MerkleNode &node, HashAlgorithm algorithm, const ChunkingConfig &chunking)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    int64_t nowNs = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    int64_t changedNs = max(node.fileStat.mtimeNs, node.fileStat.ctimeNs);
+    if (nowNs - changedNs < MTFSConstants::HASH_CACHE_SETTLE_NS)
+    {
+        return;
+    }
+
+    Key key = make_key(node.fileStat, algorithm, chunking);
+
+    vector<char> bytes(sizeof(Record) + node.chunkHashes.size() * sizeof(Digest));
+    Record &record = *reinterpret_cast<Record *>(bytes.data());
+    record.magic = RECORD_MAGIC;
+    record.chunkCount = node.chunkHashes.size();
+    record.fileStat = node.fileStat;
+    record.algorithm = get<2>(key);
+    record.mode = get<3>(key);
+    record.sizes[0] = get<4>(key);
+    record.sizes[1] = get<5>(key);
+    record.sizes[2] = get<6>(key);
+    record.fileSize = node.fileSize;
+    record.contentHash = node.contentHash;
+    memcpy(bytes.data() + sizeof(Record), node.chunkHashes.data(), node.chunkHashes.size() * sizeof(Digest));
+    record.checksum = record.computeChecksum();
+
+    bool full;
+    {
+        unique_lock<shared_mutex> guard(lock);
+        Slot &slot = slots[key];
+        if (slot.record && slot.record->fileStat == node.fileStat && slot.record->contentHash == node.contentHash)
+        {
+            return;
+        }
+
+        unwritten.insert(unwritten.end(), bytes.begin(), bytes.end());
+        slot.owned = move(bytes);
+        slot.record = reinterpret_cast<const Record *>(slot.owned.data());
+        full = unwritten.size() >= MTFSConstants::HASH_CACHE_FLUSH_SIZE;
+    }
+
+    if (full)
+    {
+        flush();
+    }
+}
+
+/**
+ * @brief Append the records stored since the last flush to the file
+ *
+ * Errors are reported as warnings; the records stay in memory.
+ */
+void HashCache::flush()
+{
+    unique_lock<shared_mutex> guard(lock);
+    if (unwritten.empty())
+    {
+        return;
+    }
+
+    try
+    {
+        open_locked();
+    }
+    catch (const exception &e)
+    {
+        cerr << "Warning: Cannot write hash cache - " << e.what() << endl;
+        return;
+    }
+
+    // The lock keeps records of other processes from interleaving with these
+    if (!writeAll(fd, unwritten.data(), unwritten.size()))
+    {
+        cerr << "Warning: Cannot write hash cache " << path << endl;
+    }
+    flock(fd, LOCK_UN);
+    unwritten.clear();
+}
+
+/**
+ * @brief Open the file and lock it exclusively
+ * @throws runtime_error If the file cannot be opened
+ *
+ * Retries if the path was replaced by a compaction while waiting.
+ */
+void HashCache::open_locked()
+{
+    while (true)
+    {
+        if (fd < 0)
+        {
+            fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (fd < 0)
+            {
+                throw runtime_error("Cannot open hash cache: " + path);
+            }
+        }
+
+        if (flock(fd, LOCK_EX) != 0)
+        {
+            throw runtime_error("Cannot lock hash cache: " + path);
+        }
+
+        struct stat opened, current;
+        if (fstat(fd, &opened) == 0 && ::stat(path.c_str(), &current) == 0 &&
+            opened.st_dev == current.st_dev && opened.st_ino == current.st_ino)
+        {
+            return;
+        }
+
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+/**
+ * @brief Map the locked file and index its records
+ * @throws runtime_error If the file is not a hash cache
+ */
+void HashCache::load()
+{
+    static_assert(sizeof(CacheHeader) % 8 == 0 && sizeof(Record) % 8 == 0, "Hash cache records must stay 8-byte aligned");
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        throw runtime_error("Cannot stat hash cache: " + path);
+    }
+
+    if (st.st_size == 0)
+    {
+        CacheHeader header = {};
+        memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+        header.version = MTFSConstants::HASH_CACHE_VERSION;
+        header.headerSize = sizeof(CacheHeader);
+        if (!writeAll(fd, reinterpret_cast<const char *>(&header), sizeof(header)))
+        {
+            throw runtime_error("Cannot write hash cache: " + path);
+        }
+        return;
+    }
+
+    if ((size_t)st.st_size < sizeof(CacheHeader))
+    {
+        throw runtime_error("Not an MTFS hash cache: " + path);
+    }
+
+    void *base = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED)
+    {
+        throw runtime_error("Cannot map hash cache: " + path);
+    }
+    mapping = base;
+    mappingSize = st.st_size;
+
+    const char *bytes = static_cast<const char *>(base);
+    const CacheHeader &header = *reinterpret_cast<const CacheHeader *>(bytes);
+    if (memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0)
+    {
+        throw runtime_error("Not an MTFS hash cache: " + path);
+    }
+    if (header.version != MTFSConstants::HASH_CACHE_VERSION || header.headerSize != sizeof(CacheHeader))
+    {
+        throw runtime_error("Unsupported hash cache version in " + path);
+    }
+
+    // Later records of a file replace earlier ones
+    slots.clear();
+    recordCount = 0;
+    size_t offset = sizeof(CacheHeader);
+    while (offset + sizeof(Record) <= mappingSize)
+    {
+        const Record &record = *reinterpret_cast<const Record *>(bytes + offset);
+        size_t length = sizeof(Record) + (size_t)record.chunkCount * sizeof(Digest);
+        if (record.magic != RECORD_MAGIC || length > mappingSize - offset ||
+            record.checksum != record.computeChecksum())
+        {
+            break;
+        }
+
+        Key key(record.fileStat.device, record.fileStat.inode, record.algorithm, record.mode,
+                record.sizes[0], record.sizes[1], record.sizes[2]);
+        slots[key] = Slot{&record, {}};
+        recordCount++;
+        offset += length;
+    }
+
+    // A crash during an append leaves a partial record at the end
+    if (offset < mappingSize && ftruncate(fd, offset) == 0)
+    {
+        cerr << "Warning: Dropped a torn record at the end of hash cache " << path << endl;
+    }
+}
+
+/**
+ * @brief Rewrite the locked file with only the current records
+ * @throws runtime_error If the file cannot be rewritten
+ *
+ * The new file replaces the old one by rename, so processes that still
+ * have the old one mapped keep reading valid records.
+ */
+void HashCache::compact()
+{
+    string tempPath = path + ".tmp";
+    int tempFd = ::open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (tempFd < 0)
+    {
+        throw runtime_error("Cannot create hash cache: " + tempPath);
+    }
+
+    vector<char> contents(static_cast<const char *>(mapping), static_cast<const char *>(mapping) + sizeof(CacheHeader));
+    for (const auto &entry : slots)
+    {
+        const char *record = reinterpret_cast<const char *>(entry.second.record);
+        contents.insert(contents.end(), record, record + sizeof(Record) + entry.second.record->chunkCount * sizeof(Digest));
+    }
+
+    bool written = writeAll(tempFd, contents.data(), contents.size());
+    ::close(tempFd);
+    if (!written || rename(tempPath.c_str(), path.c_str()) != 0)
+    {
+        ::unlink(tempPath.c_str());
+        throw runtime_error("Error rewriting hash cache: " + path);
+    }
+
+    slots.clear();
+    munmap(mapping, mappingSize);
+    mapping = nullptr;
+    mappingSize = 0;
+
+    // The old file stays locked until closed, so waiting processes move on to the new one
+    ::close(fd);
+    fd = -1;
+    open_locked();
+}
+
+/**
+ * @brief Build the index key of a file
+ * @param fileStat Metadata of the file
+ * @param algorithm Hash algorithm
+ * @param chunking Chunking
+ * @return Key
+ */
+HashCache::Key HashCache::make_key(const FileStat &fileStat, HashAlgorithm algorithm, const ChunkingConfig &chunking)
+{
+    if (chunking.mode == ChunkingMode::CDC)
+    {
+        return Key(fileStat.device, fileStat.inode, (uint32_t)algorithm, (uint32_t)chunking.mode,
+                   chunking.minSize, chunking.averageSize, chunking.maxSize);
+    }
+    return Key(fileStat.device, fileStat.inode, (uint32_t)algorithm, (uint32_t)chunking.mode, chunking.chunkSize, 0, 0);
+}
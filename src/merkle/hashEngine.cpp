@@ -0,0 +1,338 @@
+#include "merkle.hpp"
+#include <openssl/evp.h>
+
+#ifdef MTFS_HAVE_BLAKE3
+#include <blake3.h>
+#endif
+
+#ifdef MTFS_HAVE_XXHASH
+#include <xxhash.h>
+#endif
+
+namespace
+{
+    /**
+     * @class Sha256Context
+     * @brief Streaming SHA-256 through the OpenSSL EVP interface
+     */
+    class Sha256Context : public HashContext
+    {
+    public:
+        explicit Sha256Context(const EVP_MD *md) : context(EVP_MD_CTX_new())
+        {
+            if (!context || EVP_DigestInit_ex(context, md, nullptr) != 1)
+            {
+                EVP_MD_CTX_free(context);
+                throw runtime_error("Cannot initialize SHA-256 context");
+            }
+        }
+
+        ~Sha256Context() override
+        {
+            EVP_MD_CTX_free(context);
+        }
+
+        void update(const void *data, size_t length) override
+        {
+            EVP_DigestUpdate(context, data, length);
+        }
+
+        Digest finish() override
+        {
+            Digest digest{};
+            EVP_DigestFinal_ex(context, digest.data(), nullptr);
+            return digest;
+        }
+
+    private:
+        EVP_MD_CTX *context; // OpenSSL digest state
+    };
+
+    /**
+     * @class Sha256Engine
+     * @brief SHA-256 through EVP, which uses SHA-NI / ARMv8 crypto extensions when present
+     *
+     * Batches go to the AVX2 / AVX-512 multi-buffer kernel when the CPU has one.
+     */
+    class Sha256Engine : public HashEngine
+    {
+    public:
+        Sha256Engine()
+        {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+            // Fetch once so EVP does not look the algorithm up on every init
+            md = EVP_MD_fetch(nullptr, "SHA256", nullptr);
+#else
+            md = EVP_sha256();
+#endif
+        }
+
+        HashAlgorithm algorithm() const override
+        {
+            return HashAlgorithm::SHA256;
+        }
+
+        unique_ptr<HashContext> createContext() const override
+        {
+            return make_unique<Sha256Context>(md);
+        }
+
+        Digest hash(const void *data, size_t length) const override
+        {
+            Digest digest{};
+            EVP_Digest(data, length, digest.data(), nullptr, md, nullptr);
+            return digest;
+        }
+
+        void hashMany(const HashInput *inputs, size_t count, Digest *digests) const override
+        {
+            // SHA-NI hashes one message faster than the 8-lane AVX2 kernel
+            // hashes eight, so with it only the 16-lane kernel is worth using
+            size_t lanes = sha256MultiBufferLanes();
+            if (lanes == 1 || (lanes < 16 && sha256HardwareSupport()) || count < lanes / 2)
+            {
+                HashEngine::hashMany(inputs, count, digests);
+                return;
+            }
+
+            sha256MultiBuffer(inputs, count, digests);
+        }
+
+    private:
+        const EVP_MD *md; // SHA-256 implementation
+    };
+
+#ifdef MTFS_HAVE_BLAKE3
+    /**
+     * @class Blake3Context
+     * @brief Streaming BLAKE3 with the library's SIMD kernels
+     */
+    class Blake3Context : public HashContext
+    {
+    public:
+        Blake3Context()
+        {
+            blake3_hasher_init(&hasher);
+        }
+
+        void update(const void *data, size_t length) override
+        {
+#ifdef MTFS_BLAKE3_TBB
+            // Large buffers are split over the library's TBB thread pool
+            if (length >= MTFSConstants::BLAKE3_PARALLEL_THRESHOLD)
+            {
+                blake3_hasher_update_tbb(&hasher, data, length);
+                return;
+            }
+#endif
+            blake3_hasher_update(&hasher, data, length);
+        }
+
+        Digest finish() override
+        {
+            Digest digest{};
+            blake3_hasher_finalize(&hasher, digest.data(), digest.size());
+            return digest;
+        }
+
+    private:
+        blake3_hasher hasher; // BLAKE3 state
+    };
+
+    /**
+     * @class Blake3Engine
+     * @brief BLAKE3 with 256-bit output
+     */
+    class Blake3Engine : public HashEngine
+    {
+    public:
+        HashAlgorithm algorithm() const override
+        {
+            return HashAlgorithm::BLAKE3;
+        }
+
+        unique_ptr<HashContext> createContext() const override
+        {
+            return make_unique<Blake3Context>();
+        }
+    };
+#endif
+
+#ifdef MTFS_HAVE_XXHASH
+    /**
+     * @class Xxh3Context
+     * @brief Streaming XXH3-128 (non-cryptographic)
+     */
+    class Xxh3Context : public HashContext
+    {
+    public:
+        Xxh3Context() : state(XXH3_createState())
+        {
+            if (!state || XXH3_128bits_reset(state) != XXH_OK)
+            {
+                XXH3_freeState(state);
+                throw runtime_error("Cannot initialize XXH3 state");
+            }
+        }
+
+        ~Xxh3Context() override
+        {
+            XXH3_freeState(state);
+        }
+
+        void update(const void *data, size_t length) override
+        {
+            XXH3_128bits_update(state, data, length);
+        }
+
+        Digest finish() override
+        {
+            // Canonical (big-endian) 16 bytes, zero-extended to a Digest
+            Digest digest{};
+            XXH128_canonical_t canonical;
+            XXH128_canonicalFromHash(&canonical, XXH3_128bits_digest(state));
+            memcpy(digest.data(), canonical.digest, sizeof(canonical.digest));
+            return digest;
+        }
+
+    private:
+        XXH3_state_t *state; // XXH3 streaming state
+    };
+
+    /**
+     * @class Xxh3Engine
+     * @brief XXH3-128 for fast, non-cryptographic dedupe scans
+     */
+    class Xxh3Engine : public HashEngine
+    {
+    public:
+        HashAlgorithm algorithm() const override
+        {
+            return HashAlgorithm::XXH3_128;
+        }
+
+        unique_ptr<HashContext> createContext() const override
+        {
+            return make_unique<Xxh3Context>();
+        }
+
+        Digest hash(const void *data, size_t length) const override
+        {
+            Digest digest{};
+            XXH128_canonical_t canonical;
+            XXH128_canonicalFromHash(&canonical, XXH3_128bits(data, length));
+            memcpy(digest.data(), canonical.digest, sizeof(canonical.digest));
+            return digest;
+        }
+    };
+#endif
+}
+
+/**
+ * @brief Hash a buffer in one call
+ * @param data Pointer to the input bytes
+ * @param length Number of bytes to hash
+ * @return Digest of the data
+ */
+Digest HashEngine::hash(const void *data, size_t length) const
+{
+    auto context = createContext();
+    context->update(data, length);
+    return context->finish();
+}
+
+/**
+ * @brief Hash many independent messages in one call
+ * @param inputs Messages to hash
+ * @param count Number of messages
+ * @param digests Receives one digest per message, in input order
+ */
+void HashEngine::hashMany(const HashInput *inputs, size_t count, Digest *digests) const
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        digests[i] = hash(inputs[i].data, inputs[i].length);
+    }
+}
+
+/**
+ * @brief Get the canonical name of the engine's algorithm
+ * @return Algorithm name (e.g. "sha256")
+ */
+string HashEngine::name() const
+{
+    return algorithmName(algorithm());
+}
+
+/**
+ * @brief Get the engine for an algorithm
+ * @param algorithm Algorithm to use
+ * @return Reference to a shared, thread-safe engine instance
+ * @throws runtime_error If the algorithm was not compiled in
+ */
+const HashEngine &HashEngine::get(HashAlgorithm algorithm)
+{
+    switch (algorithm)
+    {
+    case HashAlgorithm::SHA256:
+    {
+        static const Sha256Engine engine;
+        return engine;
+    }
+#ifdef MTFS_HAVE_BLAKE3
+    case HashAlgorithm::BLAKE3:
+    {
+        static const Blake3Engine engine;
+        return engine;
+    }
+#endif
+#ifdef MTFS_HAVE_XXHASH
+    case HashAlgorithm::XXH3_128:
+    {
+        static const Xxh3Engine engine;
+        return engine;
+    }
+#endif
+    default:
+        throw runtime_error("Hash algorithm not available in this build: " + algorithmName(algorithm));
+    }
+}
+
+/**
+ * @brief Get the canonical name of an algorithm
+ * @param algorithm Algorithm
+ * @return Algorithm name ("sha256", "blake3" or "xxh3-128")
+ */
+string HashEngine::algorithmName(HashAlgorithm algorithm)
+{
+    switch (algorithm)
+    {
+    case HashAlgorithm::SHA256:
+        return "sha256";
+    case HashAlgorithm::BLAKE3:
+        return "blake3";
+    case HashAlgorithm::XXH3_128:
+        return "xxh3-128";
+    }
+
+    return "unknown";
+}
+
+/**
+ * @brief Parse an algorithm name
+ * @param name Algorithm name as returned by algorithmName
+ * @return Parsed algorithm
+ * @throws runtime_error If the name is unknown
+ */
+HashAlgorithm HashEngine::parseAlgorithm(const string &name)
+{
+    for (HashAlgorithm algorithm : {HashAlgorithm::SHA256, HashAlgorithm::BLAKE3, HashAlgorithm::XXH3_128})
+    {
+        if (name == algorithmName(algorithm))
+        {
+            return algorithm;
+        }
+    }
+
+    throw runtime_error("Unknown hash algorithm: " + name);
+}
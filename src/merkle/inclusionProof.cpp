@@ -0,0 +1,241 @@
+#include "merkle.hpp"
+
+namespace
+{
+    const char PROOF_MAGIC[4] = {'M', 'T', 'F', 'P'};
+    const uint8_t PROOF_VERSION = 2;
+
+    /**
+     * @brief Append an unsigned LEB128 varint
+     * @param out Buffer to append to
+     * @param value Value to encode
+     */
+    void putVarint(vector<uint8_t> &out, uint64_t value)
+    {
+        while (value >= 0x80)
+        {
+            out.push_back((uint8_t)(value | 0x80));
+            value >>= 7;
+        }
+        out.push_back((uint8_t)value);
+    }
+
+    /**
+     * @class ProofReader
+     * @brief Bounds-checked cursor over an encoded proof
+     */
+    class ProofReader
+    {
+    public:
+        ProofReader(const uint8_t *data, size_t length) : data(data), length(length), position(0)
+        {
+        }
+
+        uint64_t varint()
+        {
+            uint64_t value = 0;
+            for (int shift = 0; shift < 64; shift += 7)
+            {
+                uint8_t byte = *take(1);
+                value |= (uint64_t)(byte & 0x7f) << shift;
+                if (!(byte & 0x80))
+                {
+                    return value;
+                }
+            }
+            throw runtime_error("Malformed proof: varint too long");
+        }
+
+        const uint8_t *take(size_t count)
+        {
+            if (count > length - position)
+            {
+                throw runtime_error("Malformed proof: truncated");
+            }
+            const uint8_t *bytes = data + position;
+            position += count;
+            return bytes;
+        }
+
+        size_t remaining() const
+        {
+            return length - position;
+        }
+
+    private:
+        const uint8_t *data; // Encoded proof
+        size_t length;       // Length of the encoding
+        size_t position;     // Bytes consumed so far
+    };
+}
+
+/**
+ * @brief Serialize the proof
+ * @return Binary encoding of the proof
+ */
+vector<uint8_t> InclusionProof::encode() const
+{
+    vector<uint8_t> out(PROOF_MAGIC, PROOF_MAGIC + sizeof(PROOF_MAGIC));
+    out.push_back(PROOF_VERSION);
+    out.push_back((uint8_t)algorithm);
+    out.insert(out.end(), nodeHash.begin(), nodeHash.end());
+
+    putVarint(out, levels.size());
+    for (const auto &level : levels)
+    {
+        putVarint(out, level.entries.size());
+        putVarint(out, level.pathIndex);
+        for (size_t i = 0; i < level.entries.size(); ++i)
+        {
+            const ProofEntry &entry = level.entries[i];
+            putVarint(out, entry.name.size());
+            out.insert(out.end(), entry.name.begin(), entry.name.end());
+            if (i != level.pathIndex)
+            {
+                out.insert(out.end(), entry.hash.begin(), entry.hash.end());
+            }
+        }
+    }
+
+    return out;
+}
+
+/**
+ * @brief Parse a serialized proof
+ * @param data Pointer to the encoding
+ * @param length Length of the encoding
+ * @return Decoded proof
+ * @throws runtime_error If the encoding is malformed
+ */
+InclusionProof InclusionProof::decode(const uint8_t *data, size_t length)
+{
+    ProofReader reader(data, length);
+
+    if (memcmp(reader.take(sizeof(PROOF_MAGIC)), PROOF_MAGIC, sizeof(PROOF_MAGIC)) != 0)
+    {
+        throw runtime_error("Not an MTFS inclusion proof");
+    }
+    if (*reader.take(1) != PROOF_VERSION)
+    {
+        throw runtime_error("Unsupported inclusion proof version");
+    }
+
+    InclusionProof proof;
+    proof.algorithm = static_cast<HashAlgorithm>(*reader.take(1));
+    memcpy(proof.nodeHash.data(), reader.take(sizeof(Digest)), sizeof(Digest));
+
+    // Every level and entry takes at least one byte, which bounds the counts
+    uint64_t levelCount = reader.varint();
+    if (levelCount > reader.remaining())
+    {
+        throw runtime_error("Malformed proof: bad level count");
+    }
+
+    proof.levels.resize(levelCount);
+    for (auto &level : proof.levels)
+    {
+        uint64_t entryCount = reader.varint();
+        uint64_t pathIndex = reader.varint();
+        if (entryCount > reader.remaining() || pathIndex >= entryCount)
+        {
+            throw runtime_error("Malformed proof: bad entry count");
+        }
+
+        level.pathIndex = pathIndex;
+        level.entries.resize(entryCount);
+        for (uint64_t i = 0; i < entryCount; ++i)
+        {
+            ProofEntry &entry = level.entries[i];
+            uint64_t nameLength = reader.varint();
+            if (nameLength == 0 || nameLength > reader.remaining())
+            {
+                throw runtime_error("Malformed proof: bad name");
+            }
+
+            const uint8_t *name = reader.take(nameLength);
+            entry.name.assign(reinterpret_cast<const char *>(name), nameLength);
+            if (entry.name.find('/') != string::npos)
+            {
+                throw runtime_error("Malformed proof: bad name");
+            }
+
+            if (i == pathIndex)
+            {
+                entry.hash.fill(0);
+            }
+            else
+            {
+                memcpy(entry.hash.data(), reader.take(sizeof(Digest)), sizeof(Digest));
+            }
+        }
+    }
+
+    if (reader.remaining() != 0)
+    {
+        throw runtime_error("Malformed proof: trailing bytes");
+    }
+
+    return proof;
+}
+
+/**
+ * @brief Get the path of the proven node
+ * @return Path relative to the root ("" for the root itself)
+ */
+string InclusionProof::path() const
+{
+    string result;
+    for (auto level = levels.rbegin(); level != levels.rend(); ++level)
+    {
+        if (!result.empty())
+        {
+            result += '/';
+        }
+        result += level->entries[level->pathIndex].name;
+    }
+
+    return result;
+}
+
+/**
+ * @brief Recompute the root hash from the node hash and the levels
+ * @return Root hash the proof leads to
+ * @throws runtime_error If the algorithm is not available in this build
+ */
+Digest InclusionProof::computeRoot() const
+{
+    const HashEngine &engine = HashEngine::get(algorithm);
+
+    Digest current = nodeHash;
+    for (const auto &level : levels)
+    {
+        // The directory is never empty here, so its name is not hashed
+        DirectoryHasher hasher(engine, string_view());
+        for (size_t i = 0; i < level.entries.size(); ++i)
+        {
+            const ProofEntry &entry = level.entries[i];
+            hasher.add(entry.name, i == level.pathIndex ? current : entry.hash);
+        }
+        current = hasher.finish();
+    }
+
+    return current;
+}
+
+/**
+ * @brief Check an inclusion proof against a root hash
+ * @param rootHash Trusted root hash (e.g. a published one)
+ * @param proof Binary proof as returned by MerkleTree::prove
+ * @return True if the proof is well-formed and leads to the root hash
+ */
+bool verifyProof(const Digest &rootHash, const vector<uint8_t> &proof)
+{
+    try
+    {
+        return InclusionProof::decode(proof.data(), proof.size()).computeRoot() == rootHash;
+    }
+    catch (const exception &)
+    {
+        return false;
+    }
+}
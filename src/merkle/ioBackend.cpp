@@ -0,0 +1,448 @@
+#include "merkle.hpp"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/**
+ * @brief Start hashing a stream
+ * @param engine Hash engine of the tree
+ * @param chunking How the stream is split into chunks
+ */
+ChunkHasher::ChunkHasher(const HashEngine &engine, const ChunkingConfig &chunking)
+    : engine(engine), chunking(chunking), content(engine.createContext()), partialLength(0), total(0)
+{
+    if (chunking.mode == ChunkingMode::CDC)
+    {
+        chunker = make_unique<CdcChunker>(chunking.minSize, chunking.averageSize, chunking.maxSize);
+    }
+}
+
+/**
+ * @brief Feed the next bytes of the stream
+ * @param data Pointer to the bytes (only used during the call)
+ * @param length Number of bytes
+ *
+ * Large buffers are processed HASH_PIECE_SIZE at a time, so the content
+ * hash, the boundary scan and the chunk hashes read each piece while it
+ * is still in cache.
+ */
+void ChunkHasher::update(const void *data, size_t length)
+{
+    PhaseTimer timer(ProfilePhase::HASH);
+    BuildProfiler::count(ProfileCounter::HASH_BYTES, length);
+
+    const char *bytes = static_cast<const char *>(data);
+    total += length;
+
+    while (length > 0)
+    {
+        size_t pieceLength = min(length, max(chunking.maxChunkSize(), MTFSConstants::HASH_PIECE_SIZE));
+        const char *piece = bytes;
+        bytes += pieceLength;
+        length -= pieceLength;
+
+        content->update(piece, pieceLength);
+
+        // End offsets of the chunks that end in this piece
+        if (chunker)
+        {
+            chunker->scan(reinterpret_cast<const uint8_t *>(piece), pieceLength, cuts);
+        }
+        else
+        {
+            cuts.clear();
+            for (size_t end = chunking.chunkSize - partialLength; end <= pieceLength; end += chunking.chunkSize)
+            {
+                cuts.push_back(end);
+            }
+        }
+
+        size_t position = 0;
+        size_t next = 0;
+
+        // Complete the chunk left over from the previous update
+        if (partial && !cuts.empty())
+        {
+            partial->update(piece, cuts[0]);
+            chunkHashes.push_back(partial->finish());
+            partial.reset();
+            partialLength = 0;
+            position = cuts[0];
+            next = 1;
+        }
+
+        // Whole chunks are hashed in place, several at once
+        wholeChunks.clear();
+        for (; next < cuts.size(); ++next)
+        {
+            wholeChunks.push_back({piece + position, cuts[next] - position});
+            position = cuts[next];
+        }
+
+        if (!wholeChunks.empty())
+        {
+            size_t first = chunkHashes.size();
+            chunkHashes.resize(first + wholeChunks.size());
+            engine.hashMany(wholeChunks.data(), wholeChunks.size(), chunkHashes.data() + first);
+        }
+
+        // Start (or extend) the chunk that continues in the next update
+        if (position < pieceLength)
+        {
+            if (!partial)
+            {
+                partial = engine.createContext();
+            }
+            partial->update(piece + position, pieceLength - position);
+            partialLength += pieceLength - position;
+        }
+    }
+}
+
+/**
+ * @brief Finish hashing
+ * @return Tuple containing (content_hash, bytes_hashed, chunk_hashes)
+ */
+tuple<Digest, size_t, vector<Digest>> ChunkHasher::finish()
+{
+    if (partial)
+    {
+        chunkHashes.push_back(partial->finish());
+        partial.reset();
+        partialLength = 0;
+    }
+
+    return make_tuple(content->finish(), total, move(chunkHashes));
+}
+
+/**
+ * @brief Hash a whole content held in memory
+ * @param engine Hash engine of the tree
+ * @param chunking How the content is split into chunks
+ * @param data Pointer to the content
+ * @param length Content length
+ * @return Tuple containing (content_hash, length, chunk_hashes)
+ */
+tuple<Digest, size_t, vector<Digest>> ChunkHasher::hashBuffer(const HashEngine &engine,
+                                                              const ChunkingConfig &chunking,
+                                                              const void *data, size_t length)
+{
+    if (length > 0 && length <= chunking.singleChunkLimit())
+    {
+        PhaseTimer timer(ProfilePhase::HASH);
+        BuildProfiler::count(ProfileCounter::HASH_BYTES, length);
+        Digest contentHash = engine.hash(data, length);
+        return make_tuple(contentHash, length, vector<Digest>{contentHash});
+    }
+
+    ChunkHasher hasher(engine, chunking);
+    hasher.update(data, length);
+    return hasher.finish();
+}
+
+/**
+ * @brief Hash an open file from its start with pread
+ * @param engine Hash engine of the tree
+ * @param chunking How the file is split into chunks
+ * @param fd Descriptor of the file
+ * @return Tuple containing (content_hash, bytes_read, chunk_hashes)
+ * @throws runtime_error If a read fails
+ */
+tuple<Digest, size_t, vector<Digest>> ChunkHasher::hashDescriptor(const HashEngine &engine,
+                                                                  const ChunkingConfig &chunking, int fd)
+{
+    ChunkHasher hasher(engine, chunking);
+    vector<char> buffer(MTFSConstants::HASH_PIECE_SIZE);
+    off_t offset = 0;
+
+    while (true)
+    {
+        ssize_t bytesRead;
+        {
+            PhaseTimer timer(ProfilePhase::READ);
+            bytesRead = ::pread(fd, buffer.data(), buffer.size(), offset);
+        }
+        if (bytesRead < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            throw runtime_error(string("Read failed: ") + strerror(errno));
+        }
+        if (bytesRead == 0)
+        {
+            break;
+        }
+        BuildProfiler::count(ProfileCounter::READ_BYTES, bytesRead);
+
+        hasher.update(buffer.data(), bytesRead);
+        offset += bytesRead;
+    }
+
+    return hasher.finish();
+}
+
+namespace
+{
+    int ioUringSetup(unsigned entries, io_uring_params *params)
+    {
+        return (int)syscall(__NR_io_uring_setup, entries, params);
+    }
+
+    int ioUringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags)
+    {
+        return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0);
+    }
+
+    int ioUringRegister(int fd, unsigned opcode, const void *arg, unsigned count)
+    {
+        return (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+    }
+
+    // Ring of the current thread; unavailable is set once setup has failed
+    thread_local unique_ptr<IoRing> threadRing;
+    thread_local bool threadRingUnavailable = false;
+}
+
+/**
+ * @brief Get the ring of the calling thread, creating it on first use
+ * @return The ring, or nullptr if io_uring is not available
+ */
+IoRing *IoRing::forThread()
+{
+    if (!threadRing && !threadRingUnavailable)
+    {
+        try
+        {
+            threadRing.reset(new IoRing());
+        }
+        catch (const exception &)
+        {
+            // Kernel too old, or io_uring blocked (e.g. by seccomp)
+            threadRingUnavailable = true;
+        }
+    }
+
+    return threadRing.get();
+}
+
+/**
+ * @brief Set up the ring and register its buffer
+ * @throws runtime_error If io_uring is not available
+ */
+IoRing::IoRing()
+    : ringFd(-1), sqRing(MAP_FAILED), cqRing(MAP_FAILED), sqes(MAP_FAILED), sqRingSize(0), cqRingSize(0),
+      sqesSize(0), toSubmit(0), registeredBuffer(nullptr), fixedBuffer(false)
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    ringFd = ioUringSetup(MTFSConstants::IO_RING_ENTRIES, &params);
+    if (ringFd < 0)
+    {
+        throw runtime_error(string("io_uring_setup failed: ") + strerror(errno));
+    }
+
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMap)
+    {
+        sqRingSize = cqRingSize = max(sqRingSize, cqRingSize);
+    }
+
+    sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    cqRing = singleMap ? sqRing
+                       : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd,
+                              IORING_OFF_CQ_RING);
+    sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+
+    if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqes == MAP_FAILED)
+    {
+        release();
+        throw runtime_error("Cannot map io_uring rings");
+    }
+
+    char *sq = static_cast<char *>(sqRing);
+    sqHead = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    sqTail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    sqMask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    sqArray = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+
+    char *cq = static_cast<char *>(cqRing);
+    cqHead = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    cqTail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    cqMask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    cqes = cq + params.cq_off.cqes;
+
+    void *memory = mmap(nullptr, MTFSConstants::IO_RING_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+    {
+        release();
+        throw runtime_error("Cannot allocate io_uring buffer");
+    }
+    registeredBuffer = static_cast<char *>(memory);
+
+    // Registration counts against RLIMIT_MEMLOCK; plain reads work without it
+    iovec vector = {registeredBuffer, MTFSConstants::IO_RING_BUFFER_SIZE};
+    fixedBuffer = ioUringRegister(ringFd, IORING_REGISTER_BUFFERS, &vector, 1) == 0;
+}
+
+/**
+ * @brief Unmap the rings and close the instance
+ */
+IoRing::~IoRing()
+{
+    release();
+}
+
+/**
+ * @brief Unmap whatever was set up so far and close the instance
+ */
+void IoRing::release()
+{
+    if (registeredBuffer)
+    {
+        munmap(registeredBuffer, MTFSConstants::IO_RING_BUFFER_SIZE);
+        registeredBuffer = nullptr;
+    }
+    if (sqes != MAP_FAILED)
+    {
+        munmap(sqes, sqesSize);
+        sqes = MAP_FAILED;
+    }
+    if (cqRing != MAP_FAILED && cqRing != sqRing)
+    {
+        munmap(cqRing, cqRingSize);
+    }
+    cqRing = MAP_FAILED;
+    if (sqRing != MAP_FAILED)
+    {
+        munmap(sqRing, sqRingSize);
+        sqRing = MAP_FAILED;
+    }
+    if (ringFd >= 0)
+    {
+        close(ringFd);
+        ringFd = -1;
+    }
+}
+
+/**
+ * @brief Get the registered buffer
+ * @return Pointer to IO_RING_BUFFER_SIZE bytes
+ */
+char *IoRing::buffer() const
+{
+    return registeredBuffer;
+}
+
+/**
+ * @brief Queue a read
+ * @param fd File to read
+ * @param destination Where to read to
+ * @param length Number of bytes to read
+ * @param offset File offset to read from
+ * @param tag Value returned with the completion
+ */
+void IoRing::read(int fd, void *destination, size_t length, uint64_t offset, uint64_t tag)
+{
+    unsigned tail = *sqTail;
+    unsigned index = tail & *sqMask;
+
+    io_uring_sqe &sqe = static_cast<io_uring_sqe *>(sqes)[index];
+    memset(&sqe, 0, sizeof(sqe));
+
+    char *target = static_cast<char *>(destination);
+    bool inBuffer = fixedBuffer && target >= registeredBuffer &&
+                    target + length <= registeredBuffer + MTFSConstants::IO_RING_BUFFER_SIZE;
+    sqe.opcode = inBuffer ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe.fd = fd;
+    sqe.off = offset;
+    sqe.addr = reinterpret_cast<uint64_t>(destination);
+    sqe.len = (unsigned)length;
+    sqe.buf_index = 0;
+    sqe.user_data = tag;
+
+    sqArray[index] = index;
+    __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+    ++toSubmit;
+}
+
+/**
+ * @brief Submit the queued reads and wait for one completion
+ * @param tag Receives the tag of the completed read
+ * @return Bytes read, or a negative errno
+ * @throws runtime_error If the ring itself fails
+ */
+int IoRing::wait(uint64_t &tag)
+{
+    while (true)
+    {
+        unsigned head = *cqHead;
+        if (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+        {
+            const io_uring_cqe &cqe = static_cast<const io_uring_cqe *>(cqes)[head & *cqMask];
+            tag = cqe.user_data;
+            int result = cqe.res;
+            __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+            return result;
+        }
+
+        int submitted = ioUringEnter(ringFd, toSubmit, 1, IORING_ENTER_GETEVENTS);
+        if (submitted < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            throw runtime_error(string("io_uring_enter failed: ") + strerror(errno));
+        }
+        toSubmit -= min<unsigned>(toSubmit, submitted);
+    }
+}
+
+/**
+ * @brief Get the canonical name of an I/O backend
+ * @param backend I/O backend
+ * @return Backend name ("stream", "mmap" or "io_uring")
+ */
+string ioBackendName(IoBackend backend)
+{
+    switch (backend)
+    {
+    case IoBackend::STREAM:
+        return "stream";
+    case IoBackend::MMAP:
+        return "mmap";
+    case IoBackend::IO_URING:
+        return "io_uring";
+    }
+
+    return "unknown";
+}
+
+/**
+ * @brief Parse an I/O backend name
+ * @param name Backend name as returned by ioBackendName
+ * @return Parsed backend
+ * @throws runtime_error If the name is unknown
+ */
+IoBackend parseIoBackend(const string &name)
+{
+    for (IoBackend backend : {IoBackend::STREAM, IoBackend::MMAP, IoBackend::IO_URING})
+    {
+        if (name == ioBackendName(backend))
+        {
+            return backend;
+        }
+    }
+
+    throw runtime_error("Unknown I/O backend: " + name);
+}
@@ -0,0 +1,86 @@
+#include "merkle.hpp"
+
+/**
+ * @brief Create the error of a cancelled operation
+ */
+OperationCancelled::OperationCancelled() : runtime_error("Operation cancelled")
+{
+}
+
+/**
+ * @brief Start the clock of an operation with unknown totals
+ */
+JobControl::JobControl()
+    : filesDone(0), bytesDone(0), filesExpected(0), bytesExpected(0), cancelRequested(false),
+      startNs(BuildProfiler::now())
+{
+}
+
+/**
+ * @brief Set the totals the progress is measured against
+ * @param files Files expected
+ * @param bytes Bytes expected
+ */
+void JobControl::expect(uint64_t files, uint64_t bytes)
+{
+    filesExpected.store(files, memory_order_relaxed);
+    bytesExpected.store(bytes, memory_order_relaxed);
+}
+
+/**
+ * @brief Count finished work
+ * @param files Files finished
+ * @param bytes Their size in bytes
+ */
+void JobControl::advance(uint64_t files, uint64_t bytes)
+{
+    filesDone.fetch_add(files, memory_order_relaxed);
+    bytesDone.fetch_add(bytes, memory_order_relaxed);
+}
+
+/**
+ * @brief Ask the operation to stop at its next check
+ */
+void JobControl::cancel()
+{
+    cancelRequested.store(true, memory_order_relaxed);
+}
+
+/**
+ * @brief Check whether cancellation was requested
+ * @return True once cancel has been called
+ */
+bool JobControl::cancelled() const
+{
+    return cancelRequested.load(memory_order_relaxed);
+}
+
+/**
+ * @brief Stop the operation if cancellation was requested
+ * @throws OperationCancelled If cancel has been called
+ */
+void JobControl::checkCancelled() const
+{
+    if (cancelled())
+    {
+        throw OperationCancelled();
+    }
+}
+
+/**
+ * @brief Read the counters
+ * @return Current progress
+ *
+ * The counters are read one by one, so the totals of a walk that is
+ * still finding files may briefly be below the work done.
+ */
+JobProgress JobControl::progress() const
+{
+    JobProgress progress;
+    progress.filesDone = filesDone.load(memory_order_relaxed);
+    progress.bytesDone = bytesDone.load(memory_order_relaxed);
+    progress.filesExpected = filesExpected.load(memory_order_relaxed);
+    progress.bytesExpected = bytesExpected.load(memory_order_relaxed);
+    progress.elapsedNs = BuildProfiler::now() - startNs;
+    return progress;
+}
@@ -0,0 +1,322 @@
+#include "merkle.hpp"
+#include <unistd.h>
+
+namespace
+{
+    // UTF-8 encoding of U+FFFD, written for bytes that are not valid UTF-8
+    const char REPLACEMENT_CHARACTER[] = "\xEF\xBF\xBD";
+
+    /**
+     * @brief Measure the UTF-8 sequence starting at a byte
+     * @param bytes Pointer to a lead byte (at least 0x80)
+     * @param remaining Bytes available from there
+     * @return Length of the sequence, or 0 if it is not valid UTF-8
+     *
+     * Overlong forms, surrogates and code points above U+10FFFF are
+     * rejected, as RFC 3629 requires.
+     */
+    size_t utf8SequenceLength(const uint8_t *bytes, size_t remaining)
+    {
+        uint8_t lead = bytes[0];
+        size_t length;
+        uint8_t low = 0x80, high = 0xBF; // Range of the second byte
+
+        if (lead >= 0xC2 && lead <= 0xDF)
+        {
+            length = 2;
+        }
+        else if (lead >= 0xE0 && lead <= 0xEF)
+        {
+            length = 3;
+            low = lead == 0xE0 ? 0xA0 : 0x80;
+            high = lead == 0xED ? 0x9F : 0xBF;
+        }
+        else if (lead >= 0xF0 && lead <= 0xF4)
+        {
+            length = 4;
+            low = lead == 0xF0 ? 0x90 : 0x80;
+            high = lead == 0xF4 ? 0x8F : 0xBF;
+        }
+        else
+        {
+            return 0;
+        }
+
+        if (remaining < length || bytes[1] < low || bytes[1] > high)
+        {
+            return 0;
+        }
+        for (size_t i = 2; i < length; ++i)
+        {
+            if ((bytes[i] & 0xC0) != 0x80)
+            {
+                return 0;
+            }
+        }
+
+        return length;
+    }
+}
+
+/**
+ * @brief Write to a stream
+ * @param out Stream receiving the text
+ */
+JsonWriter::JsonWriter(ostream &out)
+    : stream(&out), fd(-1), buffer(MTFSConstants::JSON_BUFFER_SIZE), used(0)
+{
+}
+
+/**
+ * @brief Write to a file descriptor
+ * @param fd Descriptor receiving the text (not closed)
+ */
+JsonWriter::JsonWriter(int fd)
+    : stream(nullptr), fd(fd), buffer(MTFSConstants::JSON_BUFFER_SIZE), used(0)
+{
+}
+
+/**
+ * @brief Flush what is left, ignoring errors (call flush() to see them)
+ */
+JsonWriter::~JsonWriter()
+{
+    try
+    {
+        flush();
+    }
+    catch (const exception &)
+    {
+    }
+}
+
+/**
+ * @brief Append text as is
+ * @param text JSON syntax or pre-escaped text
+ * @return This writer
+ */
+JsonWriter &JsonWriter::raw(string_view text)
+{
+    while (!text.empty())
+    {
+        size_t count = min(text.size(), buffer.size());
+        memcpy(reserve(count), text.data(), count);
+        used += count;
+        text.remove_prefix(count);
+    }
+
+    return *this;
+}
+
+/**
+ * @brief Append a quoted, escaped JSON string
+ * @param text String bytes
+ * @return This writer
+ */
+JsonWriter &JsonWriter::quoted(string_view text)
+{
+    static const char HEX_DIGITS[] = "0123456789abcdef";
+
+    raw("\"");
+
+    const uint8_t *bytes = reinterpret_cast<const uint8_t *>(text.data());
+    size_t runStart = 0;
+    size_t i = 0;
+    while (i < text.size())
+    {
+        uint8_t byte = bytes[i];
+        if (byte >= 0x20 && byte != '"' && byte != '\\' && byte < 0x80)
+        {
+            ++i;
+            continue;
+        }
+
+        size_t sequence = byte >= 0x80 ? utf8SequenceLength(bytes + i, text.size() - i) : 0;
+        if (sequence > 0)
+        {
+            i += sequence;
+            continue;
+        }
+
+        // Copy the plain run, then the escape for this byte
+        raw(text.substr(runStart, i - runStart));
+        switch (byte)
+        {
+        case '"':
+            raw("\\\"");
+            break;
+        case '\\':
+            raw("\\\\");
+            break;
+        case '\b':
+            raw("\\b");
+            break;
+        case '\f':
+            raw("\\f");
+            break;
+        case '\n':
+            raw("\\n");
+            break;
+        case '\r':
+            raw("\\r");
+            break;
+        case '\t':
+            raw("\\t");
+            break;
+        default:
+            if (byte < 0x20)
+            {
+                char escape[] = {'\\', 'u', '0', '0', HEX_DIGITS[byte >> 4], HEX_DIGITS[byte & 0xF]};
+                raw(string_view(escape, sizeof(escape)));
+            }
+            else
+            {
+                raw(REPLACEMENT_CHARACTER);
+            }
+            break;
+        }
+        runStart = ++i;
+    }
+
+    raw(text.substr(runStart));
+    return raw("\"");
+}
+
+/**
+ * @brief Append a quoted hex digest
+ * @param digest Digest to encode
+ * @return This writer
+ */
+JsonWriter &JsonWriter::quoted(const Digest &digest)
+{
+    const size_t length = digest.size() * 2 + 2;
+    char *out = reserve(length);
+    out[0] = '"';
+    toHex(digest, out + 1);
+    out[length - 1] = '"';
+    used += length;
+    return *this;
+}
+
+/**
+ * @brief Append an unsigned number
+ * @param value Number to write
+ * @return This writer
+ */
+JsonWriter &JsonWriter::number(uint64_t value)
+{
+    char digits[20];
+    size_t count = 0;
+    do
+    {
+        digits[sizeof(digits) - ++count] = '0' + value % 10;
+        value /= 10;
+    } while (value > 0);
+
+    return raw(string_view(digits + sizeof(digits) - count, count));
+}
+
+/**
+ * @brief Append spaces
+ * @param count Number of spaces
+ * @return This writer
+ */
+JsonWriter &JsonWriter::spaces(size_t count)
+{
+    while (count > 0)
+    {
+        size_t step = min(count, buffer.size());
+        memset(reserve(step), ' ', step);
+        used += step;
+        count -= step;
+    }
+
+    return *this;
+}
+
+/**
+ * @brief Write the buffered text out
+ * @throws runtime_error If the stream or descriptor fails
+ */
+void JsonWriter::flush()
+{
+    if (stream)
+    {
+        if (used > 0 && !stream->write(buffer.data(), used))
+        {
+            used = 0;
+            throw runtime_error("Error writing JSON output");
+        }
+        used = 0;
+        return;
+    }
+
+    size_t written = 0;
+    while (written < used)
+    {
+        ssize_t count = ::write(fd, buffer.data() + written, used - written);
+        if (count < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            used = 0;
+            throw runtime_error(string("Error writing JSON output: ") + strerror(errno));
+        }
+        written += count;
+    }
+    used = 0;
+}
+
+/**
+ * @brief Make room for a number of bytes, flushing if needed
+ * @param count Bytes about to be appended (at most JSON_BUFFER_SIZE)
+ * @return Where to append them
+ */
+char *JsonWriter::reserve(size_t count)
+{
+    if (buffer.size() - used < count)
+    {
+        flush();
+    }
+
+    return buffer.data() + used;
+}
+
+/**
+ * @brief Get the canonical name of a JSON export format
+ * @param format Export format
+ * @return Format name ("tree" or "ndjson")
+ */
+string jsonFormatName(JsonFormat format)
+{
+    switch (format)
+    {
+    case JsonFormat::TREE:
+        return "tree";
+    case JsonFormat::NDJSON:
+        return "ndjson";
+    }
+
+    return "unknown";
+}
+
+/**
+ * @brief Parse a JSON export format name
+ * @param name Format name as returned by jsonFormatName
+ * @return Parsed format
+ * @throws runtime_error If the name is unknown
+ */
+JsonFormat parseJsonFormat(const string &name)
+{
+    for (JsonFormat format : {JsonFormat::TREE, JsonFormat::NDJSON})
+    {
+        if (name == jsonFormatName(format))
+        {
+            return format;
+        }
+    }
+
+    throw runtime_error("Unknown JSON format: " + name);
+}
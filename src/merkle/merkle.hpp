@@ -19,6 +19,9 @@
 #include <vector>
 #include <memory>
 #include <map>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
 #include <tuple>
 #include <filesystem>
 #include <iostream>
@@ -27,6 +30,17 @@
 #include <iomanip>
 #include <algorithm>
 #include <stdexcept>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
 
 #pragma once
 
@@ -35,244 +49,3678 @@ using namespace std;
 namespace fs = std::filesystem;
 
 /**
- * @struct MerkleNode
- * @brief Represents a node in the Merkle tree structure
+ * @brief Raw 32-byte digest used for every hash stored in the tree
  *
- * Each node can represent either a file or a directory in the file system.
- * Files store content hashes and chunk information, while directories
- * store references to their children nodes.
+ * Digests are kept in binary inside the tree and only hex-encoded at the
+ * output edges (printing and JSON export) with toHex().
  */
-typedef struct MerkleNode
+using Digest = array<uint8_t, 32>;
+
+/**
+ * @struct DigestHasher
+ * @brief Hash functor for using Digest as an unordered container key
+ *
+ * The digest is already uniformly distributed, so its first word is used
+ * as the bucket hash.
+ */
+struct DigestHasher
+{
+    size_t operator()(const Digest &digest) const noexcept
+    {
+        size_t value;
+        memcpy(&value, digest.data(), sizeof(value));
+        return value;
+    }
+};
+
+/**
+ * @enum HashAlgorithm
+ * @brief Hash algorithms a tree can be built with
+ *
+ * The numeric values are stored in snapshot files and must not change.
+ */
+enum class HashAlgorithm : uint32_t
+{
+    SHA256 = 0,  // SHA-256 (default, cryptographic)
+    BLAKE3 = 1,  // BLAKE3-256 (cryptographic, SIMD)
+    XXH3_128 = 2 // XXH3-128, zero-extended to 32 bytes (non-cryptographic)
+};
+
+/**
+ * @struct HashInput
+ * @brief One message of a batch passed to HashEngine::hashMany
+ */
+struct HashInput
+{
+    const void *data; // Pointer to the message bytes
+    size_t length;    // Number of bytes
+};
+
+/**
+ * @class HashContext
+ * @brief Running state of one streaming hash computation
+ */
+class HashContext
 {
 public:
-    string name;                // Name of the file or directory
-    string hash;                // Calculated Merkle hash of this node
-    string contentHash;         // Hash of the file content (for files only)
-    vector<string> chunkHashes; // Hashes of individual chunks (for large files)
+    virtual ~HashContext() = default;
+
+    /**
+     * @brief Feed bytes into the hash
+     * @param data Pointer to the input bytes
+     * @param length Number of bytes
+     */
+    virtual void update(const void *data, size_t length) = 0;
+
+    /**
+     * @brief Finish the computation
+     * @return Digest of all bytes fed so far
+     */
+    virtual Digest finish() = 0;
+};
+
+/**
+ * @class HashEngine
+ * @brief Hash algorithm used for every digest of a tree
+ *
+ * Engines are stateless singletons obtained with get() and may be shared
+ * between threads; all state lives in the contexts they create. BLAKE3 and
+ * XXH3 are only available when built with BLAKE3=1 / XXHASH=1.
+ */
+class HashEngine
+{
+public:
+    virtual ~HashEngine() = default;
+
+    /**
+     * @brief Get the algorithm implemented by this engine
+     * @return Hash algorithm
+     */
+    virtual HashAlgorithm algorithm() const = 0;
+
+    /**
+     * @brief Start a streaming hash computation
+     * @return New hash context
+     */
+    virtual unique_ptr<HashContext> createContext() const = 0;
+
+    /**
+     * @brief Hash a buffer in one call
+     * @param data Pointer to the input bytes
+     * @param length Number of bytes to hash
+     * @return Digest of the data
+     */
+    virtual Digest hash(const void *data, size_t length) const;
+
+    /**
+     * @brief Hash many independent messages in one call
+     * @param inputs Messages to hash
+     * @param count Number of messages
+     * @param digests Receives one digest per message, in input order
+     *
+     * Engines with a multi-buffer kernel hash several messages at once;
+     * the default hashes them one by one with hash().
+     */
+    virtual void hashMany(const HashInput *inputs, size_t count, Digest *digests) const;
+
+    /**
+     * @brief Get the canonical name of the engine's algorithm
+     * @return Algorithm name (e.g. "sha256")
+     */
+    string name() const;
+
+    /**
+     * @brief Get the engine for an algorithm
+     * @param algorithm Algorithm to use
+     * @return Reference to a shared, thread-safe engine instance
+     * @throws runtime_error If the algorithm was not compiled in
+     */
+    static const HashEngine &get(HashAlgorithm algorithm);
+
+    /**
+     * @brief Get the canonical name of an algorithm
+     * @param algorithm Algorithm
+     * @return Algorithm name ("sha256", "blake3" or "xxh3-128")
+     */
+    static string algorithmName(HashAlgorithm algorithm);
+
+    /**
+     * @brief Parse an algorithm name
+     * @param name Algorithm name as returned by algorithmName
+     * @return Parsed algorithm
+     * @throws runtime_error If the name is unknown
+     */
+    static HashAlgorithm parseAlgorithm(const string &name);
+};
+
+/**
+ * @class DirectoryHasher
+ * @brief Streams the "name:hash;" records of a directory into one hash context
+ *
+ * Children must be added in name order. The result is the hash of the
+ * concatenated records, without ever building that string; a directory
+ * with no children hashes to the hash of its own name.
+ */
+class DirectoryHasher
+{
+public:
+    /**
+     * @brief Start hashing a directory
+     * @param engine Hash engine of the tree
+     * @param directoryName Name of the directory (used when it has no children)
+     */
+    DirectoryHasher(const HashEngine &engine, string_view directoryName);
+
+    /**
+     * @brief Add the record of one child
+     * @param childName Name of the child
+     * @param childHash Merkle hash of the child
+     */
+    void add(string_view childName, const Digest &childHash);
+
+    /**
+     * @brief Finish hashing
+     * @return Merkle hash of the directory
+     */
+    Digest finish();
+
+private:
+    unique_ptr<HashContext> context; // Running hash of the child records
+    string_view directoryName;       // Hashed instead when no child was added
+    bool empty;                      // True until the first child is added
+};
+
+/**
+ * @struct ChunkProof
+ * @brief Inclusion proof of one chunk in the chunk tree of a file
+ */
+struct ChunkProof
+{
+    uint64_t chunkIndex;     // Position of the chunk in the file
+    uint64_t chunkCount;     // Number of chunks of the file
+    vector<Digest> siblings; // Sibling hashes from the leaf level up
+};
+
+/**
+ * @class ChunkTree
+ * @brief Binary Merkle tree over the chunk hashes of a file
+ *
+ * A leaf hashes the byte 0x00 followed by a chunk hash, and an inner node
+ * hashes the byte 0x01 followed by its two children, so no inner node is
+ * the hash of a valid leaf (RFC 6962 domain separation). A node left
+ * without a sibling at the end of a level moves up unchanged, which gives
+ * the same shape as RFC 6962. The root is the Merkle hash of the file
+ * node, so one chunk can be checked against it with about log2(chunkCount)
+ * hashes instead of rehashing the whole file. A file of one chunk has its
+ * leaf as root.
+ */
+class ChunkTree
+{
+public:
+    /**
+     * @brief Compute the root of a chunk tree
+     * @param engine Hash engine of the tree
+     * @param chunkHashes Leaves (at least one)
+     * @return Root hash
+     * @throws runtime_error If there are no chunk hashes
+     */
+    static Digest root(const HashEngine &engine, const vector<Digest> &chunkHashes);
+
+    /**
+     * @brief Build the inclusion proof of one chunk
+     * @param engine Hash engine of the tree
+     * @param chunkHashes Leaves of the chunk tree
+     * @param chunkIndex Chunk to prove
+     * @return Proof of the chunk
+     * @throws runtime_error If the index is out of range
+     */
+    static ChunkProof prove(const HashEngine &engine, const vector<Digest> &chunkHashes, size_t chunkIndex);
+
+    /**
+     * @brief Check a chunk hash against the root of a chunk tree
+     * @param engine Hash engine of the tree
+     * @param root Trusted root (the file node's hash)
+     * @param chunkHash Hash of the chunk to check
+     * @param proof Inclusion proof of the chunk
+     * @return True if the proof leads from the chunk hash to the root
+     *
+     * The chunk count is part of the proof; a caller that knows the file's
+     * chunk count should compare it as well.
+     */
+    static bool verify(const HashEngine &engine, const Digest &root, const Digest &chunkHash, const ChunkProof &proof);
+
+    /**
+     * @brief Hash a chunk hash into its leaf node
+     * @param engine Hash engine of the tree
+     * @param chunkHash Hash of the chunk
+     * @return Leaf hash
+     */
+    static Digest leaf(const HashEngine &engine, const Digest &chunkHash);
+
+    /**
+     * @brief Hash two sibling nodes into their parent
+     * @param engine Hash engine of the tree
+     * @param left Left child
+     * @param right Right child
+     * @return Parent hash
+     */
+    static Digest combine(const HashEngine &engine, const Digest &left, const Digest &right);
+
+private:
+    /**
+     * @brief Replace a level of the tree by the level above it
+     * @param engine Hash engine of the tree
+     * @param level Node hashes of one level (at least two)
+     */
+    static void hash_level(const HashEngine &engine, vector<Digest> &level);
+
+    /**
+     * @brief Hash the chunk hashes of a file into the leaf level
+     * @param engine Hash engine of the tree
+     * @param chunkHashes Hashes of the chunks
+     * @return Leaf hashes, in chunk order
+     */
+    static vector<Digest> hash_leaves(const HashEngine &engine, const vector<Digest> &chunkHashes);
+};
+
+/**
+ * @struct ProofEntry
+ * @brief Record of one directory child as hashed by DirectoryHasher
+ */
+struct ProofEntry
+{
+    string name; // Name of the child
+    Digest hash; // Merkle hash of the child (unused for the child on the proven path)
+};
+
+/**
+ * @struct ProofLevel
+ * @brief One directory on the path from a proven node to the root
+ */
+struct ProofLevel
+{
+    vector<ProofEntry> entries; // All children of the directory, in hashing order
+    uint32_t pathIndex;         // Entry of the child on the proven path
+};
+
+/**
+ * @struct InclusionProof
+ * @brief Proof that a node with a given hash sits at a path under a root hash
+ *
+ * A directory hash covers the records of all its children, so a level of
+ * the proof carries the names and hashes of every sibling on the path;
+ * the hashes on the path itself are recomputed by the verifier. Nothing
+ * else of the tree is needed to check it.
+ *
+ * Binary encoding (integers are LEB128 varints unless noted):
+ * "MTFP", format version (1 byte), hash algorithm (1 byte), node hash
+ * (32 bytes), level count, then per level from the bottom up: entry count,
+ * path index, and per entry the name length, the name bytes and, except
+ * for the path entry, the 32-byte hash.
+ */
+struct InclusionProof
+{
+    HashAlgorithm algorithm;   // Algorithm of every hash in the proof
+    Digest nodeHash;           // Hash of the proven node (a file hash for files)
+    vector<ProofLevel> levels; // Directories from the node's parent up to the root
+
+    /**
+     * @brief Serialize the proof
+     * @return Binary encoding of the proof
+     */
+    vector<uint8_t> encode() const;
+
+    /**
+     * @brief Parse a serialized proof
+     * @param data Pointer to the encoding
+     * @param length Length of the encoding
+     * @return Decoded proof
+     * @throws runtime_error If the encoding is malformed
+     */
+    static InclusionProof decode(const uint8_t *data, size_t length);
+
+    /**
+     * @brief Get the path of the proven node
+     * @return Path relative to the root ("" for the root itself)
+     */
+    string path() const;
+
+    /**
+     * @brief Recompute the root hash from the node hash and the levels
+     * @return Root hash the proof leads to
+     * @throws runtime_error If the algorithm is not available in this build
+     */
+    Digest computeRoot() const;
+};
+
+/**
+ * @enum ProfileCounter
+ * @brief Events counted while profiling a build
+ */
+enum class ProfileCounter : uint32_t
+{
+    STAT_CALLS = 0,         // stat() of entries, including type checks
+    OPEN_CALLS = 1,         // Files opened for reading
+    READ_BYTES = 2,         // Bytes read from files (mapped bytes for mmap)
+    HASH_BYTES = 3,         // File bytes fed to the hash engine
+    NODES_ALLOCATED = 4,    // MerkleNode objects created
+    DIRECTORIES_LISTED = 5, // Directories iterated
+    FILES_HASHED = 6,       // Files whose content was hashed
+    HASH_CACHE_HITS = 7,    // Files filled from the hash cache without reading
+    COUNT = 8
+};
+
+/**
+ * @enum ProfilePhase
+ * @brief Parts of a build whose time is measured while profiling
+ *
+ * Phases do not nest, so their times add up to the busy time of the
+ * threads. Reading a memory-mapped file happens through page faults and
+ * counts as HASH.
+ */
+enum class ProfilePhase : uint32_t
+{
+    LIST = 0,      // directory_iterator
+    STAT = 1,      // stat() and file type checks
+    OPEN = 2,      // Opening files
+    READ = 3,      // read, pread and io_uring waits
+    HASH = 4,      // Hashing file contents and chunks
+    TREE_HASH = 5, // Directory and chunk tree hashes (calculateHash)
+    INDEX = 6,     // Filling the lookup and content indexes
+    COUNT = 7
+};
+
+/**
+ * @enum ProfileHistogram
+ * @brief Per-file distributions recorded while profiling
+ */
+enum class ProfileHistogram : uint32_t
+{
+    FILE_SIZE = 0,    // File sizes in bytes
+    FILE_LATENCY = 1, // Nanoseconds per file (batched files: their read plus their share of the batch hash)
+    COUNT = 2
+};
+
+/**
+ * @struct ProfileReport
+ * @brief Totals of all threads since profiling was started or reset
+ *
+ * Histogram bucket 0 counts zeros and bucket i > 0 counts values in
+ * [2^(i-1), 2^i); the last bucket also holds everything above.
+ */
+struct ProfileReport
+{
+    static const size_t BUCKETS = 48; // Buckets per histogram
+
+    typedef array<uint64_t, BUCKETS> Buckets;
+
+    array<uint64_t, (size_t)ProfileCounter::COUNT> counters;    // Counter totals
+    array<uint64_t, (size_t)ProfilePhase::COUNT> phaseNs;       // Phase times summed over threads
+    array<Buckets, (size_t)ProfileHistogram::COUNT> histograms; // Histogram buckets
+    uint64_t wallNs;                                            // Time since the start or reset
+    size_t threads;                                             // Threads that recorded something
+    size_t traceEvents;                                         // Trace events kept
+    uint64_t droppedEvents;                                     // Trace events beyond MAX_TRACE_EVENTS
+};
+
+/**
+ * @class BuildProfiler
+ * @brief Process-wide counters, phase timers, histograms and trace events
+ *
+ * Each thread records into its own slot, so the hot path takes no lock
+ * and shares no cache line; report() sums the slots. While profiling is
+ * off every probe costs one relaxed load. Trace events are spans kept for
+ * a Chrome trace-event JSON dump (chrome://tracing, Perfetto).
+ */
+class BuildProfiler
+{
+public:
+    /**
+     * @brief Start profiling, dropping what was recorded before
+     * @param trace True to also keep trace events
+     */
+    static void start(bool trace);
+
+    /**
+     * @brief Stop recording; what was recorded stays available
+     */
+    static void stop();
+
+    /**
+     * @brief Drop what was recorded and restart the wall clock, if profiling
+     */
+    static void reset();
+
+    /**
+     * @brief Stop the wall clock at the end of a build, so later reports cover the build only
+     */
+    static void finish();
+
+    /**
+     * @brief Check whether probes record anything
+     * @return True while profiling
+     */
+    static bool enabled()
+    {
+        return active.load(memory_order_relaxed);
+    }
+
+    /**
+     * @brief Check whether trace events are kept
+     * @return True while tracing
+     */
+    static bool tracing()
+    {
+        return tracingActive.load(memory_order_relaxed);
+    }
+
+    /**
+     * @brief Add to a counter of the calling thread
+     * @param counter Counter to add to
+     * @param amount Amount to add
+     */
+    static void count(ProfileCounter counter, uint64_t amount = 1)
+    {
+        if (enabled())
+        {
+            add_count(counter, amount);
+        }
+    }
+
+    /**
+     * @brief Record a value in a histogram of the calling thread
+     * @param histogram Histogram to record in
+     * @param value Value to record
+     */
+    static void record(ProfileHistogram histogram, uint64_t value)
+    {
+        if (enabled())
+        {
+            add_record(histogram, value);
+        }
+    }
+
+    /**
+     * @brief Sum what every thread recorded
+     * @return Totals since the start or reset (wall time up to the last finish)
+     */
+    static ProfileReport report();
+
+    /**
+     * @brief Write the trace events as Chrome trace-event JSON
+     * @param out Stream receiving the document
+     * @throws runtime_error If writing fails
+     */
+    static void writeTrace(ostream &out);
+
+    /**
+     * @brief Read the profiling clock
+     * @return Nanoseconds of a monotonic clock
+     */
+    static uint64_t now();
+
+private:
+    friend class PhaseTimer;
+    friend class TraceSpan;
+
+    static atomic<bool> active;        // Probes record
+    static atomic<bool> tracingActive; // Trace events are kept
+
+    static void add_count(ProfileCounter counter, uint64_t amount);
+    static void add_record(ProfileHistogram histogram, uint64_t value);
+    static void add_phase(ProfilePhase phase, uint64_t nanoseconds);
+    static void add_event(const char *name, string detail, uint64_t startNs, uint64_t endNs);
+};
+
+/**
+ * @class PhaseTimer
+ * @brief Adds the time of a scope to a phase of the calling thread
+ */
+class PhaseTimer
+{
+public:
+    /**
+     * @brief Start timing, if profiling
+     * @param phase Phase the time is charged to
+     */
+    explicit PhaseTimer(ProfilePhase phase) : phase(phase), startNs(BuildProfiler::enabled() ? BuildProfiler::now() : 0)
+    {
+    }
+
+    /**
+     * @brief Charge the elapsed time
+     */
+    ~PhaseTimer()
+    {
+        if (startNs != 0)
+        {
+            BuildProfiler::add_phase(phase, BuildProfiler::now() - startNs);
+        }
+    }
+
+    PhaseTimer(const PhaseTimer &) = delete;
+    PhaseTimer &operator=(const PhaseTimer &) = delete;
+
+private:
+    ProfilePhase phase; // Phase the time is charged to
+    uint64_t startNs;   // Start time, or 0 when not profiling
+};
+
+/**
+ * @class TraceSpan
+ * @brief Records a scope as a trace event, if tracing
+ */
+class TraceSpan
+{
+public:
+    /**
+     * @brief Start the span
+     * @param name Event name (a string literal)
+     * @param detail Shown as the event's "detail" argument, e.g. a path
+     */
+    TraceSpan(const char *name, string_view detail = {})
+        : name(name), startNs(BuildProfiler::tracing() ? BuildProfiler::now() : 0)
+    {
+        if (startNs != 0)
+        {
+            this->detail = detail;
+        }
+    }
+
+    /**
+     * @brief Record the event
+     */
+    ~TraceSpan()
+    {
+        if (startNs != 0)
+        {
+            BuildProfiler::add_event(name, move(detail), startNs, BuildProfiler::now());
+        }
+    }
+
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan &operator=(const TraceSpan &) = delete;
+
+private:
+    const char *name; // Event name
+    string detail;    // Event argument
+    uint64_t startNs; // Start time, or 0 when not tracing
+};
+
+/**
+ * @class ProfiledRun
+ * @brief Scope of a build, rebuild or update: what it records replaces the previous profile
+ */
+class ProfiledRun
+{
+public:
+    /**
+     * @brief Drop the previous profile and start a span for the run
+     * @param name Event name (a string literal)
+     * @param detail Shown as the event's "detail" argument, e.g. the root path
+     */
+    ProfiledRun(const char *name, string_view detail) : span(name, detail)
+    {
+        // The span is only recorded when it ends, so the reset does not drop it
+        BuildProfiler::reset();
+    }
+
+    /**
+     * @brief Stop the wall clock
+     */
+    ~ProfiledRun()
+    {
+        BuildProfiler::finish();
+    }
+
+    ProfiledRun(const ProfiledRun &) = delete;
+    ProfiledRun &operator=(const ProfiledRun &) = delete;
+
+private:
+    TraceSpan span; // Span of the whole run
+};
+
+/**
+ * @brief Get the name of a profile counter
+ * @param counter Counter
+ * @return Name in snake_case, as used in JSON reports
+ */
+string profileCounterName(ProfileCounter counter);
+
+/**
+ * @brief Get the name of a profile phase
+ * @param phase Phase
+ * @return Name in snake_case, as used in JSON reports and traces
+ */
+string profilePhaseName(ProfilePhase phase);
+
+/**
+ * @brief Get the name of a profile histogram
+ * @param histogram Histogram
+ * @return Name in snake_case, as used in JSON reports
+ */
+string profileHistogramName(ProfileHistogram histogram);
+
+/**
+ * @brief Describe a profile report as a JSON object
+ * @param report Report to describe
+ * @return JSON object with the counters, phase times, histograms and trace totals
+ */
+string profileJson(const ProfileReport &report);
+
+/**
+ * @enum IoBackend
+ * @brief How file contents are read for hashing
+ */
+enum class IoBackend : uint32_t
+{
+    STREAM = 0,  // ifstream reads into a reused buffer (default)
+    MMAP = 1,    // Large files memory-mapped with MADV_SEQUENTIAL
+    IO_URING = 2 // Reads kept in flight on a per-thread io_uring
+};
+
+/**
+ * @enum ChunkingMode
+ * @brief How file contents are split into chunks
+ */
+enum class ChunkingMode : uint32_t
+{
+    FIXED = 0, // Chunks of CHUNK_SIZE bytes (default)
+    CDC = 1    // Content-defined chunks (FastCDC with a Gear rolling hash)
+};
+
+/**
+ * @struct ChunkingConfig
+ * @brief Chunking mode and the chunk sizes it uses
+ */
+struct ChunkingConfig
+{
+    ChunkingMode mode;  // How chunk boundaries are chosen
+    size_t chunkSize;   // Chunk size (fixed mode)
+    size_t minSize;     // Smallest chunk but the last (CDC mode)
+    size_t averageSize; // Expected chunk size (CDC mode)
+    size_t maxSize;     // Largest chunk (CDC mode)
+
+    /**
+     * @brief Get the largest content that is always a single chunk
+     * @return Size in bytes
+     */
+    size_t singleChunkLimit() const
+    {
+        return mode == ChunkingMode::CDC ? minSize : chunkSize;
+    }
+
+    /**
+     * @brief Get the largest chunk this configuration produces
+     * @return Size in bytes
+     */
+    size_t maxChunkSize() const
+    {
+        return mode == ChunkingMode::CDC ? maxSize : chunkSize;
+    }
+
+    /**
+     * @brief Compare the sizes that matter for the mode
+     * @param other Configuration to compare with
+     * @return True if both produce the same chunks
+     */
+    /**
+     * @brief Get the length of one chunk of a file, if the sizes determine it
+     * @param fileSize Size of the file
+     * @param chunkIndex Position of the chunk
+     * @param chunkCount Number of chunks of the file
+     * @param length Receives the chunk length
+     * @return False for a content-defined chunk of a multi-chunk file, whose length is not kept
+     */
+    bool chunkLength(uint64_t fileSize, size_t chunkIndex, size_t chunkCount, uint64_t &length) const
+    {
+        if (chunkCount == 1)
+        {
+            length = fileSize;
+            return true;
+        }
+        if (mode == ChunkingMode::CDC)
+        {
+            return false;
+        }
+        length = chunkIndex + 1 < chunkCount ? chunkSize : fileSize - (uint64_t)chunkSize * (chunkCount - 1);
+        return true;
+    }
+
+    bool operator==(const ChunkingConfig &other) const
+    {
+        if (mode != other.mode)
+        {
+            return false;
+        }
+        if (mode == ChunkingMode::CDC)
+        {
+            return minSize == other.minSize && averageSize == other.averageSize && maxSize == other.maxSize;
+        }
+        return chunkSize == other.chunkSize;
+    }
+
+    bool operator!=(const ChunkingConfig &other) const
+    {
+        return !(*this == other);
+    }
+};
+
+/**
+ * @class CdcChunker
+ * @brief Finds FastCDC chunk boundaries in a byte stream
+ *
+ * A Gear fingerprint (fp = (fp << 1) + GEAR[byte]) depends only on the
+ * last 64 bytes, so boundaries move with the content instead of with file
+ * offsets. As in FastCDC, a stricter mask is used below the average size
+ * and a looser one above it, and a cut is forced at the maximum size.
+ *
+ * The fingerprint is a serial dependency chain, and its table lookups do
+ * not map onto SIMD gathers profitably, so the scan splits a buffer into
+ * interleaved lanes instead: each lane is warmed up on the 64 bytes before
+ * its segment and yields exactly the fingerprints of a serial scan.
+ */
+class CdcChunker
+{
+public:
+    static const size_t CDC_SCAN_LANES = 4; // Independent fingerprint chains per scan
+
+    /**
+     * @brief Start chunking a stream
+     * @param minSize Smallest chunk but the last
+     * @param averageSize Expected chunk size
+     * @param maxSize Largest chunk
+     */
+    CdcChunker(size_t minSize, size_t averageSize, size_t maxSize);
+
+    /**
+     * @brief Find the chunk ends in the next bytes of the stream
+     * @param data Pointer to the bytes
+     * @param length Number of bytes
+     * @param cuts Receives the end offsets (relative to data) of the chunks that end in the bytes
+     */
+    void scan(const uint8_t *data, size_t length, vector<size_t> &cuts);
+
+private:
+    size_t minSize;                                  // Smallest chunk but the last
+    size_t averageSize;                              // Expected chunk size
+    size_t maxSize;                                  // Largest chunk
+    uint64_t strictMask;                             // Cut mask below the average size
+    uint64_t looseMask;                              // Cut mask above the average size
+    uint64_t fingerprint;                            // Gear fingerprint after the last byte scanned
+    size_t chunkLength;                              // Bytes of the open chunk scanned before this call
+    vector<uint64_t> candidates;                     // Bytes matching looseMask (offset << 1 | matches strictMask)
+    vector<uint64_t> laneCandidates[CDC_SCAN_LANES]; // Candidates found by each lane of the scan
+
+    /**
+     * @brief Collect the cut candidates of a buffer, in order
+     * @param data Pointer to the bytes
+     * @param length Number of bytes
+     */
+    void find_candidates(const uint8_t *data, size_t length);
+};
+
+/**
+ * @class ChunkHasher
+ * @brief Computes the content hash and chunk hashes of a byte stream
+ *
+ * Bytes are hashed where they lie: whole chunks inside a buffer passed to
+ * update() go to HashEngine::hashMany in place, only chunks that straddle
+ * two buffers use a running context. Every I/O backend feeds its buffers
+ * through this class, so all of them produce the same chunk list.
+ */
+class ChunkHasher
+{
+public:
+    /**
+     * @brief Start hashing a stream
+     * @param engine Hash engine of the tree
+     * @param chunking How the stream is split into chunks
+     */
+    ChunkHasher(const HashEngine &engine, const ChunkingConfig &chunking);
+
+    /**
+     * @brief Feed the next bytes of the stream
+     * @param data Pointer to the bytes (only used during the call)
+     * @param length Number of bytes
+     */
+    void update(const void *data, size_t length);
+
+    /**
+     * @brief Finish hashing
+     * @return Tuple containing (content_hash, bytes_hashed, chunk_hashes)
+     */
+    tuple<Digest, size_t, vector<Digest>> finish();
+
+    /**
+     * @brief Hash a whole content held in memory
+     * @param engine Hash engine of the tree
+     * @param chunking How the content is split into chunks
+     * @param data Pointer to the content
+     * @param length Content length
+     * @return Tuple containing (content_hash, length, chunk_hashes)
+     *
+     * A content of a single chunk is hashed only once, as its content hash
+     * and its chunk hash are the same.
+     */
+    static tuple<Digest, size_t, vector<Digest>> hashBuffer(const HashEngine &engine, const ChunkingConfig &chunking,
+                                                            const void *data, size_t length);
+
+    /**
+     * @brief Hash an open file from its start with pread
+     * @param engine Hash engine of the tree
+     * @param chunking How the file is split into chunks
+     * @param fd Descriptor of the file
+     * @return Tuple containing (content_hash, bytes_read, chunk_hashes)
+     * @throws runtime_error If a read fails
+     */
+    static tuple<Digest, size_t, vector<Digest>> hashDescriptor(const HashEngine &engine,
+                                                                const ChunkingConfig &chunking, int fd);
+
+private:
+    const HashEngine &engine;        // Engine of the tree
+    ChunkingConfig chunking;         // How the stream is split into chunks
+    unique_ptr<CdcChunker> chunker;  // Boundary finder (CDC mode only)
+    unique_ptr<HashContext> content; // Running hash of the whole stream
+    unique_ptr<HashContext> partial; // Chunk split over several updates, if any
+    size_t partialLength;            // Bytes already in partial
+    size_t total;                    // Bytes hashed so far
+    vector<Digest> chunkHashes;      // Finished chunk hashes
+    vector<HashInput> wholeChunks;   // Chunks of the current update hashed in place
+    vector<size_t> cuts;             // Chunk ends found in the current piece
+};
+
+/**
+ * @class IoRing
+ * @brief Minimal io_uring used to keep many file reads in flight
+ *
+ * Talks to the kernel through the raw system calls, so no liburing is
+ * needed. Each thread gets its own ring from forThread(), with one buffer
+ * of IO_RING_BUFFER_SIZE registered for fixed-buffer reads; reads into
+ * other memory fall back to plain IORING_OP_READ.
+ */
+class IoRing
+{
+public:
+    /**
+     * @brief Get the ring of the calling thread, creating it on first use
+     * @return The ring, or nullptr if io_uring is not available
+     */
+    static IoRing *forThread();
+
+    ~IoRing();
+
+    IoRing(const IoRing &) = delete;
+    IoRing &operator=(const IoRing &) = delete;
+
+    /**
+     * @brief Get the registered buffer
+     * @return Pointer to IO_RING_BUFFER_SIZE bytes
+     */
+    char *buffer() const;
+
+    /**
+     * @brief Queue a read
+     * @param fd File to read
+     * @param destination Where to read to
+     * @param length Number of bytes to read
+     * @param offset File offset to read from
+     * @param tag Value returned with the completion
+     *
+     * At most IO_RING_ENTRIES reads may be in flight.
+     */
+    void read(int fd, void *destination, size_t length, uint64_t offset, uint64_t tag);
+
+    /**
+     * @brief Submit the queued reads and wait for one completion
+     * @param tag Receives the tag of the completed read
+     * @return Bytes read, or a negative errno
+     * @throws runtime_error If the ring itself fails
+     */
+    int wait(uint64_t &tag);
+
+private:
+    /**
+     * @brief Set up the ring and register its buffer
+     * @throws runtime_error If io_uring is not available
+     */
+    IoRing();
+
+    /**
+     * @brief Unmap whatever was set up so far and close the instance
+     */
+    void release();
+
+    int ringFd;                                   // io_uring instance
+    void *sqRing;                                 // Mapped submission ring
+    void *cqRing;                                 // Mapped completion ring (may equal sqRing)
+    void *sqes;                                   // Mapped submission queue entries
+    size_t sqRingSize;                            // Size of the sqRing mapping
+    size_t cqRingSize;                            // Size of the cqRing mapping
+    size_t sqesSize;                              // Size of the sqes mapping
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray; // Submission ring fields
+    unsigned *cqHead, *cqTail, *cqMask;           // Completion ring fields
+    void *cqes;                                   // Completion queue entries
+    unsigned toSubmit;                            // Queued but not yet submitted reads
+    char *registeredBuffer;                       // Buffer for fixed-buffer reads
+    bool fixedBuffer;                             // True if registeredBuffer is registered
+};
+
+/**
+ * @struct FileStat
+ * @brief Filesystem metadata used to detect unchanged files between builds
+ */
+struct FileStat
+{
+    uint64_t device = 0;  // Device containing the file
+    uint64_t inode = 0;   // Inode number
+    uint64_t size = 0;    // Size in bytes
+    int64_t mtimeNs = 0;  // Last modification time (nanoseconds)
+    int64_t ctimeNs = 0;  // Last status change time (nanoseconds)
+
+    bool operator==(const FileStat &other) const
+    {
+        return device == other.device && inode == other.inode && size == other.size &&
+               mtimeNs == other.mtimeNs && ctimeNs == other.ctimeNs;
+    }
+
+    bool operator!=(const FileStat &other) const
+    {
+        return !(*this == other);
+    }
+};
+
+/**
+ * @enum EntryType
+ * @brief Type of a directory entry, with symlinks followed unless the walk skips them
+ */
+enum class EntryType : uint32_t
+{
+    FILE = 0,      // Regular file
+    DIRECTORY = 1, // Directory
+    OTHER = 2,     // Device, FIFO or socket (kept as an empty directory)
+    MISSING = 3,   // Dangling symlink, or gone before it could be stat'ed
+    SYMLINK = 4    // Symlink not followed (SymlinkPolicy::SKIP; left out of the tree)
+};
+
+/**
+ * @enum SymlinkPolicy
+ * @brief How a build treats symbolic links
+ */
+enum class SymlinkPolicy : uint32_t
+{
+    FOLLOW = 0, // Hash the target; links back to a parent directory are skipped (default)
+    SKIP = 1    // Leave symlinks out of the tree
+};
+
+/**
+ * @enum HardlinkPolicy
+ * @brief How a build treats files with several hard links
+ */
+enum class HardlinkPolicy : uint32_t
+{
+    HASH_EACH = 0, // Read every link like any other file (default)
+    SHARE = 1      // Read the file once per build; its other links reuse the hashes
+};
+
+/**
+ * @struct WalkPolicy
+ * @brief What a build follows while walking a directory tree
+ */
+struct WalkPolicy
+{
+    SymlinkPolicy symlinks = SymlinkPolicy::FOLLOW;       // Symbolic links
+    HardlinkPolicy hardlinks = HardlinkPolicy::HASH_EACH; // Files with several hard links
+    bool oneFileSystem = false;                           // Keep mount points as empty directories, as tar does
+    vector<string> excluded;                              // Directories, relative to the root, kept as empty directories
+};
+
+typedef pair<uint64_t, uint64_t> InodeKey; // (device, inode) of a file or directory
+
+/**
+ * @struct ScannedEntry
+ * @brief One entry of a directory listing
+ */
+struct ScannedEntry
+{
+    string name;    // Entry name
+    EntryType type; // From d_type, or a stat when the filesystem leaves it unknown
+    int error;      // errno of the failed stat of a MISSING entry, else 0
+};
+
+/**
+ * @struct DirectoryListing
+ * @brief A directory read by scanDirectory
+ */
+struct DirectoryListing
+{
+    InodeKey id;                  // (device, inode) of the directory itself
+    vector<ScannedEntry> entries; // Entries other than "." and "..", in directory order
+};
+
+/**
+ * @brief List a directory with getdents64, typing entries without a stat where possible
+ * @param path Directory to list
+ * @param followSymlinks Type symlinks by their target (as fs::status does) rather than as SYMLINK
+ * @return Identity and entries of the directory
+ * @throws PathTooLong If the path is longer than the kernel accepts
+ * @throws runtime_error If the directory cannot be opened or read
+ *
+ * Entries are typed from d_type, so only followed symlinks and entries of
+ * filesystems that do not fill d_type cost a stat (fstatat on the
+ * directory). The identity comes from an fstat of the open directory.
+ */
+DirectoryListing scanDirectory(const fs::path &path, bool followSymlinks = true);
+
+/**
+ * @class PathTooLong
+ * @brief Thrown when a path of a walk is longer than the kernel accepts (ENAMETOOLONG)
+ *
+ * Walks open entries by their full path, so a tree deeper than PATH_MAX
+ * cannot be read past that depth. Unlike other errors of an entry, it is
+ * never caught to skip the entry: leaving the subtree out would give a
+ * hash for a tree that is not the one on disk, so the walk fails instead.
+ */
+class PathTooLong : public runtime_error
+{
+public:
+    explicit PathTooLong(const fs::path &path);
+};
+
+/**
+ * @brief Get the type of a path with one stat
+ * @param path Path to look up
+ * @param followSymlinks Type a symlink by its target rather than as SYMLINK
+ * @param device Receives the device of the path when not nullptr
+ * @return Type of the path (MISSING if it does not exist)
+ * @throws runtime_error If the path exists but cannot be stat'ed
+ */
+EntryType statEntry(const fs::path &path, bool followSymlinks = true, uint64_t *device = nullptr);
+
+/**
+ * @struct SubtreeTotals
+ * @brief Aggregates of a node's subtree
+ */
+struct SubtreeTotals
+{
+    uint64_t totalSize = 0;      // Bytes in the files of the subtree
+    uint64_t fileCount = 0;      // Files in the subtree
+    uint64_t directoryCount = 0; // Directories in the subtree, the node itself included
+    int depth = 0;               // Height of the subtree (0 for a leaf)
+
+    bool operator==(const SubtreeTotals &other) const
+    {
+        return totalSize == other.totalSize && fileCount == other.fileCount &&
+               directoryCount == other.directoryCount && depth == other.depth;
+    }
+
+    bool operator!=(const SubtreeTotals &other) const
+    {
+        return !(*this == other);
+    }
+};
+
+/**
+ * @struct MerkleNode
+ * @brief Represents a node in the Merkle tree structure
+ *
+ * Each node can represent either a file or a directory in the file system.
+ * Files store content hashes and chunk information, while directories
+ * store references to their children nodes.
+ */
+typedef struct MerkleNode
+{
+public:
+    string name;                // Name of the file or directory
+    Digest hash;                // Calculated Merkle hash of this node (chunk tree root for files)
+    Digest contentHash;         // Hash of the file content (for files only)
+    vector<Digest> chunkHashes; // Hashes of individual chunks (for large files)
+
+    map<string, shared_ptr<MerkleNode>> children; // Child nodes (for directories)
+    MerkleNode *parent;                           // Directory holding this node, or nullptr (set by addChild)
+
+    bool isFile;       // Flag indicating if this is a file (true) or directory (false)
+    size_t fileSize;   // Size of the file in bytes (for files only)
+    FileStat fileStat; // Metadata seen when the file was hashed (for files only)
+
+    /**
+     * @brief Constructor for MerkleNode
+     * @param name Name of the file or directory
+     * @param isFile True if this represents a file, false for directory
+     */
+    MerkleNode(const string &name, bool isFile = false);
+
+    /**
+     * @brief Destructor; detaches the children, which may outlive this node
+     */
+    ~MerkleNode();
+
+    /**
+     * @brief Add a child node to this MerkleNode
+     * @param child Shared pointer to the child node to add
+     * @throws runtime_error If trying to add child to a file node
+     */
+    void addChild(const shared_ptr<MerkleNode> &child);
+
+    /**
+     * @brief Remove a child node, if present
+     * @param childName Name of the child to remove
+     */
+    void removeChild(const string &childName);
+
+    /**
+     * @brief Remove every child node
+     */
+    void clearChildren();
+
+    /**
+     * @brief Calculate the Merkle hash of this node
+     * @param engine Hash engine of the tree
+     * @return Digest of the calculated hash
+     *
+     * For files: Returns the root of the chunk tree (ChunkTree)
+     * For directories: Calculates hash based on sorted children hashes
+     */
+    Digest calculateHash(const HashEngine &engine = HashEngine::get(HashAlgorithm::SHA256));
+
+    /**
+     * @brief Recalculate the hash of this node from its children's cached hashes
+     * @param engine Hash engine of the tree
+     * @return Digest of the calculated hash
+     *
+     * Unlike calculateHash() this does not descend into the children, so it
+     * can be used to refresh a directory after only some children changed.
+     */
+    Digest updateHash(const HashEngine &engine = HashEngine::get(HashAlgorithm::SHA256));
+
+    /**
+     * @brief Get the depth of this node in the tree
+     * @return Height of the subtree (0 for a leaf)
+     */
+    int getDepth() const;
+
+    /**
+     * @brief Check if this node is a leaf (has no children)
+     * @return True if leaf node, false otherwise
+     */
+    bool isLeaf() const;
+
+    /**
+     * @brief Get total size of all files under this node
+     * @return Total size in bytes
+     */
+    size_t getTotalSize() const;
+
+    /**
+     * @brief Get the number of files under this node
+     * @return Number of files
+     */
+    size_t getFileCount() const;
+
+    /**
+     * @brief Get the number of directories under this node
+     * @return Number of directories, this one included
+     */
+    size_t getDirectoryCount() const;
+
+    /**
+     * @brief Get the aggregates of this node's subtree
+     * @return Totals, recomputed first for the stale part of the subtree
+     *
+     * Hashing keeps the totals current bottom-up, so after a build or an
+     * incremental update this is O(1).
+     */
+    const SubtreeTotals &getTotals() const;
+
+    /**
+     * @brief Mark the totals of this node and its ancestors stale
+     *
+     * Called by the child mutators; needed only after changing children or
+     * fileSize directly.
+     */
+    void invalidateTotals();
+
+private:
+    mutable SubtreeTotals totals; // Aggregates of the subtree, valid if totalsValid
+    mutable bool totalsValid;     // A stale node has only stale ancestors
+
+    /**
+     * @brief Add up the totals of the children
+     * @param result Receives the totals of this node
+     * @return False if a child's totals are stale
+     */
+    bool collect_totals(SubtreeTotals &result) const;
+};
+
+/**
+ * @class HashCache
+ * @brief Persistent map from file metadata to content and chunk hashes
+ *
+ * Hashed files are appended to a log file as records keyed by (device,
+ * inode) and the algorithm and chunking they were hashed with. Opening the
+ * cache maps the log read-only and indexes its latest record per key, so
+ * the chunk lists of earlier runs are used in place. A record is used only
+ * while the file's FileStat is unchanged, so a file written since it was
+ * hashed is read again. Every tree of a process that opens the same path
+ * shares one cache, and several processes may append to it: records are
+ * written under flock(), one write() per flush. Records torn by a crash
+ * are dropped on open, and the log is rewritten without superseded
+ * records once they make up most of it.
+ */
+class HashCache
+{
+public:
+    /**
+     * @brief Open a cache file, creating it if needed
+     * @param path Path of the cache file
+     * @return The cache of that file, shared with its other users in the process
+     * @throws runtime_error If the file cannot be opened or is not a hash cache
+     */
+    static shared_ptr<HashCache> open(const string &path);
+
+    ~HashCache();
+
+    HashCache(const HashCache &) = delete;
+    HashCache &operator=(const HashCache &) = delete;
+
+    /**
+     * @brief Get the path of the cache file
+     * @return Absolute path
+     */
+    const string &getPath() const;
+
+    /**
+     * @brief Get the number of files in the cache
+     * @return Files with a current record
+     */
+    size_t size() const;
+
+    /**
+     * @brief Fill a file node from its record, if the file is unchanged
+     * @param node File node (its fileStat must be set)
+     * @param algorithm Hash algorithm of the tree
+     * @param chunking Chunking of the tree
+     * @return True if the node was filled
+     */
+    bool fill(MerkleNode &node, HashAlgorithm algorithm, const ChunkingConfig &chunking) const;
+
+    /**
+     * @brief Record the hashes of a file node
+     * @param node File node just hashed (fileStat read before its content)
+     * @param algorithm Hash algorithm of the tree
+     * @param chunking Chunking of the tree
+     *
+     * Files changed less than HASH_CACHE_SETTLE_NS ago are not recorded:
+     * a write within the timestamp granularity would leave their metadata
+     * unchanged.
+     */
+    void store(const MerkleNode &node, HashAlgorithm algorithm, const ChunkingConfig &chunking);
+
+    /**
+     * @brief Append the records stored since the last flush to the file
+     *
+     * Errors are reported as warnings; the records stay in memory.
+     */
+    void flush();
+
+private:
+    struct Record;
+
+    // Device, inode, algorithm, chunking mode and the chunk sizes that matter for the mode
+    typedef tuple<uint64_t, uint64_t, uint32_t, uint32_t, uint64_t, uint64_t, uint64_t> Key;
+
+    /**
+     * @brief Current record of a file
+     */
+    struct Slot
+    {
+        const Record *record; // In the mapping, or in owned
+        vector<char> owned;   // Record stored by this process, else empty
+    };
+
+    string path;                // Absolute path of the file
+    int fd;                     // Descriptor of the file (O_APPEND)
+    void *mapping;              // Log mapped when opened, or nullptr
+    size_t mappingSize;         // Length of the mapping
+    size_t recordCount;         // Records in the mapping, superseded ones included
+    mutable shared_mutex lock;  // Guards slots and unwritten
+    map<Key, Slot> slots;       // Current record of every file
+    vector<char> unwritten;     // Records not yet appended to the file
+
+    /**
+     * @brief Open a cache file
+     * @param path Absolute path of the file
+     * @throws runtime_error If the file cannot be opened or is not a hash cache
+     */
+    explicit HashCache(const string &path);
+
+    /**
+     * @brief Open the file and lock it exclusively
+     * @throws runtime_error If the file cannot be opened
+     *
+     * Retries if the path was replaced by a compaction while waiting.
+     */
+    void open_locked();
+
+    /**
+     * @brief Map the locked file and index its records
+     * @throws runtime_error If the file is not a hash cache
+     */
+    void load();
+
+    /**
+     * @brief Rewrite the locked file with only the current records
+     * @throws runtime_error If the file cannot be rewritten
+     */
+    void compact();
+
+    /**
+     * @brief Build the index key of a file
+     * @param fileStat Metadata of the file
+     * @param algorithm Hash algorithm
+     * @param chunking Chunking
+     * @return Key
+     */
+    static Key make_key(const FileStat &fileStat, HashAlgorithm algorithm, const ChunkingConfig &chunking);
+};
+
+/**
+ * @class FileBatch
+ * @brief Reads small files and hashes them together with HashEngine::hashMany
+ *
+ * Files of at most min(chunk size, SMALL_FILE_SIZE) are read whole and
+ * hashed up to HASH_BATCH_SIZE at a time, so a multi-buffer kernel works on
+ * many files at once. Such a file is a single chunk, so its chunk hash is
+ * its content hash. Nodes are filled by flush() in the order they were
+ * added. With the io_uring backend add() only opens the file and flush()
+ * keeps the reads of the whole batch in flight at once.
+ */
+class FileBatch
+{
+public:
+    /**
+     * @struct FailedFile
+     * @brief A queued file whose content could not be read
+     */
+    struct FailedFile
+    {
+        shared_ptr<MerkleNode> node; // Node that was not filled
+        string path;                 // Filesystem path of the file
+        string error;                // Error message
+    };
+
+    /**
+     * @brief Create an empty batch
+     * @param engine Hash engine of the tree
+     * @param chunking Chunking of the tree
+     * @param backend How file contents are read
+     * @param cache Cache the hashed files are recorded in, or nullptr
+     */
+    FileBatch(const HashEngine &engine, const ChunkingConfig &chunking, IoBackend backend,
+              HashCache *cache = nullptr);
+
+    ~FileBatch();
+
+    FileBatch(const FileBatch &) = delete;
+    FileBatch &operator=(const FileBatch &) = delete;
+
+    /**
+     * @brief Get the largest file size accepted by add()
+     * @return Size limit in bytes
+     */
+    size_t getSizeLimit() const;
+
+    /**
+     * @brief Queue a file
+     * @param node File node to fill on flush (its fileStat must be set)
+     * @param path Filesystem path of the file
+     * @return False (and nothing queued) if the file is larger than the limit
+     * @throws runtime_error If the file cannot be opened or read
+     */
+    bool add(const shared_ptr<MerkleNode> &node, const string &path);
+
+    /**
+     * @brief Check whether the batch should be flushed
+     * @return True once HASH_BATCH_SIZE files are queued
+     */
+    bool full() const;
+
+    /**
+     * @brief Hash the queued files and fill their nodes
+     * @return The filled nodes, in the order they were added
+     *
+     * Files that fail to read are left out and reported by takeFailures().
+     */
+    vector<shared_ptr<MerkleNode>> flush();
+
+    /**
+     * @brief Take the files that failed in previous flushes
+     * @return Failed files, in the order they were added
+     */
+    vector<FailedFile> takeFailures();
+
+private:
+    /**
+     * @brief A queued file and the location of its content
+     */
+    struct PendingFile
+    {
+        shared_ptr<MerkleNode> node; // Node to fill
+        string path;                 // Filesystem path (io_uring backend)
+        int fd;                      // Open descriptor (io_uring backend), else -1
+        const char *data;            // Content, set once read
+        size_t offset;               // Start of the content in buffer
+        size_t length;               // Content length
+        bool streamed;               // Grew past the limit and was hashed on its own
+        uint64_t readNs;             // Time spent reading it, while profiling
+    };
+
+    /**
+     * @brief Read all queued files on the thread's io_uring
+     * @param ring Ring of the calling thread
+     *
+     * Sets data of every file that was read, and streamed of every file
+     * that grew; files that failed are added to failures.
+     */
+    void read_queued(IoRing &ring);
+
+    const HashEngine &engine;    // Engine hashing the batch
+    ChunkingConfig chunking;     // Chunking of the tree
+    size_t sizeLimit;            // Largest file accepted
+    bool deferredReads;          // True if reads happen in flush (io_uring)
+    HashCache *cache;            // Cache the hashed files are recorded in, or nullptr
+    vector<char> buffer;         // Contents of the queued files (synchronous reads)
+    size_t used;                 // Bytes of buffer in use
+    vector<PendingFile> pending; // Queued files, in add() order
+    vector<FailedFile> failures; // Files that failed to read
+};
+
+/**
+ * @class ThreadPool
+ * @brief Work-stealing thread pool used for parallel tree construction
+ *
+ * Every worker owns a task deque. Tasks submitted from a worker go to the
+ * back of its own deque and are taken LIFO, which keeps a directory walk
+ * depth-first and cache-warm; idle workers steal from the front of other
+ * workers' deques. Tasks submitted from outside the pool are spread over
+ * the deques round-robin.
+ */
+class ThreadPool
+{
+public:
+    /**
+     * @brief Start a pool with the given number of workers
+     * @param threadCount Number of worker threads (at least 1)
+     */
+    explicit ThreadPool(size_t threadCount);
+
+    /**
+     * @brief Stop all workers after the queued tasks have run
+     */
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    /**
+     * @brief Queue a task for execution
+     * @param task Callable to run on one of the workers
+     *
+     * Tasks must not throw; exceptions escaping a task are discarded.
+     */
+    void submit(function<void()> task);
+
+    /**
+     * @brief Block until every submitted task (including tasks submitted
+     *        by other tasks) has finished
+     */
+    void wait();
+
+    /**
+     * @brief Get the number of worker threads
+     * @return Worker thread count
+     */
+    size_t size() const;
+
+private:
+    struct WorkerQueue
+    {
+        mutex lock;                   // Guards tasks
+        deque<function<void()>> tasks; // Owner pops back, thieves pop front
+    };
+
+    vector<unique_ptr<WorkerQueue>> queues; // One deque per worker
+    vector<thread> workers;                 // Worker threads
+    mutex stateLock;                        // Guards pending, queued and stopping
+    condition_variable wakeup;              // Signalled when work is queued or on stop
+    condition_variable idle;                // Signalled when pending drops to zero
+    size_t pending;                         // Tasks submitted but not yet finished
+    size_t queued;                          // Tasks sitting in a deque
+    bool stopping;                          // Set by the destructor
+    atomic<size_t> nextQueue;               // Round-robin cursor for external submits
+
+    /**
+     * @brief Main loop of a worker thread
+     * @param index Index of the worker's own deque
+     */
+    void workerLoop(size_t index);
+
+    /**
+     * @brief Take a task from the worker's own deque or steal one
+     * @param index Index of the worker's own deque
+     * @param task Receives the task on success
+     * @return True if a task was taken
+     */
+    bool takeTask(size_t index, function<void()> &task);
+};
+
+/**
+ * @class OperationCancelled
+ * @brief Thrown by a build, verify or export whose JobControl was cancelled
+ *
+ * Unlike other errors of an entry, it is never caught to skip the entry:
+ * it unwinds the whole operation.
+ */
+class OperationCancelled : public runtime_error
+{
+public:
+    OperationCancelled();
+};
+
+/**
+ * @struct JobProgress
+ * @brief Progress of a long operation at one point in time
+ */
+struct JobProgress
+{
+    uint64_t filesDone;     // Files hashed, checked or written so far
+    uint64_t bytesDone;     // Their size in bytes
+    uint64_t filesExpected; // Files the operation is expected to cover, or 0 if unknown
+    uint64_t bytesExpected; // Their size in bytes, or 0 if unknown
+    uint64_t elapsedNs;     // Time since the operation started
+};
+
+/**
+ * @class JobControl
+ * @brief Progress counters and cancellation flag of one long operation
+ *
+ * The operation advances the counters from any of its threads and checks
+ * the flag between files; observers read the progress and cancel from
+ * other threads. Nothing takes a lock, so the checks are cheap enough
+ * for every file.
+ */
+class JobControl
+{
+public:
+    /**
+     * @brief Start the clock of an operation with unknown totals
+     */
+    JobControl();
+
+    /**
+     * @brief Set the totals the progress is measured against
+     * @param files Files expected
+     * @param bytes Bytes expected
+     */
+    void expect(uint64_t files, uint64_t bytes);
+
+    /**
+     * @brief Count finished work
+     * @param files Files finished
+     * @param bytes Their size in bytes
+     */
+    void advance(uint64_t files, uint64_t bytes);
+
+    /**
+     * @brief Ask the operation to stop at its next check
+     */
+    void cancel();
+
+    /**
+     * @brief Check whether cancellation was requested
+     * @return True once cancel has been called
+     */
+    bool cancelled() const;
+
+    /**
+     * @brief Stop the operation if cancellation was requested
+     * @throws OperationCancelled If cancel has been called
+     */
+    void checkCancelled() const;
+
+    /**
+     * @brief Read the counters
+     * @return Current progress
+     */
+    JobProgress progress() const;
+
+private:
+    atomic<uint64_t> filesDone;     // Files finished
+    atomic<uint64_t> bytesDone;     // Bytes finished
+    atomic<uint64_t> filesExpected; // Files expected, or 0
+    atomic<uint64_t> bytesExpected; // Bytes expected, or 0
+    atomic<bool> cancelRequested;   // Set by cancel
+    uint64_t startNs;               // BuildProfiler::now() at construction
+};
+
+/**
+ * @struct SnapshotHeader
+ * @brief Fixed-size header at the start of a tree snapshot file
+ *
+ * A snapshot is the header followed by five 8-byte aligned tables: the
+ * node table, the stat table (one FileStat per node), the child index
+ * table, the digest table and the string pool. All values are stored in
+ * host byte order.
+ */
+struct SnapshotHeader
+{
+    char magic[8];             // "MTFSSNAP"
+    uint32_t version;          // Snapshot format version
+    uint32_t headerSize;       // sizeof(SnapshotHeader)
+    uint64_t fileSize;         // Total size of the snapshot file
+    uint64_t chunkSize;        // Chunk size the tree was built with
+    uint64_t nodeCount;        // Entries in the node table (root is entry 0)
+    uint64_t childCount;       // Entries in the child index table
+    uint64_t digestCount;      // Entries in the digest table
+    uint64_t stringBytes;      // Size of the string pool in bytes
+    uint64_t nodeOffset;       // File offset of the node table
+    uint64_t statOffset;       // File offset of the stat table
+    uint64_t childOffset;      // File offset of the child index table
+    uint64_t digestOffset;     // File offset of the digest table
+    uint64_t stringOffset;     // File offset of the string pool
+    uint64_t totalFiles;       // Number of files in the tree
+    uint64_t totalDirectories; // Number of directories in the tree
+    uint64_t totalSize;        // Total size of all files in bytes
+    uint32_t treeDepth;        // Depth of the root node
+    uint32_t rootPathLength;   // Length of the root path at the start of the string pool
+    uint32_t hashAlgorithm;    // HashAlgorithm the digests were computed with
+    uint32_t chunkingMode;     // ChunkingMode the chunks were cut with
+    uint64_t cdcMinSize;       // Smallest chunk (CDC mode, else zero)
+    uint64_t cdcAverageSize;   // Expected chunk size (CDC mode, else zero)
+    uint64_t cdcMaxSize;       // Largest chunk (CDC mode, else zero)
+};
+
+/**
+ * @struct SyncStreamHeader
+ * @brief Fixed-size header at the start of a chunk stream written by MerkleTree::sendChunks
+ */
+struct SyncStreamHeader
+{
+    char magic[8];          // "MTFSSYNC"
+    uint32_t version;       // SYNC_STREAM_VERSION
+    uint32_t hashAlgorithm; // HashAlgorithm of the chunk hashes
+    uint64_t chunkCount;    // Chunks that follow
+    uint64_t chunkBytes;    // Bytes of chunk data that follow
+};
+
+/**
+ * @struct FlatNode
+ * @brief Fixed-size (64 byte) node record of a flat tree
+ *
+ * Names live in the string pool. A directory's children are a range of
+ * the child index table, sorted by name. A file's digests are a range of
+ * the digest table: the content hash followed by its chunk hashes.
+ */
+struct FlatNode
+{
+    Digest hash;          // Merkle hash of this node
+    uint64_t fileSize;    // Size of the file in bytes (for files only)
+    uint32_t nameOffset;  // Offset of the name in the string pool
+    uint16_t nameLength;  // Length of the name in bytes
+    uint16_t flags;       // FLAG_* bits
+    uint32_t firstChild;  // First entry in the child index table (for directories)
+    uint32_t childCount;  // Number of children (for directories)
+    uint32_t firstDigest; // Entry of the content hash in the digest table (for files)
+    uint32_t chunkCount;  // Number of chunk hashes following the content hash (for files)
+
+    static const uint16_t FLAG_FILE = 1; // Node is a file
+};
+
+static_assert(sizeof(FlatNode) == 64, "FlatNode must stay 64 bytes");
+static_assert(sizeof(FileStat) == 40, "FileStat records are 40 bytes in snapshots");
+
+/**
+ * @class FlatTree
+ * @brief Flat, index-based representation of a Merkle tree
+ *
+ * Holds the same tables as a snapshot file, either in owned memory (when
+ * converted from a node graph) or directly in a read-only memory mapping
+ * of a snapshot file, so a snapshot can be queried without deserializing
+ * it into MerkleNode objects.
+ *
+ * Nodes are stored in pre-order, so every child has a larger index than
+ * its parent and a reverse scan of the node table visits children before
+ * their parents. Besides the name and digest bytes, a node costs one
+ * FlatNode record, one FileStat record and one child index entry: 108
+ * bytes (see memoryUsage).
+ */
+class FlatTree
+{
+public:
+    FlatTree();
+    ~FlatTree();
+
+    FlatTree(const FlatTree &) = delete;
+    FlatTree &operator=(const FlatTree &) = delete;
+
+    /**
+     * @brief Convert a node graph into an owned flat tree
+     * @param root Root node of the tree
+     * @param rootPath Directory the tree was built from
+     * @param chunking Chunking the tree was built with
+     * @param algorithm Hash algorithm the tree was built with
+     * @return Flat tree holding a copy of the graph
+     * @throws runtime_error If the tree does not fit the 32-bit tables
+     */
+    static unique_ptr<FlatTree> fromNodes(const shared_ptr<MerkleNode> &root, const string &rootPath,
+                                          const ChunkingConfig &chunking, HashAlgorithm algorithm);
+
+    /**
+     * @brief Memory-map a snapshot file
+     * @param path Path of the snapshot file
+     * @return Flat tree backed by the mapping
+     * @throws runtime_error If the file cannot be mapped or is not a valid snapshot
+     *
+     * Besides the table bounds, the node and child tables are checked once
+     * to form a tree in pre-order (each child index above its parent's and
+     * below nodeCount), so a corrupt snapshot is rejected here rather than
+     * sending a walk in circles.
+     */
+    static unique_ptr<FlatTree> mapFile(const string &path);
+
+    /**
+     * @brief Write the flat tree to a snapshot file
+     * @param path Path of the snapshot file
+     * @throws runtime_error If the file cannot be written
+     */
+    void writeFile(const string &path) const;
+
+    /**
+     * @brief Get the snapshot header (counts, aggregates and offsets)
+     * @return Reference to the header
+     */
+    const SnapshotHeader &header() const;
+
+    /**
+     * @brief Get a node record
+     * @param index Node index (0 is the root)
+     * @return Reference to the node record
+     * @throws runtime_error If the index is out of range
+     */
+    const FlatNode &node(uint32_t index) const;
+
+    /**
+     * @brief Get the stat record of a node
+     * @param index Node index
+     * @return Reference to the metadata recorded for the node
+     */
+    const FileStat &stat(uint32_t index) const;
+
+    /**
+     * @brief Get the name of a node
+     * @param index Node index
+     * @return View of the name in the string pool
+     */
+    string_view name(uint32_t index) const;
+
+    /**
+     * @brief Get the index of a directory's n-th child
+     * @param index Node index of the directory
+     * @param position Position among the children (name order)
+     * @return Node index of the child
+     */
+    uint32_t child(uint32_t index, uint32_t position) const;
+
+    /**
+     * @brief Get a digest from the digest table
+     * @param position Entry in the digest table
+     * @return Reference to the digest
+     */
+    const Digest &digest(uint32_t position) const;
+
+    /**
+     * @brief Get the directory the tree was built from
+     * @return Root path
+     */
+    string rootPath() const;
+
+    /**
+     * @brief Find the first node with a name, in pre-order (as
+     *        MerkleTree::findNode)
+     * @param name Name to search for
+     * @param index Receives the node index on success
+     * @return True if a node was found
+     *
+     * The first lookup indexes every name of the tree; later lookups are
+     * constant time. Lookups may run on several threads at once.
+     */
+    bool find(string_view name, uint32_t &index) const;
+
+    /**
+     * @brief Find every node with a name
+     * @param name Name to search for
+     * @return Node indices in pre-order
+     */
+    vector<uint32_t> findAll(string_view name) const;
+
+    /**
+     * @brief Find a node by its path
+     * @param path Path relative to the root, with '/' separators ("" for the root)
+     * @param index Receives the node index on success
+     * @param chain Receives the node indices from the root down to the node, or nullptr
+     * @return True if the path is in the tree
+     *
+     * Children are stored in name order, so each step is a binary search.
+     */
+    bool findPath(string_view path, uint32_t &index, vector<uint32_t> *chain = nullptr) const;
+
+    /**
+     * @brief Create MerkleNode objects for a subtree
+     * @param index Node index of the subtree root
+     * @return Shared pointer to the materialized subtree
+     */
+    shared_ptr<MerkleNode> materialize(uint32_t index = 0) const;
+
+    /**
+     * @brief Count files, directories and bytes under a node
+     * @param index Node index of the subtree root
+     * @return Tuple containing (files, directories, total_size)
+     */
+    tuple<size_t, size_t, size_t> subtreeStats(uint32_t index) const;
+
+    /**
+     * @brief Get the depth of a node, as MerkleNode::getDepth
+     * @param index Node index
+     * @return Depth level (0 for leaves)
+     */
+    int depth(uint32_t index) const;
+
+    /**
+     * @brief Check every node hash against its children, bottom-up
+     * @return True if all hashes are consistent
+     *
+     * Each directory hash is recomputed once from its children's stored
+     * hashes and each file hash is checked against the root of its chunk
+     * tree.
+     */
+    bool verify() const;
+
+    /**
+     * @brief Get the memory used by the node tables
+     * @return Size of all tables in bytes
+     *
+     * Every node costs 108 bytes of fixed records: its 64-byte FlatNode,
+     * its 40-byte FileStat and the 4-byte child table entry naming it.
+     * On top of that come its name in the string pool and, for a file, 32
+     * bytes per digest (the content hash and one per chunk), so a
+     * one-chunk file with a 10-byte name takes 182 bytes. On x86-64 a
+     * MerkleNode alone is 272 bytes, before its name, its entry in the
+     * parent's children map and its shared_ptr control block.
+     */
+    size_t memoryUsage() const;
+
+private:
+    SnapshotHeader info;            // Header (copied from the file or built in memory)
+    const FlatNode *nodeTable;      // Node records
+    const FileStat *statTable;      // Stat records, one per node
+    const uint32_t *childTable;     // Child indices, grouped per directory
+    const Digest *digestTable;      // Content and chunk hashes
+    const char *stringPool;         // Root path followed by node names
+
+    vector<FlatNode> ownedNodes;    // Storage of an in-memory tree
+    vector<FileStat> ownedStats;    // Storage of an in-memory tree
+    vector<uint32_t> ownedChildren; // Storage of an in-memory tree
+    vector<Digest> ownedDigests;    // Storage of an in-memory tree
+    string ownedStrings;            // Storage of an in-memory tree
+
+    void *mapping;                  // Base of the file mapping, if mapped
+    size_t mappingSize;             // Length of the file mapping
+
+    mutable unordered_map<string_view, vector<uint32_t>> nameIndex; // Node indices per name, built on first lookup
+    mutable once_flag nameIndexBuilt;                               // Builds nameIndex once, whichever reader looks first
+
+    /**
+     * @brief Get the nodes with a name, indexing all names on first use
+     * @param name Name to look up
+     * @return Node indices in pre-order, or nullptr if there are none
+     */
+    const vector<uint32_t> *nodesNamed(string_view name) const;
+
+    /**
+     * @brief Append a subtree to the owned tables in pre-order
+     * @param node Node to append
+     * @return Index of the appended node
+     */
+    uint32_t appendNode(const shared_ptr<MerkleNode> &node);
+
+    /**
+     * @brief Point the table views at the owned storage
+     */
+    void attachOwned();
+};
+
+/**
+ * @struct SnapshotTotals
+ * @brief Table sizes and aggregates of a tree, as its snapshot records them
+ */
+struct SnapshotTotals
+{
+    uint64_t nodes = 0;        // Node (and stat) table entries
+    uint64_t childEntries = 0; // Child index table entries
+    uint64_t digests = 0;      // Digest table entries
+    uint64_t nameBytes = 0;    // Bytes of node names in the string pool
+    uint64_t files = 0;        // Number of files
+    uint64_t directories = 0;  // Number of directories
+    uint64_t size = 0;         // Total size of all files in bytes
+    uint32_t depth = 0;        // Depth of the subtree root
+};
+
+/**
+ * @class SnapshotWriter
+ * @brief Streams a tree into a snapshot file one node at a time
+ *
+ * Nodes are added in pre-order, each directory with the node counts of its
+ * children's subtrees, so its child index entries can be written before its
+ * children are. The totals of the whole tree lay out the tables up front;
+ * each table is then written sequentially through its own buffer, so the
+ * memory used does not depend on the size of the tree. The file is the one
+ * FlatTree::fromNodes and writeFile produce for the same tree.
+ */
+class SnapshotWriter
+{
+public:
+    /**
+     * @brief Start a snapshot file
+     * @param path Path of the snapshot file (written to path + ".tmp" until finish)
+     * @param rootPath Directory the tree was built from
+     * @param chunking Chunking the tree was built with
+     * @param algorithm Hash algorithm the tree was built with
+     * @param totals Totals of the whole tree
+     * @throws runtime_error If the tree does not fit the 32-bit tables or the file cannot be created
+     */
+    SnapshotWriter(const string &path, const string &rootPath, const ChunkingConfig &chunking,
+                   HashAlgorithm algorithm, const SnapshotTotals &totals);
+
+    /**
+     * @brief Remove the unfinished file, if finish was not called
+     */
+    ~SnapshotWriter();
+
+    SnapshotWriter(const SnapshotWriter &) = delete;
+    SnapshotWriter &operator=(const SnapshotWriter &) = delete;
+
+    /**
+     * @brief Add a file node
+     * @param name Name of the file
+     * @param hash Merkle hash of the file
+     * @param fileStat Metadata recorded for the file
+     * @param fileSize Size of the file in bytes
+     * @param contentHash Hash of the file content
+     * @param chunks Chunk hashes of the file
+     * @param chunkCount Number of chunk hashes
+     * @throws runtime_error If the name is too long or a write fails
+     */
+    void addFile(const string &name, const Digest &hash, const FileStat &fileStat, uint64_t fileSize,
+                 const Digest &contentHash, const Digest *chunks, uint32_t chunkCount);
+
+    /**
+     * @brief Add a directory node; its children's subtrees follow it
+     * @param name Name of the directory
+     * @param hash Merkle hash of the directory
+     * @param fileStat Metadata recorded for the directory
+     * @param childNodes Node count of each child's subtree, in name order
+     * @throws runtime_error If the name is too long or a write fails
+     */
+    void addDirectory(const string &name, const Digest &hash, const FileStat &fileStat,
+                      const vector<uint64_t> &childNodes);
+
+    /**
+     * @brief Write the header and move the file into place
+     * @throws runtime_error If the nodes added do not match the totals or a write fails
+     */
+    void finish();
+
+private:
+    /**
+     * @brief A table written sequentially through a buffer
+     */
+    struct Table
+    {
+        uint64_t offset;    // File offset of the next buffered byte
+        vector<char> bytes; // Bytes not yet written
+    };
+
+    string path;           // Final path of the snapshot
+    string tempPath;       // File being written
+    int fd;                // Descriptor of the file, or -1 once closed
+    SnapshotHeader info;   // Header written by finish
+    Table nodeTable;       // Node records
+    Table statTable;       // Stat records
+    Table childTable;      // Child indices
+    Table digestTable;     // Content and chunk hashes
+    Table stringTable;     // Root path and names
+    uint64_t nodesAdded;   // Nodes added so far (index of the next node)
+    uint64_t childrenUsed; // Child index entries reserved so far
+    uint64_t digestsAdded; // Digests added so far
+    uint64_t stringBytes;  // Bytes of the string pool so far
+
+    /**
+     * @brief Append bytes to a table, writing it out when the buffer fills
+     * @param table Table to append to
+     * @param data Bytes to append
+     * @param length Number of bytes
+     * @throws runtime_error If a write fails
+     */
+    void append(Table &table, const void *data, size_t length);
+
+    /**
+     * @brief Write the buffered bytes of a table
+     * @param table Table to flush
+     * @throws runtime_error If a write fails
+     */
+    void flush(Table &table);
+
+    /**
+     * @brief Add the record of a node and its name, checking it fits
+     * @param record Node record (nameOffset and nameLength are filled here)
+     * @param name Name of the node
+     * @param fileStat Metadata recorded for the node
+     * @throws runtime_error If there are more nodes than the totals or the name is too long
+     */
+    void add_node(FlatNode &record, const string &name, const FileStat &fileStat);
+};
+
+/**
+ * @enum JsonFormat
+ * @brief Layout of a JSON export
+ */
+enum class JsonFormat : uint32_t
+{
+    TREE = 0,  // One JSON document nesting children inside their directory
+    NDJSON = 1 // Metadata line, then one object per node with its full path, in pre-order
+};
+
+/**
+ * @class JsonWriter
+ * @brief Buffered JSON output to a stream or a file descriptor
+ *
+ * Text is collected in a JSON_BUFFER_SIZE buffer and written out when it
+ * fills, so an export of any size needs constant memory. Strings are
+ * escaped as RFC 8259 requires; bytes that are not valid UTF-8 (file
+ * names are arbitrary bytes) become U+FFFD.
+ */
+class JsonWriter
+{
+public:
+    /**
+     * @brief Write to a stream
+     * @param out Stream receiving the text
+     */
+    explicit JsonWriter(ostream &out);
+
+    /**
+     * @brief Write to a file descriptor
+     * @param fd Descriptor receiving the text (not closed)
+     */
+    explicit JsonWriter(int fd);
+
+    /**
+     * @brief Flush what is left, ignoring errors (call flush() to see them)
+     */
+    ~JsonWriter();
+
+    JsonWriter(const JsonWriter &) = delete;
+    JsonWriter &operator=(const JsonWriter &) = delete;
+
+    /**
+     * @brief Append text as is
+     * @param text JSON syntax or pre-escaped text
+     * @return This writer
+     */
+    JsonWriter &raw(string_view text);
+
+    /**
+     * @brief Append a quoted, escaped JSON string
+     * @param text String bytes
+     * @return This writer
+     */
+    JsonWriter &quoted(string_view text);
+
+    /**
+     * @brief Append a quoted hex digest
+     * @param digest Digest to encode
+     * @return This writer
+     */
+    JsonWriter &quoted(const Digest &digest);
+
+    /**
+     * @brief Append an unsigned number
+     * @param value Number to write
+     * @return This writer
+     */
+    JsonWriter &number(uint64_t value);
+
+    /**
+     * @brief Append spaces
+     * @param count Number of spaces
+     * @return This writer
+     */
+    JsonWriter &spaces(size_t count);
+
+    /**
+     * @brief Write the buffered text out
+     * @throws runtime_error If the stream or descriptor fails
+     */
+    void flush();
+
+private:
+    ostream *stream;     // Destination stream, or nullptr
+    int fd;              // Destination descriptor if there is no stream
+    vector<char> buffer; // Pending text
+    size_t used;         // Bytes of buffer in use
+
+    /**
+     * @brief Make room for a number of bytes, flushing if needed
+     * @param count Bytes about to be appended (at most JSON_BUFFER_SIZE)
+     * @return Where to append them
+     */
+    char *reserve(size_t count);
+};
+
+/**
+ * @enum ChangeType
+ * @brief Kind of difference between two trees at one path
+ */
+enum class ChangeType : uint32_t
+{
+    ADDED = 0,   // Only in the other tree
+    REMOVED = 1, // Only in this tree
+    MODIFIED = 2 // A file in both trees, with different hashes
+};
+
+/**
+ * @struct TreeChange
+ * @brief One difference reported by MerkleTree::diff
+ */
+struct TreeChange
+{
+    ChangeType type; // Kind of change
+    string path;     // Path relative to the tree roots
+    bool isFile;     // True for a file; an added or removed directory stands for its whole subtree
+    Digest oldHash;  // Hash in this tree (zero if added)
+    Digest newHash;  // Hash in the other tree (zero if removed)
+};
+
+/**
+ * @struct IntegrityIssue
+ * @brief One problem reported by MerkleTree::verifyContents
+ */
+struct IntegrityIssue
+{
+    string path;    // Path relative to the tree root
+    string problem; // What does not match
+};
+
+/**
+ * @struct SyncChunk
+ * @brief One chunk of a file in a SyncPlan
+ */
+struct SyncChunk
+{
+    Digest hash;     // Chunk hash
+    uint64_t offset; // Start of the chunk in the file
+    uint64_t length; // Chunk length in bytes
+    bool sent;       // Bytes are in the chunk stream; otherwise the receiver has them, or they come earlier in the stream
+};
+
+/**
+ * @struct SyncFile
+ * @brief A file the receiver has to write, as a list of its chunks
+ */
+struct SyncFile
+{
+    string path;              // Path relative to the tree roots
+    uint64_t fileSize;        // Size in bytes
+    Digest contentHash;       // Hash of the whole content
+    vector<SyncChunk> chunks; // Chunks in file order
+};
+
+/**
+ * @struct SyncPlan
+ * @brief What turns a remote tree into the local one, chunk by chunk
+ *
+ * The receiver creates the directories, writes the files from their
+ * chunks and removes the removed paths last, since the chunks it already
+ * has may lie in files that are rewritten or removed.
+ */
+struct SyncPlan
+{
+    vector<string> directories; // Directories only in the local tree, parents first
+    vector<SyncFile> files;     // Files added or modified, in path order
+    vector<string> removed;     // Paths only in the remote tree (a directory stands for its subtree)
+    uint64_t fileBytes = 0;     // Total size of the files
+    uint64_t sentBytes = 0;     // Bytes in the chunk stream
+    uint64_t sentChunks = 0;    // Chunks in the chunk stream
+};
+
+/**
+ * @struct TreeShard
+ * @brief A subtree built on its own and saved as a snapshot, for MerkleTree::mergeShards
+ */
+struct TreeShard
+{
+    string mountPath;    // Where the shard's root goes, relative to the merged root ("" for the base tree)
+    string snapshotPath; // Snapshot of the shard
+};
+
+/**
+ * @struct BoundedBuildStats
+ * @brief What MerkleTree::buildBounded kept in memory and spilled to disk
+ *
+ * The peak is taken as each directory finishes, before anything is
+ * spilled, so it includes every entry of that directory.
+ */
+struct BoundedBuildStats
+{
+    size_t spilledSubtrees = 0; // Finished subtrees written out and released
+    uint64_t spilledBytes = 0;  // Bytes of spilled records
+    size_t peakResident = 0;    // Largest estimate of the finished nodes held in memory, in bytes
+    size_t budgetOvershoot = 0; // Bytes peakResident went over the budget (0 if it stayed within)
+};
+
+/**
+ * @struct DedupeStats
+ * @brief Logical and unique sizes of a tree's files, at file and chunk level
+ *
+ * Logical sizes count every file; unique sizes count each distinct content
+ * (or chunk) once, i.e. what a content-addressed store would hold. The
+ * logical chunk bytes are the logical bytes.
+ */
+struct DedupeStats
+{
+    uint64_t files;            // File nodes
+    uint64_t uniqueFiles;      // Distinct file contents
+    uint64_t logicalBytes;     // Size of all files
+    uint64_t uniqueFileBytes;  // Size left after whole-file dedupe
+    uint64_t chunks;           // Chunk references of all files
+    uint64_t uniqueChunks;     // Distinct chunks
+    uint64_t uniqueChunkBytes; // Size left after chunk dedupe, without the unsized chunks
+    uint64_t unsizedChunks;    // Distinct content-defined chunks of unknown length
+};
+
+/**
+ * @class MerkleTree
+ * @brief Main class for building and managing Merkle tree file systems
+ *
+ * This class provides functionality to:
+ * - Build Merkle trees from directory structures
+ * - Calculate file and directory hashes
+ * - Process files in chunks for large file support
+ * - Display tree structure and statistics
+ */
+class MerkleTree
+{
+public:
+    /**
+     * @brief Default constructor for MerkleTree
+     */
+    MerkleTree();
+
+    /**
+     * @brief Constructor with custom chunk size
+     * @param chunkSize Size of chunks for file processing (default: 1MB)
+     */
+    explicit MerkleTree(size_t chunkSize);
+
+    /**
+     * @brief Constructor with custom chunk size and build thread count
+     * @param chunkSize Size of chunks for file processing
+     * @param threadCount Worker threads for build_tree (1 = serial, 0 = all cores)
+     */
+    MerkleTree(size_t chunkSize, size_t threadCount);
+
+    /**
+     * @brief Constructor with custom chunk size, thread count and hash algorithm
+     * @param chunkSize Size of chunks for file processing
+     * @param threadCount Worker threads for build_tree (1 = serial, 0 = all cores)
+     * @param algorithm Hash algorithm for every digest of the tree
+     * @throws runtime_error If the algorithm is not available in this build
+     */
+    MerkleTree(size_t chunkSize, size_t threadCount, HashAlgorithm algorithm);
+
+    /**
+     * @brief Destructor
+     */
+    ~MerkleTree() = default;
+
+    /**
+     * @brief Hash input data with the tree's hash engine
+     * @param data Input data to hash
+     * @return Digest of the hash
+     */
+    Digest hash_data(const string &data);
+
+    /**
+     * @brief Hash a raw buffer with the tree's hash engine
+     * @param data Pointer to the input bytes
+     * @param length Number of bytes to hash
+     * @return Digest of the hash
+     */
+    Digest hash_data(const char *data, size_t length);
+
+    /**
+     * @brief Hash file content and split into chunks
+     * @param file_path Path to the file to process
+     * @return Tuple containing (content_hash, file_size, chunk_hashes)
+     * @throws runtime_error If file cannot be opened or read
+     */
+    tuple<Digest, size_t, vector<Digest>> hash_file_content(const string &file_path);
+
+    /**
+     * @brief Build Merkle tree from directory path
+     * @param directory_path Path to the directory to process
+     * @return Shared pointer to the root node of the built tree
+     * @throws runtime_error If directory path is invalid
+     */
+    shared_ptr<MerkleNode> build_tree(const string &directory_path);
+
+    /**
+     * @brief Build a single node from filesystem path
+     * @param path Filesystem path to process
+     * @return Shared pointer to the created node
+     * @throws runtime_error If path is invalid or inaccessible
+     */
+    shared_ptr<MerkleNode> build_node(const fs::path &path);
+
+    /**
+     * @brief Incrementally rebuild the tree from directory path
+     * @param directory_path Path to the directory to process
+     * @param control Progress and cancellation of the build, or nullptr
+     * @return Shared pointer to the root node of the rebuilt tree
+     * @throws runtime_error If directory path is invalid
+     * @throws OperationCancelled If control was cancelled (the tree is then unusable)
+     *
+     * Reuses the previous tree when it was built from the same path with the
+     * same chunk size: only files whose (device, inode, size, mtime, ctime)
+     * changed are rehashed, and directory hashes are recomputed only along
+     * the changed paths. Otherwise falls back to a full build_tree. The
+     * resulting hashes match those of a full build. Files count towards the
+     * progress as they are reached, and a reused tree sets the expected
+     * totals.
+     */
+    shared_ptr<MerkleNode> rebuild(const string &directory_path, JobControl *control = nullptr);
+
+    /**
+     * @brief Build the tree of a directory within a memory budget, straight into a snapshot
+     * @param directory_path Path to the directory to process
+     * @param snapshotPath Snapshot file receiving the tree
+     * @param memoryBudget Bytes of finished nodes kept in memory before subtrees are spilled
+     * @return What was spilled
+     * @throws runtime_error If directory path is invalid, or the spill or snapshot file
+     *         cannot be written
+     *
+     * The directory is walked as by a serial build. Once a directory is
+     * hashed its subtree is final; while the finished nodes held in memory
+     * exceed the budget, the largest finished subtrees are written to a
+     * temporary spill file next to the snapshot and released, leaving each
+     * one's root in its parent with only its name and hash. The snapshot is
+     * then streamed from the spill file, is the file save() writes for the
+     * same tree, and the tree is left mapped on it as after load().
+     *
+     * The budget is a target, not a hard bound. Only finished subtrees can be
+     * spilled: a directory's own entries stay in memory until all of them are
+     * hashed, since its hash needs them all in name order. A directory with
+     * more entries than the budget holds therefore goes over it, by up to its
+     * own size, as do the small-file batch and the hard-link table, which are
+     * not counted. The overshoot is reported in the returned stats.
+     */
+    BoundedBuildStats buildBounded(const string &directory_path, const string &snapshotPath, size_t memoryBudget);
+
+    /**
+     * @brief Apply changes to some paths of the tree
+     * @param paths Changed paths, relative to the tree root (or starting with the root path)
+     * @return Shared pointer to the root node of the updated tree
+     * @throws PathTooLong If a changed path is too deep to read; the others
+     *         are still applied, and that one keeps its previous nodes
+     * @throws runtime_error If the tree was not built from a directory
+     *
+     * Only the listed paths are looked at: each one is re-read as rebuild()
+     * would (a file is rehashed if its metadata changed, a directory is
+     * rescanned), added or removed from its parent, and the directory hashes
+     * are recomputed once along the changed paths, deepest first. A path whose
+     * parent is not in the tree is refreshed from its nearest ancestor that
+     * is, and the root path ("") falls back to rebuild(). Meant to be fed by
+     * a TreeWatcher; the hashes match those of a full build as long as every
+     * change was listed.
+     */
+    shared_ptr<MerkleNode> update(const vector<string> &paths);
+
+    /**
+     * @brief Print detailed tree structure
+     * @param node Root node to start printing from
+     * @param depth Current depth level for indentation
+     */
+    void print_tree_details(shared_ptr<MerkleNode> node, int depth = 0);
+
+    /**
+     * @brief Print file objects and their chunk information
+     *
+     * Files with the same content are listed under one content hash, and
+     * chunks used more than once show their reference count.
+     */
+    void print_file_objects();
+
+    /**
+     * @brief Process directory and display complete analysis
+     * @param directory_path Path to the directory to process
+     */
+    void process_directory(const string &directory_path);
+
+    /**
+     * @brief Get the root node of the tree
+     * @return Shared pointer to root node
+     */
+    shared_ptr<MerkleNode> getRoot() const;
+
+    /**
+     * @brief Get the root hash of the tree
+     * @return Root digest (all zero if no tree is present)
+     */
+    Digest getRootHash() const;
+
+    /**
+     * @brief Get the depth of the tree
+     * @return Depth of the root node (0 if no tree is present)
+     */
+    int getTreeDepth() const;
+
+    /**
+     * @brief Get tree statistics
+     * @return Tuple containing (total_files, total_directories, total_size)
+     */
+    tuple<size_t, size_t, size_t> getTreeStats() const;
+
+    /**
+     * @brief Get the file and chunk level dedupe statistics
+     * @return Logical and unique sizes of the tree's files
+     *
+     * Built trees answer from the content index kept by index_nodes; flat
+     * trees are scanned without materializing them.
+     */
+    DedupeStats getDedupeStats() const;
+
+    /**
+     * @brief Count the references to a chunk across all files
+     * @param chunkHash Chunk hash
+     * @return Number of file chunks with this hash (0 if none)
+     */
+    uint32_t getChunkReferences(const Digest &chunkHash) const;
+
+    /**
+     * @brief Verify tree integrity by recalculating hashes
+     * @return True if all hashes are valid, false otherwise
+     *
+     * Every stored hash is recomputed once from its children's stored
+     * hashes, bottom-up, and the tree is left untouched. File contents are
+     * not read; see verifyContents.
+     */
+    bool verifyTreeIntegrity() const;
+
+    /**
+     * @brief Re-read every file from disk and check it against the tree
+     * @param control Progress and cancellation of the check, or nullptr
+     * @return Problems found, in path order (empty if the tree matches the disk)
+     * @throws OperationCancelled If control was cancelled
+     *
+     * Files are read under the root path with the chunking the tree was
+     * built with, on threadCount threads, and their content and chunk
+     * hashes are compared with the stored ones. The stored node hashes are
+     * then checked like verifyTreeIntegrity does. A flat tree is
+     * materialized for the check alone and stays flat.
+     */
+    vector<IntegrityIssue> verifyContents(JobControl *control = nullptr);
+
+    /**
+     * @brief Find a node by name in the tree
+     * @param name Name to search for
+     * @return Shared pointer to found node, nullptr if not found
+     *
+     * Served from the name index. If several nodes share the name, the
+     * first one in pre-order (children in name order) is returned; use
+     * findNodes or findPath to tell them apart.
+     */
+    shared_ptr<MerkleNode> findNode(const string &name);
+
+    /**
+     * @brief Find every node with a name
+     * @param name Name to search for
+     * @return Matching nodes in pre-order
+     */
+    vector<shared_ptr<MerkleNode>> findNodes(const string &name);
+
+    /**
+     * @brief Find a node by its path
+     * @param path Path relative to the tree root, or starting with the root path
+     * @return Shared pointer to found node, nullptr if not found
+     */
+    shared_ptr<MerkleNode> findPath(const string &path);
+
+    /**
+     * @brief Build the inclusion proof of one chunk of a file
+     * @param path Path of the file, relative to the tree root (or starting with the root path)
+     * @param chunkIndex Chunk to prove
+     * @return Proof against the file node's hash
+     * @throws runtime_error If the path is not a file of the tree or the index is out of range
+     */
+    ChunkProof proveChunk(const string &path, size_t chunkIndex) const;
+
+    /**
+     * @brief Check the bytes of one chunk against the stored file hash
+     * @param path Path of the file, relative to the tree root (or starting with the root path)
+     * @param chunkIndex Position of the chunk in the file
+     * @param data Chunk bytes, e.g. read from the file
+     * @param length Number of bytes
+     * @return True if the bytes are that chunk of the file the tree was built from
+     * @throws runtime_error If the path is not a file of the tree or the index is out of range
+     */
+    bool verifyChunk(const string &path, size_t chunkIndex, const void *data, size_t length) const;
+
+    /**
+     * @brief Prove that a node belongs to the tree
+     * @param path Path of the node, relative to the tree root (or starting with the root path)
+     * @return Binary inclusion proof (see InclusionProof) against getRootHash()
+     * @throws runtime_error If the path is not in the tree
+     */
+    vector<uint8_t> prove(const string &path) const;
+
+    /**
+     * @brief List the differences between this tree and another one
+     * @param other Tree to compare with (e.g. a newer build of the same directory)
+     * @return Changes that turn this tree into other, in path order
+     * @throws runtime_error If the trees use different hash algorithms
+     *
+     * Subtrees with equal hashes are skipped and the sorted children of
+     * differing directories are merged, so the cost grows with the number
+     * of changes rather than the size of the trees. Loaded and compacted
+     * trees are compared in place, without materializing them. A path
+     * that is a file in one tree and a directory in the other is reported
+     * as removed and added.
+     */
+    vector<TreeChange> diff(const MerkleTree &other) const;
+
+    /**
+     * @brief Plan the transfer that turns a remote tree into this one
+     * @param remote Tree of the receiver (e.g. a snapshot it sent)
+     * @return Changed files with the chunks the receiver lacks
+     * @throws runtime_error If the trees use different hash algorithms or
+     *         chunkings, or a content-defined file cannot be re-read
+     *
+     * Differing subtrees are found with diff(). A chunk is sent only if no
+     * file of the remote tree has it, and only once per plan. Fixed-size
+     * chunk ranges follow from the sizes; content-defined boundaries are
+     * found again by re-scanning the changed files of this tree.
+     */
+    SyncPlan planSync(const MerkleTree &remote) const;
+
+    /**
+     * @brief Write the sent chunks of a plan as a chunk stream
+     * @param plan Plan made by planSync on this tree
+     * @param fd Descriptor receiving the stream (file, pipe or socket; not closed)
+     * @throws runtime_error If a file cannot be read or a write fails
+     *
+     * The stream is a SyncStreamHeader followed by, for each sent chunk in
+     * plan order, its hash, its length (8 bytes) and its bytes. The bytes
+     * go from the page cache to fd with sendfile, without a copy through
+     * user space. The receiver checks each chunk against its hash, which
+     * also catches files changed since the plan.
+     */
+    void sendChunks(const SyncPlan &plan, int fd) const;
+
+    /**
+     * @brief Export tree structure to JSON format
+     * @return JSON string representation of the tree
+     */
+    string exportToJson() const;
+
+    /**
+     * @brief Stream the tree as JSON
+     * @param out Stream receiving the export
+     * @param format Nested document or NDJSON
+     * @throws runtime_error If the stream fails
+     *
+     * Nodes are written as they are visited through a JsonWriter, so no
+     * per-node strings are built. TREE gives the same document as
+     * exportToJson.
+     */
+    void exportJson(ostream &out, JsonFormat format = JsonFormat::TREE) const;
+
+    /**
+     * @brief Stream the tree as JSON to a file descriptor
+     * @param fd Descriptor receiving the export (not closed)
+     * @param format Nested document or NDJSON
+     * @param control Progress and cancellation of the export, or nullptr
+     * @throws runtime_error If a write fails
+     * @throws OperationCancelled If control was cancelled (the output is then cut short)
+     */
+    void exportJson(int fd, JsonFormat format = JsonFormat::TREE, JobControl *control = nullptr) const;
+
+    /**
+     * @brief Save the tree to a binary snapshot file
+     * @param path Path of the snapshot file
+     * @throws runtime_error If there is no tree or the file cannot be written
+     */
+    void save(const string &path) const;
+
+    /**
+     * @brief Load a tree from a binary snapshot file
+     * @param path Path of the snapshot file
+     * @throws runtime_error If the file is not a valid snapshot
+     *
+     * The file is memory-mapped. getTreeStats, getRootHash, getTreeDepth and
+     * findNode are served straight from the mapping; MerkleNode objects are
+     * only created for the parts of the tree an operation returns or walks
+     * (e.g. getRoot or printing the whole tree).
+     */
+    void load(const string &path);
+
+    /**
+     * @brief Combine independently built shard snapshots into one tree
+     * @param rootPath Directory the merged tree stands for
+     * @param shards Snapshots and where they are mounted
+     * @throws runtime_error If a snapshot is invalid, the shards were built with
+     *         different algorithms or chunkings, a mount point is taken, or a
+     *         directory the shards leave uncovered cannot be listed
+     *
+     * Each shard's root is renamed to its mount point and only the
+     * directories on the way to the mount points are rehashed. A base tree
+     * (mount path "") built with WalkPolicy::oneFileSystem, or with the
+     * mount points in WalkPolicy::excluded, has them as empty directories,
+     * which the shards replace: merging it with a snapshot of each mount
+     * gives the tree, and root hash, of a single build of rootPath. Shards
+     * may be mounted inside other shards.
+     *
+     * Directories no shard stands for (the root without a base, and those
+     * on the way to a mount point) are listed on disk, and the entries no
+     * shard covers are built with the walk policy, so nothing of rootPath
+     * is dropped. Files are only read for those entries; with a base and
+     * every mount point inside it, rootPath is not touched at all.
+     */
+    void mergeShards(const string &rootPath, const vector<TreeShard> &shards);
+
+    /**
+     * @brief Make this tree an independent copy of another one
+     * @param other Tree to copy (only read, so it may be shared with readers)
+     *
+     * Takes over every setting of other, and a copy of its nodes in the
+     * flat node store. A rebuild of the copy then reuses the unchanged
+     * files of other without touching any of its nodes.
+     */
+    void cloneFrom(const MerkleTree &other);
+
+    /**
+     * @brief Exchange the built trees of two MerkleTrees
+     * @param other Tree to exchange with
+     *
+     * The nodes, indexes, root path and built chunking change places; the
+     * settings of each tree stay where they are. Both trees must use the
+     * same hash algorithm.
+     */
+    void swapTree(MerkleTree &other);
+
+    /**
+     * @brief Convert the current tree into the compact flat node store
+     * @throws runtime_error If there is no tree
+     *
+     * Releases the MerkleNode graph; stats, lookups, verification and
+     * snapshots are then served from the contiguous FlatTree tables.
+     */
+    void compact();
+
+    /**
+     * @brief Keep built trees in the compact flat node store
+     * @param compactStorage True to compact after every build_tree and rebuild
+     */
+    void setCompactStorage(bool compactStorage);
+
+    /**
+     * @brief Check whether built trees are compacted
+     * @return True if compact storage is enabled
+     */
+    bool getCompactStorage() const;
+
+    /**
+     * @brief Set custom chunk size for file processing
+     * @param chunkSize New chunk size in bytes
+     */
+    void setChunkSize(size_t chunkSize);
+
+    /**
+     * @brief Get current chunk size
+     * @return Current chunk size in bytes
+     */
+    size_t getChunkSize() const;
+
+    /**
+     * @brief Set how file contents are split into chunks
+     * @param mode Fixed-size or content-defined chunks
+     */
+    void setChunkingMode(ChunkingMode mode);
+
+    /**
+     * @brief Get how file contents are split into chunks
+     * @return Current chunking mode
+     */
+    ChunkingMode getChunkingMode() const;
+
+    /**
+     * @brief Set the chunk sizes of content-defined chunking
+     * @param minSize Smallest chunk but the last
+     * @param averageSize Expected chunk size
+     * @param maxSize Largest chunk
+     * @throws runtime_error If the sizes are out of range or not ordered
+     */
+    void setCdcSizes(size_t minSize, size_t averageSize, size_t maxSize);
+
+    /**
+     * @brief Get the current chunking mode and sizes
+     * @return Chunking used by the next build
+     */
+    ChunkingConfig getChunking() const;
+
+    /**
+     * @brief Set the number of threads used by build_tree
+     * @param threadCount Worker threads (1 = serial, 0 = all cores)
+     */
+    void setThreadCount(size_t threadCount);
+
+    /**
+     * @brief Get the number of threads used by build_tree
+     * @return Current thread count
+     */
+    size_t getThreadCount() const;
+
+    /**
+     * @brief Get the hash algorithm of the tree
+     * @return Hash algorithm chosen at construction (or adopted from a loaded snapshot)
+     */
+    HashAlgorithm getHashAlgorithm() const;
+
+    /**
+     * @brief Set how file contents are read
+     * @param ioBackend I/O backend (io_uring falls back to stream when unavailable)
+     */
+    void setIoBackend(IoBackend ioBackend);
+
+    /**
+     * @brief Get how file contents are read
+     * @return Current I/O backend
+     */
+    IoBackend getIoBackend() const;
+
+    /**
+     * @brief Set what builds follow while walking directories
+     * @param walkPolicy Symlink, hard link, mount point and exclusion handling
+     * @throws runtime_error If an excluded path is not a directory inside the root
+     */
+    void setWalkPolicy(const WalkPolicy &walkPolicy);
+
+    /**
+     * @brief Get what builds follow while walking directories
+     * @return Current walk policy
+     */
+    WalkPolicy getWalkPolicy() const;
+
+    /**
+     * @brief Set the cache that builds take unchanged files from
+     * @param hashCache Cache opened with HashCache::open, or nullptr to read every file
+     *
+     * Builds and rebuilds fill files whose metadata matches a record
+     * without reading them, and record the files they hash. Verification
+     * always reads the files.
+     */
+    void setHashCache(shared_ptr<HashCache> hashCache);
+
+    /**
+     * @brief Get the cache that builds take unchanged files from
+     * @return Current cache, or nullptr
+     */
+    shared_ptr<HashCache> getHashCache() const;
+
+    /**
+     * @brief Get the directory the current tree stands for
+     * @return Root path (empty if nothing was built or loaded)
+     */
+    const string &getRootPath() const;
+
+private:
+    /**
+     * @struct LinkedFile
+     * @brief Hashes of a file with several hard links, shared by its links during one build
+     */
+    struct LinkedFile
+    {
+        FileStat fileStat;          // Metadata of the file when its first link was found
+        bool reading = false;       // A thread is reading one of the links
+        bool hashed = false;        // Set once a link has been hashed
+        Digest contentHash;         // Hash of the file content
+        uint64_t fileSize = 0;      // Size in bytes
+        vector<Digest> chunkHashes; // Chunk hashes of the file
+    };
+
+    /**
+     * @enum LinkShare
+     * @brief What share_linked_file did with a link
+     */
+    enum class LinkShare
+    {
+        READ,   // No link hashed yet: the caller reads this one, and hash_file_node publishes it
+        SHARED, // Filled from a link hashed earlier in the build
+        PENDING // Another thread is reading a link; fill this one once it is done
+    };
+
+    // The graph is materialized lazily from a loaded snapshot, hence mutable
+    mutable shared_ptr<MerkleNode> root;                      // Root node of the Merkle tree
+    mutable vector<shared_ptr<MerkleNode>> nodes;             // Vector of all nodes in the tree
+    unique_ptr<FlatTree> flatTree;                            // Flat node store (loaded snapshot or compacted tree)
+    size_t CHUNK_SIZE;                                        // Size of chunks for file processing (default: 1MB)
+    size_t threadCount;                                       // Worker threads for build_tree (1 = serial)
+    string rootPath;                                          // Directory the current tree was built from
+    ChunkingMode chunkingMode;                                // Fixed-size or content-defined chunks
+    size_t cdcMinSize;                                        // Smallest content-defined chunk
+    size_t cdcAverageSize;                                    // Expected content-defined chunk size
+    size_t cdcMaxSize;                                        // Largest content-defined chunk
+    ChunkingConfig builtChunking;                             // Chunking the current tree was built with
+    bool compactStorage;                                      // Compact the tree after each build
+    const HashEngine *hashEngine;                             // Engine for every digest of the tree
+    IoBackend ioBackend;                                      // How file contents are read
+    WalkPolicy walkPolicy;                                    // What builds follow while walking
+    uint64_t rootDevice;                                      // Device of the walked root (WalkPolicy::oneFileSystem)
+    fs::path walkRoot;                                        // Walked root (WalkPolicy::excluded)
+    mutex linkedFilesLock;                                    // Guards linkedFiles (parallel builds)
+    map<InodeKey, LinkedFile> linkedFiles;                    // Files with several links seen by the current build
+    shared_ptr<HashCache> hashCache;                          // Hashes of unchanged files, or nullptr
+    JobControl *jobControl;                                   // Progress and cancellation of the running rebuild, or nullptr
+
+    // Lookup and content indexes, rebuilt by index_nodes() after every build
+    mutable unordered_map<string, shared_ptr<MerkleNode>> path_index;              // Relative path to node
+    mutable unordered_map<string_view, vector<shared_ptr<MerkleNode>>> name_index; // Node name to nodes, in pre-order
+    mutable map<Digest, vector<shared_ptr<MerkleNode>>> file_objects;              // Content hash to its files, in pre-order
+    mutable unordered_map<Digest, uint32_t, DigestHasher> chunk_refs;              // Chunk hash to its references
+    mutable DedupeStats dedupe;                                                    // Totals of file_objects and chunk_refs
+
+    /**
+     * @brief Create the node graph from the loaded snapshot, if not done yet
+     *
+     * Changes the tree: only for callers that hold it alone.
+     */
+    void materialize() const;
+
+    /**
+     * @brief Get the node graph of the tree without keeping it
+     * @return The root node, or nodes created from the flat tree for the caller alone (nullptr if no tree)
+     *
+     * Unlike materialize(), the tree itself is left as it is, so threads
+     * sharing the tree may call it at once.
+     */
+    shared_ptr<MerkleNode> node_graph() const;
+
+    /**
+     * @brief Check content-defined chunk sizes
+     * @param minSize Smallest chunk but the last
+     * @param averageSize Expected chunk size
+     * @param maxSize Largest chunk
+     * @throws runtime_error If the sizes are out of range or not ordered
+     */
+    static void validate_cdc_sizes(size_t minSize, size_t averageSize, size_t maxSize);
+
+    /**
+     * @brief Get the chunking recorded in a snapshot
+     * @param header Header of the snapshot
+     * @param path Path of the snapshot, for errors
+     * @return Chunking the snapshot was built with
+     * @throws runtime_error If the recorded chunking is invalid
+     */
+    static ChunkingConfig snapshot_chunking(const SnapshotHeader &header, const string &path);
+
+    /**
+     * @brief Take over the chunking and hash engine of a loaded tree
+     * @param chunking Chunking the tree was built with
+     * @param engine Engine its digests were computed with
+     */
+    void adopt_settings(const ChunkingConfig &chunking, const HashEngine &engine);
+
+    /**
+     * @brief Build the entries of a merged directory that no shard covers
+     * @param directory Directory created by mergeShards
+     * @param path Filesystem path of the directory
+     * @throws PathTooLong If a path below it is longer than the kernel accepts
+     * @throws runtime_error If the directory cannot be listed
+     */
+    void add_uncovered_entries(MerkleNode &directory, const fs::path &path);
+
+    /**
+     * @brief Format the chunk sizes of the built tree as JSON members
+     * @return JSON members without braces
+     */
+    string chunkingJson() const;
+
+    /**
+     * @brief Read the metadata used for change detection
+     * @param path Filesystem path to stat
+     * @param linkCount Receives the number of hard links when not nullptr
+     * @return Metadata of the file
+     * @throws runtime_error If the path cannot be stat'ed
+     */
+    static FileStat read_file_stat(const fs::path &path, uint32_t *linkCount = nullptr);
+
+    /**
+     * @brief Hash file content with a given chunking
+     * @param file_path Path to the file to process
+     * @param chunking How the file is split into chunks
+     * @param fileStat Metadata just read by the caller, or nullptr; saves the backend a stat
+     * @return Tuple containing (content_hash, file_size, chunk_hashes)
+     * @throws runtime_error If file cannot be opened or read
+     */
+    tuple<Digest, size_t, vector<Digest>> hash_file_content(const string &file_path, const ChunkingConfig &chunking,
+                                                            const FileStat *fileStat = nullptr);
+
+    /**
+     * @brief Hash a file read through an ifstream
+     * @param file_path Path to the file to process
+     * @param chunking How the file is split into chunks
+     * @param fileStat Metadata just read by the caller, or nullptr to seek for the size
+     * @return Tuple containing (content_hash, file_size, chunk_hashes)
+     * @throws runtime_error If file cannot be opened or read
+     */
+    tuple<Digest, size_t, vector<Digest>> hash_file_stream(const string &file_path, const ChunkingConfig &chunking,
+                                                           const FileStat *fileStat = nullptr);
+
+    /**
+     * @brief Hash a file through a read-only memory mapping
+     * @param file_path Path to the file to process
+     * @param chunking How the file is split into chunks
+     * @param fileStat Metadata just read by the caller, or nullptr to fstat the file
+     * @return Tuple containing (content_hash, file_size, chunk_hashes)
+     * @throws runtime_error If file cannot be opened or mapped
+     */
+    tuple<Digest, size_t, vector<Digest>> hash_file_mapped(const string &file_path, const ChunkingConfig &chunking,
+                                                           const FileStat *fileStat);
+
+    /**
+     * @brief Hash a file with several reads in flight on the thread's io_uring
+     * @param file_path Path to the file to process
+     * @param chunking How the file is split into chunks
+     * @param fileStat Metadata just read by the caller, or nullptr to fstat the file
+     * @return Tuple containing (content_hash, file_size, chunk_hashes)
+     * @throws runtime_error If file cannot be opened or read
+     */
+    tuple<Digest, size_t, vector<Digest>> hash_file_uring(const string &file_path, const ChunkingConfig &chunking,
+                                                          const FileStat *fileStat);
+
+    /**
+     * @brief Hash a file and fill in its node
+     * @param node File node to fill (its fileStat must be set)
+     * @param path Filesystem path of the file
+     * @throws runtime_error If the file cannot be read
+     */
+    void hash_file_node(MerkleNode &node, const fs::path &path);
+
+    /**
+     * @brief Build a single node of a known type
+     * @param path Filesystem path to process
+     * @param type Type of the entry (not MISSING)
+     * @return Shared pointer to the created node
+     * @throws runtime_error If path is inaccessible
+     */
+    shared_ptr<MerkleNode> build_node(const fs::path &path, EntryType type);
+
+    /**
+     * @brief Build a single node, queueing small files on a batch
+     * @param path Filesystem path to process
+     * @param type Type of the entry (not MISSING or SYMLINK), as listed by its parent
+     * @param batch Batch hashing the small files of the build
+     * @return Shared pointer to the created node (small files filled on flush)
+     * @throws runtime_error If path is inaccessible
+     */
+    shared_ptr<MerkleNode> build_node(const fs::path &path, EntryType type, FileBatch &batch);
+
+    /**
+     * @brief Fill a directory node by walking its subtree with an explicit stack
+     * @param node Directory node to fill
+     * @param path Filesystem path of the directory
+     * @param batch Batch hashing the small files of the build
+     * @param finished Called with each directory once all its entries are built, children
+     *        before parents, or nullptr
+     * @throws runtime_error If the directory itself cannot be read
+     */
+    void walk_directory(const shared_ptr<MerkleNode> &node, const fs::path &path, FileBatch &batch,
+                        const function<void(MerkleNode &)> &finished = nullptr);
+
+    /**
+     * @brief Check whether a walk stops at a directory
+     * @param path Filesystem path of the directory
+     * @param listing Listing of the directory
+     * @return True if it is kept as an empty directory: a mount point under
+     *         WalkPolicy::oneFileSystem, or one of WalkPolicy::excluded
+     */
+    bool stops_at(const fs::path &path, const DirectoryListing &listing) const;
+
+    /**
+     * @brief Check whether a path is one of WalkPolicy::excluded
+     * @param relative Path relative to the walked root
+     * @return True if the walk keeps it as an empty directory
+     */
+    bool is_excluded(const fs::path &relative) const;
+
+    /**
+     * @brief Stat a file and queue it on a batch if it is small
+     * @param batch Batch hashing small files
+     * @param node File node to fill
+     * @param path Filesystem path of the file
+     * @param pending Set if another thread is reading a link of the file (nullptr: read it again instead)
+     * @return True if queued, filled from the hash cache or another link, or pending; otherwise the caller hashes the file itself
+     * @throws runtime_error If the file cannot be stat'ed or read
+     */
+    bool queue_small_file(FileBatch &batch, const shared_ptr<MerkleNode> &node, const fs::path &path,
+                          bool *pending = nullptr);
+
+    /**
+     * @brief Fill a file with several hard links from a link hashed earlier in the build
+     * @param node File node to fill (its fileStat must be set)
+     * @return What was done with the link
+     */
+    LinkShare share_linked_file(MerkleNode &node);
+
+    /**
+     * @brief Publish the hashes of a link for the other links of the file
+     * @param node File node just hashed
+     */
+    void publish_linked_file(const MerkleNode &node);
+
+    /**
+     * @brief Let another link be read after a link of the file could not be
+     * @param node File node that failed
+     */
+    void release_linked_file(const MerkleNode &node);
+
+    /**
+     * @brief Forget the hard links seen by the previous build
+     */
+    void clear_linked_files();
+
+    /**
+     * @brief Drop file nodes whose content could not be read
+     * @param node Directory to clean, with its subdirectories
+     * @param failed Nodes to drop
+     */
+    void remove_failed_files(MerkleNode &node, const unordered_set<const MerkleNode *> &failed);
 
-    map<string, shared_ptr<MerkleNode>> children; // Child nodes (for directories)
+    /**
+     * @brief Rebuild a single node, reusing the previous one when unchanged
+     * @param path Filesystem path to process
+     * @param type Type of the entry (not MISSING)
+     * @param previous Node for this path from the previous tree, or nullptr
+     * @param changed Set to true if the node's hash may differ from previous
+     * @return Shared pointer to the reused or newly built node
+     * @throws runtime_error If path is inaccessible
+     */
+    shared_ptr<MerkleNode> rebuild_node(const fs::path &path, EntryType type, const shared_ptr<MerkleNode> &previous,
+                                        bool &changed);
 
-    bool isFile;     // Flag indicating if this is a file (true) or directory (false)
-    size_t fileSize; // Size of the file in bytes (for files only)
+    /**
+     * @brief Rebuild a directory by walking its subtree with an explicit stack
+     * @param path Filesystem path of the directory
+     * @param previous Node for this path from the previous tree, or nullptr
+     * @param changed Set to true if the node's hash may differ from previous
+     * @return Shared pointer to the reused or newly built node
+     * @throws runtime_error If the directory itself cannot be read
+     */
+    shared_ptr<MerkleNode> rebuild_directory(const fs::path &path, const shared_ptr<MerkleNode> &previous,
+                                             bool &changed);
 
     /**
-     * @brief Constructor for MerkleNode
-     * @param name Name of the file or directory
-     * @param isFile True if this represents a file, false for directory
+     * @struct OpenDirectory
+     * @brief A directory of a parallel build, linked to the one above it
+     *
+     * Tasks share the chain of their parents, so cycles are found without
+     * copying a set of open directories per task.
      */
-    MerkleNode(const string &name, bool isFile = false);
+    struct OpenDirectory
+    {
+        InodeKey id;                        // (device, inode) of the directory
+        shared_ptr<const OpenDirectory> up; // Its parent, or nullptr for the root
+    };
 
     /**
-     * @brief Add a child node to this MerkleNode
-     * @param child Shared pointer to the child node to add
-     * @throws runtime_error If trying to add child to a file node
+     * @brief Shared state of one parallel build
      */
-    void addChild(const shared_ptr<MerkleNode> &child);
+    struct ParallelBuild
+    {
+        /**
+         * @brief A hard link found while another thread was reading its file
+         */
+        struct PendingLink
+        {
+            MerkleNode *parent;          // Directory node holding the link
+            shared_ptr<MerkleNode> node; // File node to fill
+            fs::path path;               // Filesystem path of the link
+        };
+
+        ThreadPool pool;                             // Workers hashing files and listing directories
+        mutex failureLock;                           // Guards failures, rootError, pendingLinks and warning output
+        vector<pair<MerkleNode *, string>> failures; // (parent, child name) of entries to drop
+        vector<PendingLink> pendingLinks;            // Links filled once the pool drains
+        string rootError;                            // Set if the root could not be read or a path was too long
+
+        explicit ParallelBuild(size_t threadCount) : pool(threadCount) {}
+    };
 
     /**
-     * @brief Calculate the Merkle hash of this node
-     * @return String containing the calculated hash
+     * @brief Build the tree on a thread pool
+     * @param directory_path Path to the root directory
+     * @return Shared pointer to the root node (hashes not yet calculated)
+     * @throws runtime_error If the root directory cannot be read
+     */
+    shared_ptr<MerkleNode> build_tree_parallel(const string &directory_path);
+
+    /**
+     * @brief List a directory and queue its children on the pool
+     * @param build Shared parallel build state
+     * @param parent Parent of node, or nullptr for the root
+     * @param node Directory node to fill
+     * @param path Filesystem path of the directory
+     * @param parents Directories above this one, to detect cycles (nullptr for the root)
+     */
+    void build_directory_parallel(ParallelBuild &build, MerkleNode *parent,
+                                  const shared_ptr<MerkleNode> &node, const fs::path &path,
+                                  const shared_ptr<const OpenDirectory> &parents);
+
+    /**
+     * @brief Hash a file into an already attached node
+     * @param build Shared parallel build state
+     * @param parent Directory node holding the file
+     * @param node File node to fill
+     * @param path Filesystem path of the file
+     */
+    void build_file_parallel(ParallelBuild &build, MerkleNode *parent,
+                             const shared_ptr<MerkleNode> &node, const fs::path &path);
+
+    /**
+     * @brief Queue a small file of a directory task on its batch
+     * @param build Shared parallel build state
+     * @param batch Batch of the directory task
+     * @param parent Directory node holding the file
+     * @param node File node to fill
+     * @param path Filesystem path of the file
+     * @return True if the file was queued or failed; false if it needs its own task
+     */
+    bool queue_small_parallel(ParallelBuild &build, FileBatch &batch, MerkleNode *parent,
+                              const shared_ptr<MerkleNode> &node, const fs::path &path);
+
+    /**
+     * @brief Hash the small files of a directory task
+     * @param build Shared parallel build state
+     * @param batch Batch of the directory task
+     * @param parent Directory node holding the files
+     */
+    void flush_parallel_batch(ParallelBuild &build, FileBatch &batch, MerkleNode *parent);
+
+    /**
+     * @brief Record a failed entry so it is dropped after the build
+     * @param build Shared parallel build state
+     * @param parent Directory node holding the entry, or nullptr to fail the whole build
+     * @param node Node that failed
+     * @param path Filesystem path of the entry
+     * @param error Error message to report
+     */
+    void record_build_failure(ParallelBuild &build, MerkleNode *parent, const MerkleNode &node,
+                              const fs::path &path, const string &error);
+
+    /**
+     * @brief Rebuild the nodes vector and the lookup and content indexes from the tree
      *
-     * For files: Returns the content hash
-     * For directories: Calculates hash based on sorted children hashes
+     * Walks the tree in pre-order with children in name order, so the
+     * result is the same no matter which threads built the nodes.
      */
-    string calculateHash();
+    void index_nodes() const;
 
     /**
-     * @brief Get the depth of this node in the tree
-     * @return Depth level (0 for root)
+     * @brief Pre-order walk of index_nodes, with an explicit stack
+     * @param node Current node
+     * @param path Path of the node relative to the tree root
      */
-    int getDepth() const;
+    void index_node(const shared_ptr<MerkleNode> &node, const string &path) const;
 
     /**
-     * @brief Check if this node is a leaf (has no children)
-     * @return True if leaf node, false otherwise
+     * @brief Drop the nodes vector and the lookup and content indexes
      */
-    bool isLeaf() const;
+    void clear_index() const;
 
     /**
-     * @brief Get total size of all files under this node
-     * @return Total size in bytes
+     * @brief Add the chunks of one file to the dedupe statistics
+     * @param stats Statistics to update
+     * @param refs Chunk reference counts to update
+     * @param fileSize Size of the file
+     * @param chunkHashes Chunk hashes of the file
+     * @param chunkCount Number of chunks
      */
-    size_t getTotalSize() const;
+    void count_chunks(DedupeStats &stats, unordered_map<Digest, uint32_t, DigestHasher> &refs, uint64_t fileSize,
+                      const Digest *chunkHashes, size_t chunkCount) const;
 
     /**
-     * @brief Get the number of files under this node
-     * @return Number of files
+     * @brief Turn a user-supplied path into a path index key
+     * @param path Path relative to the tree root, or starting with the root path
+     * @return Normalized relative path ("" for the root)
      */
-    size_t getFileCount() const;
+    string relative_path(const string &path) const;
+
+    /**
+     * @brief Find a node by its path
+     * @param path Path relative to the tree root, or starting with the root path
+     * @return Shared pointer to found node, nullptr if not found
+     */
+    shared_ptr<MerkleNode> find_path(const string &path) const;
+
+    /**
+     * @brief Find the nodes from the root down to a path
+     * @param path Path relative to the tree root, or starting with the root path
+     * @return Root first and the node of the path last, or empty if not found
+     */
+    vector<shared_ptr<MerkleNode>> find_chain(const string &path) const;
+
+    /**
+     * @brief Find a file node by its path
+     * @param path Path relative to the tree root, or starting with the root path
+     * @return The file node
+     * @throws runtime_error If the path is not a file of the tree
+     */
+    shared_ptr<MerkleNode> find_file(const string &path) const;
+
+    /**
+     * @brief Write the whole export
+     * @param writer Destination
+     * @param format Nested document or NDJSON
+     * @param control Progress and cancellation of the export, or nullptr
+     */
+    void write_json(JsonWriter &writer, JsonFormat format, JobControl *control) const;
+
+    /**
+     * @brief Write the metadata object of an export
+     * @param writer Destination
+     */
+    void write_json_metadata(JsonWriter &writer) const;
+
+    /**
+     * @brief Write a node and its subtree as a member of the nested document
+     * @param writer Destination
+     * @param node Node to export
+     * @param depth Current depth for indentation
+     * @param control Progress and cancellation of the export, or nullptr
+     */
+    void write_json_node(JsonWriter &writer, const MerkleNode &node, int depth, JobControl *control) const;
+
+    /**
+     * @brief Write a node and its subtree as NDJSON lines
+     * @param writer Destination
+     * @param node Node to export
+     * @param path Path of the node relative to the tree root; extended in place for the children
+     * @param control Progress and cancellation of the export, or nullptr
+     */
+    void write_ndjson_node(JsonWriter &writer, const MerkleNode &node, string &path, JobControl *control) const;
+
+    /**
+     * @brief Check the stored hashes of a subtree, bottom-up
+     * @param node Subtree root
+     * @param path Path of the node relative to the tree root
+     * @param issues Receives the nodes whose hash does not match
+     */
+    void check_node_hashes(const MerkleNode &node, const string &path, vector<IntegrityIssue> &issues) const;
+
+    /**
+     * @brief Re-read a range of files and compare them with their nodes
+     * @param files (node, relative path) of every file of the tree
+     * @param first First file of the range
+     * @param last One past the last file of the range
+     * @param issues Receives the files that do not match
+     * @param issuesLock Guards issues
+     * @param control Progress and cancellation of the check, or nullptr (stops early when cancelled)
+     */
+    void verify_files(const vector<pair<const MerkleNode *, string>> &files, size_t first, size_t last,
+                      vector<IntegrityIssue> &issues, mutex &issuesLock, JobControl *control);
+};
+
+/**
+ * @class TreeWatcher
+ * @brief Collects the paths changed under a directory with inotify
+ *
+ * Every directory under the root gets a watch, and directories created or
+ * moved in later are added as their events arrive. wait() blocks for the
+ * first event, then keeps reading until no event came for the debounce
+ * window (or MAX_WATCH_DELAY_MS passed, so a steady stream of writes still
+ * gets through) and returns the changed paths in one batch for
+ * MerkleTree::update. A lost event queue is reported as the root path, which
+ * makes the update a full rebuild. Symbolic links to directories are not
+ * watched through.
+ */
+class TreeWatcher
+{
+public:
+    /**
+     * @brief Start watching a directory tree
+     * @param directory Root directory, as passed to build_tree
+     * @param debounceMs Quiet time that ends a batch of events (e.g. DEFAULT_WATCH_DEBOUNCE_MS)
+     * @throws runtime_error If inotify is unavailable or runs out of watches
+     */
+    TreeWatcher(const string &directory, size_t debounceMs);
+
+    /**
+     * @brief Stop watching
+     */
+    ~TreeWatcher();
+
+    TreeWatcher(const TreeWatcher &) = delete;
+    TreeWatcher &operator=(const TreeWatcher &) = delete;
+
+    /**
+     * @brief Wait for the next batch of changes
+     * @param paths Receives the changed paths, starting with the watched directory
+     * @return False once stop() was called
+     * @throws runtime_error If reading the events fails
+     */
+    bool wait(vector<string> &paths);
+
+    /**
+     * @brief Make wait() return false; safe to call from any thread
+     */
+    void stop();
 
 private:
+    string directory;                   // Root directory
+    size_t debounceMs;                  // Quiet time that ends a batch
+    int inotifyFd;                      // inotify instance
+    int stopFd;                         // eventfd signalled by stop()
+    unordered_map<int, string> watches; // Watch descriptor to relative directory path
+
     /**
-     * @brief Helper function to calculate SHA-256 hash of data
-     * @param data Input data to hash
-     * @return Hexadecimal string representation of the hash
+     * @brief Watch a directory and every directory under it
+     * @param relative Path of the directory relative to the root ("" for the root)
+     * @throws runtime_error If the watch limit is reached
+     */
+    void add_watches(const string &relative);
+
+    /**
+     * @brief Forget the watches of a directory that moved away, and of its subdirectories
+     * @param relative Old path of the directory relative to the root
      */
-    string sha256(const string &data);
+    void drop_watches(const string &relative);
 
-    mutable int cachedDepth; // Cached depth value for performance
+    /**
+     * @brief Read the queued events
+     * @param paths Receives the changed paths
+     */
+    void read_events(set<string> &paths);
 };
 
 /**
- * @class MerkleTree
- * @brief Main class for building and managing Merkle tree file systems
+ * @brief Arguments of one command: JSON member names to their values as text
+ */
+typedef map<string, string> CommandArgs;
+
+/**
+ * @brief Receives the event frames of a background job, as JSON objects
+ */
+typedef function<void(const string &)> EventSink;
+
+/**
+ * @class CommandProcessor
+ * @brief Runs machine-readable commands against one warm tree
  *
- * This class provides functionality to:
- * - Build Merkle trees from directory structures
- * - Calculate file and directory hashes
- * - Process files in chunks for large file support
- * - Display tree structure and statistics
+ * Shared by the batch command line and the daemon. A command is a set of
+ * named arguments whose "op" selects the operation; the result is a JSON
+ * value. Commands that only read the tree hold a shared lock and run
+ * concurrently; build, load and setting changes hold it exclusively.
+ * A loaded or compact tree stays flat: queries answer from the flat
+ * tables, or from nodes created for that query alone, so readers never
+ * change the tree they share.
+ *
+ * Builds, verifies and exports can also run as background jobs ("start"),
+ * each on its own thread with a JobControl. A job reports progress to the
+ * EventSink it was started with every JOB_PROGRESS_INTERVAL_MS, then a
+ * final event, and stops at its next check when cancelled. A build job
+ * rebuilds a private copy of the tree with no lock held, so queries keep
+ * answering from the last complete tree, and swaps it in under the
+ * exclusive lock; verify and export jobs hold the shared lock.
  */
-class MerkleTree
+class CommandProcessor
 {
 public:
     /**
-     * @brief Default constructor for MerkleTree
+     * @brief Serve commands for a tree
+     * @param tree Tree the commands operate on (outlives the processor)
      */
-    MerkleTree();
+    explicit CommandProcessor(MerkleTree &tree);
 
     /**
-     * @brief Constructor with custom chunk size
-     * @param chunkSize Size of chunks for file processing (default: 1MB)
+     * @brief Cancel the running jobs and wait for them
      */
-    explicit MerkleTree(size_t chunkSize);
+    ~CommandProcessor();
+
+    CommandProcessor(const CommandProcessor &) = delete;
+    CommandProcessor &operator=(const CommandProcessor &) = delete;
 
     /**
-     * @brief Destructor
+     * @brief Run one command
+     * @param args Command arguments, including "op"
+     * @param events Receives the events of a job started by this command, or nullptr for none
+     * @return JSON value with the result
+     * @throws runtime_error If the command is unknown, malformed or fails
      */
-    ~MerkleTree() = default;
+    string execute(const CommandArgs &args, const EventSink &events = nullptr);
 
     /**
-     * @brief Calculate SHA-256 hash of input data
-     * @param data Input data to hash
-     * @return Hexadecimal string representation of the hash
+     * @brief Start a background job
+     * @param args Command arguments: "job" names the operation (build, verify,
+     *        verify_contents or export), the others are its own
+     * @param events Receives the events of the job, or nullptr
+     * @return Id of the job
+     * @throws runtime_error If the operation cannot run as a job, or a build job is already running
      */
-    string sha256(const string &data);
+    uint64_t startJob(const CommandArgs &args, const EventSink &events);
 
     /**
-     * @brief Hash file content and split into chunks
-     * @param file_path Path to the file to process
-     * @return Tuple containing (content_hash, file_size, chunk_hashes)
-     * @throws runtime_error If file cannot be opened or read
+     * @brief Wait for a job to finish
+     * @param id Job id, as returned by startJob
+     * @return JSON result of the job, as the command it runs would return
+     * @throws runtime_error If there is no such job, or it failed or was cancelled
      */
-    tuple<string, size_t, vector<string>> hash_file_content(const string &file_path);
+    string awaitJob(uint64_t id);
 
     /**
-     * @brief Build Merkle tree from directory path
-     * @param directory_path Path to the directory to process
-     * @return Shared pointer to the root node of the built tree
-     * @throws runtime_error If directory path is invalid
+     * @brief Apply a batch of changed paths to the tree
+     * @param paths Changed paths, as returned by TreeWatcher::wait
+     * @return JSON object describing the updated tree, as the stats command
+     * @throws runtime_error If there is no tree or the update fails
      */
-    shared_ptr<MerkleNode> build_tree(const string &directory_path);
+    string update(const vector<string> &paths);
+
+private:
+    struct Job;
+
+    MerkleTree &tree;                    // Tree the commands operate on
+    shared_mutex lock;                   // Shared for readers, exclusive for changes
+    bool hasTree;                        // True once a build or load succeeded
+    mutex jobsLock;                      // Guards jobs, nextJobId, buildJob and missedUpdates
+    map<uint64_t, shared_ptr<Job>> jobs; // Running and recently finished jobs, by id
+    uint64_t nextJobId;                  // Id of the next job
+    uint64_t buildJob;                   // Id of the running build job, or 0
+    vector<string> missedUpdates;        // Paths updated while the build job runs, replayed on its tree
 
     /**
-     * @brief Build a single node from filesystem path
-     * @param path Filesystem path to process
-     * @return Shared pointer to the created node
-     * @throws runtime_error If path is invalid or inaccessible
+     * @brief Get a required argument
+     * @param args Command arguments
+     * @param name Argument name
+     * @return Argument value
+     * @throws runtime_error If the argument is missing
      */
-    shared_ptr<MerkleNode> build_node(const fs::path &path);
+    static const string &require(const CommandArgs &args, const string &name);
 
     /**
-     * @brief Print detailed tree structure
-     * @param node Root node to start printing from
-     * @param depth Current depth level for indentation
+     * @brief Describe the current tree
+     * @return JSON object with the root hash, counts and settings
      */
-    void print_tree_details(shared_ptr<MerkleNode> node, int depth = 0);
+    string summary() const;
 
     /**
-     * @brief Print file objects and their chunk information
+     * @brief Check whether an operation changes the tree or its settings
+     * @param op Operation name
+     * @return True if the operation needs the exclusive lock
      */
-    void print_file_objects();
+    static bool changes_tree(const string &op);
 
     /**
-     * @brief Process directory and display complete analysis
-     * @param directory_path Path to the directory to process
+     * @brief Run a command that changes the tree or its settings
+     * @param op Operation name
+     * @param args Command arguments
+     * @return JSON result
      */
-    void process_directory(const string &directory_path);
+    string run_change(const string &op, const CommandArgs &args);
 
     /**
-     * @brief Get the root node of the tree
-     * @return Shared pointer to root node
+     * @brief Run a command that only reads the tree
+     * @param op Operation name
+     * @param args Command arguments
+     * @return JSON result
+     * @throws runtime_error If the operation is unknown
      */
-    shared_ptr<MerkleNode> getRoot() const;
+    string run_query(const string &op, const CommandArgs &args);
 
     /**
-     * @brief Get tree statistics
-     * @return Tuple containing (total_files, total_directories, total_size)
+     * @brief Check whether an operation manages background jobs
+     * @param op Operation name
+     * @return True for start, job, jobs, cancel and wait
      */
-    tuple<size_t, size_t, size_t> getTreeStats() const;
+    static bool is_job_op(const string &op);
 
     /**
-     * @brief Verify tree integrity by recalculating hashes
-     * @return True if all hashes are valid, false otherwise
+     * @brief Run a command that manages background jobs
+     * @param op Operation name
+     * @param args Command arguments
+     * @param events Receives the events of a started job, or nullptr
+     * @return JSON result
+     * @throws runtime_error If the job is unknown or cannot be started
      */
-    bool verifyTreeIntegrity();
+    string run_job_op(const string &op, const CommandArgs &args, const EventSink &events);
 
     /**
-     * @brief Find a node by name in the tree
-     * @param name Name to search for
-     * @return Shared pointer to found node, nullptr if not found
+     * @brief Run the operation of a job, on its thread
+     * @param job Job to run
+     * @param args Command arguments of the job
+     * @return JSON result
+     * @throws OperationCancelled If the job was cancelled
+     * @throws runtime_error If the operation fails
      */
-    shared_ptr<MerkleNode> findNode(const string &name);
+    string run_job(Job &job, const CommandArgs &args);
 
     /**
-     * @brief Export tree structure to JSON format
-     * @return JSON string representation of the tree
+     * @brief Rebuild a copy of the tree and swap it in
+     * @param path Directory to build
+     * @param control Progress and cancellation of the build
+     * @return JSON object describing the new tree, as the stats command
+     * @throws OperationCancelled If the build was cancelled (the current tree is kept)
+     * @throws runtime_error If the build fails (the current tree is kept)
      */
-    string exportToJson() const;
+    string build_in_background(const string &path, JobControl &control);
 
     /**
-     * @brief Set custom chunk size for file processing
-     * @param chunkSize New chunk size in bytes
+     * @brief Find the job named by a command
+     * @param args Command arguments with a "job" id
+     * @return The job
+     * @throws runtime_error If there is no such job
      */
-    void setChunkSize(size_t chunkSize);
+    shared_ptr<Job> find_job(const CommandArgs &args);
 
     /**
-     * @brief Get current chunk size
-     * @return Current chunk size in bytes
+     * @brief Describe a job
+     * @param job Job to describe
+     * @param event Event name to describe it as, or nullptr for a status object
+     * @return JSON object with the job's state and progress, and its result or error once finished
      */
-    size_t getChunkSize() const;
+    static string job_json(Job &job, const char *event);
+};
 
-private:
-    shared_ptr<MerkleNode> root;                      // Root node of the Merkle tree
-    map<string, shared_ptr<MerkleNode>> file_objects; // Map of content hash to file nodes
-    vector<shared_ptr<MerkleNode>> nodes;             // Vector of all nodes in the tree
-    size_t CHUNK_SIZE;                                // Size of chunks for file processing (default: 1MB)
+/**
+ * @class CommandServer
+ * @brief Unix socket daemon answering commands with a CommandProcessor
+ *
+ * Every message in either direction is a frame: a 4-byte big-endian
+ * length followed by that many bytes of JSON. A request is a flat JSON
+ * object of scalars with an "op" and an optional "id"; the response
+ * {"id": ..., "ok": true, "result": ...} or {"id": ..., "ok": false,
+ * "error": "..."} repeats the id. Each connection has a reader thread
+ * that hands requests to a thread pool, so a client can keep many
+ * requests in flight; responses are sent as they complete, possibly out
+ * of order. The events of a job started on a connection are sent to it
+ * as frames {"event": ..., "job": ..., ...} with no id, between the
+ * responses. The "shutdown" op stops the server.
+ */
+class CommandServer
+{
+public:
+    /**
+     * @brief Listen on a Unix socket
+     * @param processor Processor running the commands
+     * @param socketPath Filesystem path of the socket (replaced if it exists)
+     * @param workerCount Threads running commands
+     * @throws runtime_error If the socket cannot be created
+     */
+    CommandServer(CommandProcessor &processor, const string &socketPath, size_t workerCount);
 
     /**
-     * @brief Recursive helper for finding nodes
-     * @param node Current node to search in
-     * @param name Name to search for
-     * @return Shared pointer to found node, nullptr if not found
+     * @brief Close the socket and remove its path
      */
-    shared_ptr<MerkleNode> findNodeRecursive(shared_ptr<MerkleNode> node, const string &name);
+    ~CommandServer();
+
+    CommandServer(const CommandServer &) = delete;
+    CommandServer &operator=(const CommandServer &) = delete;
 
     /**
-     * @brief Helper function to export node to JSON
-     * @param node Node to export
-     * @param depth Current depth for indentation
-     * @return JSON string representation of the node
+     * @brief Accept connections until a client sends "shutdown"
      */
-    string nodeToJson(shared_ptr<MerkleNode> node, int depth = 0) const;
+    void run();
+
+private:
+    struct Connection; // One client socket and its write lock
+
+    CommandProcessor &processor;  // Processor running the commands
+    string socketPath;            // Filesystem path of the socket
+    int listenFd;                 // Listening socket
+    ThreadPool workers;           // Threads running commands
+    atomic<bool> stopping;        // Set by the "shutdown" op
+    mutex readersLock;            // Guards readers
+    vector<thread> readers;       // One reader thread per connection
 
     /**
-     * @brief Calculate statistics recursively
-     * @param node Current node
-     * @param files Reference to file count
-     * @param directories Reference to directory count
-     * @param totalSize Reference to total size
+     * @brief Read the frames of one connection and queue their requests
+     * @param connection Client connection
      */
-    void calculateStatsRecursive(shared_ptr<MerkleNode> node, size_t &files, size_t &directories, size_t &totalSize) const;
+    void serve_connection(const shared_ptr<Connection> &connection);
 
     /**
-     * @brief Verify node integrity recursively
-     * @param node Node to verify
-     * @return True if node and all children are valid
+     * @brief Run one request and send its response
+     * @param connection Client connection
+     * @param frame Request frame payload
      */
-    bool verifyNodeIntegrity(shared_ptr<MerkleNode> node);
+    void handle_request(const shared_ptr<Connection> &connection, const string &frame);
 };
 
+/**
+ * @brief Parse a flat JSON object of scalars into command arguments
+ * @param text JSON text
+ * @return Member names to values (strings unescaped, other scalars as written)
+ * @throws runtime_error If the text is not such an object
+ */
+CommandArgs parseCommandArgs(string_view text);
+
 /**
  * @brief Utility function to format file size in human-readable format
  * @param bytes Size in bytes
@@ -280,6 +3728,142 @@ private:
  */
 string formatFileSize(size_t bytes);
 
+/**
+ * @brief Utility function to hex-encode a digest
+ * @param digest Digest to encode
+ * @return Lowercase hexadecimal string (64 characters)
+ */
+string toHex(const Digest &digest);
+
+/**
+ * @brief Utility function to hex-encode a digest into a buffer
+ * @param digest Digest to encode
+ * @param out Buffer receiving 64 lowercase hex characters (not terminated)
+ */
+void toHex(const Digest &digest, char *out);
+
+/**
+ * @brief Utility function to decode a hex digest
+ * @param hex Hexadecimal string (64 characters)
+ * @return Decoded digest
+ * @throws runtime_error If the string is not a valid hex digest
+ */
+Digest fromHex(const string &hex);
+
+/**
+ * @brief Get the number of messages the multi-buffer SHA-256 kernel hashes at once
+ * @return 16 (AVX-512), 8 (AVX2), or 1 if no kernel can run on this CPU
+ */
+size_t sha256MultiBufferLanes();
+
+/**
+ * @brief Check whether the CPU has the SHA extensions (SHA-NI)
+ * @return True if single-message SHA-256 runs in hardware
+ */
+bool sha256HardwareSupport();
+
+/**
+ * @brief Hash independent messages with the multi-buffer SHA-256 kernel
+ * @param inputs Messages to hash
+ * @param count Number of messages
+ * @param digests Receives one digest per message, in input order
+ * @throws runtime_error If sha256MultiBufferLanes() is 1
+ */
+void sha256MultiBuffer(const HashInput *inputs, size_t count, Digest *digests);
+
+/**
+ * @brief Get the canonical name of an I/O backend
+ * @param backend I/O backend
+ * @return Backend name ("stream", "mmap" or "io_uring")
+ */
+string ioBackendName(IoBackend backend);
+
+/**
+ * @brief Parse an I/O backend name
+ * @param name Backend name as returned by ioBackendName
+ * @return Parsed backend
+ * @throws runtime_error If the name is unknown
+ */
+IoBackend parseIoBackend(const string &name);
+
+/**
+ * @brief Get the canonical name of a symlink policy
+ * @param policy Symlink policy
+ * @return Policy name ("follow" or "skip")
+ */
+string symlinkPolicyName(SymlinkPolicy policy);
+
+/**
+ * @brief Parse a symlink policy name
+ * @param name Policy name as returned by symlinkPolicyName
+ * @return Parsed policy
+ * @throws runtime_error If the name is unknown
+ */
+SymlinkPolicy parseSymlinkPolicy(const string &name);
+
+/**
+ * @brief Get the canonical name of a hard link policy
+ * @param policy Hard link policy
+ * @return Policy name ("each" or "share")
+ */
+string hardlinkPolicyName(HardlinkPolicy policy);
+
+/**
+ * @brief Parse a hard link policy name
+ * @param name Policy name as returned by hardlinkPolicyName
+ * @return Parsed policy
+ * @throws runtime_error If the name is unknown
+ */
+HardlinkPolicy parseHardlinkPolicy(const string &name);
+
+/**
+ * @brief Check an inclusion proof against a root hash
+ * @param rootHash Trusted root hash (e.g. a published one)
+ * @param proof Binary proof as returned by MerkleTree::prove
+ * @return True if the proof is well-formed and leads to the root hash
+ *
+ * Decode the proof with InclusionProof::decode to see which path and hash
+ * it proves.
+ */
+bool verifyProof(const Digest &rootHash, const vector<uint8_t> &proof);
+
+/**
+ * @brief Get the canonical name of a change type
+ * @param type Change type
+ * @return Name ("added", "removed" or "modified")
+ */
+string changeTypeName(ChangeType type);
+
+/**
+ * @brief Get the canonical name of a chunking mode
+ * @param mode Chunking mode
+ * @return Mode name ("fixed" or "cdc")
+ */
+string chunkingModeName(ChunkingMode mode);
+
+/**
+ * @brief Parse a chunking mode name
+ * @param name Mode name as returned by chunkingModeName
+ * @return Parsed mode
+ * @throws runtime_error If the name is unknown
+ */
+ChunkingMode parseChunkingMode(const string &name);
+
+/**
+ * @brief Get the canonical name of a JSON export format
+ * @param format Export format
+ * @return Format name ("tree" or "ndjson")
+ */
+string jsonFormatName(JsonFormat format);
+
+/**
+ * @brief Parse a JSON export format name
+ * @param name Format name as returned by jsonFormatName
+ * @return Parsed format
+ * @throws runtime_error If the name is unknown
+ */
+JsonFormat parseJsonFormat(const string &name);
+
 /**
  * @brief Utility function to get file extension
  * @param filename Name of the file
@@ -300,8 +3884,45 @@ namespace MTFSConstants
     const size_t DEFAULT_CHUNK_SIZE = 1024 * 1024;   // Default chunk size (1MB)
     const size_t MAX_CHUNK_SIZE = 100 * 1024 * 1024; // Maximum chunk size (100MB)
     const size_t MIN_CHUNK_SIZE = 1024;              // Minimum chunk size (1KB)
-    const int MAX_TREE_DEPTH = 10;                   // Maximum allowed tree depth
+    const size_t DEFAULT_THREAD_COUNT = 1;           // Default build threads (serial)
+    const size_t MAX_THREAD_COUNT = 1024;            // Maximum build threads
     const string MTFS_VERSION = "1.0";               // MTFS version
+    const uint32_t SNAPSHOT_VERSION = 5;             // Snapshot file format version
+    const size_t BLAKE3_PARALLEL_THRESHOLD = 128 * 1024; // Buffers hashed multithreaded by BLAKE3 (TBB builds)
+    const size_t SMALL_FILE_SIZE = 16 * 1024;            // Files (and chunks) up to this size are hashed in batches
+    const size_t HASH_BATCH_SIZE = 64;                   // Messages per hashMany batch
+    const size_t HASH_PIECE_SIZE = 1024 * 1024;          // Bytes hashed per step while streaming a file
+    const size_t MMAP_MIN_SIZE = 256 * 1024;             // Smaller files are read, not mapped (mmap backend)
+    const unsigned IO_RING_ENTRIES = 64;                 // Reads in flight per io_uring
+    const size_t IO_RING_BUFFER_SIZE = 2 * 1024 * 1024;  // Registered buffer per io_uring
+    const size_t IO_RING_READ_SIZE = 128 * 1024;         // Read size for large files (io_uring backend)
+    const size_t DEFAULT_CDC_MIN_SIZE = 16 * 1024;       // Default smallest content-defined chunk
+    const size_t DEFAULT_CDC_AVERAGE_SIZE = 64 * 1024;   // Default expected content-defined chunk size
+    const size_t DEFAULT_CDC_MAX_SIZE = 256 * 1024;      // Default largest content-defined chunk
+    const size_t CDC_WINDOW_SIZE = 64;                   // Bytes that influence a Gear fingerprint
+    const size_t VERIFY_TASK_SIZE = 8 * 1024 * 1024;     // Bytes re-read per verifyContents task
+    const size_t JSON_BUFFER_SIZE = 64 * 1024;           // Text buffered by a JsonWriter
+    const size_t MAX_FRAME_SIZE = 16 * 1024 * 1024;      // Largest request accepted by the daemon
+    const size_t DEFAULT_SERVER_WORKERS = 4;             // Threads running daemon commands
+    const size_t DEFAULT_WATCH_DEBOUNCE_MS = 10;         // Quiet time that ends a batch of watch events
+    const size_t MAX_WATCH_DELAY_MS = 250;               // Longest a watch event waits to be applied
+    const size_t WATCH_EVENT_BUFFER_SIZE = 64 * 1024;    // Bytes of inotify events read at once
+    const size_t MAX_TRACE_EVENTS = 1 << 20;             // Trace events kept per profile
+    const size_t DIRENT_BUFFER_SIZE = 128 * 1024;        // Bytes of directory entries read per getdents64
+    const uint32_t HASH_CACHE_VERSION = 1;               // Hash cache file format version
+    const uint32_t SYNC_STREAM_VERSION = 1;              // Chunk stream format version
+    const int64_t HASH_CACHE_SETTLE_NS = 1000000000;     // Files changed more recently are not cached
+    const size_t HASH_CACHE_FLUSH_SIZE = 256 * 1024;     // Bytes of records buffered before an append
+    const size_t HASH_CACHE_COMPACT_MIN = 4096;          // Records before a mostly superseded log is rewritten
+    const size_t JOB_PROGRESS_INTERVAL_MS = 200;         // Time between the progress events of a job
+    const size_t JOB_HISTORY_SIZE = 64;                  // Finished jobs kept for the job command
+    const size_t SNAPSHOT_WRITE_BUFFER = 256 * 1024;     // Bytes buffered per table by a SnapshotWriter
+    const size_t SPILL_BUFFER_SIZE = 64 * 1024;          // Bytes buffered per spill segment written or read
+    const size_t BOUNDED_NODE_OVERHEAD = 128;            // Estimated allocator and map cost of a node (buildBounded)
+
+    static_assert(HASH_BATCH_SIZE * (SMALL_FILE_SIZE + 1) <= IO_RING_BUFFER_SIZE,
+                  "A batch of small files must fit in the io_uring buffer");
+    static_assert(HASH_BATCH_SIZE <= IO_RING_ENTRIES, "A batch of small files must fit in the io_uring");
 }
 
 #endif
\ No newline at end of file
@@ -1,25 +1,81 @@
 #include "merkle.hpp"
-#include <openssl/sha.h>
 #include <sstream>
 #include <iomanip>
 #include <algorithm>
 #include <stdexcept>
 
+/**
+ * @brief Start hashing a directory
+ * @param engine Hash engine of the tree
+ * @param directoryName Name of the directory (used when it has no children)
+ */
+DirectoryHasher::DirectoryHasher(const HashEngine &engine, string_view directoryName)
+    : context(engine.createContext()), directoryName(directoryName), empty(true)
+{
+}
+
+/**
+ * @brief Add the record of one child
+ * @param childName Name of the child
+ * @param childHash Merkle hash of the child
+ */
+void DirectoryHasher::add(string_view childName, const Digest &childHash)
+{
+    char hex[2 * sizeof(Digest)];
+    toHex(childHash, hex);
+
+    context->update(childName.data(), childName.length());
+    context->update(":", 1);
+    context->update(hex, sizeof(hex));
+    context->update(";", 1);
+    empty = false;
+}
+
+/**
+ * @brief Finish hashing
+ * @return Merkle hash of the directory
+ */
+Digest DirectoryHasher::finish()
+{
+    if (empty)
+    {
+        context->update(directoryName.data(), directoryName.length());
+    }
+
+    return context->finish();
+}
+
 /**
  * @brief Constructor for MerkleNode
  * @param name Name of the file or directory
  * @param isFile True if this represents a file, false for directory
  */
 MerkleNode::MerkleNode(const string &name, bool isFile)
-    : name(name), isFile(isFile), fileSize(0), cachedDepth(-1)
+    : name(name), parent(nullptr), isFile(isFile), fileSize(0), totalsValid(false)
 {
+    BuildProfiler::count(ProfileCounter::NODES_ALLOCATED);
+
     // Initialize empty hash - will be calculated later
-    hash = "";
-    contentHash = "";
+    hash.fill(0);
+    contentHash.fill(0);
     chunkHashes.clear();
     children.clear();
 }
 
+/**
+ * @brief Destructor; detaches the children, which may outlive this node
+ */
+MerkleNode::~MerkleNode()
+{
+    for (const auto &child : children)
+    {
+        if (child.second->parent == this)
+        {
+            child.second->parent = nullptr;
+        }
+    }
+}
+
 /**
  * @brief Add a child node to this MerkleNode
  * @param child Shared pointer to the child node to add
@@ -37,85 +93,132 @@ void MerkleNode::addChild(const shared_ptr<MerkleNode> &child)
         throw runtime_error("Cannot add null child to node: " + name);
     }
 
-    children[child->name] = child;
-    // Reset cached depth when structure changes
-    cachedDepth = -1;
+    auto &slot = children[child->name];
+    if (slot && slot != child && slot->parent == this)
+    {
+        slot->parent = nullptr;
+    }
+    slot = child;
+    child->parent = this;
+
+    // Totals are recomputed on the next query or hash
+    invalidateTotals();
 }
 
 /**
- * @brief Calculate the Merkle hash of this node
- * @return String containing the calculated hash
- *
- * For files: Returns the content hash
- * For directories: Calculates hash based on sorted children hashes
+ * @brief Remove a child node, if present
+ * @param childName Name of the child to remove
  */
-string MerkleNode::calculateHash()
+void MerkleNode::removeChild(const string &childName)
 {
-    if (isFile)
+    auto it = children.find(childName);
+    if (it == children.end())
     {
-        // For files, the hash is the content hash
-        hash = contentHash;
-        return hash;
+        return;
     }
-    else
+
+    if (it->second->parent == this)
+    {
+        it->second->parent = nullptr;
+    }
+    children.erase(it);
+    invalidateTotals();
+}
+
+/**
+ * @brief Remove every child node
+ */
+void MerkleNode::clearChildren()
+{
+    for (const auto &child : children)
     {
-        // For directories, calculate hash based on sorted children
-        if (children.empty())
+        if (child.second->parent == this)
         {
-            // Empty directory gets hash of its name
-            hash = sha256(name);
-            return hash;
+            child.second->parent = nullptr;
         }
+    }
+    children.clear();
+    invalidateTotals();
+}
 
-        // Sort children by name for consistent hashing
-        vector<string> sortedNames;
-        for (const auto &child : children)
+/**
+ * @brief Calculate the Merkle hash of this node
+ * @param engine Hash engine of the tree
+ * @return Digest of the calculated hash
+ *
+ * For files: Returns the root of the chunk tree (ChunkTree)
+ * For directories: Calculates hash based on sorted children hashes
+ */
+Digest MerkleNode::calculateHash(const HashEngine &engine)
+{
+    // Post-order with an explicit stack: a directory is hashed once all its
+    // children are, without a call frame per level
+    vector<pair<MerkleNode *, bool>> stack{{this, false}};
+    while (!stack.empty())
+    {
+        MerkleNode *node = stack.back().first;
+        if (node->isFile || stack.back().second)
         {
-            sortedNames.push_back(child.first);
+            node->updateHash(engine);
+            stack.pop_back();
+            continue;
         }
-        sort(sortedNames.begin(), sortedNames.end());
 
-        // Concatenate all children hashes
-        string combined = "";
-        for (const string &childName : sortedNames)
+        stack.back().second = true;
+        for (const auto &child : node->children)
         {
-            auto child = children[childName];
-            string childHash = child->calculateHash();
-            combined += childName + ":" + childHash + ";";
+            stack.emplace_back(child.second.get(), false);
         }
-
-        // Hash the combined string
-        hash = sha256(combined);
-        return hash;
     }
+
+    return hash;
 }
 
 /**
- * @brief Get the depth of this node in the tree
- * @return Depth level (0 for root)
+ * @brief Recalculate the hash of this node from its children's cached hashes
+ * @param engine Hash engine of the tree
+ * @return Digest of the calculated hash
  */
-int MerkleNode::getDepth() const
+Digest MerkleNode::updateHash(const HashEngine &engine)
 {
-    if (cachedDepth != -1)
+    // Hashing runs children first, so the totals are refreshed on the way up
+    SubtreeTotals updated;
+    if (collect_totals(updated))
     {
-        return cachedDepth;
+        if (totalsValid && updated != totals && parent)
+        {
+            parent->invalidateTotals();
+        }
+        totals = updated;
+        totalsValid = true;
     }
 
-    if (children.empty())
+    if (isFile)
     {
-        cachedDepth = 0;
-        return cachedDepth;
+        // The chunk tree root; an empty file has no chunks and keeps its content hash
+        hash = chunkHashes.empty() ? contentHash : ChunkTree::root(engine, chunkHashes);
+        return hash;
     }
 
-    int maxChildDepth = 0;
+    // std::map already iterates children in name order; an empty
+    // directory gets the hash of its name
+    DirectoryHasher hasher(engine, name);
     for (const auto &child : children)
     {
-        int childDepth = child.second->getDepth();
-        maxChildDepth = max(maxChildDepth, childDepth);
+        hasher.add(child.first, child.second->hash);
     }
 
-    cachedDepth = maxChildDepth + 1;
-    return cachedDepth;
+    hash = hasher.finish();
+    return hash;
+}
+
+/**
+ * @brief Get the depth of this node in the tree
+ * @return Height of the subtree (0 for a leaf)
+ */
+int MerkleNode::getDepth() const
+{
+    return getTotals().depth;
 }
 
 /**
@@ -133,18 +236,7 @@ bool MerkleNode::isLeaf() const
  */
 size_t MerkleNode::getTotalSize() const
 {
-    if (isFile)
-    {
-        return fileSize;
-    }
-
-    size_t totalSize = 0;
-    for (const auto &child : children)
-    {
-        totalSize += child.second->getTotalSize();
-    }
-
-    return totalSize;
+    return getTotals().totalSize;
 }
 
 /**
@@ -153,39 +245,98 @@ size_t MerkleNode::getTotalSize() const
  */
 size_t MerkleNode::getFileCount() const
 {
-    if (isFile)
+    return getTotals().fileCount;
+}
+
+/**
+ * @brief Get the number of directories under this node
+ * @return Number of directories, this one included
+ */
+size_t MerkleNode::getDirectoryCount() const
+{
+    return getTotals().directoryCount;
+}
+
+/**
+ * @brief Get the aggregates of this node's subtree
+ * @return Totals, recomputed first for the stale part of the subtree
+ */
+const SubtreeTotals &MerkleNode::getTotals() const
+{
+    // Post-order with an explicit stack over the stale nodes only; valid
+    // subtrees are never entered
+    vector<const MerkleNode *> stack;
+    if (!totalsValid)
     {
-        return 1;
+        stack.push_back(this);
     }
 
-    size_t fileCount = 0;
-    for (const auto &child : children)
+    while (!stack.empty())
     {
-        fileCount += child.second->getFileCount();
+        const MerkleNode *node = stack.back();
+        if (node->collect_totals(node->totals))
+        {
+            node->totalsValid = true;
+            stack.pop_back();
+            continue;
+        }
+
+        for (const auto &child : node->children)
+        {
+            if (!child.second->totalsValid)
+            {
+                stack.push_back(child.second.get());
+            }
+        }
     }
 
-    return fileCount;
+    return totals;
 }
 
 /**
- * @brief Helper function to calculate SHA-256 hash of data
- * @param data Input data to hash
- * @return Hexadecimal string representation of the hash
+ * @brief Mark the totals of this node and its ancestors stale
  */
-string MerkleNode::sha256(const string &data)
+void MerkleNode::invalidateTotals()
 {
-    unsigned char hash[SHA256_DIGEST_LENGTH];
-    SHA256_CTX sha256_ctx;
-    SHA256_Init(&sha256_ctx);
-    SHA256_Update(&sha256_ctx, data.c_str(), data.length());
-    SHA256_Final(hash, &sha256_ctx);
+    // Ancestors of a stale node are already stale, so the walk stops there
+    for (MerkleNode *node = this; node && node->totalsValid; node = node->parent)
+    {
+        node->totalsValid = false;
+    }
+}
+
+/**
+ * @brief Add up the totals of the children
+ * @param result Receives the totals of this node
+ * @return False if a child's totals are stale
+ */
+bool MerkleNode::collect_totals(SubtreeTotals &result) const
+{
+    SubtreeTotals sum;
+    if (isFile)
+    {
+        sum.totalSize = fileSize;
+        sum.fileCount = 1;
+        result = sum;
+        return true;
+    }
 
-    // Convert to hex string
-    stringstream ss;
-    for (int i = 0; i < SHA256_DIGEST_LENGTH; ++i)
+    sum.directoryCount = 1;
+    int maxChildDepth = -1;
+    for (const auto &child : children)
     {
-        ss << hex << setw(2) << setfill('0') << (int)hash[i];
+        const MerkleNode &node = *child.second;
+        if (!node.totalsValid)
+        {
+            return false;
+        }
+        sum.totalSize += node.totals.totalSize;
+        sum.fileCount += node.totals.fileCount;
+        sum.directoryCount += node.totals.directoryCount;
+        maxChildDepth = max(maxChildDepth, node.totals.depth);
     }
+    sum.depth = maxChildDepth + 1;
 
-    return ss.str();
-}
\ No newline at end of file
+    result = sum;
+    return true;
+}
@@ -0,0 +1,1025 @@
+#include "merkle.hpp"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+    const char SNAPSHOT_MAGIC[8] = {'M', 'T', 'F', 'S', 'S', 'N', 'A', 'P'};
+
+    /**
+     * @brief Round an offset up to the table alignment
+     * @param offset Offset in bytes
+     * @return Offset aligned to 8 bytes
+     */
+    uint64_t alignOffset(uint64_t offset)
+    {
+        return (offset + 7) & ~uint64_t(7);
+    }
+
+    /**
+     * @brief Check that a table lies inside the snapshot file
+     * @param offset File offset of the table
+     * @param count Number of entries
+     * @param entrySize Size of one entry in bytes
+     * @param fileSize Size of the snapshot file
+     * @return True if the table fits
+     */
+    bool tableFits(uint64_t offset, uint64_t count, uint64_t entrySize, uint64_t fileSize)
+    {
+        return offset <= fileSize && count <= (fileSize - offset) / entrySize;
+    }
+
+    /**
+     * @brief Check that the node and child tables form a tree in pre-order
+     * @param header Header of the snapshot, with its tables already bounds-checked
+     * @param nodes Node table
+     * @param children Child index table
+     * @return True if every directory's child range lies inside the child
+     *         table and its children are the subtrees that follow it, in order
+     *
+     * Every child index is then above its parent's and below nodeCount, and
+     * each node has one parent, so walks of the tree always end.
+     */
+    bool inPreOrder(const SnapshotHeader &header, const FlatNode *nodes, const uint32_t *children)
+    {
+        // Subtree sizes, bottom-up: children always come after their parent
+        vector<uint32_t> subtreeNodes(header.nodeCount, 1);
+        for (uint64_t i = header.nodeCount; i > 0; --i)
+        {
+            uint32_t index = i - 1;
+            const FlatNode &record = nodes[index];
+            if (record.flags & FlatNode::FLAG_FILE)
+            {
+                continue;
+            }
+            if ((uint64_t)record.firstChild + record.childCount > header.childCount)
+            {
+                return false;
+            }
+
+            uint64_t next = (uint64_t)index + 1;
+            for (uint32_t c = 0; c < record.childCount; ++c)
+            {
+                uint32_t child = children[record.firstChild + c];
+                if (child != next || child >= header.nodeCount)
+                {
+                    return false;
+                }
+                next += subtreeNodes[child];
+            }
+            if (next > header.nodeCount)
+            {
+                return false;
+            }
+            subtreeNodes[index] = next - index;
+        }
+
+        return subtreeNodes[0] == header.nodeCount;
+    }
+
+    /**
+     * @brief Start the header of a snapshot
+     * @param rootPath Directory the tree was built from
+     * @param chunking Chunking the tree was built with
+     * @param algorithm Hash algorithm the tree was built with
+     * @return Header without counts, aggregates or offsets
+     */
+    SnapshotHeader newHeader(const string &rootPath, const ChunkingConfig &chunking, HashAlgorithm algorithm)
+    {
+        SnapshotHeader header{};
+        memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+        header.version = MTFSConstants::SNAPSHOT_VERSION;
+        header.headerSize = sizeof(SnapshotHeader);
+        header.chunkSize = chunking.chunkSize;
+        header.rootPathLength = rootPath.length();
+        header.hashAlgorithm = static_cast<uint32_t>(algorithm);
+        header.chunkingMode = static_cast<uint32_t>(chunking.mode);
+        if (chunking.mode == ChunkingMode::CDC)
+        {
+            header.cdcMinSize = chunking.minSize;
+            header.cdcAverageSize = chunking.averageSize;
+            header.cdcMaxSize = chunking.maxSize;
+        }
+        return header;
+    }
+
+    /**
+     * @brief Lay the tables out after the header
+     * @param header Header with its counts set; receives the offsets and file size
+     */
+    void layOutTables(SnapshotHeader &header)
+    {
+        uint64_t offset = alignOffset(sizeof(SnapshotHeader));
+        header.nodeOffset = offset;
+        offset = alignOffset(offset + header.nodeCount * sizeof(FlatNode));
+        header.statOffset = offset;
+        offset = alignOffset(offset + header.nodeCount * sizeof(FileStat));
+        header.childOffset = offset;
+        offset = alignOffset(offset + header.childCount * sizeof(uint32_t));
+        header.digestOffset = offset;
+        offset = alignOffset(offset + header.digestCount * sizeof(Digest));
+        header.stringOffset = offset;
+        header.fileSize = offset + header.stringBytes;
+    }
+}
+
+/**
+ * @brief Construct an empty flat tree
+ */
+FlatTree::FlatTree()
+    : info{}, nodeTable(nullptr), statTable(nullptr), childTable(nullptr),
+      digestTable(nullptr), stringPool(nullptr), mapping(nullptr), mappingSize(0)
+{
+}
+
+/**
+ * @brief Release the file mapping, if any
+ */
+FlatTree::~FlatTree()
+{
+    if (mapping)
+    {
+        munmap(mapping, mappingSize);
+    }
+}
+
+/**
+ * @brief Convert a node graph into an owned flat tree
+ * @param root Root node of the tree
+ * @param rootPath Directory the tree was built from
+ * @param chunking Chunking the tree was built with
+ * @param algorithm Hash algorithm the tree was built with
+ * @return Flat tree holding a copy of the graph
+ * @throws runtime_error If the tree does not fit the 32-bit tables
+ */
+unique_ptr<FlatTree> FlatTree::fromNodes(const shared_ptr<MerkleNode> &root, const string &rootPath,
+                                         const ChunkingConfig &chunking, HashAlgorithm algorithm)
+{
+    if (!root)
+    {
+        throw runtime_error("Cannot flatten an empty tree");
+    }
+
+    auto tree = unique_ptr<FlatTree>(new FlatTree());
+    tree->info = newHeader(rootPath, chunking, algorithm);
+    tree->info.treeDepth = root->getDepth();
+
+    tree->ownedStrings = rootPath;
+    tree->appendNode(root);
+
+    if (tree->ownedStrings.size() > UINT32_MAX || tree->ownedDigests.size() > UINT32_MAX)
+    {
+        throw runtime_error("Tree is too large for the snapshot format");
+    }
+
+    tree->info.nodeCount = tree->ownedNodes.size();
+    tree->info.childCount = tree->ownedChildren.size();
+    tree->info.digestCount = tree->ownedDigests.size();
+    tree->info.stringBytes = tree->ownedStrings.size();
+    layOutTables(tree->info);
+
+    tree->attachOwned();
+    return tree;
+}
+
+/**
+ * @brief Append a subtree to the owned tables in pre-order
+ * @param node Node to append
+ * @return Index of the appended node
+ */
+uint32_t FlatTree::appendNode(const shared_ptr<MerkleNode> &node)
+{
+    // Appends one node; a directory's child range is reserved and filled as its children follow
+    auto appendOne = [this](const MerkleNode &current) -> uint32_t
+    {
+        if (ownedNodes.size() >= UINT32_MAX)
+        {
+            throw runtime_error("Tree is too large for the snapshot format");
+        }
+
+        if (current.name.length() > UINT16_MAX)
+        {
+            throw runtime_error("Name too long for the snapshot format: " + current.name);
+        }
+
+        uint32_t index = ownedNodes.size();
+
+        FlatNode record{};
+        record.hash = current.hash;
+        record.nameOffset = ownedStrings.size();
+        record.nameLength = current.name.length();
+        ownedStrings += current.name;
+
+        if (current.isFile)
+        {
+            record.flags = FlatNode::FLAG_FILE;
+            record.fileSize = current.fileSize;
+            record.firstDigest = ownedDigests.size();
+            record.chunkCount = current.chunkHashes.size();
+
+            ownedDigests.push_back(current.contentHash);
+            ownedDigests.insert(ownedDigests.end(), current.chunkHashes.begin(), current.chunkHashes.end());
+
+            info.totalFiles++;
+            info.totalSize += current.fileSize;
+        }
+        else
+        {
+            record.firstChild = ownedChildren.size();
+            record.childCount = current.children.size();
+            ownedChildren.resize(ownedChildren.size() + current.children.size());
+
+            info.totalDirectories++;
+        }
+
+        ownedNodes.push_back(record);
+        ownedStats.push_back(current.fileStat);
+        return index;
+    };
+
+    struct Level
+    {
+        const MerkleNode *node;                                    // Directory being appended
+        map<string, shared_ptr<MerkleNode>>::const_iterator next; // Its next child to append
+        uint32_t position;                                         // Child table entry of that child
+    };
+
+    uint32_t index = appendOne(*node);
+    vector<Level> stack;
+    if (!node->isFile)
+    {
+        stack.push_back({node.get(), node->children.begin(), ownedNodes[index].firstChild});
+    }
+
+    while (!stack.empty())
+    {
+        Level &level = stack.back();
+        if (level.next == level.node->children.end())
+        {
+            stack.pop_back();
+            continue;
+        }
+
+        const MerkleNode &child = *(level.next++)->second;
+        uint32_t childIndex = appendOne(child);
+        ownedChildren[level.position++] = childIndex;
+        if (!child.isFile)
+        {
+            stack.push_back({&child, child.children.begin(), ownedNodes[childIndex].firstChild});
+        }
+    }
+
+    return index;
+}
+
+/**
+ * @brief Point the table views at the owned storage
+ */
+void FlatTree::attachOwned()
+{
+    nodeTable = ownedNodes.data();
+    statTable = ownedStats.data();
+    childTable = ownedChildren.data();
+    digestTable = ownedDigests.data();
+    stringPool = ownedStrings.data();
+}
+
+/**
+ * @brief Memory-map a snapshot file
+ * @param path Path of the snapshot file
+ * @return Flat tree backed by the mapping
+ * @throws runtime_error If the file cannot be mapped or is not a valid snapshot
+ */
+unique_ptr<FlatTree> FlatTree::mapFile(const string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        throw runtime_error("Cannot open snapshot: " + path);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SnapshotHeader))
+    {
+        close(fd);
+        throw runtime_error("Invalid snapshot file: " + path);
+    }
+
+    void *base = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        throw runtime_error("Cannot map snapshot: " + path);
+    }
+
+    auto tree = unique_ptr<FlatTree>(new FlatTree());
+    tree->mapping = base;
+    tree->mappingSize = st.st_size;
+
+    const SnapshotHeader &header = *static_cast<const SnapshotHeader *>(base);
+    uint64_t fileSize = st.st_size;
+
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0)
+    {
+        throw runtime_error("Not an MTFS snapshot: " + path);
+    }
+
+    if (header.version != MTFSConstants::SNAPSHOT_VERSION || header.headerSize != sizeof(SnapshotHeader))
+    {
+        throw runtime_error("Unsupported snapshot version in " + path);
+    }
+
+    if (header.fileSize != fileSize || header.nodeCount == 0 ||
+        !tableFits(header.nodeOffset, header.nodeCount, sizeof(FlatNode), fileSize) ||
+        !tableFits(header.statOffset, header.nodeCount, sizeof(FileStat), fileSize) ||
+        !tableFits(header.childOffset, header.childCount, sizeof(uint32_t), fileSize) ||
+        !tableFits(header.digestOffset, header.digestCount, sizeof(Digest), fileSize) ||
+        !tableFits(header.stringOffset, header.stringBytes, 1, fileSize) ||
+        header.rootPathLength > header.stringBytes ||
+        header.nodeOffset % 8 != 0 || header.statOffset % 8 != 0 || header.childOffset % 4 != 0)
+    {
+        throw runtime_error("Corrupt snapshot file: " + path);
+    }
+
+    const char *bytes = static_cast<const char *>(base);
+    tree->info = header;
+    tree->nodeTable = reinterpret_cast<const FlatNode *>(bytes + header.nodeOffset);
+    tree->statTable = reinterpret_cast<const FileStat *>(bytes + header.statOffset);
+    tree->childTable = reinterpret_cast<const uint32_t *>(bytes + header.childOffset);
+    tree->digestTable = reinterpret_cast<const Digest *>(bytes + header.digestOffset);
+    tree->stringPool = bytes + header.stringOffset;
+
+    // Walks trust the shape of the tree, so a snapshot from elsewhere is checked once here
+    if (!inPreOrder(header, tree->nodeTable, tree->childTable))
+    {
+        throw runtime_error("Corrupt snapshot file: " + path);
+    }
+
+    return tree;
+}
+
+/**
+ * @brief Write the flat tree to a snapshot file
+ * @param path Path of the snapshot file
+ * @throws runtime_error If the file cannot be written
+ */
+void FlatTree::writeFile(const string &path) const
+{
+    // Write to a temporary file and rename, so a mapped snapshot at the
+    // same path is never truncated under its readers
+    string tempPath = path + ".tmp";
+    ofstream file(tempPath, ios::binary | ios::trunc);
+    if (!file.is_open())
+    {
+        throw runtime_error("Cannot create snapshot: " + path);
+    }
+
+    auto writeTable = [&file](uint64_t offset, const void *data, uint64_t length)
+    {
+        static const char padding[8] = {};
+        uint64_t position = file.tellp();
+        file.write(padding, offset - position);
+        file.write(static_cast<const char *>(data), length);
+    };
+
+    file.write(reinterpret_cast<const char *>(&info), sizeof(info));
+    writeTable(info.nodeOffset, nodeTable, info.nodeCount * sizeof(FlatNode));
+    writeTable(info.statOffset, statTable, info.nodeCount * sizeof(FileStat));
+    writeTable(info.childOffset, childTable, info.childCount * sizeof(uint32_t));
+    writeTable(info.digestOffset, digestTable, info.digestCount * sizeof(Digest));
+    writeTable(info.stringOffset, stringPool, info.stringBytes);
+    file.close();
+
+    if (!file)
+    {
+        fs::remove(tempPath);
+        throw runtime_error("Error writing snapshot: " + path);
+    }
+
+    fs::rename(tempPath, path);
+}
+
+/**
+ * @brief Get the snapshot header (counts, aggregates and offsets)
+ * @return Reference to the header
+ */
+const SnapshotHeader &FlatTree::header() const
+{
+    return info;
+}
+
+/**
+ * @brief Get a node record
+ * @param index Node index (0 is the root)
+ * @return Reference to the node record
+ * @throws runtime_error If the index is out of range
+ */
+const FlatNode &FlatTree::node(uint32_t index) const
+{
+    if (index >= info.nodeCount)
+    {
+        throw runtime_error("Snapshot node index out of range: " + to_string(index));
+    }
+
+    return nodeTable[index];
+}
+
+/**
+ * @brief Get the stat record of a node
+ * @param index Node index
+ * @return Reference to the metadata recorded for the node
+ */
+const FileStat &FlatTree::stat(uint32_t index) const
+{
+    node(index);
+    return statTable[index];
+}
+
+/**
+ * @brief Get the name of a node
+ * @param index Node index
+ * @return View of the name in the string pool
+ */
+string_view FlatTree::name(uint32_t index) const
+{
+    const FlatNode &record = node(index);
+    if ((uint64_t)record.nameOffset + record.nameLength > info.stringBytes)
+    {
+        throw runtime_error("Snapshot name out of range for node " + to_string(index));
+    }
+
+    return string_view(stringPool + record.nameOffset, record.nameLength);
+}
+
+/**
+ * @brief Get the index of a directory's n-th child
+ * @param index Node index of the directory
+ * @param position Position among the children (name order)
+ * @return Node index of the child
+ */
+uint32_t FlatTree::child(uint32_t index, uint32_t position) const
+{
+    const FlatNode &record = node(index);
+    uint64_t entry = (uint64_t)record.firstChild + position;
+    if (position >= record.childCount || entry >= info.childCount)
+    {
+        throw runtime_error("Snapshot child out of range for node " + to_string(index));
+    }
+
+    return childTable[entry];
+}
+
+/**
+ * @brief Get a digest from the digest table
+ * @param position Entry in the digest table
+ * @return Reference to the digest
+ */
+const Digest &FlatTree::digest(uint32_t position) const
+{
+    if (position >= info.digestCount)
+    {
+        throw runtime_error("Snapshot digest index out of range: " + to_string(position));
+    }
+
+    return digestTable[position];
+}
+
+/**
+ * @brief Get the directory the tree was built from
+ * @return Root path
+ */
+string FlatTree::rootPath() const
+{
+    return string(stringPool, info.rootPathLength);
+}
+
+/**
+ * @brief Find the first node with a name, in pre-order (as
+ *        MerkleTree::findNode)
+ * @param name Name to search for
+ * @param index Receives the node index on success
+ * @return True if a node was found
+ */
+bool FlatTree::find(string_view name, uint32_t &index) const
+{
+    const vector<uint32_t> *matches = nodesNamed(name);
+    if (!matches)
+    {
+        return false;
+    }
+
+    index = matches->front();
+    return true;
+}
+
+/**
+ * @brief Find every node with a name
+ * @param name Name to search for
+ * @return Node indices in pre-order
+ */
+vector<uint32_t> FlatTree::findAll(string_view name) const
+{
+    const vector<uint32_t> *matches = nodesNamed(name);
+    return matches ? *matches : vector<uint32_t>();
+}
+
+/**
+ * @brief Find a node by its path
+ * @param path Path relative to the root, with '/' separators ("" for the root)
+ * @param index Receives the node index on success
+ * @param chain Receives the node indices from the root down to the node, or nullptr
+ * @return True if the path is in the tree
+ */
+bool FlatTree::findPath(string_view path, uint32_t &index, vector<uint32_t> *chain) const
+{
+    uint32_t current = 0;
+    if (chain)
+    {
+        chain->assign(1, current);
+    }
+    while (!path.empty())
+    {
+        size_t slash = path.find('/');
+        string_view component = path.substr(0, slash);
+        path = slash == string_view::npos ? string_view() : path.substr(slash + 1);
+
+        const FlatNode &record = node(current);
+        if (record.flags & FlatNode::FLAG_FILE)
+        {
+            return false;
+        }
+
+        // Binary search over the children, which are in name order
+        uint32_t low = 0, high = record.childCount;
+        while (low < high)
+        {
+            uint32_t middle = low + (high - low) / 2;
+            if (name(child(current, middle)) < component)
+            {
+                low = middle + 1;
+            }
+            else
+            {
+                high = middle;
+            }
+        }
+
+        if (low == record.childCount || name(child(current, low)) != component)
+        {
+            return false;
+        }
+        current = child(current, low);
+        if (chain)
+        {
+            chain->push_back(current);
+        }
+    }
+
+    index = current;
+    return true;
+}
+
+/**
+ * @brief Get the nodes with a name, indexing all names on first use
+ * @param name Name to look up
+ * @return Node indices in pre-order, or nullptr if there are none
+ *
+ * Nodes are stored in pre-order, so one scan of the node table lists
+ * every name's nodes in that order. Names point into the string pool,
+ * which lives as long as the tree. The index is never changed once
+ * built, so concurrent lookups only wait for the first one.
+ */
+const vector<uint32_t> *FlatTree::nodesNamed(string_view name) const
+{
+    call_once(nameIndexBuilt, [this]()
+              {
+                  for (uint32_t i = 0; i < info.nodeCount; ++i)
+                  {
+                      nameIndex[this->name(i)].push_back(i);
+                  }
+              });
+
+    auto it = nameIndex.find(name);
+    return it != nameIndex.end() ? &it->second : nullptr;
+}
+
+/**
+ * @brief Create MerkleNode objects for a subtree
+ * @param index Node index of the subtree root
+ * @return Shared pointer to the materialized subtree
+ */
+shared_ptr<MerkleNode> FlatTree::materialize(uint32_t index) const
+{
+    auto makeNode = [this](uint32_t current)
+    {
+        const FlatNode &record = node(current);
+        bool isFile = record.flags & FlatNode::FLAG_FILE;
+
+        auto result = make_shared<MerkleNode>(string(name(current)), isFile);
+        result->hash = record.hash;
+        result->fileStat = stat(current);
+
+        if (isFile)
+        {
+            result->fileSize = record.fileSize;
+            result->contentHash = digest(record.firstDigest);
+            result->chunkHashes.reserve(record.chunkCount);
+            for (uint32_t i = 1; i <= record.chunkCount; ++i)
+            {
+                result->chunkHashes.push_back(digest(record.firstDigest + i));
+            }
+        }
+        return result;
+    };
+
+    struct Level
+    {
+        MerkleNode *node; // Directory being filled
+        uint32_t index;   // Its node index
+        uint32_t next;    // Position of the next child to create
+    };
+
+    auto root = makeNode(index);
+    vector<Level> stack;
+    if (!root->isFile)
+    {
+        stack.push_back({root.get(), index, 0});
+    }
+
+    while (!stack.empty())
+    {
+        Level &level = stack.back();
+        if (level.next == node(level.index).childCount)
+        {
+            stack.pop_back();
+            continue;
+        }
+
+        uint32_t childIndex = child(level.index, level.next++);
+        auto childNode = makeNode(childIndex);
+        level.node->addChild(childNode);
+        if (!childNode->isFile)
+        {
+            stack.push_back({childNode.get(), childIndex, 0});
+        }
+    }
+
+    return root;
+}
+
+/**
+ * @brief Count files, directories and bytes under a node
+ * @param index Node index of the subtree root
+ * @return Tuple containing (files, directories, total_size)
+ */
+tuple<size_t, size_t, size_t> FlatTree::subtreeStats(uint32_t index) const
+{
+    size_t files = 0, directories = 0, totalSize = 0;
+
+    vector<uint32_t> stack = {index};
+    while (!stack.empty())
+    {
+        const FlatNode &record = node(stack.back());
+        uint32_t current = stack.back();
+        stack.pop_back();
+
+        if (record.flags & FlatNode::FLAG_FILE)
+        {
+            files++;
+            totalSize += record.fileSize;
+            continue;
+        }
+
+        directories++;
+        for (uint32_t i = 0; i < record.childCount; ++i)
+        {
+            stack.push_back(child(current, i));
+        }
+    }
+
+    return make_tuple(files, directories, totalSize);
+}
+
+/**
+ * @brief Get the depth of a node, as MerkleNode::getDepth
+ * @param index Node index
+ * @return Depth level (0 for leaves)
+ */
+int FlatTree::depth(uint32_t index) const
+{
+    int deepest = 0;
+
+    // (node, levels below the starting node)
+    vector<pair<uint32_t, int>> stack = {{index, 0}};
+    while (!stack.empty())
+    {
+        auto [current, level] = stack.back();
+        stack.pop_back();
+        deepest = max(deepest, level);
+
+        const FlatNode &record = node(current);
+        for (uint32_t i = 0; i < record.childCount && !(record.flags & FlatNode::FLAG_FILE); ++i)
+        {
+            stack.push_back({child(current, i), level + 1});
+        }
+    }
+
+    return deepest;
+}
+
+/**
+ * @brief Check every node hash against its children, bottom-up
+ * @return True if all hashes are consistent
+ */
+bool FlatTree::verify() const
+{
+    const HashEngine &engine = HashEngine::get(static_cast<HashAlgorithm>(info.hashAlgorithm));
+
+    for (uint64_t i = info.nodeCount; i > 0; --i)
+    {
+        uint32_t index = i - 1;
+        const FlatNode &record = node(index);
+
+        if (record.flags & FlatNode::FLAG_FILE)
+        {
+            // Chunk tree root, or the content hash of an empty file
+            Digest expected = digest(record.firstDigest);
+            if (record.chunkCount > 0)
+            {
+                vector<Digest> chunkHashes;
+                chunkHashes.reserve(record.chunkCount);
+                for (uint32_t c = 1; c <= record.chunkCount; ++c)
+                {
+                    chunkHashes.push_back(digest(record.firstDigest + c));
+                }
+                expected = ChunkTree::root(engine, chunkHashes);
+            }
+
+            if (record.hash != expected)
+            {
+                return false;
+            }
+            continue;
+        }
+
+        DirectoryHasher hasher(engine, name(index));
+        for (uint32_t c = 0; c < record.childCount; ++c)
+        {
+            uint32_t childIndex = child(index, c);
+            hasher.add(name(childIndex), node(childIndex).hash);
+        }
+
+        Digest expected = hasher.finish();
+        if (record.hash != expected)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Get the memory used by the node tables
+ * @return Size of all tables in bytes
+ *
+ * 108 bytes per node (FlatNode, FileStat and child entry), plus the
+ * digests and the string pool. The name index is not counted.
+ */
+size_t FlatTree::memoryUsage() const
+{
+    return info.nodeCount * (sizeof(FlatNode) + sizeof(FileStat)) +
+           info.childCount * sizeof(uint32_t) +
+           info.digestCount * sizeof(Digest) +
+           info.stringBytes;
+}
+
+/**
+ * @brief Start a snapshot file
+ * @param path Path of the snapshot file (written to path + ".tmp" until finish)
+ * @param rootPath Directory the tree was built from
+ * @param chunking Chunking the tree was built with
+ * @param algorithm Hash algorithm the tree was built with
+ * @param totals Totals of the whole tree
+ * @throws runtime_error If the tree does not fit the 32-bit tables or the file cannot be created
+ */
+SnapshotWriter::SnapshotWriter(const string &path, const string &rootPath, const ChunkingConfig &chunking,
+                               HashAlgorithm algorithm, const SnapshotTotals &totals)
+    : path(path), tempPath(path + ".tmp"), fd(-1), info(newHeader(rootPath, chunking, algorithm)),
+      nodeTable{}, statTable{}, childTable{}, digestTable{}, stringTable{}, nodesAdded(0), childrenUsed(0),
+      digestsAdded(0), stringBytes(0)
+{
+    if (totals.nodes == 0 || totals.nodes > UINT32_MAX || totals.childEntries > UINT32_MAX ||
+        totals.digests > UINT32_MAX || rootPath.length() + totals.nameBytes > UINT32_MAX)
+    {
+        throw runtime_error("Tree is too large for the snapshot format");
+    }
+
+    info.nodeCount = totals.nodes;
+    info.childCount = totals.childEntries;
+    info.digestCount = totals.digests;
+    info.stringBytes = rootPath.length() + totals.nameBytes;
+    info.totalFiles = totals.files;
+    info.totalDirectories = totals.directories;
+    info.totalSize = totals.size;
+    info.treeDepth = totals.depth;
+    layOutTables(info);
+
+    nodeTable.offset = info.nodeOffset;
+    statTable.offset = info.statOffset;
+    childTable.offset = info.childOffset;
+    digestTable.offset = info.digestOffset;
+    stringTable.offset = info.stringOffset;
+
+    fd = ::open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0)
+    {
+        throw runtime_error("Cannot create snapshot: " + path);
+    }
+
+    append(stringTable, rootPath.data(), rootPath.length());
+    stringBytes = rootPath.length();
+}
+
+/**
+ * @brief Remove the unfinished file, if finish was not called
+ */
+SnapshotWriter::~SnapshotWriter()
+{
+    if (fd >= 0)
+    {
+        ::close(fd);
+        ::unlink(tempPath.c_str());
+    }
+}
+
+/**
+ * @brief Add a file node
+ * @param name Name of the file
+ * @param hash Merkle hash of the file
+ * @param fileStat Metadata recorded for the file
+ * @param fileSize Size of the file in bytes
+ * @param contentHash Hash of the file content
+ * @param chunks Chunk hashes of the file
+ * @param chunkCount Number of chunk hashes
+ * @throws runtime_error If the name is too long or a write fails
+ */
+void SnapshotWriter::addFile(const string &name, const Digest &hash, const FileStat &fileStat, uint64_t fileSize,
+                             const Digest &contentHash, const Digest *chunks, uint32_t chunkCount)
+{
+    if (digestsAdded + 1 + chunkCount > info.digestCount)
+    {
+        throw runtime_error("Snapshot totals do not match the tree: " + path);
+    }
+
+    FlatNode record{};
+    record.hash = hash;
+    record.flags = FlatNode::FLAG_FILE;
+    record.fileSize = fileSize;
+    record.firstDigest = digestsAdded;
+    record.chunkCount = chunkCount;
+    add_node(record, name, fileStat);
+
+    append(digestTable, &contentHash, sizeof(Digest));
+    append(digestTable, chunks, chunkCount * sizeof(Digest));
+    digestsAdded += 1 + chunkCount;
+}
+
+/**
+ * @brief Add a directory node; its children's subtrees follow it
+ * @param name Name of the directory
+ * @param hash Merkle hash of the directory
+ * @param fileStat Metadata recorded for the directory
+ * @param childNodes Node count of each child's subtree, in name order
+ * @throws runtime_error If the name is too long or a write fails
+ */
+void SnapshotWriter::addDirectory(const string &name, const Digest &hash, const FileStat &fileStat,
+                                  const vector<uint64_t> &childNodes)
+{
+    if (childrenUsed + childNodes.size() > info.childCount)
+    {
+        throw runtime_error("Snapshot totals do not match the tree: " + path);
+    }
+
+    uint64_t index = nodesAdded;
+    FlatNode record{};
+    record.hash = hash;
+    record.firstChild = childrenUsed;
+    record.childCount = childNodes.size();
+    add_node(record, name, fileStat);
+
+    // Pre-order: each child follows the subtrees of the siblings before it
+    uint64_t childIndex = index + 1;
+    for (uint64_t count : childNodes)
+    {
+        uint32_t entry = childIndex;
+        append(childTable, &entry, sizeof(entry));
+        childIndex += count;
+    }
+    childrenUsed += childNodes.size();
+}
+
+/**
+ * @brief Write the header and move the file into place
+ * @throws runtime_error If the nodes added do not match the totals or a write fails
+ */
+void SnapshotWriter::finish()
+{
+    if (nodesAdded != info.nodeCount || childrenUsed != info.childCount || digestsAdded != info.digestCount ||
+        stringBytes != info.stringBytes)
+    {
+        throw runtime_error("Snapshot totals do not match the tree: " + path);
+    }
+
+    flush(nodeTable);
+    flush(statTable);
+    flush(childTable);
+    flush(digestTable);
+    flush(stringTable);
+
+    // The gaps between tables are holes, which read as the zero padding of writeFile
+    Table header{0, vector<char>(reinterpret_cast<const char *>(&info), reinterpret_cast<const char *>(&info + 1))};
+    flush(header);
+    if (::ftruncate(fd, info.fileSize) != 0)
+    {
+        throw runtime_error("Error writing snapshot: " + path);
+    }
+
+    fs::rename(tempPath, path);
+    ::close(fd);
+    fd = -1;
+}
+
+/**
+ * @brief Append bytes to a table, writing it out when the buffer fills
+ * @param table Table to append to
+ * @param data Bytes to append
+ * @param length Number of bytes
+ * @throws runtime_error If a write fails
+ */
+void SnapshotWriter::append(Table &table, const void *data, size_t length)
+{
+    const char *bytes = static_cast<const char *>(data);
+    table.bytes.insert(table.bytes.end(), bytes, bytes + length);
+    if (table.bytes.size() >= MTFSConstants::SNAPSHOT_WRITE_BUFFER)
+    {
+        flush(table);
+    }
+}
+
+/**
+ * @brief Write the buffered bytes of a table
+ * @param table Table to flush
+ * @throws runtime_error If a write fails
+ */
+void SnapshotWriter::flush(Table &table)
+{
+    size_t done = 0;
+    while (done < table.bytes.size())
+    {
+        ssize_t written = ::pwrite(fd, table.bytes.data() + done, table.bytes.size() - done, table.offset + done);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            throw runtime_error("Error writing snapshot: " + path);
+        }
+        done += written;
+    }
+
+    table.offset += done;
+    table.bytes.clear();
+}
+
+/**
+ * @brief Add the record of a node and its name, checking it fits
+ * @param record Node record (nameOffset and nameLength are filled here)
+ * @param name Name of the node
+ * @param fileStat Metadata recorded for the node
+ * @throws runtime_error If there are more nodes than the totals or the name is too long
+ */
+void SnapshotWriter::add_node(FlatNode &record, const string &name, const FileStat &fileStat)
+{
+    if (nodesAdded == info.nodeCount || stringBytes + name.length() > info.stringBytes)
+    {
+        throw runtime_error("Snapshot totals do not match the tree: " + path);
+    }
+
+    if (name.length() > UINT16_MAX)
+    {
+        throw runtime_error("Name too long for the snapshot format: " + name);
+    }
+
+    record.nameOffset = stringBytes;
+    record.nameLength = name.length();
+    append(stringTable, name.data(), name.length());
+    stringBytes += name.length();
+
+    append(nodeTable, &record, sizeof(record));
+    append(statTable, &fileStat, sizeof(fileStat));
+    nodesAdded++;
+}
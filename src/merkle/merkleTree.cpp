@@ -1,15 +1,105 @@
 #include "merkle.hpp"
-#include <openssl/sha.h>
 #include <sstream>
 #include <iomanip>
 #include <algorithm>
 #include <stdexcept>
 #include <fstream>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace
+{
+    /**
+     * @brief Open a file for reading, counted in the OPEN phase
+     * @param path Path of the file
+     * @return Descriptor of the file, or -1 with errno set
+     */
+    int openFile(const string &path)
+    {
+        PhaseTimer timer(ProfilePhase::OPEN);
+        BuildProfiler::count(ProfileCounter::OPEN_CALLS);
+        return ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    }
+
+    /**
+     * @brief Fill a buffer from a stream, counted in the READ phase
+     * @param file Stream to read from
+     * @param buffer Buffer to fill
+     * @return The stream, to test for success
+     */
+    istream &timedRead(istream &file, vector<char> &buffer)
+    {
+        PhaseTimer timer(ProfilePhase::READ);
+        return file.read(buffer.data(), buffer.size());
+    }
+
+    /**
+     * @brief Throw for an entry that could not be typed
+     * @param path Filesystem path of the entry
+     * @param entry Entry from scanDirectory
+     * @throws runtime_error If the entry is MISSING
+     */
+    void requireEntry(const fs::path &path, const ScannedEntry &entry)
+    {
+        if (entry.type != EntryType::MISSING)
+        {
+            return;
+        }
+        if (entry.error == 0 || entry.error == ENOENT)
+        {
+            throw runtime_error("Path does not exist: " + path.string());
+        }
+        throw runtime_error("Cannot stat " + path.string() + ": " + strerror(entry.error));
+    }
+
+    /**
+     * @brief List a directory for a walk, naming it in the error
+     * @param path Filesystem path of the directory
+     * @param followSymlinks Type symlinks by their target
+     * @return Identity and entries of the directory
+     * @throws PathTooLong If the path is longer than the kernel accepts
+     * @throws runtime_error If the directory cannot be read
+     */
+    DirectoryListing listDirectory(const fs::path &path, bool followSymlinks)
+    {
+        try
+        {
+            return scanDirectory(path, followSymlinks);
+        }
+        catch (const PathTooLong &)
+        {
+            throw;
+        }
+        catch (const exception &e)
+        {
+            throw runtime_error("Error reading directory " + path.string() + ": " + e.what());
+        }
+    }
+
+    /**
+     * @brief Start a directory's trace event, if tracing
+     * @param path Filesystem path of the directory
+     * @return The span, or nullptr when not tracing (walks keep one per open level)
+     */
+    unique_ptr<TraceSpan> directorySpan(const fs::path &path)
+    {
+        return BuildProfiler::tracing() ? make_unique<TraceSpan>("directory", path.native()) : nullptr;
+    }
+}
 
 /**
  * @brief Default constructor for MerkleTree
  */
-MerkleTree::MerkleTree() : CHUNK_SIZE(MTFSConstants::DEFAULT_CHUNK_SIZE)
+MerkleTree::MerkleTree()
+    : CHUNK_SIZE(MTFSConstants::DEFAULT_CHUNK_SIZE), threadCount(MTFSConstants::DEFAULT_THREAD_COUNT),
+      chunkingMode(ChunkingMode::FIXED), cdcMinSize(MTFSConstants::DEFAULT_CDC_MIN_SIZE),
+      cdcAverageSize(MTFSConstants::DEFAULT_CDC_AVERAGE_SIZE), cdcMaxSize(MTFSConstants::DEFAULT_CDC_MAX_SIZE),
+      builtChunking{ChunkingMode::FIXED, 0, 0, 0, 0}, compactStorage(false),
+      hashEngine(&HashEngine::get(HashAlgorithm::SHA256)), ioBackend(IoBackend::STREAM),
+      rootDevice(0), jobControl(nullptr)
 {
     root = nullptr;
     file_objects.clear();
@@ -20,7 +110,33 @@ MerkleTree::MerkleTree() : CHUNK_SIZE(MTFSConstants::DEFAULT_CHUNK_SIZE)
  * @brief Constructor with custom chunk size
  * @param chunkSize Size of chunks for file processing (default: 1MB)
  */
-MerkleTree::MerkleTree(size_t chunkSize) : CHUNK_SIZE(chunkSize)
+MerkleTree::MerkleTree(size_t chunkSize)
+    : MerkleTree(chunkSize, MTFSConstants::DEFAULT_THREAD_COUNT)
+{
+}
+
+/**
+ * @brief Constructor with custom chunk size and build thread count
+ * @param chunkSize Size of chunks for file processing
+ * @param threadCount Worker threads for build_tree (1 = serial, 0 = all cores)
+ */
+MerkleTree::MerkleTree(size_t chunkSize, size_t threadCount)
+    : MerkleTree(chunkSize, threadCount, HashAlgorithm::SHA256)
+{
+}
+
+/**
+ * @brief Constructor with custom chunk size, thread count and hash algorithm
+ * @param chunkSize Size of chunks for file processing
+ * @param threadCount Worker threads for build_tree (1 = serial, 0 = all cores)
+ * @param algorithm Hash algorithm for every digest of the tree
+ * @throws runtime_error If the algorithm is not available in this build
+ */
+MerkleTree::MerkleTree(size_t chunkSize, size_t threadCount, HashAlgorithm algorithm)
+    : CHUNK_SIZE(chunkSize), chunkingMode(ChunkingMode::FIXED), cdcMinSize(MTFSConstants::DEFAULT_CDC_MIN_SIZE),
+      cdcAverageSize(MTFSConstants::DEFAULT_CDC_AVERAGE_SIZE), cdcMaxSize(MTFSConstants::DEFAULT_CDC_MAX_SIZE),
+      builtChunking{ChunkingMode::FIXED, 0, 0, 0, 0}, compactStorage(false), hashEngine(&HashEngine::get(algorithm)),
+      ioBackend(IoBackend::STREAM), rootDevice(0), jobControl(nullptr)
 {
     if (chunkSize < MTFSConstants::MIN_CHUNK_SIZE || chunkSize > MTFSConstants::MAX_CHUNK_SIZE)
     {
@@ -29,365 +145,2223 @@ MerkleTree::MerkleTree(size_t chunkSize) : CHUNK_SIZE(chunkSize)
                             to_string(MTFSConstants::MAX_CHUNK_SIZE) + " bytes");
     }
 
+    setThreadCount(threadCount);
+
     root = nullptr;
     file_objects.clear();
     nodes.clear();
 }
 
 /**
- * @brief Calculate SHA-256 hash of input data
+ * @brief Hash input data with the tree's hash engine
  * @param data Input data to hash
- * @return Hexadecimal string representation of the hash
+ * @return Digest of the hash
+ */
+Digest MerkleTree::hash_data(const string &data)
+{
+    return hash_data(data.data(), data.length());
+}
+
+/**
+ * @brief Hash a raw buffer with the tree's hash engine
+ * @param data Pointer to the input bytes
+ * @param length Number of bytes to hash
+ * @return Digest of the hash
+ */
+Digest MerkleTree::hash_data(const char *data, size_t length)
+{
+    return hashEngine->hash(data, length);
+}
+
+/**
+ * @brief Hash file content and split into chunks
+ * @param file_path Path to the file to process
+ * @return Tuple containing (content_hash, file_size, chunk_hashes)
+ * @throws runtime_error If file cannot be opened or read
+ *
+ * The file is read with the tree's I/O backend and every buffer is passed
+ * to a ChunkHasher, which hashes the chunks where they lie, so memory use
+ * stays bounded regardless of the file size. All backends produce the
+ * same hashes.
  */
-string MerkleTree::sha256(const string &data)
+tuple<Digest, size_t, vector<Digest>> MerkleTree::hash_file_content(const string &file_path)
 {
-    unsigned char hash[SHA256_DIGEST_LENGTH];
-    SHA256_CTX sha256_ctx;
-    SHA256_Init(&sha256_ctx);
-    SHA256_Update(&sha256_ctx, data.c_str(), data.length());
-    SHA256_Final(hash, &sha256_ctx);
+    return hash_file_content(file_path, getChunking());
+}
 
-    // Convert to hex string
-    stringstream ss;
-    for (int i = 0; i < SHA256_DIGEST_LENGTH; ++i)
+/**
+ * @brief Hash file content with a given chunking
+ * @param file_path Path to the file to process
+ * @param chunking How the file is split into chunks
+ * @param fileStat Metadata just read by the caller, or nullptr; saves the backend a stat
+ * @return Tuple containing (content_hash, file_size, chunk_hashes)
+ * @throws runtime_error If file cannot be opened or read
+ */
+tuple<Digest, size_t, vector<Digest>> MerkleTree::hash_file_content(const string &file_path,
+                                                                    const ChunkingConfig &chunking,
+                                                                    const FileStat *fileStat)
+{
+    switch (ioBackend)
     {
-        ss << hex << setw(2) << setfill('0') << (int)hash[i];
+    case IoBackend::MMAP:
+        return hash_file_mapped(file_path, chunking, fileStat);
+    case IoBackend::IO_URING:
+        return hash_file_uring(file_path, chunking, fileStat);
+    default:
+        return hash_file_stream(file_path, chunking, fileStat);
     }
-
-    return ss.str();
 }
 
 /**
- * @brief Hash file content and split into chunks
+ * @brief Hash a file read through an ifstream
  * @param file_path Path to the file to process
+ * @param chunking How the file is split into chunks
+ * @param fileStat Metadata just read by the caller, or nullptr to seek for the size
  * @return Tuple containing (content_hash, file_size, chunk_hashes)
  * @throws runtime_error If file cannot be opened or read
  */
-tuple<string, size_t, vector<string>> MerkleTree::hash_file_content(const string &file_path)
+tuple<Digest, size_t, vector<Digest>> MerkleTree::hash_file_stream(const string &file_path, const ChunkingConfig &chunking,
+                                                                   const FileStat *fileStat)
 {
-    ifstream file(file_path, ios::binary);
+    ifstream file;
+    {
+        PhaseTimer timer(ProfilePhase::OPEN);
+        BuildProfiler::count(ProfileCounter::OPEN_CALLS);
+        file.open(file_path, ios::binary);
+    }
     if (!file.is_open())
     {
         throw runtime_error("Cannot open file: " + file_path);
     }
 
     // Get file size
-    file.seekg(0, ios::end);
-    size_t fileSize = file.tellg();
-    file.seekg(0, ios::beg);
-
-    vector<string> chunkHashes;
-    string entireContent;
+    size_t fileSize;
+    if (fileStat)
+    {
+        fileSize = fileStat->size;
+    }
+    else
+    {
+        file.seekg(0, ios::end);
+        fileSize = file.tellg();
+        file.seekg(0, ios::beg);
+    }
 
-    // Read file in chunks
-    char *buffer = new char[CHUNK_SIZE];
-    size_t bytesRead;
+    // One byte more than the file, so a small file is read whole in one go
+    vector<char> buffer(min(fileSize + 1, max(chunking.maxChunkSize(), MTFSConstants::HASH_PIECE_SIZE)));
+    ChunkHasher hasher(*hashEngine, chunking);
+    bool first = true;
 
     try
     {
-        while (file.read(buffer, CHUNK_SIZE) || file.gcount() > 0)
+        while (timedRead(file, buffer) || file.gcount() > 0)
         {
-            bytesRead = file.gcount();
-            string chunk(buffer, bytesRead);
+            size_t bytesRead = file.gcount();
+            BuildProfiler::count(ProfileCounter::READ_BYTES, bytesRead);
 
-            // Add to entire content for overall hash
-            entireContent += chunk;
+            // The whole file is in the buffer
+            if (first && file.eof())
+            {
+                auto [contentHash, length, chunkHashes] =
+                    ChunkHasher::hashBuffer(*hashEngine, chunking, buffer.data(), bytesRead);
+                return make_tuple(contentHash, fileSize, move(chunkHashes));
+            }
 
-            // Calculate chunk hash
-            string chunkHash = sha256(chunk);
-            chunkHashes.push_back(chunkHash);
+            hasher.update(buffer.data(), bytesRead);
+            first = false;
         }
     }
     catch (const exception &e)
     {
-        delete[] buffer;
         throw runtime_error("Error reading file: " + file_path + " - " + e.what());
     }
 
-    delete[] buffer;
     file.close();
 
-    // Calculate hash of entire content
-    string contentHash = sha256(entireContent);
-
-    return make_tuple(contentHash, fileSize, chunkHashes);
+    auto [contentHash, length, chunkHashes] = hasher.finish();
+    return make_tuple(contentHash, fileSize, move(chunkHashes));
 }
 
 /**
- * @brief Build Merkle tree from directory path
- * @param directory_path Path to the directory to process
- * @return Shared pointer to the root node of the built tree
- * @throws runtime_error If directory path is invalid
+ * @brief Hash a file through a read-only memory mapping
+ * @param file_path Path to the file to process
+ * @param chunking How the file is split into chunks
+ * @param fileStat Metadata just read by the caller, or nullptr to fstat the file
+ * @return Tuple containing (content_hash, file_size, chunk_hashes)
+ * @throws runtime_error If file cannot be opened or mapped
+ *
+ * Files below MMAP_MIN_SIZE are cheaper to read and use the stream path.
+ * Larger ones are mapped with MADV_SEQUENTIAL and hashed without a copy.
+ * A file truncated while it is being hashed raises SIGBUS, as with any
+ * mapping, so this backend is for trees that are not written during a
+ * build.
  */
-shared_ptr<MerkleNode> MerkleTree::build_tree(const string &directory_path)
+tuple<Digest, size_t, vector<Digest>> MerkleTree::hash_file_mapped(const string &file_path, const ChunkingConfig &chunking,
+                                                                   const FileStat *fileStat)
 {
-    if (!fs::exists(directory_path))
+    // A known small size goes to the stream path without opening the file twice
+    if (fileStat && fileStat->size < MTFSConstants::MMAP_MIN_SIZE)
     {
-        throw runtime_error("Directory does not exist: " + directory_path);
+        return hash_file_stream(file_path, chunking, fileStat);
     }
 
-    if (!fs::is_directory(directory_path))
+    int fd = openFile(file_path);
+    if (fd < 0)
     {
-        throw runtime_error("Path is not a directory: " + directory_path);
+        throw runtime_error("Cannot open file: " + file_path);
     }
 
-    // Clear previous tree data
-    file_objects.clear();
-    nodes.clear();
-
-    // Build tree from directory
-    root = build_node(fs::path(directory_path));
+    size_t fileSize;
+    if (fileStat)
+    {
+        fileSize = fileStat->size;
+    }
+    else
+    {
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || (size_t)st.st_size < MTFSConstants::MMAP_MIN_SIZE)
+        {
+            ::close(fd);
+            return hash_file_stream(file_path, chunking);
+        }
+        fileSize = st.st_size;
+    }
 
-    // Calculate all hashes
-    if (root)
+    void *mapping = ::mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED)
     {
-        root->calculateHash();
+        throw runtime_error("Cannot map file: " + file_path + " - " + strerror(errno));
     }
 
-    return root;
+    ::madvise(mapping, fileSize, MADV_SEQUENTIAL);
+    // Pages fault in while they are hashed, so the read time is part of HASH
+    BuildProfiler::count(ProfileCounter::READ_BYTES, fileSize);
+    auto result = ChunkHasher::hashBuffer(*hashEngine, chunking, mapping, fileSize);
+    ::munmap(mapping, fileSize);
+
+    return result;
 }
 
 /**
- * @brief Build a single node from filesystem path
- * @param path Filesystem path to process
- * @return Shared pointer to the created node
- * @throws runtime_error If path is invalid or inaccessible
+ * @brief Hash a file with several reads in flight on the thread's io_uring
+ * @param file_path Path to the file to process
+ * @param chunking How the file is split into chunks
+ * @param fileStat Metadata just read by the caller, or nullptr to fstat the file
+ * @return Tuple containing (content_hash, file_size, chunk_hashes)
+ * @throws runtime_error If file cannot be opened or read
+ *
+ * The registered buffer is split into IO_RING_READ_SIZE slots, one read
+ * each. Slots are hashed in file order as their reads complete and are
+ * reused for the next read right away, so the device always has work
+ * queued. Falls back to the stream path when io_uring is unavailable.
  */
-shared_ptr<MerkleNode> MerkleTree::build_node(const fs::path &path)
+tuple<Digest, size_t, vector<Digest>> MerkleTree::hash_file_uring(const string &file_path, const ChunkingConfig &chunking,
+                                                                  const FileStat *fileStat)
 {
-    if (!fs::exists(path))
+    IoRing *ring = IoRing::forThread();
+    if (!ring)
     {
-        throw runtime_error("Path does not exist: " + path.string());
+        return hash_file_stream(file_path, chunking, fileStat);
     }
 
-    string nodeName = path.filename().string();
-    bool isFile = fs::is_regular_file(path);
-
-    auto node = make_shared<MerkleNode>(nodeName, isFile);
-    nodes.push_back(node);
+    int fd = openFile(file_path);
+    if (fd < 0)
+    {
+        throw runtime_error("Cannot open file: " + file_path);
+    }
 
-    if (isFile)
+    size_t fileSize;
+    if (fileStat)
     {
-        // Process file
-        try
+        fileSize = fileStat->size;
+    }
+    else
+    {
+        struct stat st;
+        if (::fstat(fd, &st) != 0)
         {
-            auto [contentHash, fileSize, chunkHashes] = hash_file_content(path.string());
+            ::close(fd);
+            throw runtime_error("Cannot stat file: " + file_path);
+        }
+        fileSize = st.st_size;
+    }
 
-            node->contentHash = contentHash;
-            node->fileSize = fileSize;
-            node->chunkHashes = chunkHashes;
+    const size_t slotSize = MTFSConstants::IO_RING_READ_SIZE;
+    const size_t slotCount = MTFSConstants::IO_RING_BUFFER_SIZE / slotSize;
 
-            // Store in file_objects map
-            file_objects[contentHash] = node;
-        }
-        catch (const exception &e)
+    // A file of one chunk lands contiguously in the buffer and is hashed once at the end
+    bool whole = fileSize > 0 && fileSize <= min(chunking.singleChunkLimit(), MTFSConstants::IO_RING_BUFFER_SIZE);
+
+    vector<int> results(slotCount);
+    vector<unsigned char> done(slotCount, 0);
+    size_t nextRead = 0; // Offset of the next read to submit
+    size_t nextHash = 0; // Offset of the next bytes to hash
+    size_t inFlight = 0; // Reads submitted but not completed
+    int error = 0;
+    bool truncated = false;
+
+    ChunkHasher hasher(*hashEngine, chunking);
+    auto submitReads = [&]
+    {
+        // A slot is free again once its bytes were hashed, not when its read completed
+        while (nextRead < nextHash + slotCount * slotSize && nextRead < fileSize && !truncated && !error)
         {
-            throw runtime_error("Error processing file " + path.string() + ": " + e.what());
+            size_t slot = (nextRead / slotSize) % slotCount;
+            size_t length = min(slotSize, fileSize - nextRead);
+            ring->read(fd, ring->buffer() + slot * slotSize, length, nextRead, slot);
+            done[slot] = 0;
+            nextRead += length;
+            ++inFlight;
         }
-    }
-    else if (fs::is_directory(path))
+    };
+
+    submitReads();
+    while (inFlight > 0)
     {
-        // Process directory
-        try
+        uint64_t tag;
+        int result;
+        {
+            PhaseTimer timer(ProfilePhase::READ);
+            result = ring->wait(tag);
+        }
+        --inFlight;
+        if (result > 0)
+        {
+            BuildProfiler::count(ProfileCounter::READ_BYTES, result);
+        }
+        results[tag] = result;
+        done[tag] = 1;
+
+        // Hash the completed slots that are next in file order
+        while (nextHash < nextRead && !truncated && !error)
         {
-            for (const auto &entry : fs::directory_iterator(path))
+            size_t slot = (nextHash / slotSize) % slotCount;
+            if (!done[slot])
+            {
+                break;
+            }
+
+            size_t expected = min(slotSize, fileSize - nextHash);
+            char *data = ring->buffer() + slot * slotSize;
+            ssize_t length = results[slot];
+
+            // Complete a short read synchronously
+            while (length >= 0 && (size_t)length < expected)
             {
-                try
+                ssize_t bytesRead;
+                {
+                    PhaseTimer timer(ProfilePhase::READ);
+                    bytesRead = ::pread(fd, data + length, expected - length, nextHash + length);
+                }
+                if (bytesRead < 0 && errno == EINTR)
                 {
-                    auto childNode = build_node(entry.path());
-                    node->addChild(childNode);
+                    continue;
                 }
-                catch (const exception &e)
+                if (bytesRead <= 0)
                 {
-                    // Log error but continue processing other entries
-                    cerr << "Warning: Skipping " << entry.path().string() << " - " << e.what() << endl;
+                    if (bytesRead < 0)
+                    {
+                        length = -errno;
+                    }
+                    break;
                 }
+                BuildProfiler::count(ProfileCounter::READ_BYTES, bytesRead);
+                length += bytesRead;
             }
+
+            if (length < 0)
+            {
+                error = (int)-length;
+                break;
+            }
+
+            if (length > 0 && !whole)
+            {
+                hasher.update(data, length);
+            }
+            nextHash += length;
+            done[slot] = 0;
+
+            // The file shrank since it was stat'ed
+            truncated = (size_t)length < expected;
         }
-        catch (const exception &e)
-        {
-            throw runtime_error("Error reading directory " + path.string() + ": " + e.what());
-        }
+
+        submitReads();
     }
 
-    return node;
+    ::close(fd);
+
+    if (error)
+    {
+        throw runtime_error("Error reading file: " + file_path + " - " + strerror(error));
+    }
+
+    if (whole)
+    {
+        return ChunkHasher::hashBuffer(*hashEngine, chunking, ring->buffer(), nextHash);
+    }
+
+    return hasher.finish();
 }
 
 /**
- * @brief Print detailed tree structure
- * @param node Root node to start printing from
- * @param depth Current depth level for indentation
+ * @brief Build Merkle tree from directory path
+ * @param directory_path Path to the directory to process
+ * @return Shared pointer to the root node of the built tree
+ * @throws runtime_error If directory path is invalid
  */
-void MerkleTree::print_tree_details(shared_ptr<MerkleNode> node, int depth)
+shared_ptr<MerkleNode> MerkleTree::build_tree(const string &directory_path)
 {
-    if (!node)
-        return;
+    ProfiledRun run("build", directory_path);
 
-    string indent(depth * 2, ' ');
-    cout << indent << node->name;
+    EntryType rootType = statEntry(directory_path, true, &rootDevice);
+    walkRoot = directory_path;
+    if (rootType == EntryType::MISSING)
+    {
+        throw runtime_error("Directory does not exist: " + directory_path);
+    }
 
-    if (node->isFile)
+    if (rootType != EntryType::DIRECTORY)
     {
-        cout << " (File, Size: " << node->fileSize << " bytes, Hash: "
-             << node->contentHash.substr(0, 8) << "...)";
+        throw runtime_error("Path is not a directory: " + directory_path);
+    }
 
-        if (node->chunkHashes.size() > 1)
-        {
-            cout << " [" << node->chunkHashes.size() << " chunks]";
-        }
+    // Clear previous tree data
+    clear_index();
+    flatTree.reset();
+    clear_linked_files();
+
+    // Set before indexing, which sizes chunks with the built chunking
+    rootPath = directory_path;
+    builtChunking = getChunking();
+
+    // Build tree from directory
+    if (threadCount > 1)
+    {
+        root = build_tree_parallel(directory_path);
     }
     else
     {
-        cout << " (Directory, Children: " << node->children.size() << ")";
+        root = build_node(fs::path(directory_path), EntryType::DIRECTORY);
+        index_nodes();
     }
 
-    cout << endl;
+    if (hashCache)
+    {
+        hashCache->flush();
+    }
 
-    // Print children recursively
-    if (!node->isFile)
+    // Calculate all hashes
+    if (root)
     {
-        vector<string> childNames;
-        for (const auto &child : node->children)
-        {
-            childNames.push_back(child.first);
-        }
-        sort(childNames.begin(), childNames.end());
+        PhaseTimer timer(ProfilePhase::TREE_HASH);
+        TraceSpan hashSpan("tree hash");
+        root->calculateHash(*hashEngine);
+    }
 
-        for (const string &childName : childNames)
-        {
-            print_tree_details(node->children[childName], depth + 1);
-        }
+    if (compactStorage && root)
+    {
+        auto builtRoot = root;
+        compact();
+        return builtRoot;
     }
+
+    return root;
 }
 
 /**
- * @brief Print file objects and their chunk information
+ * @brief Build a single node from filesystem path
+ * @param path Filesystem path to process
+ * @return Shared pointer to the created node
+ * @throws runtime_error If path is invalid or inaccessible
  */
-void MerkleTree::print_file_objects()
+shared_ptr<MerkleNode> MerkleTree::build_node(const fs::path &path)
 {
-    cout << "\n=== File Objects ===" << endl;
-
-    for (const auto &entry : file_objects)
+    EntryType type = statEntry(path, walkPolicy.symlinks == SymlinkPolicy::FOLLOW, &rootDevice);
+    if (type == EntryType::MISSING)
     {
-        const string &hash = entry.first;
-        const auto &node = entry.second;
-
-        cout << "Content Hash: " << hash << endl;
-        cout << "  File: " << node->name << endl;
-        cout << "  Size: " << node->fileSize << " bytes" << endl;
-        cout << "  Chunks: " << node->chunkHashes.size() << endl;
-
-        if (node->chunkHashes.size() > 1)
-        {
-            cout << "  Chunk Hashes:" << endl;
-            for (size_t i = 0; i < node->chunkHashes.size(); ++i)
-            {
-                cout << "    [" << i << "] " << node->chunkHashes[i] << endl;
-            }
-        }
-        cout << endl;
+        throw runtime_error("Path does not exist: " + path.string());
+    }
+    if (type == EntryType::SYMLINK)
+    {
+        throw runtime_error("Path is a symlink and symlinks are skipped: " + path.string());
     }
+
+    return build_node(path, type);
 }
 
 /**
- * @brief Process directory and display complete analysis
- * @param directory_path Path to the directory to process
+ * @brief Build a single node of a known type
+ * @param path Filesystem path to process
+ * @param type Type of the entry (not MISSING)
+ * @return Shared pointer to the created node
+ * @throws runtime_error If path is inaccessible
  */
-void MerkleTree::process_directory(const string &directory_path)
+shared_ptr<MerkleNode> MerkleTree::build_node(const fs::path &path, EntryType type)
 {
-    cout << "Processing directory: " << directory_path << endl;
-    cout << "Chunk size: " << CHUNK_SIZE << " bytes" << endl;
+    FileBatch batch(*hashEngine, getChunking(), ioBackend, hashCache.get());
+    auto node = build_node(path, type, batch);
+    batch.flush();
 
-    try
+    // Files whose deferred read failed are dropped like any other failed entry
+    unordered_set<const MerkleNode *> failed;
+    for (const auto &file : batch.takeFailures())
     {
-        auto root = build_tree(directory_path);
-
-        cout << "\n=== Tree Structure ===" << endl;
-        print_tree_details(root);
-
-        auto [totalFiles, totalDirs, totalSize] = getTreeStats();
-        cout << "\n=== Statistics ===" << endl;
-        cout << "Total files: " << totalFiles << endl;
-        cout << "Total directories: " << totalDirs << endl;
-        cout << "Total size: " << totalSize << " bytes" << endl;
-        cout << "Tree depth: " << root->getDepth() << endl;
-        cout << "Root hash: " << root->hash << endl;
+        string error = "Error processing file " + file.path + ": " + file.error;
+        if (file.node == node)
+        {
+            throw runtime_error(error);
+        }
 
-        print_file_objects();
+        cerr << "Warning: Skipping " << file.path << " - " << error << endl;
+        failed.insert(file.node.get());
     }
-    catch (const exception &e)
+
+    if (!failed.empty())
     {
-        throw runtime_error("Error processing directory: " + string(e.what()));
+        remove_failed_files(*node, failed);
     }
+
+    return node;
 }
 
 /**
- * @brief Get the root node of the tree
- * @return Shared pointer to root node
+ * @brief Build a single node, queueing small files on a batch
+ * @param path Filesystem path to process
+ * @param type Type of the entry (not MISSING or SYMLINK), as listed by its parent
+ * @param batch Batch hashing the small files of the build
+ * @return Shared pointer to the created node (small files filled on flush)
+ * @throws runtime_error If path is inaccessible
+ *
+ * The type comes from the parent's listing, so files cost only the one
+ * read_file_stat does; directories are walked by walk_directory.
+ */
+shared_ptr<MerkleNode> MerkleTree::build_node(const fs::path &path, EntryType type, FileBatch &batch)
+{
+    string nodeName = path.filename().string();
+    bool isFile = type == EntryType::FILE;
+
+    auto node = make_shared<MerkleNode>(nodeName, isFile);
+
+    if (isFile)
+    {
+        // Process file
+        try
+        {
+            if (queue_small_file(batch, node, path))
+            {
+                if (batch.full())
+                {
+                    batch.flush();
+                }
+            }
+            else
+            {
+                hash_file_node(*node, path);
+            }
+        }
+        catch (const PathTooLong &)
+        {
+            throw;
+        }
+        catch (const exception &e)
+        {
+            throw runtime_error("Error processing file " + path.string() + ": " + e.what());
+        }
+    }
+    else if (type == EntryType::DIRECTORY)
+    {
+        walk_directory(node, path, batch);
+    }
+
+    return node;
+}
+
+/**
+ * @brief Fill a directory node by walking its subtree with an explicit stack
+ * @param node Directory node to fill
+ * @param path Filesystem path of the directory
+ * @param batch Batch hashing the small files of the build
+ * @param finished Called with each directory once all its entries are built, children
+ *        before parents, or nullptr
+ * @throws runtime_error If the directory itself cannot be read
+ *
+ * Each open level keeps its listing and the index of its next entry on the
+ * heap, so depth is bounded by memory rather than the call stack. Listings
+ * are read whole before descending, so no directory stays open below the
+ * current one. Directories already open further up (a symlink back to a
+ * parent) are skipped, as are entries that fail; mount points are left
+ * empty under WalkPolicy::oneFileSystem.
+ */
+void MerkleTree::walk_directory(const shared_ptr<MerkleNode> &node, const fs::path &path, FileBatch &batch,
+                                const function<void(MerkleNode &)> &finished)
+{
+    struct Level
+    {
+        MerkleNode *node;           // Directory being filled
+        fs::path path;              // Its filesystem path
+        DirectoryListing listing;   // Its identity and entries
+        size_t next;                // Index of the next entry to build
+        unique_ptr<TraceSpan> span; // Its trace event, while tracing
+    };
+
+    bool followSymlinks = walkPolicy.symlinks == SymlinkPolicy::FOLLOW;
+    vector<Level> stack;
+    set<InodeKey> open;
+
+    DirectoryListing listing = listDirectory(path, followSymlinks);
+    if (stops_at(path, listing))
+    {
+        return;
+    }
+    open.insert(listing.id);
+    stack.push_back({node.get(), path, move(listing), 0, directorySpan(path)});
+
+    while (!stack.empty())
+    {
+        Level &level = stack.back();
+        if (level.next == level.listing.entries.size())
+        {
+            open.erase(level.listing.id);
+            if (finished)
+            {
+                finished(*level.node);
+            }
+            stack.pop_back();
+            continue;
+        }
+
+        if (jobControl)
+        {
+            jobControl->checkCancelled();
+        }
+
+        const ScannedEntry &entry = level.listing.entries[level.next++];
+        fs::path childPath = level.path / entry.name;
+        try
+        {
+            requireEntry(childPath, entry);
+            if (entry.type == EntryType::SYMLINK)
+            {
+                continue;
+            }
+            if (entry.type != EntryType::DIRECTORY)
+            {
+                auto childNode = build_node(childPath, entry.type, batch);
+                level.node->addChild(childNode);
+                if (jobControl && childNode->isFile)
+                {
+                    jobControl->advance(1, childNode->fileStat.size);
+                }
+                continue;
+            }
+
+            DirectoryListing childListing = listDirectory(childPath, followSymlinks);
+            auto childNode = make_shared<MerkleNode>(entry.name, false);
+            if (stops_at(childPath, childListing))
+            {
+                level.node->addChild(childNode);
+                continue;
+            }
+            if (open.count(childListing.id))
+            {
+                throw runtime_error("Directory cycle: " + childPath.string() + " leads back to a parent directory");
+            }
+
+            // Attached before it is filled; level is not used past the push, which may move it
+            level.node->addChild(childNode);
+            open.insert(childListing.id);
+            stack.push_back({childNode.get(), childPath, move(childListing), 0, directorySpan(childPath)});
+        }
+        catch (const OperationCancelled &)
+        {
+            throw;
+        }
+        catch (const PathTooLong &)
+        {
+            throw;
+        }
+        catch (const exception &e)
+        {
+            // Log error but continue processing other entries
+            cerr << "Warning: Skipping " << childPath.string() << " - " << e.what() << endl;
+        }
+    }
+}
+
+/**
+ * @brief Incrementally rebuild the tree from directory path
+ * @param directory_path Path to the directory to process
+ * @param control Progress and cancellation of the build, or nullptr
+ * @return Shared pointer to the root node of the rebuilt tree
+ * @throws runtime_error If directory path is invalid
+ * @throws OperationCancelled If control was cancelled (the tree is then unusable)
+ */
+shared_ptr<MerkleNode> MerkleTree::rebuild(const string &directory_path, JobControl *control)
+{
+    // Seen by the walks below, for this call only
+    struct ControlScope
+    {
+        JobControl *&current;
+        ~ControlScope()
+        {
+            current = nullptr;
+        }
+    } scope{jobControl};
+    jobControl = control;
+
+    materialize();
+    flatTree.reset();
+
+    if (!root || directory_path != rootPath || getChunking() != builtChunking)
+    {
+        return build_tree(directory_path);
+    }
+
+    if (control)
+    {
+        // The previous tree is the best guess of what the walk will find
+        auto [files, directories, totalSize] = getTreeStats();
+        control->expect(files, totalSize);
+    }
+
+    ProfiledRun run("rebuild", directory_path);
+
+    EntryType rootType = statEntry(directory_path, true, &rootDevice);
+    walkRoot = directory_path;
+    if (rootType == EntryType::MISSING)
+    {
+        throw runtime_error("Directory does not exist: " + directory_path);
+    }
+
+    if (rootType != EntryType::DIRECTORY)
+    {
+        throw runtime_error("Path is not a directory: " + directory_path);
+    }
+
+    clear_linked_files();
+    bool changed = false;
+    root = rebuild_node(fs::path(directory_path), EntryType::DIRECTORY, root, changed);
+    index_nodes();
+
+    if (hashCache)
+    {
+        hashCache->flush();
+    }
+
+    if (compactStorage)
+    {
+        auto builtRoot = root;
+        compact();
+        return builtRoot;
+    }
+
+    return root;
+}
+
+/**
+ * @brief Rebuild a single node, reusing the previous one when unchanged
+ * @param path Filesystem path to process
+ * @param type Type of the entry (not MISSING)
+ * @param previous Node for this path from the previous tree, or nullptr
+ * @param changed Set to true if the node's hash may differ from previous
+ * @return Shared pointer to the reused or newly built node
+ * @throws runtime_error If path is inaccessible
+ */
+shared_ptr<MerkleNode> MerkleTree::rebuild_node(const fs::path &path, EntryType type,
+                                                const shared_ptr<MerkleNode> &previous, bool &changed)
+{
+    string nodeName = path.filename().string();
+
+    if (type == EntryType::FILE)
+    {
+        // The stat that detects a change is also the one the hash path uses
+        FileStat fileStat = read_file_stat(path);
+        if (previous && previous->isFile && previous->fileStat == fileStat)
+        {
+            changed = false;
+            return previous;
+        }
+
+        auto node = make_shared<MerkleNode>(nodeName, true);
+        node->fileStat = fileStat;
+        try
+        {
+            if (!hashCache || !hashCache->fill(*node, getHashAlgorithm(), getChunking()))
+            {
+                hash_file_node(*node, path);
+            }
+        }
+        catch (const exception &e)
+        {
+            throw runtime_error("Error processing file " + path.string() + ": " + e.what());
+        }
+
+        node->updateHash(*hashEngine);
+        changed = true;
+        return node;
+    }
+
+    if (type != EntryType::DIRECTORY)
+    {
+        // Other entry types are kept as empty directories, as in build_node
+        auto node = make_shared<MerkleNode>(nodeName, false);
+        node->updateHash(*hashEngine);
+        changed = !previous || previous->hash != node->hash;
+        return node;
+    }
+
+    return rebuild_directory(path, previous, changed);
+}
+
+/**
+ * @brief Rebuild a directory by walking its subtree with an explicit stack
+ * @param path Filesystem path of the directory
+ * @param previous Node for this path from the previous tree, or nullptr
+ * @param changed Set to true if the node's hash may differ from previous
+ * @return Shared pointer to the reused or newly built node
+ * @throws runtime_error If the directory itself cannot be read
+ *
+ * Directories are updated in place so unchanged subtrees keep their nodes.
+ * A level is finished (children swapped in and hash updated, only if
+ * something changed) once all its entries are done, and then reported to
+ * its parent, so the walk is post-order without recursion. Cycles, failed
+ * entries and mount points are handled as in walk_directory.
+ */
+shared_ptr<MerkleNode> MerkleTree::rebuild_directory(const fs::path &path, const shared_ptr<MerkleNode> &previous,
+                                                     bool &changed)
+{
+    struct Level
+    {
+        shared_ptr<MerkleNode> node;                  // Directory being rebuilt (the previous one when reused)
+        shared_ptr<MerkleNode> previous;              // Node for this path from the previous tree, or nullptr
+        fs::path path;                                // Its filesystem path
+        DirectoryListing listing;                     // Its identity and entries
+        size_t next;                                  // Index of the next entry to rebuild
+        map<string, shared_ptr<MerkleNode>> children; // Children rebuilt so far
+        bool dirty;                                   // Hash may differ from the previous one
+        unique_ptr<TraceSpan> span;                   // Its trace event, while tracing
+    };
+
+    bool followSymlinks = walkPolicy.symlinks == SymlinkPolicy::FOLLOW;
+    vector<Level> stack;
+    set<InodeKey> open;
+
+    // Starts a level, or returns the finished (empty) node of a mount point that is not descended
+    auto enter = [&](const fs::path &directoryPath, const shared_ptr<MerkleNode> &previousNode,
+                     DirectoryListing listing) -> shared_ptr<MerkleNode>
+    {
+        bool reuse = previousNode && !previousNode->isFile;
+        if (stops_at(directoryPath, listing))
+        {
+            auto node = make_shared<MerkleNode>(directoryPath.filename().string(), false);
+            node->updateHash(*hashEngine);
+            return node;
+        }
+        if (open.count(listing.id))
+        {
+            throw runtime_error("Directory cycle: " + directoryPath.string() + " leads back to a parent directory");
+        }
+
+        open.insert(listing.id);
+        stack.push_back({reuse ? previousNode : make_shared<MerkleNode>(directoryPath.filename().string(), false),
+                         previousNode, directoryPath, move(listing), 0, {}, !reuse, directorySpan(directoryPath)});
+        return nullptr;
+    };
+
+    auto result = enter(path, previous, listDirectory(path, followSymlinks));
+    if (result)
+    {
+        changed = !previous || previous->hash != result->hash;
+        return result;
+    }
+
+    while (true)
+    {
+        Level &level = stack.back();
+        if (level.next == level.listing.entries.size())
+        {
+            // Entries that disappeared also change the directory
+            level.dirty = level.dirty || level.children.size() != level.node->children.size();
+            if (level.dirty)
+            {
+                // Re-add through addChild so the parent links and totals are kept
+                level.node->clearChildren();
+                for (const auto &child : level.children)
+                {
+                    level.node->addChild(child.second);
+                }
+                level.node->updateHash(*hashEngine);
+            }
+
+            auto node = level.node;
+            bool dirty = level.dirty;
+            bool replaced = node != level.previous;
+            open.erase(level.listing.id);
+            stack.pop_back();
+            if (stack.empty())
+            {
+                changed = dirty;
+                return node;
+            }
+
+            stack.back().dirty = stack.back().dirty || dirty || replaced;
+            stack.back().children[node->name] = node;
+            continue;
+        }
+
+        if (jobControl)
+        {
+            jobControl->checkCancelled();
+        }
+
+        const ScannedEntry &entry = level.listing.entries[level.next++];
+        fs::path childPath = level.path / entry.name;
+        try
+        {
+            requireEntry(childPath, entry);
+            if (entry.type == EntryType::SYMLINK)
+            {
+                continue;
+            }
+
+            auto it = level.node->children.find(entry.name);
+            shared_ptr<MerkleNode> previousChild = it != level.node->children.end() ? it->second : nullptr;
+
+            shared_ptr<MerkleNode> childNode;
+            bool childChanged = false;
+            if (entry.type == EntryType::DIRECTORY)
+            {
+                // Level is not used past enter, which may move it
+                childNode = enter(childPath, previousChild, listDirectory(childPath, followSymlinks));
+                if (!childNode)
+                {
+                    continue;
+                }
+                childChanged = !previousChild || previousChild->hash != childNode->hash;
+            }
+            else
+            {
+                childNode = rebuild_node(childPath, entry.type, previousChild, childChanged);
+                if (jobControl && childNode->isFile)
+                {
+                    jobControl->advance(1, childNode->fileSize);
+                }
+            }
+
+            level.dirty = level.dirty || childChanged || childNode != previousChild;
+            level.children[entry.name] = childNode;
+        }
+        catch (const OperationCancelled &)
+        {
+            throw;
+        }
+        catch (const PathTooLong &)
+        {
+            throw;
+        }
+        catch (const exception &e)
+        {
+            // Log error but continue processing other entries
+            cerr << "Warning: Skipping " << childPath.string() << " - " << e.what() << endl;
+        }
+    }
+}
+
+/**
+ * @brief Read the metadata used for change detection
+ * @param path Filesystem path to stat
+ * @param linkCount Receives the number of hard links when not nullptr
+ * @return Metadata of the file
+ * @throws PathTooLong If the path is longer than the kernel accepts
+ * @throws runtime_error If the path cannot be stat'ed
+ *
+ * One statx asking for only the fields FileStat keeps; glibc falls back
+ * to stat on kernels without statx. The size is passed on to the hash
+ * path, so the file is not stat'ed again.
+ */
+FileStat MerkleTree::read_file_stat(const fs::path &path, uint32_t *linkCount)
+{
+    PhaseTimer timer(ProfilePhase::STAT);
+    BuildProfiler::count(ProfileCounter::STAT_CALLS);
+
+    struct statx stx;
+    const unsigned mask = STATX_INO | STATX_SIZE | STATX_MTIME | STATX_CTIME | STATX_NLINK;
+    if (::statx(AT_FDCWD, path.c_str(), AT_STATX_SYNC_AS_STAT, mask, &stx) != 0)
+    {
+        if (errno == ENAMETOOLONG)
+        {
+            throw PathTooLong(path);
+        }
+        throw runtime_error("Cannot stat file: " + path.string());
+    }
+
+    FileStat fileStat;
+    fileStat.device = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+    fileStat.inode = stx.stx_ino;
+    fileStat.size = stx.stx_size;
+    fileStat.mtimeNs = (int64_t)stx.stx_mtime.tv_sec * 1000000000 + stx.stx_mtime.tv_nsec;
+    fileStat.ctimeNs = (int64_t)stx.stx_ctime.tv_sec * 1000000000 + stx.stx_ctime.tv_nsec;
+    if (linkCount)
+    {
+        *linkCount = stx.stx_nlink;
+    }
+    return fileStat;
+}
+
+/**
+ * @brief Hash a file and fill in its node
+ * @param node File node to fill (its fileStat must be set)
+ * @param path Filesystem path of the file
+ * @throws runtime_error If the file cannot be read
+ *
+ * The caller reads the metadata before the content, so a file modified
+ * while it is being hashed is seen as changed by the next rebuild (and
+ * misses the hash cache, which is checked by the callers).
+ */
+void MerkleTree::hash_file_node(MerkleNode &node, const fs::path &path)
+{
+    TraceSpan span("file", path.native());
+    uint64_t startNs = BuildProfiler::enabled() ? BuildProfiler::now() : 0;
+
+    tuple<Digest, size_t, vector<Digest>> content;
+    try
+    {
+        content = hash_file_content(path.string(), getChunking(), &node.fileStat);
+    }
+    catch (const exception &)
+    {
+        if (walkPolicy.hardlinks == HardlinkPolicy::SHARE)
+        {
+            release_linked_file(node);
+        }
+        throw;
+    }
+    auto &[contentHash, fileSize, chunkHashes] = content;
+
+    if (startNs != 0)
+    {
+        BuildProfiler::count(ProfileCounter::FILES_HASHED);
+        BuildProfiler::record(ProfileHistogram::FILE_SIZE, fileSize);
+        BuildProfiler::record(ProfileHistogram::FILE_LATENCY, BuildProfiler::now() - startNs);
+    }
+
+    node.contentHash = contentHash;
+    node.fileSize = fileSize;
+    node.chunkHashes = move(chunkHashes);
+
+    if (hashCache)
+    {
+        hashCache->store(node, getHashAlgorithm(), getChunking());
+    }
+
+    if (walkPolicy.hardlinks == HardlinkPolicy::SHARE)
+    {
+        publish_linked_file(node);
+    }
+}
+
+/**
+ * @brief Stat a file and queue it on a batch if it is small
+ * @param batch Batch hashing small files
+ * @param node File node to fill
+ * @param path Filesystem path of the file
+ * @param pending Set if another thread is reading a link of the file (nullptr: read it again instead)
+ * @return True if queued, filled from the hash cache or another link, or pending; otherwise the caller hashes the file itself
+ * @throws runtime_error If the file cannot be stat'ed or read
+ */
+bool MerkleTree::queue_small_file(FileBatch &batch, const shared_ptr<MerkleNode> &node, const fs::path &path,
+                                  bool *pending)
+{
+    uint32_t linkCount = 0;
+    node->fileStat = read_file_stat(path, &linkCount);
+    if (hashCache && hashCache->fill(*node, getHashAlgorithm(), getChunking()))
+    {
+        return true;
+    }
+    if (linkCount > 1 && walkPolicy.hardlinks == HardlinkPolicy::SHARE)
+    {
+        // A link that is read is not batched, so its hashes are published as soon as it is done
+        LinkShare share = share_linked_file(*node);
+        if (share == LinkShare::PENDING && pending)
+        {
+            *pending = true;
+            return true;
+        }
+        return share == LinkShare::SHARED;
+    }
+    return node->fileStat.size <= batch.getSizeLimit() && batch.add(node, path.string());
+}
+
+/**
+ * @brief Fill a file with several hard links from a link hashed earlier in the build
+ * @param node File node to fill (its fileStat must be set)
+ * @return What was done with the link
+ *
+ * Links are matched by (device, inode) and must have the same metadata,
+ * so a file changed during the build is read again.
+ */
+MerkleTree::LinkShare MerkleTree::share_linked_file(MerkleNode &node)
+{
+    lock_guard<mutex> lock(linkedFilesLock);
+    auto [it, inserted] = linkedFiles.try_emplace(InodeKey{node.fileStat.device, node.fileStat.inode});
+    LinkedFile &linked = it->second;
+    if (inserted || linked.fileStat != node.fileStat)
+    {
+        linked = LinkedFile{};
+        linked.fileStat = node.fileStat;
+    }
+    else if (linked.hashed)
+    {
+        node.contentHash = linked.contentHash;
+        node.fileSize = linked.fileSize;
+        node.chunkHashes = linked.chunkHashes;
+        return LinkShare::SHARED;
+    }
+    else if (linked.reading)
+    {
+        return LinkShare::PENDING;
+    }
+
+    linked.reading = true;
+    return LinkShare::READ;
+}
+
+/**
+ * @brief Publish the hashes of a link for the other links of the file
+ * @param node File node just hashed
+ */
+void MerkleTree::publish_linked_file(const MerkleNode &node)
+{
+    lock_guard<mutex> lock(linkedFilesLock);
+    auto it = linkedFiles.find(InodeKey{node.fileStat.device, node.fileStat.inode});
+    if (it == linkedFiles.end() || it->second.hashed || it->second.fileStat != node.fileStat)
+    {
+        return;
+    }
+
+    LinkedFile &linked = it->second;
+    linked.reading = false;
+    linked.hashed = true;
+    linked.contentHash = node.contentHash;
+    linked.fileSize = node.fileSize;
+    linked.chunkHashes = node.chunkHashes;
+}
+
+/**
+ * @brief Let another link be read after a link of the file could not be
+ * @param node File node that failed
+ */
+void MerkleTree::release_linked_file(const MerkleNode &node)
+{
+    lock_guard<mutex> lock(linkedFilesLock);
+    auto it = linkedFiles.find(InodeKey{node.fileStat.device, node.fileStat.inode});
+    if (it != linkedFiles.end() && it->second.fileStat == node.fileStat)
+    {
+        it->second.reading = false;
+    }
+}
+
+/**
+ * @brief Forget the hard links seen by the previous build
+ */
+void MerkleTree::clear_linked_files()
+{
+    lock_guard<mutex> lock(linkedFilesLock);
+    linkedFiles.clear();
+}
+
+/**
+ * @brief Check whether a walk stops at a directory
+ * @param path Filesystem path of the directory
+ * @param listing Listing of the directory
+ * @return True if it is kept as an empty directory: a mount point under
+ *         WalkPolicy::oneFileSystem, or one of WalkPolicy::excluded
+ */
+bool MerkleTree::stops_at(const fs::path &path, const DirectoryListing &listing) const
+{
+    if (walkPolicy.oneFileSystem && listing.id.first != rootDevice)
+    {
+        return true;
+    }
+    return !walkPolicy.excluded.empty() && is_excluded(path.lexically_relative(walkRoot));
+}
+
+/**
+ * @brief Check whether a path is one of WalkPolicy::excluded
+ * @param relative Path relative to the walked root
+ * @return True if the walk keeps it as an empty directory
+ */
+bool MerkleTree::is_excluded(const fs::path &relative) const
+{
+    string key = relative.lexically_normal().generic_string();
+    return find(walkPolicy.excluded.begin(), walkPolicy.excluded.end(), key) != walkPolicy.excluded.end();
+}
+
+/**
+ * @brief Drop file nodes whose content could not be read
+ * @param node Directory to clean, with its subdirectories
+ * @param failed Nodes to drop
+ */
+void MerkleTree::remove_failed_files(MerkleNode &node, const unordered_set<const MerkleNode *> &failed)
+{
+    vector<MerkleNode *> stack{&node};
+    while (!stack.empty())
+    {
+        MerkleNode *directory = stack.back();
+        stack.pop_back();
+
+        for (auto it = directory->children.begin(); it != directory->children.end();)
+        {
+            if (failed.count(it->second.get()))
+            {
+                it->second->parent = nullptr;
+                it = directory->children.erase(it);
+                directory->invalidateTotals();
+                continue;
+            }
+
+            if (!it->second->isFile)
+            {
+                stack.push_back(it->second.get());
+            }
+            ++it;
+        }
+    }
+}
+
+/**
+ * @brief Build the tree on a thread pool
+ * @param directory_path Path to the root directory
+ * @return Shared pointer to the root node (hashes not yet calculated)
+ * @throws runtime_error If the root directory cannot be read
+ *
+ * Each task only writes to the node it was given, so no locking is needed
+ * on the hot path. Entries that fail are dropped once the pool drains, and
+ * nodes/file_objects are filled afterwards by index_nodes(). Hashes are
+ * calculated by the caller exactly as in the serial path, so the root hash
+ * is identical.
+ */
+shared_ptr<MerkleNode> MerkleTree::build_tree_parallel(const string &directory_path)
+{
+    fs::path path(directory_path);
+    auto rootNode = make_shared<MerkleNode>(path.filename().string(), false);
+
+    ParallelBuild build(threadCount);
+    build.pool.submit([this, &build, rootNode, path]
+                      { build_directory_parallel(build, nullptr, rootNode, path, nullptr); });
+    build.pool.wait();
+
+    // Tasks stop early once cancelled, rather than throw on the pool
+    if (jobControl)
+    {
+        jobControl->checkCancelled();
+    }
+
+    if (!build.rootError.empty())
+    {
+        throw runtime_error(build.rootError);
+    }
+
+    // Every link has been read by now, or its read failed and this one is tried instead
+    for (const auto &link : build.pendingLinks)
+    {
+        if (share_linked_file(*link.node) != LinkShare::SHARED)
+        {
+            build_file_parallel(build, link.parent, link.node, link.path);
+        }
+    }
+
+    for (const auto &[parent, childName] : build.failures)
+    {
+        parent->removeChild(childName);
+    }
+
+    root = rootNode;
+    index_nodes();
+
+    return rootNode;
+}
+
+/**
+ * @brief List a directory and queue its children on the pool
+ * @param build Shared parallel build state
+ * @param parent Parent of node, or nullptr for the root
+ * @param node Directory node to fill
+ * @param path Filesystem path of the directory
+ * @param parents Directories above this one, to detect cycles (nullptr for the root)
+ */
+void MerkleTree::build_directory_parallel(ParallelBuild &build, MerkleNode *parent,
+                                          const shared_ptr<MerkleNode> &node, const fs::path &path,
+                                          const shared_ptr<const OpenDirectory> &parents)
+{
+    bool followSymlinks = walkPolicy.symlinks == SymlinkPolicy::FOLLOW;
+    TraceSpan span("directory", path.native());
+
+    DirectoryListing listing;
+    try
+    {
+        listing = listDirectory(path, followSymlinks);
+        for (const OpenDirectory *above = parents.get(); above; above = above->up.get())
+        {
+            if (above->id == listing.id)
+            {
+                throw runtime_error("Directory cycle: " + path.string() + " leads back to a parent directory");
+            }
+        }
+    }
+    catch (const PathTooLong &e)
+    {
+        // Fails the whole build, as an unreadable root does
+        record_build_failure(build, nullptr, *node, path, e.what());
+        return;
+    }
+    catch (const exception &e)
+    {
+        record_build_failure(build, parent, *node, path, e.what());
+        return;
+    }
+
+    if (stops_at(path, listing))
+    {
+        return;
+    }
+
+    // Small files are hashed here in batches, larger ones get their own task
+    FileBatch batch(*hashEngine, getChunking(), ioBackend, hashCache.get());
+    auto self = make_shared<const OpenDirectory>(OpenDirectory{listing.id, parents});
+
+    for (const auto &entry : listing.entries)
+    {
+        if (jobControl && jobControl->cancelled())
+        {
+            return;
+        }
+
+        fs::path childPath = path / entry.name;
+
+        try
+        {
+            requireEntry(childPath, entry);
+            if (entry.type == EntryType::SYMLINK)
+            {
+                continue;
+            }
+
+            bool isFile = entry.type == EntryType::FILE;
+            auto childNode = make_shared<MerkleNode>(entry.name, isFile);
+            node->addChild(childNode);
+
+            if (isFile)
+            {
+                if (queue_small_parallel(build, batch, node.get(), childNode, childPath))
+                {
+                    if (jobControl)
+                    {
+                        jobControl->advance(1, childNode->fileStat.size);
+                    }
+                    if (batch.full())
+                    {
+                        flush_parallel_batch(build, batch, node.get());
+                    }
+                }
+                else
+                {
+                    build.pool.submit([this, &build, node, childNode, childPath]
+                                      { build_file_parallel(build, node.get(), childNode, childPath); });
+                }
+            }
+            else if (entry.type == EntryType::DIRECTORY)
+            {
+                build.pool.submit([this, &build, node, childNode, childPath, self]
+                                  { build_directory_parallel(build, node.get(), childNode, childPath, self); });
+            }
+        }
+        catch (const PathTooLong &e)
+        {
+            record_build_failure(build, nullptr, *node, childPath, e.what());
+        }
+        catch (const exception &e)
+        {
+            lock_guard<mutex> lock(build.failureLock);
+            cerr << "Warning: Skipping " << childPath.string() << " - " << e.what() << endl;
+        }
+    }
+
+    flush_parallel_batch(build, batch, node.get());
+}
+
+/**
+ * @brief Queue a small file of a directory task on its batch
+ * @param build Shared parallel build state
+ * @param batch Batch of the directory task
+ * @param parent Directory node holding the file
+ * @param node File node to fill
+ * @param path Filesystem path of the file
+ * @return True if the file was queued or failed; false if it needs its own task
+ */
+bool MerkleTree::queue_small_parallel(ParallelBuild &build, FileBatch &batch, MerkleNode *parent,
+                                      const shared_ptr<MerkleNode> &node, const fs::path &path)
+{
+    try
+    {
+        bool pending = false;
+        bool handled = queue_small_file(batch, node, path, &pending);
+        if (pending)
+        {
+            lock_guard<mutex> lock(build.failureLock);
+            build.pendingLinks.push_back({parent, node, path});
+        }
+        return handled;
+    }
+    catch (const PathTooLong &e)
+    {
+        record_build_failure(build, nullptr, *node, path, e.what());
+        return true;
+    }
+    catch (const exception &e)
+    {
+        record_build_failure(build, parent, *node, path,
+                             "Error processing file " + path.string() + ": " + e.what());
+        return true;
+    }
+}
+
+/**
+ * @brief Hash the small files of a directory task
+ * @param build Shared parallel build state
+ * @param batch Batch of the directory task
+ * @param parent Directory node holding the files
+ */
+void MerkleTree::flush_parallel_batch(ParallelBuild &build, FileBatch &batch, MerkleNode *parent)
+{
+    batch.flush();
+
+    for (const auto &failed : batch.takeFailures())
+    {
+        record_build_failure(build, parent, *failed.node, failed.path,
+                             "Error processing file " + failed.path + ": " + failed.error);
+    }
+}
+
+/**
+ * @brief Hash a file into an already attached node
+ * @param build Shared parallel build state
+ * @param parent Directory node holding the file
+ * @param node File node to fill
+ * @param path Filesystem path of the file
+ */
+void MerkleTree::build_file_parallel(ParallelBuild &build, MerkleNode *parent,
+                                     const shared_ptr<MerkleNode> &node, const fs::path &path)
+{
+    if (jobControl && jobControl->cancelled())
+    {
+        return;
+    }
+
+    try
+    {
+        hash_file_node(*node, path);
+        if (jobControl)
+        {
+            jobControl->advance(1, node->fileSize);
+        }
+    }
+    catch (const exception &e)
+    {
+        record_build_failure(build, parent, *node, path,
+                             "Error processing file " + path.string() + ": " + e.what());
+    }
+}
+
+/**
+ * @brief Record a failed entry so it is dropped after the build
+ * @param build Shared parallel build state
+ * @param parent Directory node holding the entry, or nullptr to fail the whole build
+ * @param node Node that failed
+ * @param path Filesystem path of the entry
+ * @param error Error message to report
+ */
+void MerkleTree::record_build_failure(ParallelBuild &build, MerkleNode *parent, const MerkleNode &node,
+                                      const fs::path &path, const string &error)
+{
+    lock_guard<mutex> lock(build.failureLock);
+    if (!parent)
+    {
+        build.rootError = error;
+        return;
+    }
+
+    cerr << "Warning: Skipping " << path.string() << " - " << error << endl;
+    build.failures.emplace_back(parent, node.name);
+}
+
+/**
+ * @brief Rebuild the nodes vector and the lookup and content indexes from the tree
+ */
+void MerkleTree::index_nodes() const
+{
+    PhaseTimer timer(ProfilePhase::INDEX);
+    TraceSpan span("index");
+
+    size_t previousSize = nodes.size();
+    clear_index();
+
+    if (root)
+    {
+        // A rebuild usually has about as many nodes as the tree it replaces
+        path_index.reserve(previousSize);
+        index_node(root, "");
+    }
+}
+
+/**
+ * @brief Pre-order walk of index_nodes, with an explicit stack
+ * @param node Current node
+ * @param path Path of the node relative to the tree root
+ */
+void MerkleTree::index_node(const shared_ptr<MerkleNode> &node, const string &path) const
+{
+    // Pre-order with an explicit stack of (node, path)
+    vector<pair<shared_ptr<MerkleNode>, string>> stack;
+    stack.emplace_back(node, path);
+    while (!stack.empty())
+    {
+        auto [current, currentPath] = move(stack.back());
+        stack.pop_back();
+
+        nodes.push_back(current);
+        name_index[current->name].push_back(current);
+
+        if (current->isFile)
+        {
+            auto &sameContent = file_objects[current->contentHash];
+            dedupe.files++;
+            dedupe.logicalBytes += current->fileSize;
+            if (sameContent.empty())
+            {
+                dedupe.uniqueFiles++;
+                dedupe.uniqueFileBytes += current->fileSize;
+            }
+            sameContent.push_back(current);
+
+            count_chunks(dedupe, chunk_refs, current->fileSize, current->chunkHashes.data(),
+                         current->chunkHashes.size());
+            path_index.emplace(move(currentPath), move(current));
+            continue;
+        }
+
+        // Pushed in reverse so children are visited in name order
+        for (auto it = current->children.rbegin(); it != current->children.rend(); ++it)
+        {
+            stack.emplace_back(it->second, currentPath.empty() ? it->first : currentPath + "/" + it->first);
+        }
+        path_index.emplace(move(currentPath), move(current));
+    }
+}
+
+/**
+ * @brief Drop the nodes vector and the lookup and content indexes
+ */
+void MerkleTree::clear_index() const
+{
+    file_objects.clear();
+    nodes.clear();
+    path_index.clear();
+    name_index.clear();
+    chunk_refs.clear();
+    dedupe = DedupeStats{};
+}
+
+/**
+ * @brief Add the chunks of one file to the dedupe statistics
+ * @param stats Statistics to update
+ * @param refs Chunk reference counts to update
+ * @param fileSize Size of the file
+ * @param chunkHashes Chunk hashes of the file
+ * @param chunkCount Number of chunks
+ */
+void MerkleTree::count_chunks(DedupeStats &stats, unordered_map<Digest, uint32_t, DigestHasher> &refs,
+                              uint64_t fileSize, const Digest *chunkHashes, size_t chunkCount) const
+{
+    stats.chunks += chunkCount;
+    for (size_t i = 0; i < chunkCount; ++i)
+    {
+        if (refs[chunkHashes[i]]++ > 0)
+        {
+            continue;
+        }
+
+        stats.uniqueChunks++;
+        uint64_t length;
+        if (builtChunking.chunkLength(fileSize, i, chunkCount, length))
+        {
+            stats.uniqueChunkBytes += length;
+        }
+        else
+        {
+            stats.unsizedChunks++;
+        }
+    }
+}
+
+/**
+ * @brief Print detailed tree structure
+ * @param node Root node to start printing from
+ * @param depth Current depth level for indentation
+ */
+void MerkleTree::print_tree_details(shared_ptr<MerkleNode> node, int depth)
+{
+    if (!node)
+        return;
+
+    // Children are pushed last-first so they print in name order, the order they are kept in
+    vector<pair<const MerkleNode *, int>> stack = {{node.get(), depth}};
+    while (!stack.empty())
+    {
+        auto [current, level] = stack.back();
+        stack.pop_back();
+
+        string indent(level * 2, ' ');
+        cout << indent << current->name;
+
+        if (current->isFile)
+        {
+            cout << " (File, Size: " << current->fileSize << " bytes, Hash: "
+                 << toHex(current->contentHash).substr(0, 8) << "...)";
+
+            if (current->chunkHashes.size() > 1)
+            {
+                cout << " [" << current->chunkHashes.size() << " chunks]";
+            }
+        }
+        else
+        {
+            cout << " (Directory, Children: " << current->children.size() << ")";
+        }
+
+        cout << endl;
+
+        if (!current->isFile)
+        {
+            for (auto it = current->children.rbegin(); it != current->children.rend(); ++it)
+            {
+                stack.push_back({it->second.get(), level + 1});
+            }
+        }
+    }
+}
+
+/**
+ * @brief Print file objects and their chunk information
+ */
+void MerkleTree::print_file_objects()
+{
+    materialize();
+
+    cout << "\n=== File Objects ===" << endl;
+
+    for (const auto &entry : file_objects)
+    {
+        const Digest &hash = entry.first;
+        const auto &node = entry.second.front();
+
+        cout << "Content Hash: " << toHex(hash) << endl;
+        for (const auto &file : entry.second)
+        {
+            cout << "  File: " << file->name << endl;
+        }
+        cout << "  Size: " << node->fileSize << " bytes" << endl;
+        cout << "  Chunks: " << node->chunkHashes.size() << endl;
+
+        if (node->chunkHashes.size() > 1)
+        {
+            cout << "  Chunk Hashes:" << endl;
+            for (size_t i = 0; i < node->chunkHashes.size(); ++i)
+            {
+                cout << "    [" << i << "] " << toHex(node->chunkHashes[i]);
+                uint32_t refs = getChunkReferences(node->chunkHashes[i]);
+                if (refs > 1)
+                {
+                    cout << " (" << refs << " references)";
+                }
+                cout << endl;
+            }
+        }
+        cout << endl;
+    }
+}
+
+/**
+ * @brief Process directory and display complete analysis
+ * @param directory_path Path to the directory to process
+ */
+void MerkleTree::process_directory(const string &directory_path)
+{
+    cout << "Processing directory: " << directory_path << endl;
+    cout << "Chunk size: " << CHUNK_SIZE << " bytes" << endl;
+    if (chunkingMode == ChunkingMode::CDC)
+    {
+        cout << "Chunking: content-defined (min " << cdcMinSize << ", average " << cdcAverageSize << ", max "
+             << cdcMaxSize << " bytes)" << endl;
+    }
+
+    try
+    {
+        auto root = build_tree(directory_path);
+
+        cout << "\n=== Tree Structure ===" << endl;
+        print_tree_details(root);
+
+        auto [totalFiles, totalDirs, totalSize] = getTreeStats();
+        cout << "\n=== Statistics ===" << endl;
+        cout << "Total files: " << totalFiles << endl;
+        cout << "Total directories: " << totalDirs << endl;
+        cout << "Total size: " << totalSize << " bytes" << endl;
+        cout << "Tree depth: " << root->getDepth() << endl;
+        cout << "Root hash: " << toHex(root->hash) << endl;
+
+        print_file_objects();
+    }
+    catch (const exception &e)
+    {
+        throw runtime_error("Error processing directory: " + string(e.what()));
+    }
+}
+
+/**
+ * @brief Get the root node of the tree
+ * @return Shared pointer to root node
  */
 shared_ptr<MerkleNode> MerkleTree::getRoot() const
 {
-    return root;
+    materialize();
+    return root;
+}
+
+/**
+ * @brief Get the root hash of the tree
+ * @return Root digest (all zero if no tree is present)
+ */
+Digest MerkleTree::getRootHash() const
+{
+    if (!root && flatTree)
+    {
+        return flatTree->node(0).hash;
+    }
+
+    return root ? root->hash : Digest{};
+}
+
+/**
+ * @brief Get the depth of the tree
+ * @return Depth of the root node (0 if no tree is present)
+ */
+int MerkleTree::getTreeDepth() const
+{
+    if (!root && flatTree)
+    {
+        return flatTree->header().treeDepth;
+    }
+
+    return root ? root->getDepth() : 0;
+}
+
+/**
+ * @brief Get tree statistics
+ * @return Tuple containing (total_files, total_directories, total_size)
+ */
+tuple<size_t, size_t, size_t> MerkleTree::getTreeStats() const
+{
+    if (!root && flatTree)
+    {
+        const SnapshotHeader &header = flatTree->header();
+        return make_tuple(header.totalFiles, header.totalDirectories, header.totalSize);
+    }
+
+    if (!root)
+    {
+        return make_tuple(0, 0, 0);
+    }
+
+    // Kept by the nodes since hashing, so this does not walk the tree
+    const SubtreeTotals &totals = root->getTotals();
+    return make_tuple(totals.fileCount, totals.directoryCount, totals.totalSize);
+}
+
+/**
+ * @brief Get the file and chunk level dedupe statistics
+ * @return Logical and unique sizes of the tree's files
+ */
+DedupeStats MerkleTree::getDedupeStats() const
+{
+    if (root || !flatTree)
+    {
+        return dedupe;
+    }
+
+    // Flat trees have no content index, so their file records are scanned once
+    DedupeStats stats{};
+    unordered_set<Digest, DigestHasher> contents;
+    unordered_map<Digest, uint32_t, DigestHasher> refs;
+    vector<Digest> chunkHashes;
+    for (uint64_t i = 0; i < flatTree->header().nodeCount; ++i)
+    {
+        const FlatNode &record = flatTree->node(i);
+        if (!(record.flags & FlatNode::FLAG_FILE))
+        {
+            continue;
+        }
+
+        stats.files++;
+        stats.logicalBytes += record.fileSize;
+        if (contents.insert(flatTree->digest(record.firstDigest)).second)
+        {
+            stats.uniqueFiles++;
+            stats.uniqueFileBytes += record.fileSize;
+        }
+
+        chunkHashes.clear();
+        for (uint32_t c = 1; c <= record.chunkCount; ++c)
+        {
+            chunkHashes.push_back(flatTree->digest(record.firstDigest + c));
+        }
+        count_chunks(stats, refs, record.fileSize, chunkHashes.data(), chunkHashes.size());
+    }
+
+    return stats;
+}
+
+/**
+ * @brief Count the references to a chunk across all files
+ * @param chunkHash Chunk hash
+ * @return Number of file chunks with this hash (0 if none)
+ */
+uint32_t MerkleTree::getChunkReferences(const Digest &chunkHash) const
+{
+    materialize();
+
+    auto it = chunk_refs.find(chunkHash);
+    return it != chunk_refs.end() ? it->second : 0;
+}
+
+/**
+ * @brief Find a node by name in the tree
+ * @param name Name to search for
+ * @return Shared pointer to found node, nullptr if not found
+ */
+shared_ptr<MerkleNode> MerkleTree::findNode(const string &name)
+{
+    if (!root && flatTree)
+    {
+        // Only the matching subtree is materialized
+        uint32_t index;
+        return flatTree->find(name, index) ? flatTree->materialize(index) : nullptr;
+    }
+
+    auto it = name_index.find(name);
+    return it != name_index.end() ? it->second.front() : nullptr;
+}
+
+/**
+ * @brief Find every node with a name
+ * @param name Name to search for
+ * @return Matching nodes in pre-order
+ */
+vector<shared_ptr<MerkleNode>> MerkleTree::findNodes(const string &name)
+{
+    if (!root && flatTree)
+    {
+        vector<shared_ptr<MerkleNode>> result;
+        for (uint32_t index : flatTree->findAll(name))
+        {
+            result.push_back(flatTree->materialize(index));
+        }
+        return result;
+    }
+
+    auto it = name_index.find(name);
+    return it != name_index.end() ? it->second : vector<shared_ptr<MerkleNode>>();
+}
+
+/**
+ * @brief Find a node by its path
+ * @param path Path relative to the tree root, or starting with the root path
+ * @return Shared pointer to found node, nullptr if not found
+ */
+shared_ptr<MerkleNode> MerkleTree::findPath(const string &path)
+{
+    return find_path(path);
+}
+
+/**
+ * @brief Build the inclusion proof of one chunk of a file
+ * @param path Path of the file, relative to the tree root (or starting with the root path)
+ * @param chunkIndex Chunk to prove
+ * @return Proof against the file node's hash
+ * @throws runtime_error If the path is not a file of the tree or the index is out of range
+ */
+ChunkProof MerkleTree::proveChunk(const string &path, size_t chunkIndex) const
+{
+    auto node = find_file(path);
+    return ChunkTree::prove(*hashEngine, node->chunkHashes, chunkIndex);
+}
+
+/**
+ * @brief Check the bytes of one chunk against the stored file hash
+ * @param path Path of the file, relative to the tree root (or starting with the root path)
+ * @param chunkIndex Position of the chunk in the file
+ * @param data Chunk bytes, e.g. read from the file
+ * @param length Number of bytes
+ * @return True if the bytes are that chunk of the file the tree was built from
+ * @throws runtime_error If the path is not a file of the tree or the index is out of range
+ *
+ * Costs one hash of the chunk and about log2(chunk count) inner hashes,
+ * however large the file is.
+ */
+bool MerkleTree::verifyChunk(const string &path, size_t chunkIndex, const void *data, size_t length) const
+{
+    auto node = find_file(path);
+    ChunkProof proof = ChunkTree::prove(*hashEngine, node->chunkHashes, chunkIndex);
+    return ChunkTree::verify(*hashEngine, node->hash, hashEngine->hash(data, length), proof);
+}
+
+/**
+ * @brief Prove that a node belongs to the tree
+ * @param path Path of the node, relative to the tree root (or starting with the root path)
+ * @return Binary inclusion proof (see InclusionProof) against getRootHash()
+ * @throws runtime_error If the path is not in the tree
+ */
+vector<uint8_t> MerkleTree::prove(const string &path) const
+{
+    InclusionProof proof;
+    proof.algorithm = hashEngine->algorithm();
+
+    if (!root && flatTree)
+    {
+        // Read straight from the flat tables, whose children are in the same name order
+        uint32_t index;
+        vector<uint32_t> chain;
+        if (!flatTree->findPath(relative_path(path), index, &chain))
+        {
+            throw runtime_error("Path not in the tree: " + path);
+        }
+        proof.nodeHash = flatTree->node(index).hash;
+
+        for (size_t depth = chain.size() - 1; depth > 0; --depth)
+        {
+            uint32_t directory = chain[depth - 1];
+            uint32_t childCount = flatTree->node(directory).childCount;
+
+            ProofLevel level;
+            level.pathIndex = 0;
+            level.entries.reserve(childCount);
+            for (uint32_t position = 0; position < childCount; ++position)
+            {
+                uint32_t child = flatTree->child(directory, position);
+                if (child == chain[depth])
+                {
+                    level.pathIndex = position;
+                }
+                level.entries.push_back({string(flatTree->name(child)), flatTree->node(child).hash});
+            }
+            proof.levels.push_back(move(level));
+        }
+
+        return proof.encode();
+    }
+
+    auto chain = find_chain(path);
+    if (chain.empty())
+    {
+        throw runtime_error("Path not in the tree: " + path);
+    }
+    proof.nodeHash = chain.back()->hash;
+
+    // Bottom-up: each directory lists its children in DirectoryHasher order
+    for (size_t depth = chain.size() - 1; depth > 0; --depth)
+    {
+        const MerkleNode &directory = *chain[depth - 1];
+        const MerkleNode *onPath = chain[depth].get();
+
+        ProofLevel level;
+        level.pathIndex = 0;
+        level.entries.reserve(directory.children.size());
+        for (const auto &child : directory.children)
+        {
+            if (child.second.get() == onPath)
+            {
+                level.pathIndex = level.entries.size();
+            }
+            level.entries.push_back({child.first, child.second->hash});
+        }
+        proof.levels.push_back(move(level));
+    }
+
+    return proof.encode();
+}
+
+/**
+ * @brief Export tree structure to JSON format
+ * @return JSON string representation of the tree
+ */
+string MerkleTree::exportToJson() const
+{
+    ostringstream out;
+    exportJson(out);
+    return out.str();
+}
+
+/**
+ * @brief Stream the tree as JSON
+ * @param out Stream receiving the export
+ * @param format Nested document or NDJSON
+ * @throws runtime_error If the stream fails
+ */
+void MerkleTree::exportJson(ostream &out, JsonFormat format) const
+{
+    JsonWriter writer(out);
+    write_json(writer, format, nullptr);
+    writer.flush();
+}
+
+/**
+ * @brief Stream the tree as JSON to a file descriptor
+ * @param fd Descriptor receiving the export (not closed)
+ * @param format Nested document or NDJSON
+ * @param control Progress and cancellation of the export, or nullptr
+ * @throws runtime_error If a write fails
+ * @throws OperationCancelled If control was cancelled (the output is then cut short)
+ */
+void MerkleTree::exportJson(int fd, JsonFormat format, JobControl *control) const
+{
+    JsonWriter writer(fd);
+    write_json(writer, format, control);
+    writer.flush();
+}
+
+/**
+ * @brief Save the tree to a binary snapshot file
+ * @param path Path of the snapshot file
+ * @throws runtime_error If there is no tree or the file cannot be written
+ */
+void MerkleTree::save(const string &path) const
+{
+    if (!root && flatTree)
+    {
+        flatTree->writeFile(path);
+        return;
+    }
+
+    if (!root)
+    {
+        throw runtime_error("No tree to save");
+    }
+
+    FlatTree::fromNodes(root, rootPath, builtChunking, hashEngine->algorithm())->writeFile(path);
+}
+
+/**
+ * @brief Load a tree from a binary snapshot file
+ * @param path Path of the snapshot file
+ * @throws runtime_error If the file is not a valid snapshot
+ */
+void MerkleTree::load(const string &path)
+{
+    auto loaded = FlatTree::mapFile(path);
+    const SnapshotHeader &header = loaded->header();
+
+    ChunkingConfig chunking = snapshot_chunking(header, path);
+    const HashEngine &engine = HashEngine::get(static_cast<HashAlgorithm>(header.hashAlgorithm));
+
+    root = nullptr;
+    clear_index();
+
+    // Later rebuilds of the same directory reuse the loaded hashes
+    rootPath = loaded->rootPath();
+    adopt_settings(chunking, engine);
+    flatTree = move(loaded);
 }
 
 /**
- * @brief Get tree statistics
- * @return Tuple containing (total_files, total_directories, total_size)
+ * @brief Get the chunking recorded in a snapshot
+ * @param header Header of the snapshot
+ * @param path Path of the snapshot, for errors
+ * @return Chunking the snapshot was built with
+ * @throws runtime_error If the recorded chunking is invalid
  */
-tuple<size_t, size_t, size_t> MerkleTree::getTreeStats() const
+ChunkingConfig MerkleTree::snapshot_chunking(const SnapshotHeader &header, const string &path)
 {
-    if (!root)
+    if (header.chunkSize < MTFSConstants::MIN_CHUNK_SIZE || header.chunkSize > MTFSConstants::MAX_CHUNK_SIZE)
     {
-        return make_tuple(0, 0, 0);
+        throw runtime_error("Invalid chunk size in snapshot: " + path);
+    }
+
+    ChunkingConfig chunking{static_cast<ChunkingMode>(header.chunkingMode), header.chunkSize, header.cdcMinSize,
+                            header.cdcAverageSize, header.cdcMaxSize};
+    if (chunking.mode == ChunkingMode::CDC)
+    {
+        validate_cdc_sizes(chunking.minSize, chunking.averageSize, chunking.maxSize);
+    }
+    else if (chunking.mode != ChunkingMode::FIXED)
+    {
+        throw runtime_error("Unknown chunking mode in snapshot: " + path);
     }
 
-    size_t files = 0, directories = 0, totalSize = 0;
-    calculateStatsRecursive(root, files, directories, totalSize);
+    return chunking;
+}
 
-    return make_tuple(files, directories, totalSize);
+/**
+ * @brief Take over the chunking and hash engine of a loaded tree
+ * @param chunking Chunking the tree was built with
+ * @param engine Engine its digests were computed with
+ */
+void MerkleTree::adopt_settings(const ChunkingConfig &chunking, const HashEngine &engine)
+{
+    CHUNK_SIZE = chunking.chunkSize;
+    chunkingMode = chunking.mode;
+    if (chunking.mode == ChunkingMode::CDC)
+    {
+        cdcMinSize = chunking.minSize;
+        cdcAverageSize = chunking.averageSize;
+        cdcMaxSize = chunking.maxSize;
+    }
+    builtChunking = chunking;
+    hashEngine = &engine;
 }
 
 /**
- * @brief Verify tree integrity by recalculating hashes
- * @return True if all hashes are valid, false otherwise
+ * @brief Convert the current tree into the compact flat node store
+ * @throws runtime_error If there is no tree
  */
-bool MerkleTree::verifyTreeIntegrity()
+void MerkleTree::compact()
 {
+    if (!root && flatTree)
+    {
+        return;
+    }
+
     if (!root)
     {
-        return true; // Empty tree is valid
+        throw runtime_error("No tree to compact");
     }
 
-    return verifyNodeIntegrity(root);
+    flatTree = FlatTree::fromNodes(root, rootPath, builtChunking, hashEngine->algorithm());
+    root = nullptr;
+    clear_index();
 }
 
 /**
- * @brief Find a node by name in the tree
- * @param name Name to search for
- * @return Shared pointer to found node, nullptr if not found
+ * @brief Keep built trees in the compact flat node store
+ * @param compactStorage True to compact after every build_tree and rebuild
  */
-shared_ptr<MerkleNode> MerkleTree::findNode(const string &name)
+void MerkleTree::setCompactStorage(bool compactStorage)
 {
-    if (!root)
+    this->compactStorage = compactStorage;
+}
+
+/**
+ * @brief Check whether built trees are compacted
+ * @return True if compact storage is enabled
+ */
+bool MerkleTree::getCompactStorage() const
+{
+    return compactStorage;
+}
+
+/**
+ * @brief Make this tree an independent copy of another one
+ * @param other Tree to copy (only read, so it may be shared with readers)
+ */
+void MerkleTree::cloneFrom(const MerkleTree &other)
+{
+    CHUNK_SIZE = other.CHUNK_SIZE;
+    threadCount = other.threadCount;
+    chunkingMode = other.chunkingMode;
+    cdcMinSize = other.cdcMinSize;
+    cdcAverageSize = other.cdcAverageSize;
+    cdcMaxSize = other.cdcMaxSize;
+    compactStorage = other.compactStorage;
+    hashEngine = other.hashEngine;
+    ioBackend = other.ioBackend;
+    walkPolicy = other.walkPolicy;
+    hashCache = other.hashCache;
+
+    root = nullptr;
+    clear_index();
+    clear_linked_files();
+    rootPath = other.rootPath;
+    builtChunking = other.builtChunking;
+
+    // Through the flat store, so the copy shares no node; a compacted tree is materialized privately
+    if (other.root)
     {
-        return nullptr;
+        flatTree = FlatTree::fromNodes(other.root, rootPath, builtChunking, hashEngine->algorithm());
+    }
+    else if (other.flatTree)
+    {
+        flatTree = FlatTree::fromNodes(other.flatTree->materialize(), rootPath, builtChunking,
+                                       hashEngine->algorithm());
+    }
+    else
+    {
+        flatTree.reset();
+    }
+}
+
+/**
+ * @brief Exchange the built trees of two MerkleTrees
+ * @param other Tree to exchange with
+ * @throws runtime_error If the trees use different hash algorithms
+ */
+void MerkleTree::swapTree(MerkleTree &other)
+{
+    if (hashEngine != other.hashEngine)
+    {
+        throw runtime_error("Cannot swap trees hashed with different algorithms");
     }
 
-    return findNodeRecursive(root, name);
+    swap(root, other.root);
+    swap(nodes, other.nodes);
+    swap(flatTree, other.flatTree);
+    swap(rootPath, other.rootPath);
+    swap(builtChunking, other.builtChunking);
+    swap(rootDevice, other.rootDevice);
+    swap(walkRoot, other.walkRoot);
+    swap(path_index, other.path_index);
+    swap(name_index, other.name_index);
+    swap(file_objects, other.file_objects);
+    swap(chunk_refs, other.chunk_refs);
+    swap(dedupe, other.dedupe);
 }
 
 /**
- * @brief Export tree structure to JSON format
- * @return JSON string representation of the tree
+ * @brief Create the node graph from the loaded snapshot, if not done yet
  */
-string MerkleTree::exportToJson() const
+void MerkleTree::materialize() const
 {
-    if (!root)
+    if (root || !flatTree)
+    {
+        return;
+    }
+
+    root = flatTree->materialize();
+    index_nodes();
+}
+
+/**
+ * @brief Get the node graph of the tree without keeping it
+ * @return The root node, or nodes created from the flat tree for the caller alone (nullptr if no tree)
+ */
+shared_ptr<MerkleNode> MerkleTree::node_graph() const
+{
+    if (!root && flatTree)
     {
-        return "{}";
+        return flatTree->materialize();
     }
 
-    return "{\n" + nodeToJson(root, 1) + "\n}";
+    return root;
 }
 
 /**
@@ -416,157 +2390,494 @@ size_t MerkleTree::getChunkSize() const
 }
 
 /**
- * @brief Recursive helper for finding nodes
- * @param node Current node to search in
- * @param name Name to search for
- * @return Shared pointer to found node, nullptr if not found
+ * @brief Set how file contents are split into chunks
+ * @param mode Fixed-size or content-defined chunks
  */
-shared_ptr<MerkleNode> MerkleTree::findNodeRecursive(shared_ptr<MerkleNode> node, const string &name)
+void MerkleTree::setChunkingMode(ChunkingMode mode)
 {
-    if (!node)
+    chunkingMode = mode;
+}
+
+/**
+ * @brief Get how file contents are split into chunks
+ * @return Current chunking mode
+ */
+ChunkingMode MerkleTree::getChunkingMode() const
+{
+    return chunkingMode;
+}
+
+/**
+ * @brief Set the chunk sizes of content-defined chunking
+ * @param minSize Smallest chunk but the last
+ * @param averageSize Expected chunk size
+ * @param maxSize Largest chunk
+ * @throws runtime_error If the sizes are out of range or not ordered
+ */
+void MerkleTree::setCdcSizes(size_t minSize, size_t averageSize, size_t maxSize)
+{
+    validate_cdc_sizes(minSize, averageSize, maxSize);
+
+    cdcMinSize = minSize;
+    cdcAverageSize = averageSize;
+    cdcMaxSize = maxSize;
+}
+
+/**
+ * @brief Get the current chunking mode and sizes
+ * @return Chunking used by the next build
+ */
+ChunkingConfig MerkleTree::getChunking() const
+{
+    return {chunkingMode, CHUNK_SIZE, cdcMinSize, cdcAverageSize, cdcMaxSize};
+}
+
+/**
+ * @brief Check content-defined chunk sizes
+ * @param minSize Smallest chunk but the last
+ * @param averageSize Expected chunk size
+ * @param maxSize Largest chunk
+ * @throws runtime_error If the sizes are out of range or not ordered
+ */
+void MerkleTree::validate_cdc_sizes(size_t minSize, size_t averageSize, size_t maxSize)
+{
+    if (minSize < MTFSConstants::MIN_CHUNK_SIZE || maxSize > MTFSConstants::MAX_CHUNK_SIZE ||
+        !(minSize < averageSize && averageSize < maxSize))
     {
-        return nullptr;
+        throw runtime_error("Invalid CDC sizes. Need " + to_string(MTFSConstants::MIN_CHUNK_SIZE) +
+                            " <= min < average < max <= " + to_string(MTFSConstants::MAX_CHUNK_SIZE) + " bytes");
     }
+}
 
-    if (node->name == name)
+/**
+ * @brief Format the chunk sizes of the built tree as JSON members
+ * @return JSON members without braces
+ */
+string MerkleTree::chunkingJson() const
+{
+    if (builtChunking.mode == ChunkingMode::CDC)
     {
-        return node;
+        return "\"cdc_min_size\": " + to_string(builtChunking.minSize) +
+               ", \"cdc_average_size\": " + to_string(builtChunking.averageSize) +
+               ", \"cdc_max_size\": " + to_string(builtChunking.maxSize);
+    }
+
+    return "\"chunk_size\": " + to_string(builtChunking.chunkSize);
+}
+
+/**
+ * @brief Set the number of threads used by build_tree
+ * @param threadCount Worker threads (1 = serial, 0 = all cores)
+ */
+void MerkleTree::setThreadCount(size_t threadCount)
+{
+    if (threadCount == 0)
+    {
+        threadCount = max<size_t>(1, thread::hardware_concurrency());
+    }
+
+    if (threadCount > MTFSConstants::MAX_THREAD_COUNT)
+    {
+        throw runtime_error("Invalid thread count. Must be between 1 and " +
+                            to_string(MTFSConstants::MAX_THREAD_COUNT));
     }
 
-    // Search in children
-    for (const auto &child : node->children)
+    this->threadCount = threadCount;
+}
+
+/**
+ * @brief Get the number of threads used by build_tree
+ * @return Current thread count
+ */
+size_t MerkleTree::getThreadCount() const
+{
+    return threadCount;
+}
+
+/**
+ * @brief Get the hash algorithm of the tree
+ * @return Hash algorithm chosen at construction (or adopted from a loaded snapshot)
+ */
+HashAlgorithm MerkleTree::getHashAlgorithm() const
+{
+    return hashEngine->algorithm();
+}
+
+/**
+ * @brief Set how file contents are read
+ * @param ioBackend I/O backend (io_uring falls back to stream when unavailable)
+ */
+void MerkleTree::setIoBackend(IoBackend ioBackend)
+{
+    this->ioBackend = ioBackend;
+}
+
+/**
+ * @brief Get how file contents are read
+ * @return Current I/O backend
+ */
+IoBackend MerkleTree::getIoBackend() const
+{
+    return ioBackend;
+}
+
+/**
+ * @brief Set what builds follow while walking directories
+ * @param walkPolicy Symlink, hard link, mount point and exclusion handling
+ * @throws runtime_error If an excluded path is not a directory inside the root
+ */
+void MerkleTree::setWalkPolicy(const WalkPolicy &walkPolicy)
+{
+    // Excluded paths are kept in the form the walk compares against
+    WalkPolicy policy = walkPolicy;
+    for (auto &excluded : policy.excluded)
     {
-        auto result = findNodeRecursive(child.second, name);
-        if (result)
+        fs::path normal = fs::path(excluded).lexically_normal();
+        if (!normal.has_filename() && normal.has_parent_path())
+        {
+            normal = normal.parent_path();
+        }
+        string key = normal.generic_string();
+        if (normal.is_absolute() || key.empty() || key == "." || key == ".." || key.rfind("../", 0) == 0)
         {
-            return result;
+            throw runtime_error("Excluded path must be a directory inside the root: " + excluded);
         }
+        excluded = key;
     }
+    this->walkPolicy = policy;
+}
 
-    return nullptr;
+/**
+ * @brief Get what builds follow while walking directories
+ * @return Current walk policy
+ */
+WalkPolicy MerkleTree::getWalkPolicy() const
+{
+    return walkPolicy;
 }
 
 /**
- * @brief Helper function to export node to JSON
- * @param node Node to export
- * @param depth Current depth for indentation
- * @return JSON string representation of the node
+ * @brief Set the cache that builds take unchanged files from
+ * @param hashCache Cache opened with HashCache::open, or nullptr to read every file
  */
-string MerkleTree::nodeToJson(shared_ptr<MerkleNode> node, int depth) const
+void MerkleTree::setHashCache(shared_ptr<HashCache> hashCache)
 {
-    if (!node)
+    this->hashCache = move(hashCache);
+}
+
+/**
+ * @brief Get the cache that builds take unchanged files from
+ * @return Current cache, or nullptr
+ */
+shared_ptr<HashCache> MerkleTree::getHashCache() const
+{
+    return hashCache;
+}
+
+/**
+ * @brief Get the directory the current tree stands for
+ * @return Root path (empty if nothing was built or loaded)
+ */
+const string &MerkleTree::getRootPath() const
+{
+    return rootPath;
+}
+
+/**
+ * @brief Find a node by its path
+ * @param path Path relative to the tree root, or starting with the root path
+ * @return Shared pointer to found node, nullptr if not found
+ */
+shared_ptr<MerkleNode> MerkleTree::find_path(const string &path) const
+{
+    if (!root && flatTree)
     {
-        return "null";
+        // Only the matching subtree is materialized, for the caller alone
+        uint32_t index;
+        return flatTree->findPath(relative_path(path), index) ? flatTree->materialize(index) : nullptr;
     }
 
-    string indent(depth * 2, ' ');
-    string childIndent((depth + 1) * 2, ' ');
+    auto it = path_index.find(relative_path(path));
+    return it != path_index.end() ? it->second : nullptr;
+}
 
-    stringstream ss;
-    ss << indent << "\"" << node->name << "\": {\n";
-    ss << childIndent << "\"type\": \"" << (node->isFile ? "file" : "directory") << "\",\n";
-    ss << childIndent << "\"hash\": \"" << node->hash << "\"";
+/**
+ * @brief Find the nodes from the root down to a path
+ * @param path Path relative to the tree root, or starting with the root path
+ * @return Root first and the node of the path last, or empty if not found
+ */
+vector<shared_ptr<MerkleNode>> MerkleTree::find_chain(const string &path) const
+{
+    materialize();
 
-    if (node->isFile)
+    if (!root)
     {
-        ss << ",\n"
-           << childIndent << "\"size\": " << node->fileSize;
-        ss << ",\n"
-           << childIndent << "\"chunks\": " << node->chunkHashes.size();
-        ss << ",\n"
-           << childIndent << "\"content_hash\": \"" << node->contentHash << "\"";
+        return {};
     }
-    else if (!node->children.empty())
-    {
-        ss << ",\n"
-           << childIndent << "\"children\": {\n";
 
-        vector<string> childNames;
-        for (const auto &child : node->children)
+    vector<shared_ptr<MerkleNode>> chain{root};
+    for (const auto &component : fs::path(relative_path(path)))
+    {
+        auto it = chain.back()->children.find(component.string());
+        if (it == chain.back()->children.end())
         {
-            childNames.push_back(child.first);
+            return {};
         }
-        sort(childNames.begin(), childNames.end());
+        chain.push_back(it->second);
+    }
+
+    return chain;
+}
+
+/**
+ * @brief Turn a user-supplied path into a path index key
+ * @param path Path relative to the tree root, or starting with the root path
+ * @return Normalized relative path ("" for the root)
+ */
+string MerkleTree::relative_path(const string &path) const
+{
+    fs::path relative = fs::path(path).lexically_normal();
+    fs::path underRoot = relative.lexically_relative(fs::path(rootPath).lexically_normal());
+    if (!underRoot.empty() && *underRoot.begin() != "..")
+    {
+        relative = underRoot;
+    }
 
-        for (size_t i = 0; i < childNames.size(); ++i)
+    string key;
+    for (const auto &component : relative)
+    {
+        if (component == "." || component.empty())
         {
-            ss << nodeToJson(node->children[childNames[i]], depth + 2);
-            if (i < childNames.size() - 1)
-            {
-                ss << ",";
-            }
-            ss << "\n";
+            continue;
         }
 
-        ss << childIndent << "}";
+        if (!key.empty())
+        {
+            key += '/';
+        }
+        key += component.string();
     }
 
-    ss << "\n"
-       << indent << "}";
-    return ss.str();
+    return key;
 }
 
 /**
- * @brief Calculate statistics recursively
- * @param node Current node
- * @param files Reference to file count
- * @param directories Reference to directory count
- * @param totalSize Reference to total size
+ * @brief Find a file node by its path
+ * @param path Path relative to the tree root, or starting with the root path
+ * @return The file node
+ * @throws runtime_error If the path is not a file of the tree
  */
-void MerkleTree::calculateStatsRecursive(shared_ptr<MerkleNode> node, size_t &files, size_t &directories, size_t &totalSize) const
+shared_ptr<MerkleNode> MerkleTree::find_file(const string &path) const
 {
-    if (!node)
+    auto node = find_path(path);
+    if (!node || !node->isFile)
     {
-        return;
+        throw runtime_error("Not a file of the tree: " + path);
     }
 
-    if (node->isFile)
+    return node;
+}
+
+/**
+ * @brief Write the whole export
+ * @param writer Destination
+ * @param format Nested document or NDJSON
+ * @param control Progress and cancellation of the export, or nullptr
+ */
+void MerkleTree::write_json(JsonWriter &writer, JsonFormat format, JobControl *control) const
+{
+    // Concurrent exports of a flat tree each walk their own nodes
+    auto graph = node_graph();
+
+    if (control)
     {
-        files++;
-        totalSize += node->fileSize;
+        auto [files, directories, totalSize] = getTreeStats();
+        control->expect(files, totalSize);
     }
-    else
+
+    if (format == JsonFormat::NDJSON)
     {
-        directories++;
-        for (const auto &child : node->children)
+        writer.raw("{\"mtfs_metadata\": ");
+        write_json_metadata(writer);
+        writer.raw("}\n");
+        if (graph)
         {
-            calculateStatsRecursive(child.second, files, directories, totalSize);
+            string path;
+            write_ndjson_node(writer, *graph, path, control);
         }
+        return;
+    }
+
+    if (!graph)
+    {
+        writer.raw("{}");
+        return;
     }
+
+    writer.raw("{\n  \"mtfs_metadata\": ");
+    write_json_metadata(writer);
+    writer.raw(",\n");
+    write_json_node(writer, *graph, 1, control);
+    writer.raw("\n}");
 }
 
 /**
- * @brief Verify node integrity recursively
- * @param node Node to verify
- * @return True if node and all children are valid
+ * @brief Write the metadata object of an export
+ * @param writer Destination
  */
-bool MerkleTree::verifyNodeIntegrity(shared_ptr<MerkleNode> node)
+void MerkleTree::write_json_metadata(JsonWriter &writer) const
 {
-    if (!node)
+    writer.raw("{\"version\": ").quoted(MTFSConstants::MTFS_VERSION);
+    writer.raw(", \"hash_algorithm\": ").quoted(hashEngine->name());
+    writer.raw(", \"chunking\": ").quoted(chunkingModeName(builtChunking.mode));
+    writer.raw(", ").raw(chunkingJson()).raw("}");
+}
+
+/**
+ * @brief Write a node and its subtree as a member of the nested document
+ * @param writer Destination
+ * @param node Node to export
+ * @param depth Current depth for indentation
+ * @param control Progress and cancellation of the export, or nullptr
+ */
+void MerkleTree::write_json_node(JsonWriter &writer, const MerkleNode &node, int depth, JobControl *control) const
+{
+    struct Level
     {
-        return true;
-    }
+        const MerkleNode *node;                                   // Directory whose children are being written
+        map<string, shared_ptr<MerkleNode>>::const_iterator next; // Its next child
+        size_t indent;                                            // Indentation of its name
+    };
+    vector<Level> stack;
+
+    // Writes a member; a non-empty directory is left open on the stack for its children
+    auto writeMember = [&](const MerkleNode &member, size_t indent)
+    {
+        size_t childIndent = indent + 2;
+        if (control)
+        {
+            control->checkCancelled();
+        }
 
-    // Store original hash
-    string originalHash = node->hash;
+        writer.spaces(indent).quoted(member.name).raw(": {\n");
+        writer.spaces(childIndent).raw("\"type\": ").raw(member.isFile ? "\"file\"" : "\"directory\"").raw(",\n");
+        writer.spaces(childIndent).raw("\"hash\": ").quoted(member.hash);
+
+        if (member.isFile)
+        {
+            writer.raw(",\n").spaces(childIndent).raw("\"size\": ").number(member.fileSize);
+            writer.raw(",\n").spaces(childIndent).raw("\"chunks\": ").number(member.chunkHashes.size());
+            writer.raw(",\n").spaces(childIndent).raw("\"content_hash\": ").quoted(member.contentHash);
+            if (control)
+            {
+                control->advance(1, member.fileSize);
+            }
+        }
+        else if (!member.children.empty())
+        {
+            writer.raw(",\n").spaces(childIndent).raw("\"children\": {\n");
+            stack.push_back({&member, member.children.begin(), indent});
+            return false;
+        }
 
-    // Recalculate hash
-    string calculatedHash = node->calculateHash();
+        writer.raw("\n").spaces(indent).raw("}");
+        return true;
+    };
 
-    // Verify hash matches
-    if (originalHash != calculatedHash)
+    writeMember(node, depth * 2);
+    while (!stack.empty())
     {
-        return false;
+        Level &level = stack.back();
+        if (level.next == level.node->children.end())
+        {
+            size_t indent = level.indent;
+            stack.pop_back();
+            writer.spaces(indent + 2).raw("}");
+            writer.raw("\n").spaces(indent).raw("}");
+        }
+        else
+        {
+            // std::map already iterates children in name order; level is not used past writeMember
+            const MerkleNode &child = *level.next->second;
+            ++level.next;
+            if (!writeMember(child, level.indent + 4))
+            {
+                continue;
+            }
+        }
+
+        // A member was closed: separate it from the next one of its directory
+        if (!stack.empty())
+        {
+            writer.raw(stack.back().next != stack.back().node->children.end() ? ",\n" : "\n");
+        }
     }
+}
 
-    // Verify all children recursively
-    for (const auto &child : node->children)
+/**
+ * @brief Write a node and its subtree as NDJSON lines
+ * @param writer Destination
+ * @param node Node to export
+ * @param path Path of the node relative to the tree root; extended in place for the children
+ * @param control Progress and cancellation of the export, or nullptr
+ */
+void MerkleTree::write_ndjson_node(JsonWriter &writer, const MerkleNode &node, string &path, JobControl *control) const
+{
+    struct Level
+    {
+        const MerkleNode *node;                                   // Directory whose children are being written
+        map<string, shared_ptr<MerkleNode>>::const_iterator next; // Its next child
+        size_t pathLength;                                        // Length of its path
+    };
+    vector<Level> stack;
+
+    // Writes the line of a node; a directory is left on the stack for its children
+    auto writeLine = [&](const MerkleNode &member)
     {
-        if (!verifyNodeIntegrity(child.second))
+        if (control)
         {
-            return false;
+            control->checkCancelled();
         }
-    }
 
-    return true;
-}
\ No newline at end of file
+        writer.raw("{\"path\": ").quoted(path);
+        writer.raw(", \"type\": ").raw(member.isFile ? "\"file\"" : "\"directory\"");
+        writer.raw(", \"hash\": ").quoted(member.hash);
+        if (member.isFile)
+        {
+            writer.raw(", \"size\": ").number(member.fileSize);
+            writer.raw(", \"chunks\": ").number(member.chunkHashes.size());
+            writer.raw(", \"content_hash\": ").quoted(member.contentHash);
+            if (control)
+            {
+                control->advance(1, member.fileSize);
+            }
+        }
+        writer.raw("}\n");
+
+        if (!member.children.empty())
+        {
+            stack.push_back({&member, member.children.begin(), path.size()});
+        }
+    };
+
+    writeLine(node);
+    while (!stack.empty())
+    {
+        Level &level = stack.back();
+        path.resize(level.pathLength);
+        if (level.next == level.node->children.end())
+        {
+            stack.pop_back();
+            continue;
+        }
+
+        const auto &child = *level.next;
+        ++level.next;
+        if (!path.empty())
+        {
+            path += '/';
+        }
+        path += child.first;
+        writeLine(*child.second);
+    }
+}
@@ -0,0 +1,492 @@
+#include "merkle.hpp"
+
+atomic<bool> BuildProfiler::active(false);
+atomic<bool> BuildProfiler::tracingActive(false);
+
+namespace
+{
+    const size_t COUNTER_COUNT = (size_t)ProfileCounter::COUNT;
+    const size_t PHASE_COUNT = (size_t)ProfilePhase::COUNT;
+    const size_t HISTOGRAM_COUNT = (size_t)ProfileHistogram::COUNT;
+
+    /**
+     * @struct TraceEvent
+     * @brief A finished span
+     */
+    struct TraceEvent
+    {
+        const char *name; // Event name
+        string detail;    // Event argument
+        uint64_t startNs; // Start time
+        uint64_t endNs;   // End time
+    };
+
+    /**
+     * @struct ThreadSlot
+     * @brief What one thread recorded
+     *
+     * Only the owning thread adds to the counters, so the relaxed atomic
+     * adds never contend; they are atomic so report() can read them and
+     * reset() can clear them while the thread runs.
+     */
+    struct ThreadSlot
+    {
+        uint32_t id;                                                               // Thread id in traces
+        atomic<uint64_t> counters[COUNTER_COUNT] = {};                             // Counter totals
+        atomic<uint64_t> phaseNs[PHASE_COUNT] = {};                                // Phase times
+        atomic<uint64_t> histograms[HISTOGRAM_COUNT][ProfileReport::BUCKETS] = {}; // Histogram buckets
+        mutex eventsLock;                                                          // Guards events
+        vector<TraceEvent> events;                                                 // Finished spans
+        bool retired = false;                                                      // Thread exited (registry lock)
+    };
+
+    /**
+     * @struct Registry
+     * @brief Slots of all threads that recorded since the last reset
+     */
+    struct Registry
+    {
+        mutex lock;                           // Guards slots and nextId
+        vector<unique_ptr<ThreadSlot>> slots; // One per thread
+        uint32_t nextId = 1;                  // Trace id of the next slot
+        atomic<uint64_t> startNs{0};          // Time of the start or reset
+        atomic<uint64_t> endNs{0};            // Time of the last finish(), 0 since the reset
+        atomic<size_t> eventCount{0};         // Trace events kept, over all threads
+        atomic<uint64_t> droppedEvents{0};    // Trace events beyond MAX_TRACE_EVENTS
+    };
+
+    Registry &registry()
+    {
+        static Registry instance;
+        return instance;
+    }
+
+    /**
+     * @struct SlotHandle
+     * @brief Thread-local link to a slot, retiring it when the thread exits
+     */
+    struct SlotHandle
+    {
+        ThreadSlot *slot = nullptr;
+
+        ~SlotHandle()
+        {
+            if (slot)
+            {
+                lock_guard<mutex> lock(registry().lock);
+                slot->retired = true;
+            }
+        }
+    };
+
+    thread_local SlotHandle threadSlot;
+
+    /**
+     * @brief Get the slot of the calling thread, creating it on first use
+     * @return Slot of the calling thread
+     */
+    ThreadSlot &localSlot()
+    {
+        if (!threadSlot.slot)
+        {
+            Registry &state = registry();
+            lock_guard<mutex> lock(state.lock);
+            state.slots.push_back(make_unique<ThreadSlot>());
+            state.slots.back()->id = state.nextId++;
+            threadSlot.slot = state.slots.back().get();
+        }
+        return *threadSlot.slot;
+    }
+
+    /**
+     * @brief Get the histogram bucket of a value
+     * @param value Recorded value
+     * @return 0 for 0, otherwise 1 + floor(log2(value)), capped at the last bucket
+     */
+    size_t bucketOf(uint64_t value)
+    {
+        size_t bucket = value == 0 ? 0 : 64 - __builtin_clzll(value);
+        return min(bucket, ProfileReport::BUCKETS - 1);
+    }
+
+    /**
+     * @brief Write a duration in microseconds with nanosecond precision
+     * @param writer Writer receiving the number
+     * @param nanoseconds Duration
+     */
+    void writeMicros(JsonWriter &writer, uint64_t nanoseconds)
+    {
+        char fraction[4] = {'.', char('0' + nanoseconds / 100 % 10), char('0' + nanoseconds / 10 % 10),
+                            char('0' + nanoseconds % 10)};
+        writer.number(nanoseconds / 1000).raw(string_view(fraction, sizeof(fraction)));
+    }
+}
+
+/**
+ * @brief Start profiling, dropping what was recorded before
+ * @param trace True to also keep trace events
+ */
+void BuildProfiler::start(bool trace)
+{
+    active = true;
+    tracingActive = trace;
+    reset();
+}
+
+/**
+ * @brief Stop recording; what was recorded stays available
+ */
+void BuildProfiler::stop()
+{
+    active = false;
+    tracingActive = false;
+}
+
+/**
+ * @brief Drop what was recorded and restart the wall clock, if profiling
+ */
+void BuildProfiler::reset()
+{
+    if (!enabled())
+    {
+        return;
+    }
+
+    Registry &state = registry();
+    lock_guard<mutex> lock(state.lock);
+
+    // Slots of threads that exited are not needed any more
+    state.slots.erase(remove_if(state.slots.begin(), state.slots.end(),
+                                [](const unique_ptr<ThreadSlot> &slot) { return slot->retired; }),
+                      state.slots.end());
+
+    for (const auto &slot : state.slots)
+    {
+        for (auto &counter : slot->counters)
+        {
+            counter = 0;
+        }
+        for (auto &phase : slot->phaseNs)
+        {
+            phase = 0;
+        }
+        for (auto &histogram : slot->histograms)
+        {
+            for (auto &bucket : histogram)
+            {
+                bucket = 0;
+            }
+        }
+
+        lock_guard<mutex> eventsLock(slot->eventsLock);
+        slot->events.clear();
+    }
+
+    state.eventCount = 0;
+    state.droppedEvents = 0;
+    state.endNs = 0;
+    state.startNs = now();
+}
+
+/**
+ * @brief Stop the wall clock at the end of a build, so later reports cover the build only
+ */
+void BuildProfiler::finish()
+{
+    if (enabled())
+    {
+        registry().endNs = now();
+    }
+}
+
+/**
+ * @brief Sum what every thread recorded
+ * @return Totals since the start or reset
+ */
+ProfileReport BuildProfiler::report()
+{
+    ProfileReport report{};
+
+    Registry &state = registry();
+    lock_guard<mutex> lock(state.lock);
+    for (const auto &slot : state.slots)
+    {
+        bool used = false;
+        for (size_t i = 0; i < COUNTER_COUNT; ++i)
+        {
+            uint64_t count = slot->counters[i].load(memory_order_relaxed);
+            report.counters[i] += count;
+            used = used || count > 0;
+        }
+        for (size_t i = 0; i < PHASE_COUNT; ++i)
+        {
+            uint64_t phaseNs = slot->phaseNs[i].load(memory_order_relaxed);
+            report.phaseNs[i] += phaseNs;
+            used = used || phaseNs > 0;
+        }
+        for (size_t i = 0; i < HISTOGRAM_COUNT; ++i)
+        {
+            for (size_t bucket = 0; bucket < ProfileReport::BUCKETS; ++bucket)
+            {
+                report.histograms[i][bucket] += slot->histograms[i][bucket].load(memory_order_relaxed);
+            }
+        }
+        report.threads += used ? 1 : 0;
+    }
+
+    uint64_t startNs = state.startNs;
+    uint64_t endNs = state.endNs > startNs ? state.endNs.load() : now();
+    report.wallNs = startNs > 0 ? endNs - startNs : 0;
+    report.traceEvents = min(state.eventCount.load(), MTFSConstants::MAX_TRACE_EVENTS);
+    report.droppedEvents = state.droppedEvents;
+    return report;
+}
+
+/**
+ * @brief Write the trace events as Chrome trace-event JSON
+ * @param out Stream receiving the document
+ * @throws runtime_error If writing fails
+ *
+ * Spans are complete ("X") events with microsecond timestamps relative to
+ * the start or reset; each thread gets a thread_name metadata event.
+ */
+void BuildProfiler::writeTrace(ostream &out)
+{
+    Registry &state = registry();
+    lock_guard<mutex> lock(state.lock);
+    uint64_t startNs = state.startNs;
+
+    JsonWriter writer(out);
+    writer.raw("{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+
+    bool first = true;
+    for (const auto &slot : state.slots)
+    {
+        lock_guard<mutex> eventsLock(slot->eventsLock);
+        if (slot->events.empty())
+        {
+            continue;
+        }
+
+        writer.raw(first ? "\n" : ",\n");
+        first = false;
+        writer.raw("{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": ").number(slot->id);
+        writer.raw(", \"args\": {\"name\": \"mtfs thread ").number(slot->id).raw("\"}}");
+
+        for (const auto &event : slot->events)
+        {
+            // Spans that began before a reset start at 0
+            uint64_t eventStart = max(event.startNs, startNs);
+            writer.raw(",\n{\"name\": ").quoted(event.name);
+            writer.raw(", \"cat\": \"mtfs\", \"ph\": \"X\", \"pid\": 1, \"tid\": ").number(slot->id);
+            writer.raw(", \"ts\": ");
+            writeMicros(writer, eventStart - startNs);
+            writer.raw(", \"dur\": ");
+            writeMicros(writer, event.endNs > eventStart ? event.endNs - eventStart : 0);
+            if (!event.detail.empty())
+            {
+                writer.raw(", \"args\": {\"detail\": ").quoted(event.detail).raw("}");
+            }
+            writer.raw("}");
+        }
+    }
+
+    writer.raw("\n]}\n");
+    writer.flush();
+}
+
+/**
+ * @brief Read the profiling clock
+ * @return Nanoseconds of a monotonic clock
+ */
+uint64_t BuildProfiler::now()
+{
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * @brief Add to a counter of the calling thread
+ * @param counter Counter to add to
+ * @param amount Amount to add
+ */
+void BuildProfiler::add_count(ProfileCounter counter, uint64_t amount)
+{
+    localSlot().counters[(size_t)counter].fetch_add(amount, memory_order_relaxed);
+}
+
+/**
+ * @brief Record a value in a histogram of the calling thread
+ * @param histogram Histogram to record in
+ * @param value Value to record
+ */
+void BuildProfiler::add_record(ProfileHistogram histogram, uint64_t value)
+{
+    localSlot().histograms[(size_t)histogram][bucketOf(value)].fetch_add(1, memory_order_relaxed);
+}
+
+/**
+ * @brief Add time to a phase of the calling thread
+ * @param phase Phase the time is charged to
+ * @param nanoseconds Time to add
+ */
+void BuildProfiler::add_phase(ProfilePhase phase, uint64_t nanoseconds)
+{
+    localSlot().phaseNs[(size_t)phase].fetch_add(nanoseconds, memory_order_relaxed);
+}
+
+/**
+ * @brief Keep a finished span, unless MAX_TRACE_EVENTS are kept already
+ * @param name Event name
+ * @param detail Event argument
+ * @param startNs Start time
+ * @param endNs End time
+ */
+void BuildProfiler::add_event(const char *name, string detail, uint64_t startNs, uint64_t endNs)
+{
+    Registry &state = registry();
+    if (state.eventCount.fetch_add(1, memory_order_relaxed) >= MTFSConstants::MAX_TRACE_EVENTS)
+    {
+        state.droppedEvents.fetch_add(1, memory_order_relaxed);
+        return;
+    }
+
+    ThreadSlot &slot = localSlot();
+    lock_guard<mutex> lock(slot.eventsLock);
+    slot.events.push_back({name, move(detail), startNs, endNs});
+}
+
+/**
+ * @brief Get the name of a profile counter
+ * @param counter Counter
+ * @return Name in snake_case, as used in JSON reports
+ */
+string profileCounterName(ProfileCounter counter)
+{
+    switch (counter)
+    {
+    case ProfileCounter::STAT_CALLS:
+        return "stat_calls";
+    case ProfileCounter::OPEN_CALLS:
+        return "open_calls";
+    case ProfileCounter::READ_BYTES:
+        return "read_bytes";
+    case ProfileCounter::HASH_BYTES:
+        return "hash_bytes";
+    case ProfileCounter::NODES_ALLOCATED:
+        return "nodes_allocated";
+    case ProfileCounter::DIRECTORIES_LISTED:
+        return "directories_listed";
+    case ProfileCounter::FILES_HASHED:
+        return "files_hashed";
+    case ProfileCounter::HASH_CACHE_HITS:
+        return "hash_cache_hits";
+    case ProfileCounter::COUNT:
+        break;
+    }
+
+    return "unknown";
+}
+
+/**
+ * @brief Get the name of a profile phase
+ * @param phase Phase
+ * @return Name in snake_case, as used in JSON reports and traces
+ */
+string profilePhaseName(ProfilePhase phase)
+{
+    switch (phase)
+    {
+    case ProfilePhase::LIST:
+        return "list";
+    case ProfilePhase::STAT:
+        return "stat";
+    case ProfilePhase::OPEN:
+        return "open";
+    case ProfilePhase::READ:
+        return "read";
+    case ProfilePhase::HASH:
+        return "hash";
+    case ProfilePhase::TREE_HASH:
+        return "tree_hash";
+    case ProfilePhase::INDEX:
+        return "index";
+    case ProfilePhase::COUNT:
+        break;
+    }
+
+    return "unknown";
+}
+
+/**
+ * @brief Get the name of a profile histogram
+ * @param histogram Histogram
+ * @return Name in snake_case, as used in JSON reports
+ */
+string profileHistogramName(ProfileHistogram histogram)
+{
+    switch (histogram)
+    {
+    case ProfileHistogram::FILE_SIZE:
+        return "file_size_bytes";
+    case ProfileHistogram::FILE_LATENCY:
+        return "file_latency_ns";
+    case ProfileHistogram::COUNT:
+        break;
+    }
+
+    return "unknown";
+}
+
+/**
+ * @brief Describe a profile report as a JSON object
+ * @param report Report to describe
+ * @return JSON object with the counters, phase times, histograms and trace totals
+ *
+ * Histograms are cut after their last non-empty bucket.
+ */
+string profileJson(const ProfileReport &report)
+{
+    ostringstream out;
+    JsonWriter writer(out);
+
+    writer.raw("{\"wall_ns\": ").number(report.wallNs);
+    writer.raw(", \"threads\": ").number(report.threads);
+
+    writer.raw(", \"counters\": {");
+    for (size_t i = 0; i < COUNTER_COUNT; ++i)
+    {
+        writer.raw(i > 0 ? ", " : "").quoted(profileCounterName((ProfileCounter)i)).raw(": ");
+        writer.number(report.counters[i]);
+    }
+
+    writer.raw("}, \"phase_ns\": {");
+    for (size_t i = 0; i < PHASE_COUNT; ++i)
+    {
+        writer.raw(i > 0 ? ", " : "").quoted(profilePhaseName((ProfilePhase)i)).raw(": ");
+        writer.number(report.phaseNs[i]);
+    }
+
+    writer.raw("}, \"histograms\": {");
+    for (size_t i = 0; i < HISTOGRAM_COUNT; ++i)
+    {
+        const ProfileReport::Buckets &buckets = report.histograms[i];
+        size_t used = ProfileReport::BUCKETS;
+        while (used > 0 && buckets[used - 1] == 0)
+        {
+            --used;
+        }
+
+        writer.raw(i > 0 ? ", " : "").quoted(profileHistogramName((ProfileHistogram)i)).raw(": [");
+        for (size_t bucket = 0; bucket < used; ++bucket)
+        {
+            writer.raw(bucket > 0 ? ", " : "").number(buckets[bucket]);
+        }
+        writer.raw("]");
+    }
+
+    writer.raw("}, \"trace_events\": ").number(report.traceEvents);
+    writer.raw(", \"dropped_events\": ").number(report.droppedEvents);
+    writer.raw("}");
+    writer.flush();
+    return out.str();
+}
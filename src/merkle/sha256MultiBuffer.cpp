@@ -0,0 +1,304 @@
+#include "merkle.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#define MTFS_X86 1
+#endif
+
+namespace
+{
+    const uint32_t ROUND_CONSTANTS[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+    const uint32_t INITIAL_STATE[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+    // Eight and sixteen 32-bit lanes (one message per lane)
+    typedef uint32_t Lanes8 __attribute__((vector_size(32)));
+    typedef uint32_t Lanes16 __attribute__((vector_size(64)));
+
+    /**
+     * @brief Get the number of 64-byte blocks of a padded message
+     * @param length Message length in bytes
+     * @return Block count including the padding block(s)
+     */
+    size_t blockCount(size_t length)
+    {
+        return (length + 9 + 63) / 64;
+    }
+
+    /**
+     * @brief Load one block of a message as big-endian words, padding included
+     * @param input Message
+     * @param index Block index (below blockCount(input.length))
+     * @param words Receives the 16 message words
+     */
+    void loadBlock(const HashInput &input, size_t index, uint32_t words[16])
+    {
+        size_t offset = index * 64;
+
+        if (offset + 64 <= input.length)
+        {
+            // Whole block inside the message
+            memcpy(words, static_cast<const uint8_t *>(input.data) + offset, 64);
+            for (int i = 0; i < 16; ++i)
+            {
+                words[i] = __builtin_bswap32(words[i]);
+            }
+            return;
+        }
+
+        uint8_t block[64] = {};
+
+        if (offset < input.length)
+        {
+            memcpy(block, static_cast<const uint8_t *>(input.data) + offset, min<size_t>(64, input.length - offset));
+        }
+
+        if (offset <= input.length && input.length - offset < 64)
+        {
+            block[input.length - offset] = 0x80;
+        }
+
+        if (index + 1 == blockCount(input.length))
+        {
+            uint64_t bits = (uint64_t)input.length * 8;
+            for (int i = 0; i < 8; ++i)
+            {
+                block[63 - i] = (uint8_t)(bits >> (8 * i));
+            }
+        }
+
+        memcpy(words, block, 64);
+        for (int i = 0; i < 16; ++i)
+        {
+            words[i] = __builtin_bswap32(words[i]);
+        }
+    }
+
+// Rotate every lane right (a macro, so no vector crosses a call boundary)
+#define MTFS_ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+    /**
+     * @brief Hash up to N messages, one per vector lane
+     * @param inputs Messages
+     * @param order Indices of the messages of this group
+     * @param count Number of messages in the group (at most N)
+     * @param digests Receives the digest of every message, by input index
+     *
+     * All lanes run the same number of compressions; a lane whose message is
+     * shorter is read out when its last block is done, and fed zero blocks
+     * afterwards. Groups are formed from length-sorted messages, so little
+     * work is wasted that way.
+     */
+    template <typename V, size_t N>
+    inline __attribute__((always_inline)) void hashGroup(const HashInput *inputs, const size_t *order,
+                                                         size_t count, Digest *digests)
+    {
+        size_t blocks[N] = {};
+        size_t maxBlocks = 0;
+        for (size_t lane = 0; lane < count; ++lane)
+        {
+            blocks[lane] = blockCount(inputs[order[lane]].length);
+            maxBlocks = max(maxBlocks, blocks[lane]);
+        }
+
+        V state[8];
+        for (int i = 0; i < 8; ++i)
+        {
+            state[i] = V{} + INITIAL_STATE[i];
+        }
+
+        alignas(64) uint32_t transposed[16][N];
+        alignas(64) uint32_t laneWords[N][16];
+
+        for (size_t index = 0; index < maxBlocks; ++index)
+        {
+            for (size_t lane = 0; lane < N; ++lane)
+            {
+                if (lane < count && index < blocks[lane])
+                {
+                    loadBlock(inputs[order[lane]], index, laneWords[lane]);
+                }
+                else
+                {
+                    memset(laneWords[lane], 0, sizeof(laneWords[lane]));
+                }
+            }
+
+            for (int t = 0; t < 16; ++t)
+            {
+                for (size_t lane = 0; lane < N; ++lane)
+                {
+                    transposed[t][lane] = laneWords[lane][t];
+                }
+            }
+
+            V w[16];
+            memcpy(w, transposed, sizeof(w));
+
+            V a = state[0], b = state[1], c = state[2], d = state[3];
+            V e = state[4], f = state[5], g = state[6], h = state[7];
+
+#pragma GCC unroll 64
+            for (int t = 0; t < 64; ++t)
+            {
+                if (t >= 16)
+                {
+                    V w15 = w[(t - 15) & 15];
+                    V w2 = w[(t - 2) & 15];
+                    V s0 = MTFS_ROTR(w15, 7) ^ MTFS_ROTR(w15, 18) ^ (w15 >> 3);
+                    V s1 = MTFS_ROTR(w2, 17) ^ MTFS_ROTR(w2, 19) ^ (w2 >> 10);
+                    w[t & 15] += s0 + w[(t - 7) & 15] + s1;
+                }
+
+                V t1 = h + (MTFS_ROTR(e, 6) ^ MTFS_ROTR(e, 11) ^ MTFS_ROTR(e, 25)) + ((e & f) ^ (~e & g)) +
+                       ROUND_CONSTANTS[t] + w[t & 15];
+                V t2 = (MTFS_ROTR(a, 2) ^ MTFS_ROTR(a, 13) ^ MTFS_ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+                h = g;
+                g = f;
+                f = e;
+                e = d + t1;
+                d = c;
+                c = b;
+                b = a;
+                a = t1 + t2;
+            }
+
+            state[0] += a;
+            state[1] += b;
+            state[2] += c;
+            state[3] += d;
+            state[4] += e;
+            state[5] += f;
+            state[6] += g;
+            state[7] += h;
+
+            // Read out the lanes whose message ended with this block
+            for (size_t lane = 0; lane < count; ++lane)
+            {
+                if (blocks[lane] != index + 1)
+                {
+                    continue;
+                }
+
+                Digest &digest = digests[order[lane]];
+                for (int i = 0; i < 8; ++i)
+                {
+                    uint32_t word = state[i][lane];
+                    digest[4 * i] = (uint8_t)(word >> 24);
+                    digest[4 * i + 1] = (uint8_t)(word >> 16);
+                    digest[4 * i + 2] = (uint8_t)(word >> 8);
+                    digest[4 * i + 3] = (uint8_t)word;
+                }
+            }
+        }
+    }
+
+#ifdef MTFS_X86
+    __attribute__((target("avx2"))) void hashGroupAvx2(const HashInput *inputs, const size_t *order,
+                                                        size_t count, Digest *digests)
+    {
+        hashGroup<Lanes8, 8>(inputs, order, count, digests);
+    }
+
+    __attribute__((target("avx512f"))) void hashGroupAvx512(const HashInput *inputs, const size_t *order,
+                                                             size_t count, Digest *digests)
+    {
+        hashGroup<Lanes16, 16>(inputs, order, count, digests);
+    }
+#endif
+}
+
+/**
+ * @brief Get the number of messages the multi-buffer SHA-256 kernel hashes at once
+ * @return 16 (AVX-512), 8 (AVX2), or 1 if no kernel can run on this CPU
+ */
+size_t sha256MultiBufferLanes()
+{
+#ifdef MTFS_X86
+    static const size_t lanes = []
+    {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f"))
+        {
+            return 16;
+        }
+        if (__builtin_cpu_supports("avx2"))
+        {
+            return 8;
+        }
+        return 1;
+    }();
+    return lanes;
+#else
+    return 1;
+#endif
+}
+
+/**
+ * @brief Check whether the CPU has the SHA extensions (SHA-NI)
+ * @return True if single-message SHA-256 runs in hardware
+ */
+bool sha256HardwareSupport()
+{
+#ifdef MTFS_X86
+    static const bool supported = []
+    {
+        unsigned int eax, ebx, ecx, edx;
+        return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_SHA);
+    }();
+    return supported;
+#else
+    return false;
+#endif
+}
+
+/**
+ * @brief Hash independent messages with the multi-buffer SHA-256 kernel
+ * @param inputs Messages to hash
+ * @param count Number of messages
+ * @param digests Receives one digest per message, in input order
+ * @throws runtime_error If sha256MultiBufferLanes() is 1
+ *
+ * Messages are sorted by length and hashed in groups of
+ * sha256MultiBufferLanes(), so each group has lanes of similar length.
+ */
+void sha256MultiBuffer(const HashInput *inputs, size_t count, Digest *digests)
+{
+    size_t lanes = sha256MultiBufferLanes();
+    if (lanes == 1)
+    {
+        throw runtime_error("No multi-buffer SHA-256 kernel for this CPU");
+    }
+
+    vector<size_t> order(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        order[i] = i;
+    }
+    sort(order.begin(), order.end(), [inputs](size_t left, size_t right)
+         { return inputs[left].length < inputs[right].length; });
+
+    for (size_t first = 0; first < count; first += lanes)
+    {
+        size_t groupSize = min(lanes, count - first);
+#ifdef MTFS_X86
+        if (lanes == 16)
+        {
+            hashGroupAvx512(inputs, order.data() + first, groupSize, digests);
+        }
+        else
+        {
+            hashGroupAvx2(inputs, order.data() + first, groupSize, digests);
+        }
+#endif
+    }
+}
@@ -0,0 +1,179 @@
+#include "merkle.hpp"
+
+namespace
+{
+    // Pool and deque index of the worker running on this thread, if any
+    thread_local const ThreadPool *currentPool = nullptr;
+    thread_local size_t currentWorker = 0;
+}
+
+/**
+ * @brief Start a pool with the given number of workers
+ * @param threadCount Number of worker threads (at least 1)
+ */
+ThreadPool::ThreadPool(size_t threadCount)
+    : pending(0), queued(0), stopping(false), nextQueue(0)
+{
+    if (threadCount == 0)
+    {
+        threadCount = 1;
+    }
+
+    for (size_t i = 0; i < threadCount; ++i)
+    {
+        queues.push_back(make_unique<WorkerQueue>());
+    }
+
+    for (size_t i = 0; i < threadCount; ++i)
+    {
+        workers.emplace_back(&ThreadPool::workerLoop, this, i);
+    }
+}
+
+/**
+ * @brief Stop all workers after the queued tasks have run
+ */
+ThreadPool::~ThreadPool()
+{
+    {
+        lock_guard<mutex> lock(stateLock);
+        stopping = true;
+    }
+    wakeup.notify_all();
+
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+}
+
+/**
+ * @brief Queue a task for execution
+ * @param task Callable to run on one of the workers
+ */
+void ThreadPool::submit(function<void()> task)
+{
+    size_t index;
+    if (currentPool == this)
+    {
+        index = currentWorker;
+    }
+    else
+    {
+        index = nextQueue.fetch_add(1, memory_order_relaxed) % queues.size();
+    }
+
+    // Counted before it is visible, so a thief that runs it at once cannot
+    // take the counters below the tasks still outstanding
+    {
+        lock_guard<mutex> lock(stateLock);
+        ++pending;
+        ++queued;
+    }
+
+    {
+        lock_guard<mutex> lock(queues[index]->lock);
+        queues[index]->tasks.push_back(move(task));
+    }
+    wakeup.notify_one();
+}
+
+/**
+ * @brief Block until every submitted task has finished
+ */
+void ThreadPool::wait()
+{
+    unique_lock<mutex> lock(stateLock);
+    idle.wait(lock, [this]
+              { return pending == 0; });
+}
+
+/**
+ * @brief Get the number of worker threads
+ * @return Worker thread count
+ */
+size_t ThreadPool::size() const
+{
+    return workers.size();
+}
+
+/**
+ * @brief Main loop of a worker thread
+ * @param index Index of the worker's own deque
+ */
+void ThreadPool::workerLoop(size_t index)
+{
+    currentPool = this;
+    currentWorker = index;
+
+    while (true)
+    {
+        function<void()> task;
+        if (takeTask(index, task))
+        {
+            try
+            {
+                task();
+            }
+            catch (...)
+            {
+                // Tasks report their own errors
+            }
+
+            lock_guard<mutex> lock(stateLock);
+            if (--pending == 0)
+            {
+                idle.notify_all();
+            }
+            continue;
+        }
+
+        unique_lock<mutex> lock(stateLock);
+        wakeup.wait(lock, [this]
+                    { return stopping || queued > 0; });
+        if (stopping && queued == 0)
+        {
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Take a task from the worker's own deque or steal one
+ * @param index Index of the worker's own deque
+ * @param task Receives the task on success
+ * @return True if a task was taken
+ */
+bool ThreadPool::takeTask(size_t index, function<void()> &task)
+{
+    // Own deque first, newest task first
+    {
+        lock_guard<mutex> lock(queues[index]->lock);
+        if (!queues[index]->tasks.empty())
+        {
+            task = move(queues[index]->tasks.back());
+            queues[index]->tasks.pop_back();
+        }
+    }
+
+    // Otherwise steal the oldest task of another worker
+    for (size_t i = 1; !task && i < queues.size(); ++i)
+    {
+        WorkerQueue &victim = *queues[(index + i) % queues.size()];
+        lock_guard<mutex> lock(victim.lock);
+        if (!victim.tasks.empty())
+        {
+            task = move(victim.tasks.front());
+            victim.tasks.pop_front();
+        }
+    }
+
+    if (!task)
+    {
+        return false;
+    }
+
+    lock_guard<mutex> lock(stateLock);
+    --queued;
+    return true;
+}
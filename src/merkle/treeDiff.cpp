@@ -0,0 +1,194 @@
+#include "merkle.hpp"
+
+namespace
+{
+    /**
+     * @class DiffCursor
+     * @brief A node of either a MerkleNode graph or a FlatTree
+     *
+     * A cursor with neither storage stands for an empty directory, so an
+     * empty tree compares like a root without children.
+     */
+    class DiffCursor
+    {
+    public:
+        DiffCursor() : graph(nullptr), flat(nullptr), index(0)
+        {
+        }
+
+        explicit DiffCursor(const MerkleNode *graph) : graph(graph), flat(nullptr), index(0)
+        {
+        }
+
+        DiffCursor(const FlatTree *flat, uint32_t index) : graph(nullptr), flat(flat), index(index)
+        {
+        }
+
+        bool isFile() const
+        {
+            if (graph)
+            {
+                return graph->isFile;
+            }
+            return flat && (flat->node(index).flags & FlatNode::FLAG_FILE);
+        }
+
+        Digest hash() const
+        {
+            if (graph)
+            {
+                return graph->hash;
+            }
+            return flat ? flat->node(index).hash : Digest{};
+        }
+
+        bool empty() const
+        {
+            return !graph && !flat;
+        }
+
+        /**
+         * @brief List the children in name order
+         * @param children Receives (name, child) pairs; names stay valid while the tree lives
+         */
+        void children(vector<pair<string_view, DiffCursor>> &children) const
+        {
+            children.clear();
+            if (graph)
+            {
+                for (const auto &child : graph->children)
+                {
+                    children.emplace_back(child.first, DiffCursor(child.second.get()));
+                }
+            }
+            else if (flat && !isFile())
+            {
+                for (uint32_t i = 0; i < flat->node(index).childCount; ++i)
+                {
+                    uint32_t childIndex = flat->child(index, i);
+                    children.emplace_back(flat->name(childIndex), DiffCursor(flat, childIndex));
+                }
+            }
+        }
+
+    private:
+        const MerkleNode *graph; // Node of a graph, if any
+        const FlatTree *flat;    // Flat tree, if any
+        uint32_t index;          // Node index in the flat tree
+    };
+
+    /**
+     * @brief Compare two nodes at the same path
+     * @param before Node in the first tree
+     * @param after Node in the second tree
+     * @param path Path of both nodes
+     * @param changes Receives the differences
+     */
+    void diffNodes(const DiffCursor &before, const DiffCursor &after, const string &path,
+                   vector<TreeChange> &changes)
+    {
+        if (before.isFile() != after.isFile())
+        {
+            changes.push_back({ChangeType::REMOVED, path, before.isFile(), before.hash(), Digest{}});
+            changes.push_back({ChangeType::ADDED, path, after.isFile(), Digest{}, after.hash()});
+            return;
+        }
+
+        if (before.isFile())
+        {
+            changes.push_back({ChangeType::MODIFIED, path, true, before.hash(), after.hash()});
+            return;
+        }
+
+        vector<pair<string_view, DiffCursor>> left, right;
+        before.children(left);
+        after.children(right);
+
+        // Both child lists are sorted by name: merge them
+        size_t i = 0, j = 0;
+        while (i < left.size() || j < right.size())
+        {
+            int order = i == left.size()    ? 1
+                        : j == right.size() ? -1
+                                            : left[i].first.compare(right[j].first);
+
+            string_view name = order <= 0 ? left[i].first : right[j].first;
+            string childPath = path.empty() ? string(name) : path + "/" + string(name);
+
+            if (order < 0)
+            {
+                const DiffCursor &child = left[i++].second;
+                changes.push_back({ChangeType::REMOVED, childPath, child.isFile(), child.hash(), Digest{}});
+            }
+            else if (order > 0)
+            {
+                const DiffCursor &child = right[j++].second;
+                changes.push_back({ChangeType::ADDED, childPath, child.isFile(), Digest{}, child.hash()});
+            }
+            else
+            {
+                const DiffCursor &leftChild = left[i++].second;
+                const DiffCursor &rightChild = right[j++].second;
+                if (leftChild.hash() != rightChild.hash())
+                {
+                    diffNodes(leftChild, rightChild, childPath, changes);
+                }
+            }
+        }
+    }
+}
+
+/**
+ * @brief List the differences between this tree and another one
+ * @param other Tree to compare with (e.g. a newer build of the same directory)
+ * @return Changes that turn this tree into other, in path order
+ * @throws runtime_error If the trees use different hash algorithms
+ */
+vector<TreeChange> MerkleTree::diff(const MerkleTree &other) const
+{
+    if (hashEngine->algorithm() != other.hashEngine->algorithm())
+    {
+        throw runtime_error("Cannot diff trees built with different hash algorithms (" + hashEngine->name() +
+                            " and " + other.hashEngine->name() + ")");
+    }
+
+    auto rootOf = [](const MerkleTree &tree)
+    {
+        if (tree.root)
+        {
+            return DiffCursor(tree.root.get());
+        }
+        return tree.flatTree ? DiffCursor(tree.flatTree.get(), 0) : DiffCursor();
+    };
+
+    DiffCursor before = rootOf(*this);
+    DiffCursor after = rootOf(other);
+
+    vector<TreeChange> changes;
+    if (before.empty() || after.empty() || before.hash() != after.hash())
+    {
+        diffNodes(before, after, "", changes);
+    }
+
+    return changes;
+}
+
+/**
+ * @brief Get the canonical name of a change type
+ * @param type Change type
+ * @return Name ("added", "removed" or "modified")
+ */
+string changeTypeName(ChangeType type)
+{
+    switch (type)
+    {
+    case ChangeType::ADDED:
+        return "added";
+    case ChangeType::REMOVED:
+        return "removed";
+    case ChangeType::MODIFIED:
+        return "modified";
+    }
+
+    return "unknown";
+}
@@ -0,0 +1,287 @@
+#include "merkle.hpp"
+
+namespace
+{
+    /**
+     * @brief Split a mount path into its names
+     * @param mountPath Path relative to the merged root, with '/' separators
+     * @return Names from the root down (empty for the root itself)
+     * @throws runtime_error If the path leaves the merged root
+     */
+    vector<string> splitMountPath(const string &mountPath)
+    {
+        vector<string> names;
+        for (const auto &part : fs::path(mountPath))
+        {
+            string name = part.string();
+            if (name.empty() || name == "." || name == "/")
+            {
+                continue;
+            }
+            if (name == "..")
+            {
+                throw runtime_error("Shard mount point leaves the merged root: " + mountPath);
+            }
+            names.push_back(name);
+        }
+        return names;
+    }
+
+    /**
+     * @brief A shard snapshot with its mount point split into names
+     */
+    struct MappedShard
+    {
+        const TreeShard *shard;        // Shard as given
+        vector<string> names;          // Mount point, from the root down
+        unique_ptr<FlatTree> snapshot; // Mapped snapshot
+    };
+
+    /**
+     * @brief A directory of the merged tree that no shard stands for
+     */
+    struct CreatedDirectory
+    {
+        MerkleNode *node; // Directory node
+        fs::path path;    // Path relative to the merged root
+    };
+}
+
+/**
+ * @brief Combine independently built shard snapshots into one tree
+ * @param rootPath Directory the merged tree stands for
+ * @param shards Snapshots and where they are mounted
+ * @throws runtime_error If a snapshot is invalid, the shards were built with
+ *         different algorithms or chunkings, a mount point is taken, or a
+ *         directory the shards leave uncovered cannot be listed
+ */
+void MerkleTree::mergeShards(const string &rootPath, const vector<TreeShard> &shards)
+{
+    ProfiledRun run("merge", rootPath);
+
+    if (shards.empty())
+    {
+        throw runtime_error("No shards to merge");
+    }
+
+    // Every digest of the merged tree must come from the same algorithm and chunking
+    vector<MappedShard> mapped;
+    const HashEngine *engine = nullptr;
+    ChunkingConfig chunking{};
+    for (const auto &shard : shards)
+    {
+        auto snapshot = FlatTree::mapFile(shard.snapshotPath);
+        const SnapshotHeader &header = snapshot->header();
+        ChunkingConfig shardChunking = snapshot_chunking(header, shard.snapshotPath);
+        const HashEngine &shardEngine = HashEngine::get(static_cast<HashAlgorithm>(header.hashAlgorithm));
+
+        if (!engine)
+        {
+            engine = &shardEngine;
+            chunking = shardChunking;
+        }
+        else if (&shardEngine != engine)
+        {
+            throw runtime_error("Shard " + shard.snapshotPath + " was hashed with " + shardEngine.name() +
+                                ", not " + engine->name());
+        }
+        else if (shardChunking != chunking)
+        {
+            throw runtime_error("Shard " + shard.snapshotPath + " was chunked differently from the other shards");
+        }
+
+        mapped.push_back({&shard, splitMountPath(shard.mountPath), move(snapshot)});
+    }
+
+    // Shallow mount points first, so a shard can be mounted inside another
+    stable_sort(mapped.begin(), mapped.end(),
+                [](const MappedShard &a, const MappedShard &b) { return a.names.size() < b.names.size(); });
+
+    string rootName = fs::path(rootPath).filename().string();
+    shared_ptr<MerkleNode> merged;
+    vector<MerkleNode *> grafted;
+    vector<CreatedDirectory> created;
+    for (auto &shard : mapped)
+    {
+        TraceSpan span("shard", shard.shard->snapshotPath);
+        auto shardRoot = shard.snapshot->materialize();
+        shard.snapshot.reset();
+
+        if (shard.names.empty())
+        {
+            if (merged)
+            {
+                throw runtime_error("More than one shard is mounted at the merged root");
+            }
+            shardRoot->name = rootName;
+            merged = shardRoot;
+            grafted.push_back(merged.get());
+            continue;
+        }
+
+        if (!merged)
+        {
+            merged = make_shared<MerkleNode>(rootName, false);
+            grafted.push_back(merged.get());
+            created.push_back({merged.get(), fs::path()});
+        }
+
+        MerkleNode *parent = merged.get();
+        for (size_t i = 0; i + 1 < shard.names.size(); ++i)
+        {
+            auto it = parent->children.find(shard.names[i]);
+            if (it == parent->children.end())
+            {
+                auto directory = make_shared<MerkleNode>(shard.names[i], false);
+                parent->addChild(directory);
+                parent = directory.get();
+
+                fs::path path;
+                for (size_t j = 0; j <= i; ++j)
+                {
+                    path /= shard.names[j];
+                }
+                created.push_back({parent, path});
+            }
+            else if (it->second->isFile)
+            {
+                throw runtime_error("Shard mount point is below a file: " + shard.shard->mountPath);
+            }
+            else
+            {
+                parent = it->second.get();
+            }
+        }
+
+        // A base built with oneFileSystem leaves the mount point as an empty directory
+        auto it = parent->children.find(shard.names.back());
+        if (it != parent->children.end() && count(grafted.begin(), grafted.end(), it->second.get()))
+        {
+            throw runtime_error("More than one shard is mounted at " + shard.shard->mountPath);
+        }
+        if (it != parent->children.end() && (it->second->isFile || !it->second->children.empty()))
+        {
+            throw runtime_error("Shard mount point is not an empty directory: " + shard.shard->mountPath);
+        }
+
+        shardRoot->name = shard.names.back();
+        parent->addChild(shardRoot);
+        grafted.push_back(shardRoot.get());
+    }
+
+    // Only the grafted roots and their ancestors change, children before parents
+    map<MerkleNode *, size_t> dirty;
+    for (MerkleNode *node : grafted)
+    {
+        for (MerkleNode *current = node; current && !dirty.count(current); current = current->parent)
+        {
+            size_t depth = 0;
+            for (MerkleNode *up = current->parent; up; up = up->parent)
+            {
+                depth++;
+            }
+            dirty[current] = depth;
+        }
+    }
+
+    vector<pair<size_t, MerkleNode *>> order;
+    for (const auto &entry : dirty)
+    {
+        order.emplace_back(entry.second, entry.first);
+    }
+    sort(order.begin(), order.end(), [](const auto &a, const auto &b) { return a.first > b.first; });
+
+    root = merged;
+    flatTree.reset();
+    clear_index();
+    clear_linked_files();
+    this->rootPath = rootPath;
+    adopt_settings(chunking, *engine);
+
+    // The created directories are dirty, so their new children are rehashed with them
+    if (!created.empty())
+    {
+        if (statEntry(rootPath, true, &rootDevice) != EntryType::DIRECTORY)
+        {
+            throw runtime_error("Cannot read the entries no shard covers: not a directory: " + rootPath);
+        }
+        walkRoot = rootPath;
+        for (const auto &directory : created)
+        {
+            add_uncovered_entries(*directory.node, walkRoot / directory.path);
+        }
+        if (hashCache)
+        {
+            hashCache->flush();
+        }
+    }
+
+    {
+        PhaseTimer timer(ProfilePhase::TREE_HASH);
+        for (const auto &entry : order)
+        {
+            entry.second->updateHash(*hashEngine);
+        }
+    }
+
+    index_nodes();
+
+    if (compactStorage)
+    {
+        compact();
+    }
+}
+
+/**
+ * @brief Build the entries of a merged directory that no shard covers
+ * @param directory Directory created by mergeShards
+ * @param path Filesystem path of the directory
+ * @throws PathTooLong If a path below it is longer than the kernel accepts
+ * @throws runtime_error If the directory cannot be listed
+ */
+void MerkleTree::add_uncovered_entries(MerkleNode &directory, const fs::path &path)
+{
+    bool followSymlinks = walkPolicy.symlinks == SymlinkPolicy::FOLLOW;
+    DirectoryListing listing;
+    try
+    {
+        listing = scanDirectory(path, followSymlinks);
+    }
+    catch (const PathTooLong &)
+    {
+        throw;
+    }
+    catch (const exception &e)
+    {
+        throw runtime_error("Cannot read the entries no shard covers in " + path.string() + ": " + e.what());
+    }
+
+    for (const auto &entry : listing.entries)
+    {
+        if (directory.children.count(entry.name) || entry.type == EntryType::SYMLINK)
+        {
+            continue;
+        }
+
+        // As in a build, entries that cannot be read are left out
+        fs::path childPath = path / entry.name;
+        try
+        {
+            if (entry.type == EntryType::MISSING)
+            {
+                throw runtime_error(entry.error ? string("Cannot stat: ") + strerror(entry.error) : "Path does not exist");
+            }
+            auto child = build_node(childPath, entry.type);
+            child->calculateHash(*hashEngine);
+            directory.addChild(child);
+        }
+        catch (const PathTooLong &)
+        {
+            throw;
+        }
+        catch (const exception &e)
+        {
+            cerr << "Warning: Skipping " << childPath.string() << " - " << e.what() << endl;
+        }
+    }
+}
@@ -0,0 +1,309 @@
+#include "merkle.hpp"
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+
+namespace
+{
+    const char SYNC_MAGIC[8] = {'M', 'T', 'F', 'S', 'S', 'Y', 'N', 'C'};
+
+    /**
+     * @brief Find the content-defined chunk lengths of a file by scanning it again
+     * @param path Filesystem path of the file
+     * @param chunking Chunking the file was hashed with (CDC mode)
+     * @return Chunk lengths in file order
+     * @throws runtime_error If the file cannot be read
+     */
+    vector<uint64_t> scanChunkLengths(const string &path, const ChunkingConfig &chunking)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            throw runtime_error("Cannot open file: " + path);
+        }
+
+        CdcChunker chunker(chunking.minSize, chunking.averageSize, chunking.maxSize);
+        vector<uint8_t> buffer(max(chunking.maxChunkSize(), MTFSConstants::HASH_PIECE_SIZE));
+        vector<size_t> cuts;
+        vector<uint64_t> lengths;
+        uint64_t position = 0;
+        uint64_t chunkStart = 0;
+        while (true)
+        {
+            ssize_t bytesRead = ::read(fd, buffer.data(), buffer.size());
+            if (bytesRead < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (bytesRead < 0)
+            {
+                ::close(fd);
+                throw runtime_error("Error reading file: " + path);
+            }
+            if (bytesRead == 0)
+            {
+                break;
+            }
+
+            chunker.scan(buffer.data(), bytesRead, cuts);
+            for (size_t cut : cuts)
+            {
+                lengths.push_back(position + cut - chunkStart);
+                chunkStart = position + cut;
+            }
+            position += bytesRead;
+        }
+        ::close(fd);
+
+        // The last chunk ends with the file
+        if (position > chunkStart)
+        {
+            lengths.push_back(position - chunkStart);
+        }
+        return lengths;
+    }
+
+    /**
+     * @brief Write a whole buffer to a descriptor
+     * @param fd Descriptor
+     * @param data Bytes to write
+     * @param length Number of bytes
+     * @throws runtime_error If a write fails
+     */
+    void writeAll(int fd, const void *data, size_t length)
+    {
+        const char *bytes = static_cast<const char *>(data);
+        while (length > 0)
+        {
+            ssize_t written = ::write(fd, bytes, length);
+            if (written < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (written < 0)
+            {
+                throw runtime_error("Error writing chunk stream");
+            }
+            bytes += written;
+            length -= written;
+        }
+    }
+
+    /**
+     * @brief Copy a byte range of a file to a descriptor
+     * @param out Descriptor receiving the bytes
+     * @param in Descriptor of the file
+     * @param offset Start of the range
+     * @param length Length of the range
+     * @param path Path of the file, for errors
+     * @throws runtime_error If the file ends early or a transfer fails
+     *
+     * Uses sendfile, and pread/write where the descriptors do not support it.
+     */
+    void sendRange(int out, int in, uint64_t offset, uint64_t length, const string &path)
+    {
+        off_t position = offset;
+        bool zeroCopy = true;
+        vector<char> buffer;
+        while (length > 0)
+        {
+            ssize_t sent;
+            if (zeroCopy)
+            {
+                sent = ::sendfile(out, in, &position, min<uint64_t>(length, 1 << 30));
+                if (sent < 0 && (errno == EINVAL || errno == ENOSYS))
+                {
+                    zeroCopy = false;
+                    continue;
+                }
+            }
+            else
+            {
+                buffer.resize(min<uint64_t>(length, MTFSConstants::HASH_PIECE_SIZE));
+                sent = ::pread(in, buffer.data(), buffer.size(), position);
+                if (sent > 0)
+                {
+                    writeAll(out, buffer.data(), sent);
+                    position += sent;
+                }
+            }
+
+            if (sent < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (sent < 0)
+            {
+                throw runtime_error("Error sending chunks of " + path);
+            }
+            if (sent == 0)
+            {
+                throw runtime_error("File shrank since the sync plan: " + path);
+            }
+            BuildProfiler::count(ProfileCounter::READ_BYTES, sent);
+            length -= sent;
+        }
+    }
+}
+
+/**
+ * @brief Plan the transfer that turns a remote tree into this one
+ * @param remote Tree of the receiver (e.g. a snapshot it sent)
+ * @return Changed files with the chunks the receiver lacks
+ * @throws runtime_error If the trees use different hash algorithms or
+ *         chunkings, or a content-defined file cannot be re-read
+ */
+SyncPlan MerkleTree::planSync(const MerkleTree &remote) const
+{
+    if (builtChunking != remote.builtChunking)
+    {
+        throw runtime_error("Cannot plan a sync between trees chunked differently");
+    }
+
+    // The remote tree is the older one: changes are what the receiver lacks
+    vector<TreeChange> changes = remote.diff(*this);
+
+    SyncPlan plan;
+    vector<pair<const MerkleNode *, string>> files;
+    vector<shared_ptr<MerkleNode>> found; // Keeps the nodes of files alive: a flat tree creates them for this plan only
+    for (const auto &change : changes)
+    {
+        if (change.type == ChangeType::REMOVED)
+        {
+            plan.removed.push_back(change.path);
+            continue;
+        }
+
+        found.push_back(find_path(change.path));
+        if (change.isFile)
+        {
+            files.emplace_back(found.back().get(), change.path);
+            continue;
+        }
+
+        // An added directory stands for its whole subtree, listed in path order
+        vector<pair<const MerkleNode *, string>> stack = {{found.back().get(), change.path}};
+        while (!stack.empty())
+        {
+            auto [node, path] = stack.back();
+            stack.pop_back();
+            if (node->isFile)
+            {
+                files.emplace_back(node, path);
+                continue;
+            }
+
+            plan.directories.push_back(path);
+            for (auto it = node->children.rbegin(); it != node->children.rend(); ++it)
+            {
+                stack.emplace_back(it->second.get(), path + "/" + it->first);
+            }
+        }
+    }
+
+    unordered_set<Digest, DigestHasher> sent;
+    for (const auto &[node, path] : files)
+    {
+        SyncFile file;
+        file.path = path;
+        file.fileSize = node->fileSize;
+        file.contentHash = node->contentHash;
+
+        size_t chunkCount = node->chunkHashes.size();
+        vector<uint64_t> lengths(chunkCount);
+        bool sized = true;
+        for (size_t i = 0; i < chunkCount && sized; ++i)
+        {
+            sized = builtChunking.chunkLength(node->fileSize, i, chunkCount, lengths[i]);
+        }
+        if (!sized)
+        {
+            string filePath = (fs::path(rootPath) / path).string();
+            lengths = scanChunkLengths(filePath, builtChunking);
+            if (lengths.size() != chunkCount)
+            {
+                throw runtime_error("File changed since the tree was built: " + filePath);
+            }
+        }
+
+        uint64_t offset = 0;
+        for (size_t i = 0; i < chunkCount; ++i)
+        {
+            const Digest &hash = node->chunkHashes[i];
+            bool send = remote.getChunkReferences(hash) == 0 && sent.insert(hash).second;
+            file.chunks.push_back({hash, offset, lengths[i], send});
+            offset += lengths[i];
+
+            if (send)
+            {
+                plan.sentBytes += lengths[i];
+                plan.sentChunks++;
+            }
+        }
+
+        plan.fileBytes += file.fileSize;
+        plan.files.push_back(move(file));
+    }
+
+    return plan;
+}
+
+/**
+ * @brief Write the sent chunks of a plan as a chunk stream
+ * @param plan Plan made by planSync on this tree
+ * @param fd Descriptor receiving the stream (file, pipe or socket; not closed)
+ * @throws runtime_error If a file cannot be read or a write fails
+ */
+void MerkleTree::sendChunks(const SyncPlan &plan, int fd) const
+{
+    SyncStreamHeader header = {};
+    memcpy(header.magic, SYNC_MAGIC, sizeof(SYNC_MAGIC));
+    header.version = MTFSConstants::SYNC_STREAM_VERSION;
+    header.hashAlgorithm = static_cast<uint32_t>(hashEngine->algorithm());
+    header.chunkCount = plan.sentChunks;
+    header.chunkBytes = plan.sentBytes;
+    writeAll(fd, &header, sizeof(header));
+
+    for (const auto &file : plan.files)
+    {
+        int in = -1;
+        string filePath = (fs::path(rootPath) / file.path).string();
+        try
+        {
+            for (const auto &chunk : file.chunks)
+            {
+                if (!chunk.sent)
+                {
+                    continue;
+                }
+
+                if (in < 0)
+                {
+                    BuildProfiler::count(ProfileCounter::OPEN_CALLS);
+                    in = ::open(filePath.c_str(), O_RDONLY | O_CLOEXEC);
+                    if (in < 0)
+                    {
+                        throw runtime_error("Cannot open file: " + filePath);
+                    }
+                }
+
+                writeAll(fd, chunk.hash.data(), chunk.hash.size());
+                writeAll(fd, &chunk.length, sizeof(chunk.length));
+                sendRange(fd, in, chunk.offset, chunk.length, filePath);
+            }
+        }
+        catch (...)
+        {
+            if (in >= 0)
+            {
+                ::close(in);
+            }
+            throw;
+        }
+
+        if (in >= 0)
+        {
+            ::close(in);
+        }
+    }
+}
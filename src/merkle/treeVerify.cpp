@@ -0,0 +1,309 @@
+#include "merkle.hpp"
+
+namespace
+{
+    /**
+     * @brief List the files of a subtree with their paths
+     * @param node Subtree root
+     * @param path Path of the node relative to the tree root
+     * @param files Receives (node, path) pairs in path order
+     */
+    void collectFiles(const MerkleNode &node, const string &path, vector<pair<const MerkleNode *, string>> &files)
+    {
+        if (node.isFile)
+        {
+            files.emplace_back(&node, path);
+            return;
+        }
+
+        for (const auto &child : node.children)
+        {
+            collectFiles(*child.second, path.empty() ? child.first : path + "/" + child.first, files);
+        }
+    }
+
+    /**
+     * @brief Describe how re-read file content differs from its node
+     * @param stored File node of the tree
+     * @param current Node filled from the file on disk
+     * @return Problem description, or an empty string if they match
+     */
+    string compareFile(const MerkleNode &stored, const MerkleNode &current)
+    {
+        if (current.fileSize != stored.fileSize)
+        {
+            return "size changed (" + to_string(stored.fileSize) + " -> " + to_string(current.fileSize) + " bytes)";
+        }
+        if (current.contentHash != stored.contentHash || current.chunkHashes != stored.chunkHashes)
+        {
+            return "content changed";
+        }
+        return "";
+    }
+}
+
+/**
+ * @brief Verify tree integrity by recalculating hashes
+ * @return True if all hashes are valid, false otherwise
+ *
+ * Every stored hash is recomputed once from its children's stored hashes,
+ * bottom-up, and the tree is left untouched. File contents are not read;
+ * see verifyContents.
+ */
+bool MerkleTree::verifyTreeIntegrity() const
+{
+    if (!root && flatTree)
+    {
+        return flatTree->verify();
+    }
+
+    if (!root)
+    {
+        return true; // Empty tree is valid
+    }
+
+    vector<IntegrityIssue> issues;
+    check_node_hashes(*root, "", issues);
+    return issues.empty();
+}
+
+/**
+ * @brief Re-read every file from disk and check it against the tree
+ * @param control Progress and cancellation of the check, or nullptr
+ * @return Problems found, in path order (empty if the tree matches the disk)
+ * @throws OperationCancelled If control was cancelled
+ *
+ * Files are read under the root path with the chunking the tree was built
+ * with, on threadCount threads, and their content and chunk hashes are
+ * compared with the stored ones. The stored node hashes are then checked
+ * like verifyTreeIntegrity does. A flat tree is materialized for the
+ * check alone and stays flat.
+ */
+vector<IntegrityIssue> MerkleTree::verifyContents(JobControl *control)
+{
+    auto graph = node_graph();
+
+    vector<IntegrityIssue> issues;
+    if (!graph)
+    {
+        return issues;
+    }
+
+    vector<pair<const MerkleNode *, string>> files;
+    collectFiles(*graph, "", files);
+
+    if (control)
+    {
+        auto [fileCount, directories, totalSize] = getTreeStats();
+        control->expect(fileCount, totalSize);
+    }
+
+    mutex issuesLock;
+    if (threadCount > 1)
+    {
+        // Tasks of about VERIFY_TASK_SIZE bytes, so small files share a batch
+        ThreadPool pool(threadCount);
+        size_t first = 0;
+        size_t bytes = 0;
+        for (size_t i = 0; i < files.size(); ++i)
+        {
+            bytes += files[i].first->fileSize;
+            if (bytes >= MTFSConstants::VERIFY_TASK_SIZE || i + 1 - first == MTFSConstants::HASH_BATCH_SIZE ||
+                i + 1 == files.size())
+            {
+                pool.submit([this, &files, first, i, &issues, &issuesLock, control]
+                            { verify_files(files, first, i + 1, issues, issuesLock, control); });
+                first = i + 1;
+                bytes = 0;
+            }
+        }
+        pool.wait();
+    }
+    else
+    {
+        verify_files(files, 0, files.size(), issues, issuesLock, control);
+    }
+
+    // The ranges stop early once cancelled, rather than throw on the pool
+    if (control)
+    {
+        control->checkCancelled();
+    }
+
+    check_node_hashes(*graph, "", issues);
+
+    stable_sort(issues.begin(), issues.end(),
+                [](const IntegrityIssue &a, const IntegrityIssue &b) { return a.path < b.path; });
+    return issues;
+}
+
+/**
+ * @brief Check the stored hashes of a subtree, bottom-up
+ * @param node Subtree root
+ * @param path Path of the node relative to the tree root
+ * @param issues Receives the nodes whose hash does not match
+ *
+ * Each hash is computed once from the stored hashes of the children, so
+ * the check is linear in the size of the tree.
+ */
+void MerkleTree::check_node_hashes(const MerkleNode &node, const string &path, vector<IntegrityIssue> &issues) const
+{
+    // Checks one node once its children are checked, so issues keep their bottom-up order
+    auto checkOne = [&](const MerkleNode &current, const string &currentPath)
+    {
+        Digest expected;
+        if (current.isFile)
+        {
+            // The chunk tree root; an empty file has no chunks and keeps its content hash
+            expected = current.chunkHashes.empty() ? current.contentHash : ChunkTree::root(*hashEngine, current.chunkHashes);
+        }
+        else
+        {
+            DirectoryHasher hasher(*hashEngine, current.name);
+            for (const auto &child : current.children)
+            {
+                hasher.add(child.first, child.second->hash);
+            }
+            expected = hasher.finish();
+        }
+
+        if (current.hash != expected)
+        {
+            issues.push_back({currentPath, "stored hash does not match"});
+        }
+    };
+
+    // Directories still being checked; an explicit stack, so depth is not bounded by the call stack
+    struct Level
+    {
+        const MerkleNode *node;                                    // Directory being checked
+        string path;                                               // Its path relative to the tree root
+        map<string, shared_ptr<MerkleNode>>::const_iterator next; // Its next child to check
+    };
+    vector<Level> stack;
+    stack.push_back({&node, path, node.children.begin()});
+
+    while (!stack.empty())
+    {
+        Level &level = stack.back();
+        if (level.node->isFile || level.next == level.node->children.end())
+        {
+            checkOne(*level.node, level.path);
+            stack.pop_back();
+            continue;
+        }
+
+        const auto &child = *level.next++;
+        string childPath = level.path.empty() ? child.first : level.path + "/" + child.first;
+        stack.push_back({child.second.get(), std::move(childPath), child.second->children.begin()});
+    }
+}
+
+/**
+ * @brief Re-read a range of files and compare them with their nodes
+ * @param files (node, relative path) of every file of the tree
+ * @param first First file of the range
+ * @param last One past the last file of the range
+ * @param issues Receives the files that do not match
+ * @param issuesLock Guards issues
+ * @param control Progress and cancellation of the check, or nullptr (stops early when cancelled)
+ *
+ * Small files are hashed together on a FileBatch, larger ones one by one.
+ * Nothing is thrown: unreadable files are reported as issues.
+ */
+void MerkleTree::verify_files(const vector<pair<const MerkleNode *, string>> &files, size_t first, size_t last,
+                              vector<IntegrityIssue> &issues, mutex &issuesLock, JobControl *control)
+{
+    vector<IntegrityIssue> found;
+    FileBatch batch(*hashEngine, builtChunking, ioBackend);
+
+    // Files queued on the batch, as (index in files, node filled on flush)
+    vector<pair<size_t, shared_ptr<MerkleNode>>> queued;
+
+    auto flushBatch = [&]()
+    {
+        batch.flush();
+        unordered_set<const MerkleNode *> failed;
+        for (const auto &failure : batch.takeFailures())
+        {
+            failed.insert(failure.node.get());
+        }
+
+        for (const auto &[index, current] : queued)
+        {
+            string problem = failed.count(current.get()) ? "cannot be read"
+                                                         : compareFile(*files[index].first, *current);
+            if (!problem.empty())
+            {
+                found.push_back({files[index].second, problem});
+            }
+        }
+        queued.clear();
+    };
+
+    for (size_t i = first; i < last; ++i)
+    {
+        const MerkleNode &stored = *files[i].first;
+        fs::path path = fs::path(rootPath) / files[i].second;
+        if (control)
+        {
+            if (control->cancelled())
+            {
+                return;
+            }
+            control->advance(1, stored.fileSize);
+        }
+
+        try
+        {
+            if (!fs::is_regular_file(path))
+            {
+                found.push_back({files[i].second, "missing or not a regular file"});
+                continue;
+            }
+
+            auto current = make_shared<MerkleNode>(stored.name, true);
+            current->fileStat = read_file_stat(path);
+            if (current->fileStat.size <= batch.getSizeLimit() && batch.add(current, path.string()))
+            {
+                queued.emplace_back(i, current);
+                if (batch.full())
+                {
+                    flushBatch();
+                }
+                continue;
+            }
+
+            auto [contentHash, fileSize, chunkHashes] =
+                hash_file_content(path.string(), builtChunking, &current->fileStat);
+            current->contentHash = contentHash;
+            current->fileSize = fileSize;
+            current->chunkHashes = move(chunkHashes);
+
+            string problem = compareFile(stored, *current);
+            if (!problem.empty())
+            {
+                found.push_back({files[i].second, problem});
+            }
+        }
+        catch (const exception &e)
+        {
+            found.push_back({files[i].second, e.what()});
+        }
+    }
+
+    try
+    {
+        flushBatch();
+    }
+    catch (const exception &e)
+    {
+        for (const auto &entry : queued)
+        {
+            found.push_back({files[entry.first].second, e.what()});
+        }
+    }
+
+    lock_guard<mutex> lock(issuesLock);
+    issues.insert(issues.end(), found.begin(), found.end());
+}
@@ -0,0 +1,476 @@
+#include "merkle.hpp"
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+
+namespace
+{
+    // Events that can change a node: content, metadata and directory entries
+    const uint32_t WATCH_MASK = IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_FROM |
+                                IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW;
+
+    /**
+     * @brief Get the path of a node's parent
+     * @param key Path relative to the tree root
+     * @return Parent path ("" for the children of the root)
+     */
+    string parentKey(const string &key)
+    {
+        size_t slash = key.rfind('/');
+        return slash == string::npos ? "" : key.substr(0, slash);
+    }
+
+    /**
+     * @brief Get the depth of a path
+     * @param key Path relative to the tree root
+     * @return Number of components (0 for the root)
+     */
+    size_t keyDepth(const string &key)
+    {
+        return key.empty() ? 0 : count(key.begin(), key.end(), '/') + 1;
+    }
+
+    /**
+     * @brief Join a relative directory path and an entry name
+     * @param directory Path relative to the tree root
+     * @param name Entry name (may be empty)
+     * @return Path of the entry
+     */
+    string joinKey(const string &directory, const string &name)
+    {
+        if (name.empty() || directory.empty())
+        {
+            return directory + name;
+        }
+        return directory + "/" + name;
+    }
+}
+
+/**
+ * @brief Apply changes to some paths of the tree
+ * @param paths Changed paths, relative to the tree root (or starting with the root path)
+ * @return Shared pointer to the root node of the updated tree
+ * @throws PathTooLong If a changed path is too deep to read; the others
+ *         are still applied, and that one keeps its previous nodes
+ * @throws runtime_error If the tree was not built from a directory
+ */
+shared_ptr<MerkleNode> MerkleTree::update(const vector<string> &paths)
+{
+    materialize();
+
+    if (!root || rootPath.empty())
+    {
+        throw runtime_error("No tree to update: build a directory first");
+    }
+
+    ProfiledRun run("update", rootPath);
+    walkRoot = rootPath;
+
+    // A path whose parent is not a directory of the tree (e.g. under a new
+    // directory) is refreshed from its nearest ancestor that is
+    set<string> targets;
+    for (const auto &path : paths)
+    {
+        string key = relative_path(path);
+        while (!key.empty())
+        {
+            auto parent = path_index.find(parentKey(key));
+            if (parent != path_index.end() && !parent->second->isFile)
+            {
+                break;
+            }
+            key = parentKey(key);
+        }
+
+        // Nothing under an excluded directory is part of the tree
+        if (!walkPolicy.excluded.empty())
+        {
+            for (string ancestor = key; !ancestor.empty(); ancestor = parentKey(ancestor))
+            {
+                if (is_excluded(ancestor))
+                {
+                    key = ancestor;
+                }
+            }
+        }
+        targets.insert(key);
+    }
+
+    if (targets.empty())
+    {
+        return root;
+    }
+
+    if (targets.count("") || getChunking() != builtChunking)
+    {
+        return rebuild(rootPath);
+    }
+
+    flatTree.reset();
+
+    // Rescanning a directory already covers everything under it
+    vector<string> refresh;
+    for (const auto &key : targets)
+    {
+        bool covered = false;
+        for (string ancestor = parentKey(key); !covered && !ancestor.empty(); ancestor = parentKey(ancestor))
+        {
+            covered = targets.count(ancestor) > 0;
+        }
+        if (!covered)
+        {
+            refresh.push_back(key);
+        }
+    }
+
+    // Directories whose children changed, including every ancestor
+    set<string> dirty;
+    exception_ptr tooLong; // First path that could not be read at all; it keeps its previous nodes
+    for (const auto &key : refresh)
+    {
+        const auto &parent = path_index.at(parentKey(key));
+        string name = fs::path(key).filename().string();
+        fs::path path = fs::path(rootPath) / key;
+
+        auto it = parent->children.find(name);
+        shared_ptr<MerkleNode> previous = it != parent->children.end() ? it->second : nullptr;
+
+        shared_ptr<MerkleNode> node;
+        bool changed = false;
+        try
+        {
+            // Skipped symlinks are left out, as in a build
+            EntryType type = statEntry(path, walkPolicy.symlinks == SymlinkPolicy::FOLLOW);
+            if (type != EntryType::MISSING && type != EntryType::SYMLINK)
+            {
+                node = rebuild_node(path, type, previous, changed);
+            }
+        }
+        catch (const PathTooLong &)
+        {
+            if (!tooLong)
+            {
+                tooLong = current_exception();
+            }
+            continue;
+        }
+        catch (const exception &e)
+        {
+            // As in a build, entries that cannot be read are left out
+            cerr << "Warning: Skipping " << path.string() << " - " << e.what() << endl;
+        }
+
+        if (!node && previous)
+        {
+            parent->removeChild(name);
+        }
+        else if (node && (changed || node != previous))
+        {
+            parent->addChild(node);
+        }
+        else
+        {
+            continue;
+        }
+
+        for (string ancestor = parentKey(key);; ancestor = parentKey(ancestor))
+        {
+            dirty.insert(ancestor);
+            if (ancestor.empty())
+            {
+                break;
+            }
+        }
+    }
+
+    if (dirty.empty())
+    {
+        if (tooLong)
+        {
+            rethrow_exception(tooLong);
+        }
+        return root;
+    }
+
+    // Children before parents; ancestors are updated in place, so the index still finds them
+    vector<string> order(dirty.begin(), dirty.end());
+    stable_sort(order.begin(), order.end(),
+                [](const string &a, const string &b) { return keyDepth(a) > keyDepth(b); });
+    {
+        PhaseTimer timer(ProfilePhase::TREE_HASH);
+        // Each update also refreshes the node's subtree totals from its children
+        for (const auto &key : order)
+        {
+            path_index.at(key)->updateHash(*hashEngine);
+        }
+    }
+
+    index_nodes();
+
+    auto updatedRoot = root;
+    if (compactStorage)
+    {
+        compact();
+    }
+
+    if (tooLong)
+    {
+        rethrow_exception(tooLong);
+    }
+    return updatedRoot;
+}
+
+/**
+ * @brief Start watching a directory tree
+ * @param directory Root directory, as passed to build_tree
+ * @param debounceMs Quiet time that ends a batch of events (e.g. DEFAULT_WATCH_DEBOUNCE_MS)
+ * @throws runtime_error If inotify is unavailable or runs out of watches
+ */
+TreeWatcher::TreeWatcher(const string &directory, size_t debounceMs)
+    : directory(directory), debounceMs(debounceMs), inotifyFd(-1), stopFd(-1)
+{
+    if (!fs::is_directory(directory))
+    {
+        throw runtime_error("Path is not a directory: " + directory);
+    }
+
+    // The destructor does not run if the constructor throws
+    auto closeAll = [this]()
+    {
+        if (inotifyFd >= 0)
+        {
+            ::close(inotifyFd);
+        }
+        if (stopFd >= 0)
+        {
+            ::close(stopFd);
+        }
+    };
+
+    inotifyFd = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    stopFd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (inotifyFd < 0 || stopFd < 0)
+    {
+        string error = strerror(errno);
+        closeAll();
+        throw runtime_error("Cannot start watching " + directory + ": " + error);
+    }
+
+    try
+    {
+        add_watches("");
+    }
+    catch (const exception &)
+    {
+        closeAll();
+        throw;
+    }
+}
+
+/**
+ * @brief Stop watching
+ */
+TreeWatcher::~TreeWatcher()
+{
+    // Closing the inotify instance drops all its watches
+    ::close(inotifyFd);
+    ::close(stopFd);
+}
+
+/**
+ * @brief Wait for the next batch of changes
+ * @param paths Receives the changed paths, starting with the watched directory
+ * @return False once stop() was called
+ * @throws runtime_error If reading the events fails
+ */
+bool TreeWatcher::wait(vector<string> &paths)
+{
+    using Clock = chrono::steady_clock;
+
+    set<string> pending;
+    Clock::time_point deadline;
+
+    while (true)
+    {
+        int timeout = -1;
+        if (!pending.empty())
+        {
+            auto remaining = chrono::duration_cast<chrono::milliseconds>(deadline - Clock::now()).count();
+            timeout = (int)max<int64_t>(0, min<int64_t>(debounceMs, remaining));
+        }
+
+        pollfd fds[2] = {{inotifyFd, POLLIN, 0}, {stopFd, POLLIN, 0}};
+        int ready = ::poll(fds, 2, timeout);
+        if (ready < 0 && errno != EINTR)
+        {
+            throw runtime_error(string("Error waiting for changes: ") + strerror(errno));
+        }
+
+        if (fds[1].revents & POLLIN)
+        {
+            return false;
+        }
+
+        if (ready > 0 && (fds[0].revents & POLLIN))
+        {
+            bool first = pending.empty();
+            read_events(pending);
+            if (first && !pending.empty())
+            {
+                deadline = Clock::now() + chrono::milliseconds(MTFSConstants::MAX_WATCH_DELAY_MS);
+            }
+        }
+
+        // A quiet debounce window, or events waiting for too long, end the batch
+        if (!pending.empty() && (ready == 0 || Clock::now() >= deadline))
+        {
+            break;
+        }
+    }
+
+    // Joined with the directory, so MerkleTree::update can tell them from the root path
+    paths.clear();
+    for (const auto &key : pending)
+    {
+        paths.push_back(key.empty() ? directory : (fs::path(directory) / key).string());
+    }
+    return true;
+}
+
+/**
+ * @brief Make wait() return false; safe to call from any thread
+ */
+void TreeWatcher::stop()
+{
+    uint64_t one = 1;
+    if (::write(stopFd, &one, sizeof(one)) < 0)
+    {
+        cerr << "Warning: Cannot stop watching - " << strerror(errno) << endl;
+    }
+}
+
+/**
+ * @brief Watch a directory and every directory under it
+ * @param relative Path of the directory relative to the root ("" for the root)
+ * @throws runtime_error If the watch limit is reached
+ */
+void TreeWatcher::add_watches(const string &relative)
+{
+    auto watch = [this](const string &key)
+    {
+        fs::path path = fs::path(directory) / key;
+        int wd = ::inotify_add_watch(inotifyFd, path.c_str(), WATCH_MASK);
+        if (wd >= 0)
+        {
+            watches[wd] = key;
+            return;
+        }
+
+        if (errno == ENOSPC)
+        {
+            throw runtime_error("Out of inotify watches at " + path.string() +
+                                " (raise fs.inotify.max_user_watches)");
+        }
+        // The directory went away or cannot be read; its parent still reports it
+    };
+
+    watch(relative);
+
+    error_code error;
+    fs::path start = fs::path(directory) / relative;
+    for (fs::recursive_directory_iterator it(start, fs::directory_options::skip_permission_denied, error), end;
+         !error && it != end; it.increment(error))
+    {
+        if (it->symlink_status(error).type() == fs::file_type::directory)
+        {
+            watch(it->path().lexically_relative(directory).string());
+        }
+    }
+}
+
+/**
+ * @brief Forget the watches of a directory that moved away, and of its subdirectories
+ * @param relative Old path of the directory relative to the root
+ */
+void TreeWatcher::drop_watches(const string &relative)
+{
+    string prefix = relative + "/";
+    for (auto it = watches.begin(); it != watches.end();)
+    {
+        if (it->second == relative || it->second.compare(0, prefix.size(), prefix) == 0)
+        {
+            ::inotify_rm_watch(inotifyFd, it->first);
+            it = watches.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+/**
+ * @brief Read the queued events
+ * @param paths Receives the changed paths
+ */
+void TreeWatcher::read_events(set<string> &paths)
+{
+    alignas(inotify_event) char buffer[MTFSConstants::WATCH_EVENT_BUFFER_SIZE];
+
+    while (true)
+    {
+        ssize_t length = ::read(inotifyFd, buffer, sizeof(buffer));
+        if (length < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (length < 0 && errno == EAGAIN)
+        {
+            return;
+        }
+        if (length <= 0)
+        {
+            throw runtime_error(string("Error reading watch events: ") + strerror(errno));
+        }
+
+        for (char *position = buffer; position < buffer + length;)
+        {
+            const inotify_event *event = reinterpret_cast<const inotify_event *>(position);
+            position += sizeof(inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                // Events were lost: rescan everything, and watch what is new
+                paths.insert("");
+                add_watches("");
+                continue;
+            }
+
+            auto watch = watches.find(event->wd);
+            if (watch == watches.end())
+            {
+                continue;
+            }
+            if (event->mask & IN_IGNORED)
+            {
+                watches.erase(watch);
+                continue;
+            }
+
+            string key = joinKey(watch->second, event->len > 0 ? event->name : "");
+            if (event->mask & IN_ISDIR)
+            {
+                if (event->mask & (IN_CREATE | IN_MOVED_TO))
+                {
+                    add_watches(key);
+                }
+                else if (event->mask & IN_MOVED_FROM)
+                {
+                    drop_watches(key);
+                }
+            }
+            paths.insert(key);
+        }
+    }
+}
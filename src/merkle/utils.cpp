@@ -25,6 +25,64 @@ std::string formatFileSize(size_t bytes)
     return oss.str();
 }
 
+/**
+ * @brief Hex-encode a digest
+ * 
+ * @param digest Digest to encode
+ * @return Lowercase hexadecimal string (64 characters)
+ */
+std::string toHex(const Digest &digest)
+{
+    std::string hex(digest.size() * 2, '0');
+    toHex(digest, &hex[0]);
+    return hex;
+}
+
+/**
+ * @brief Hex-encode a digest into a buffer
+ * 
+ * @param digest Digest to encode
+ * @param out Buffer receiving 64 lowercase hex characters (not terminated)
+ */
+void toHex(const Digest &digest, char *out)
+{
+    static const char digits[] = "0123456789abcdef";
+    for (size_t i = 0; i < digest.size(); ++i)
+    {
+        out[2 * i] = digits[digest[i] >> 4];
+        out[2 * i + 1] = digits[digest[i] & 0x0f];
+    }
+}
+
+/**
+ * @brief Decode a hex digest
+ * 
+ * @param hex Hexadecimal string (64 characters)
+ * @return Decoded digest
+ * @throws runtime_error If the string is not a valid hex digest
+ */
+Digest fromHex(const std::string &hex)
+{
+    auto nibble = [&hex](char c) -> uint8_t
+    {
+        if (c >= '0' && c <= '9')
+            return c - '0';
+        if (c >= 'a' && c <= 'f')
+            return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F')
+            return c - 'A' + 10;
+        throw std::runtime_error("Invalid hex digest: " + hex);
+    };
+
+    Digest digest{};
+    if (hex.length() != digest.size() * 2)
+        throw std::runtime_error("Invalid hex digest length: " + hex);
+
+    for (size_t i = 0; i < digest.size(); ++i)
+        digest[i] = (nibble(hex[2 * i]) << 4) | nibble(hex[2 * i + 1]);
+    return digest;
+}
+
 /**
  * @brief Get the File Extension
  * 
@@ -0,0 +1,180 @@
+package ui
+
+import (
+	"encoding/binary"
+	"encoding/json"
+	"errors"
+	"fmt"
+	"io"
+	"net"
+	"sync"
+	"time"
+)
+
+// Client sends commands to an "mtfs serve" daemon over its Unix socket.
+// Every message is a frame: a 4-byte big-endian length followed by that
+// many bytes of JSON. Requests carry an id that the daemon repeats in the
+// response, so several calls can be in flight at once. Frames without an
+// id are the events of the jobs started on the connection.
+type Client struct {
+	conn        net.Conn
+	events      func(JobEvent)           // Receives job events, on the reader goroutine
+	sendLock    sync.Mutex               // Keeps request frames whole
+	pendingLock sync.Mutex               // Guards pending, nextID and err
+	pending     map[uint64]chan response // Calls waiting for their response, by id
+	nextID      uint64                   // Id of the next request
+	err         error                    // Why the connection closed, once it has
+}
+
+// response is one answer of the daemon
+type response struct {
+	ID     *uint64         `json:"id"`
+	OK     bool            `json:"ok"`
+	Result json.RawMessage `json:"result"`
+	Error  string          `json:"error"`
+}
+
+// JobEvent is a progress report or the outcome ("done", "failed" or
+// "cancelled") of a background job
+type JobEvent struct {
+	Event     string          `json:"event"`
+	Job       uint64          `json:"job"`
+	Operation string          `json:"operation"`
+	Progress  JobProgress     `json:"progress"`
+	Result    json.RawMessage `json:"result"`
+	Error     string          `json:"error"`
+}
+
+// JobProgress is how far a job got; totals are 0 and EtaNs nil when unknown
+type JobProgress struct {
+	FilesDone      uint64  `json:"files_done"`
+	BytesDone      uint64  `json:"bytes_done"`
+	FilesExpected  uint64  `json:"files_expected"`
+	BytesExpected  uint64  `json:"bytes_expected"`
+	ElapsedNs      uint64  `json:"elapsed_ns"`
+	BytesPerSecond uint64  `json:"bytes_per_second"`
+	EtaNs          *uint64 `json:"eta_ns"`
+}
+
+// DialDaemon connects to the daemon listening on socketPath, retrying
+// until it is up or the timeout passes. Job events go to events, which
+// may be nil.
+func DialDaemon(socketPath string, timeout time.Duration, events func(JobEvent)) (*Client, error) {
+	deadline := time.Now().Add(timeout)
+	for {
+		conn, err := net.Dial("unix", socketPath)
+		if err == nil {
+			client := &Client{conn: conn, events: events, pending: make(map[uint64]chan response), nextID: 1}
+			go client.readFrames()
+			return client, nil
+		}
+		if time.Now().After(deadline) {
+			return nil, fmt.Errorf("cannot connect to %s: %v", socketPath, err)
+		}
+		time.Sleep(20 * time.Millisecond)
+	}
+}
+
+// Call runs one command and returns its JSON result. Arguments are sent
+// as strings, which the daemon reads as it reads numbers and booleans.
+func (c *Client) Call(op string, args map[string]string) (json.RawMessage, error) {
+	request := map[string]interface{}{"op": op}
+	for name, value := range args {
+		request[name] = value
+	}
+
+	answer := make(chan response, 1)
+	c.pendingLock.Lock()
+	if c.err != nil {
+		c.pendingLock.Unlock()
+		return nil, c.err
+	}
+	id := c.nextID
+	c.nextID++
+	c.pending[id] = answer
+	c.pendingLock.Unlock()
+	request["id"] = id
+
+	payload, err := json.Marshal(request)
+	if err == nil {
+		err = c.writeFrame(payload)
+	}
+	if err != nil {
+		c.pendingLock.Lock()
+		delete(c.pending, id)
+		c.pendingLock.Unlock()
+		return nil, err
+	}
+
+	reply, open := <-answer
+	if !open {
+		return nil, c.closeError()
+	}
+	if !reply.OK {
+		return nil, errors.New(reply.Error)
+	}
+	return reply.Result, nil
+}
+
+// Close drops the connection; calls still waiting fail
+func (c *Client) Close() error {
+	return c.conn.Close()
+}
+
+func (c *Client) writeFrame(payload []byte) error {
+	frame := make([]byte, 4+len(payload))
+	binary.BigEndian.PutUint32(frame, uint32(len(payload)))
+	copy(frame[4:], payload)
+
+	c.sendLock.Lock()
+	defer c.sendLock.Unlock()
+	_, err := c.conn.Write(frame)
+	return err
+}
+
+func (c *Client) readFrames() {
+	var err error
+	for {
+		var header [4]byte
+		if _, err = io.ReadFull(c.conn, header[:]); err != nil {
+			break
+		}
+		payload := make([]byte, binary.BigEndian.Uint32(header[:]))
+		if _, err = io.ReadFull(c.conn, payload); err != nil {
+			break
+		}
+
+		var reply response
+		if json.Unmarshal(payload, &reply) != nil {
+			continue
+		}
+		if reply.ID == nil {
+			var event JobEvent
+			if c.events != nil && json.Unmarshal(payload, &event) == nil && event.Event != "" {
+				c.events(event)
+			}
+			continue
+		}
+		c.pendingLock.Lock()
+		answer, found := c.pending[*reply.ID]
+		delete(c.pending, *reply.ID)
+		c.pendingLock.Unlock()
+		if found {
+			answer <- reply
+		}
+	}
+
+	c.pendingLock.Lock()
+	c.err = fmt.Errorf("connection to the daemon closed: %v", err)
+	for id, answer := range c.pending {
+		close(answer)
+		delete(c.pending, id)
+	}
+	c.pendingLock.Unlock()
+}
+
+func (c *Client) closeError() error {
+	c.pendingLock.Lock()
+	defer c.pendingLock.Unlock()
+	return c.err
+}
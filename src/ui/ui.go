@@ -2,10 +2,12 @@ package ui
 
 import (
 	"bufio"
+	"encoding/json"
 	"fmt"
-	"io"
 	"os"
 	"os/exec"
+	"path/filepath"
+	"sort"
 	"strconv"
 	"strings"
 	"time"
@@ -21,27 +23,62 @@ type MerkleTUI struct {
 	output        *tview.TextView
 	input         *tview.InputField
 	status        *tview.TextView
-	cppProcess    *exec.Cmd
-	stdin         io.WriteCloser
-	stdout        io.ReadCloser
-	scanner       *bufio.Scanner
+	daemon        *exec.Cmd
+	client        *Client
+	socketPath    string
 	currentAction string
+	pendingArgs   map[string]string
 	treeBuilt     bool
-	outputBuffer  []string
+	job           *backgroundJob
+	jobStatus     string
+	endedJobs     map[uint64]JobEvent
+}
+
+// A build, verify or export running as a daemon job; queries keep
+// answering from the last complete tree meanwhile
+type backgroundJob struct {
+	id    uint64
+	title string
+	done  func(result json.RawMessage)
+}
+
+// A node of the tree as the export command writes it
+type exportedNode struct {
+	Type        string                  `json:"type"`
+	Hash        string                  `json:"hash"`
+	Size        uint64                  `json:"size"`
+	Chunks      uint64                  `json:"chunks"`
+	ContentHash string                  `json:"content_hash"`
+	Children    map[string]exportedNode `json:"children"`
+}
+
+type treeStats struct {
+	RootHash         string `json:"root_hash"`
+	Files            uint64 `json:"files"`
+	Directories      uint64 `json:"directories"`
+	Size             uint64 `json:"size"`
+	Depth            uint64 `json:"depth"`
+	HashAlgorithm    string `json:"hash_algorithm"`
+	Chunking         string `json:"chunking"`
+	UniqueFiles      uint64 `json:"unique_files"`
+	UniqueFileBytes  uint64 `json:"unique_file_bytes"`
+	Chunks           uint64 `json:"chunks"`
+	UniqueChunks     uint64 `json:"unique_chunks"`
+	UniqueChunkBytes uint64 `json:"unique_chunk_bytes"`
 }
 
 func NewMerkleTUI() *MerkleTUI {
 	app := tview.NewApplication()
-	
+
 	tui := &MerkleTUI{
-		app:          app,
-		pages:        tview.NewPages(),
-		outputBuffer: make([]string, 0),
+		app:       app,
+		pages:     tview.NewPages(),
+		endedJobs: make(map[uint64]JobEvent),
 	}
-	
+
 	tui.setupUI()
-	tui.startCppProcess()
-	
+	tui.startDaemon()
+
 	return tui
 }
 
@@ -55,7 +92,15 @@ func (tui *MerkleTUI) setupUI() {
 		AddItem("Verify tree integrity", "Check tree validity", '5', tui.verifyTree).
 		AddItem("Export tree to JSON", "Export as JSON", '6', tui.exportJSON).
 		AddItem("Set chunk size", "Configure chunk size", '7', tui.setChunkSize).
-		AddItem("Exit", "Quit application", '8', tui.exit)
+		AddItem("Set thread count", "Configure build threads", '8', tui.setThreadCount).
+		AddItem("Save tree snapshot", "Write binary snapshot", 's', tui.saveSnapshot).
+		AddItem("Load tree snapshot", "Map binary snapshot", 'l', tui.loadSnapshot).
+		AddItem("Write inclusion proof", "Prove a path under the root", 'p', tui.writeProof).
+		AddItem("Verify inclusion proof", "Check a proof against a root hash", 'v', tui.verifyProof).
+		AddItem("Diff against snapshot", "Changes since a saved tree", 'd', tui.diffSnapshot).
+		AddItem("Verify contents against disk", "Re-read every file", 'c', tui.verifyContents).
+		AddItem("Show build profile", "Per-phase timings of the last build", 'f', tui.showProfile).
+		AddItem("Exit", "Quit application", 'q', tui.exit)
 
 	tui.menu.SetBorder(true).SetTitle("Merkle Tree File System CLI")
 	tui.menu.SetSelectedTextColor(tcell.ColorBlack)
@@ -108,6 +153,9 @@ func (tui *MerkleTUI) setupUI() {
 		case tcell.KeyEscape:
 			tui.app.SetFocus(tui.menu)
 			return nil
+		case tcell.KeyCtrlX:
+			tui.cancelJob()
+			return nil
 		}
 		return event
 	})
@@ -115,156 +163,265 @@ func (tui *MerkleTUI) setupUI() {
 	tui.pages.AddPage("main", mainLayout, true, true)
 }
 
-func (tui *MerkleTUI) startCppProcess() {
-	// Start the C++ executable
-	tui.cppProcess = exec.Command("merkle/mtfs")
-	
-	var err error
-	tui.stdin, err = tui.cppProcess.StdinPipe()
+func (tui *MerkleTUI) startDaemon() {
+	// The C++ backend answers length-prefixed JSON requests on a Unix socket
+	tui.socketPath = filepath.Join(os.TempDir(), fmt.Sprintf("mtfs-tui-%d.sock", os.Getpid()))
+	tui.daemon = exec.Command("merkle/mtfs", "serve", tui.socketPath)
+
+	stderr, err := tui.daemon.StderrPipe()
 	if err != nil {
-		tui.writeOutput(fmt.Sprintf("[red]Error creating stdin pipe: %v[white]", err))
+		tui.writeOutput(fmt.Sprintf("[red]Error creating stderr pipe: %v[white]", err))
 		return
 	}
-	
-	tui.stdout, err = tui.cppProcess.StdoutPipe()
+
+	err = tui.daemon.Start()
 	if err != nil {
-		tui.writeOutput(fmt.Sprintf("[red]Error creating stdout pipe: %v[white]", err))
+		tui.writeOutput(fmt.Sprintf("[red]Error starting C++ process: %v[white]", err))
+		tui.daemon = nil
 		return
 	}
-	
-	err = tui.cppProcess.Start()
+
+	// Warnings of the backend (e.g. skipped files) are shown as they come
+	go tui.readWarnings(bufio.NewScanner(stderr))
+
+	tui.client, err = DialDaemon(tui.socketPath, 5*time.Second, func(event JobEvent) {
+		tui.app.QueueUpdateDraw(func() {
+			tui.jobEvent(event)
+		})
+	})
 	if err != nil {
-		tui.writeOutput(fmt.Sprintf("[red]Error starting C++ process: %v[white]", err))
+		tui.writeOutput(fmt.Sprintf("[red]Error connecting to the C++ process: %v[white]", err))
+	}
+}
+
+func (tui *MerkleTUI) readWarnings(scanner *bufio.Scanner) {
+	for scanner.Scan() {
+		line := scanner.Text()
+		if strings.HasPrefix(line, "Listening on ") {
+			continue
+		}
+		tui.app.QueueUpdateDraw(func() {
+			tui.writeOutput(fmt.Sprintf("[yellow]%s[white]", tview.Escape(line)))
+		})
+	}
+}
+
+func (tui *MerkleTUI) connected() bool {
+	if tui.client == nil {
+		tui.writeOutput("[red]✗ The C++ process is not running.[white]")
+		tui.updateStatus("Ready")
+	}
+	return tui.client != nil
+}
+
+// request runs a command off the UI goroutine and hands its result to done on it
+func (tui *MerkleTUI) request(op string, args map[string]string, done func(result json.RawMessage)) {
+	if !tui.connected() {
 		return
 	}
-	
-	tui.scanner = bufio.NewScanner(tui.stdout)
-	
-	// Start reading output in a goroutine
-	go tui.readOutput()
+
+	go func() {
+		result, err := tui.client.Call(op, args)
+		tui.app.QueueUpdateDraw(func() {
+			if err != nil {
+				tui.writeOutput(fmt.Sprintf("[red]✗ Error: %s[white]", tview.Escape(err.Error())))
+			} else {
+				done(result)
+			}
+			tui.updateStatus("Ready")
+		})
+	}()
 }
 
-func (tui *MerkleTUI) readOutput() {
-	for tui.scanner.Scan() {
-		line := tui.scanner.Text()
-		tui.outputBuffer = append(tui.outputBuffer, line)
-		
-		// Process output based on current action
+// startJob runs an operation as a daemon job, showing its progress until
+// done gets its result
+func (tui *MerkleTUI) startJob(operation string, title string, args map[string]string, done func(result json.RawMessage)) {
+	if tui.job != nil {
+		tui.writeOutput("[red]✗ A job is already running; press Ctrl-X to cancel it.[white]")
+		return
+	}
+	if !tui.connected() {
+		return
+	}
+
+	request := map[string]string{"job": operation}
+	for name, value := range args {
+		request[name] = value
+	}
+	job := &backgroundJob{title: title, done: done}
+	tui.job = job
+	tui.jobStatus = title + "..."
+	tui.updateStatus("Ready")
+
+	go func() {
+		result, err := tui.client.Call("start", request)
 		tui.app.QueueUpdateDraw(func() {
-			tui.processOutput(line)
+			var reply struct {
+				Job uint64 `json:"job"`
+			}
+			if err == nil {
+				err = json.Unmarshal(result, &reply)
+			}
+			if err != nil {
+				tui.job = nil
+				tui.jobStatus = ""
+				tui.writeOutput(fmt.Sprintf("[red]✗ Error: %s[white]", tview.Escape(err.Error())))
+				tui.updateStatus("Ready")
+				return
+			}
+
+			// A short job can finish before its start is answered
+			job.id = reply.Job
+			if event, found := tui.endedJobs[job.id]; found {
+				delete(tui.endedJobs, job.id)
+				tui.jobEvent(event)
+			}
 		})
+	}()
+}
+
+func (tui *MerkleTUI) cancelJob() {
+	if tui.job == nil || tui.job.id == 0 {
+		return
 	}
+	tui.writeOutput(fmt.Sprintf("[yellow]Cancelling: %s[white]", tui.job.title))
+	go tui.client.Call("cancel", map[string]string{"job": strconv.FormatUint(tui.job.id, 10)})
 }
 
-func (tui *MerkleTUI) processOutput(line string) {
-	switch tui.currentAction {
-	case "build":
-		tui.processBuildOutput(line)
-	case "print_tree":
-		tui.processPrintTreeOutput(line)
-	case "print_files":
-		tui.processPrintFilesOutput(line)
-	case "stats":
-		tui.processStatsOutput(line)
-	case "verify":
-		tui.processVerifyOutput(line)
-	case "export":
-		tui.processExportOutput(line)
-	case "chunk":
-		tui.processChunkOutput(line)
+func (tui *MerkleTUI) jobEvent(event JobEvent) {
+	if tui.job == nil || tui.job.id != event.Job {
+		if event.Event != "progress" {
+			tui.endedJobs[event.Job] = event
+		}
+		return
+	}
+
+	job := tui.job
+	switch event.Event {
+	case "progress":
+		tui.jobStatus = job.title + ": " + formatProgress(event.Progress) + " | Ctrl-X cancels"
+		tui.updateStatus("Ready")
+		return
+	case "done":
+		job.done(event.Result)
+	case "cancelled":
+		tui.writeOutput(fmt.Sprintf("[yellow]✗ %s cancelled; the last complete tree is kept.[white]", job.title))
 	default:
-		tui.writeOutput(line)
+		tui.writeOutput(fmt.Sprintf("[red]✗ Error: %s[white]", tview.Escape(event.Error)))
+	}
+	tui.job = nil
+	tui.jobStatus = ""
+	tui.updateStatus("Ready")
+}
+
+// formatProgress describes files and bytes done, throughput and time left
+func formatProgress(progress JobProgress) string {
+	text := fmt.Sprintf("%d files, %s", progress.FilesDone, formatSize(progress.BytesDone))
+	if progress.BytesExpected > 0 {
+		percent := 100 * progress.BytesDone / progress.BytesExpected
+		if percent > 100 {
+			percent = 100
+		}
+		text = fmt.Sprintf("%d%% | %d of %d files, %s of %s", percent, progress.FilesDone, progress.FilesExpected,
+			formatSize(progress.BytesDone), formatSize(progress.BytesExpected))
+	}
+	text += fmt.Sprintf(" | %s/s", formatSize(progress.BytesPerSecond))
+	if progress.EtaNs != nil {
+		text += " | ETA " + (time.Duration(*progress.EtaNs) / time.Second * time.Second).String()
 	}
+	return text
 }
 
-func (tui *MerkleTUI) processBuildOutput(line string) {
-	if strings.Contains(line, "Merkle tree built successfully") {
-		tui.writeOutput("[green]✓ Merkle tree built successfully![white]")
-		tui.writeOutput("[blue]Tree is now ready for operations.[white]")
-	} else if strings.Contains(line, "Error:") {
-		tui.writeOutput(fmt.Sprintf("[red]✗ %s[white]", line))
-	} else if strings.Contains(line, "Enter directory path:") {
-		// Skip this line as we handle it in UI
+func (tui *MerkleTUI) showTreeStats(result json.RawMessage) {
+	var stats treeStats
+	if err := json.Unmarshal(result, &stats); err != nil {
+		tui.writeOutput(fmt.Sprintf("[red]✗ Unexpected reply: %v[white]", err))
 		return
-	} else {
-		tui.writeOutput(fmt.Sprintf("[yellow]%s[white]", line))
 	}
+	tui.writeOutput(fmt.Sprintf("[yellow]📄 Total files: %d[white]", stats.Files))
+	tui.writeOutput(fmt.Sprintf("[blue]📁 Total directories: %d[white]", stats.Directories))
+	tui.writeOutput(fmt.Sprintf("[green]💾 Total size: %s[white]", formatSize(stats.Size)))
+	tui.writeOutput(fmt.Sprintf("[magenta]🌳 Tree depth: %d[white]", stats.Depth))
+	tui.writeOutput(fmt.Sprintf("[cyan]🔐 Root hash: %s[white]", stats.RootHash))
+	tui.writeOutput(fmt.Sprintf("Hash algorithm: %s, chunking: %s", stats.HashAlgorithm, stats.Chunking))
+	tui.writeOutput(fmt.Sprintf("[green]♻ Unique files: %d (%s)[white]", stats.UniqueFiles, formatSize(stats.UniqueFileBytes)))
+	tui.writeOutput(fmt.Sprintf("[green]♻ Unique chunks: %d of %d (%s)[white]", stats.UniqueChunks, stats.Chunks,
+		formatSize(stats.UniqueChunkBytes)))
 }
 
-func (tui *MerkleTUI) processPrintTreeOutput(line string) {
-	if strings.HasPrefix(line, "├─") || strings.HasPrefix(line, "└─") || strings.HasPrefix(line, "│") {
-		// Tree structure lines
-		tui.writeOutput(fmt.Sprintf("[cyan]%s[white]", line))
-	} else if strings.Contains(line, "Hash:") {
-		tui.writeOutput(fmt.Sprintf("[green]%s[white]", line))
-	} else if strings.Contains(line, "Size:") {
-		tui.writeOutput(fmt.Sprintf("[blue]%s[white]", line))
-	} else {
-		tui.writeOutput(line)
+// exportedRoot returns the name and node of the root in an export
+func exportedRoot(result json.RawMessage) (string, exportedNode, error) {
+	var members map[string]json.RawMessage
+	if err := json.Unmarshal(result, &members); err != nil {
+		return "", exportedNode{}, err
+	}
+	for name, value := range members {
+		if name == "mtfs_metadata" {
+			continue
+		}
+		var node exportedNode
+		err := json.Unmarshal(value, &node)
+		return name, node, err
 	}
+	return "", exportedNode{}, fmt.Errorf("the export has no root")
 }
 
-func (tui *MerkleTUI) processPrintFilesOutput(line string) {
-	if strings.Contains(line, "File:") {
-		tui.writeOutput(fmt.Sprintf("[yellow]📁 %s[white]", line))
-	} else if strings.Contains(line, "Hash:") {
-		tui.writeOutput(fmt.Sprintf("   [green]🔐 %s[white]", line))
-	} else if strings.Contains(line, "Size:") {
-		tui.writeOutput(fmt.Sprintf("   [blue]📏 %s[white]", line))
-	} else if strings.Contains(line, "Chunks:") {
-		tui.writeOutput(fmt.Sprintf("   [magenta]🧩 %s[white]", line))
-	} else {
-		tui.writeOutput(fmt.Sprintf("   %s", line))
-	}
-}
-
-func (tui *MerkleTUI) processStatsOutput(line string) {
-	if strings.Contains(line, "Total files:") {
-		tui.writeOutput(fmt.Sprintf("[yellow]📄 %s[white]", line))
-	} else if strings.Contains(line, "Total directories:") {
-		tui.writeOutput(fmt.Sprintf("[blue]📁 %s[white]", line))
-	} else if strings.Contains(line, "Total size:") {
-		tui.writeOutput(fmt.Sprintf("[green]💾 %s[white]", line))
-	} else if strings.Contains(line, "Tree depth:") {
-		tui.writeOutput(fmt.Sprintf("[magenta]🌳 %s[white]", line))
-	} else if strings.Contains(line, "Root hash:") {
-		tui.writeOutput(fmt.Sprintf("[cyan]🔐 %s[white]", line))
-	} else {
-		tui.writeOutput(line)
+// sortedNames returns the children names in the order the C++ tree keeps them
+func sortedNames(children map[string]exportedNode) []string {
+	names := make([]string, 0, len(children))
+	for name := range children {
+		names = append(names, name)
 	}
+	sort.Strings(names)
+	return names
 }
 
-func (tui *MerkleTUI) processVerifyOutput(line string) {
-	if strings.Contains(line, "Tree integrity verified: OK") {
-		tui.writeOutput("[green]✓ Tree integrity verified: OK[white]")
-		tui.writeOutput("[green]All hashes are valid and consistent.[white]")
-	} else if strings.Contains(line, "Tree integrity check FAILED!") {
-		tui.writeOutput("[red]✗ Tree integrity check FAILED![white]")
-		tui.writeOutput("[red]Some hashes are invalid or inconsistent.[white]")
-	} else {
+func (tui *MerkleTUI) writeTreeLines(node exportedNode, prefix string) {
+	names := sortedNames(node.Children)
+	for i, name := range names {
+		child := node.Children[name]
+		branch, indent := "├─ ", "│  "
+		if i == len(names)-1 {
+			branch, indent = "└─ ", "   "
+		}
+
+		line := fmt.Sprintf("[cyan]%s%s%s[white] [green]%.16s[white]", prefix, branch, tview.Escape(name), child.Hash)
+		if child.Type == "file" {
+			line += fmt.Sprintf(" [blue]%s[white]", formatSize(child.Size))
+		}
 		tui.writeOutput(line)
+		tui.writeTreeLines(child, prefix+indent)
 	}
 }
 
-func (tui *MerkleTUI) processExportOutput(line string) {
-	if strings.HasPrefix(line, "{") && strings.HasSuffix(line, "}") {
-		// JSON output - format it nicely
-		tui.writeOutput("[green]JSON Export:[white]")
-		tui.writeOutput("[cyan]" + line + "[white]")
-		tui.writeOutput("[green]Export completed successfully![white]")
-	} else {
-		tui.writeOutput(line)
+func (tui *MerkleTUI) writeFileLines(node exportedNode, path string) {
+	for _, name := range sortedNames(node.Children) {
+		child := node.Children[name]
+		childPath := path + "/" + name
+		if child.Type != "file" {
+			tui.writeFileLines(child, childPath)
+			continue
+		}
+		tui.writeOutput(fmt.Sprintf("[yellow]📁 File: %s[white]", tview.Escape(childPath)))
+		tui.writeOutput(fmt.Sprintf("   [green]🔐 Hash: %s[white]", child.Hash))
+		tui.writeOutput(fmt.Sprintf("   [blue]📏 Size: %s[white]", formatSize(child.Size)))
+		tui.writeOutput(fmt.Sprintf("   [magenta]🧩 Chunks: %d[white]", child.Chunks))
 	}
 }
 
-func (tui *MerkleTUI) processChunkOutput(line string) {
-	if strings.Contains(line, "Chunk size set to") {
-		tui.writeOutput(fmt.Sprintf("[green]✓ %s[white]", line))
-	} else if strings.Contains(line, "Error:") {
-		tui.writeOutput(fmt.Sprintf("[red]✗ %s[white]", line))
-	} else {
-		tui.writeOutput(line)
+// formatSize writes a byte count as the C++ formatFileSize does
+func formatSize(bytes uint64) string {
+	units := []string{"B", "KB", "MB", "GB", "TB"}
+	size := float64(bytes)
+	unit := 0
+	for size >= 1024 && unit < len(units)-1 {
+		size /= 1024
+		unit++
 	}
+	if size < 10 && unit > 0 {
+		return fmt.Sprintf("%.1f %s", size, units[unit])
+	}
+	return fmt.Sprintf("%.0f %s", size, units[unit])
 }
 
 func (tui *MerkleTUI) writeOutput(text string) {
@@ -272,133 +429,400 @@ func (tui *MerkleTUI) writeOutput(text string) {
 	tui.output.ScrollToEnd()
 }
 
-func (tui *MerkleTUI) sendCommand(cmd string) {
-	if tui.stdin != nil {
-		fmt.Fprintf(tui.stdin, "%s\n", cmd)
-	}
-}
-
 func (tui *MerkleTUI) updateStatus(message string) {
 	treeStatus := "[red]Not Built[white]"
 	if tui.treeBuilt {
 		treeStatus = "[green]Built[white]"
 	}
+	if tui.jobStatus != "" {
+		message = tui.jobStatus
+	}
 	tui.status.SetText(fmt.Sprintf("[green]%s[white] | Tree: %s | Press Tab to navigate", message, treeStatus))
 }
 
+// ask shows a prompt whose answer handleInput takes for the current action
+func (tui *MerkleTUI) ask(action string, label string) {
+	tui.currentAction = action
+	tui.input.SetLabel(label)
+	tui.app.SetFocus(tui.input)
+}
+
+func (tui *MerkleTUI) requireTree() bool {
+	if !tui.treeBuilt {
+		tui.writeOutput("[red]✗ Build the tree first (option 1).[white]")
+	}
+	return tui.treeBuilt
+}
+
 func (tui *MerkleTUI) buildTree() {
-	tui.currentAction = "build"
 	tui.updateStatus("Building tree...")
 	tui.writeOutput("[yellow]═══ Building Merkle Tree ═══[white]")
 	tui.writeOutput("[blue]Please enter the directory path to build the tree.[white]")
-	tui.sendCommand("1")
-	tui.input.SetLabel("Directory path: ")
-	tui.app.SetFocus(tui.input)
+	tui.ask("build", "Directory path: ")
 }
 
 func (tui *MerkleTUI) printTree() {
-	if !tui.treeBuilt {
-		tui.writeOutput("[red]✗ Build the tree first (option 1).[white]")
+	if !tui.requireTree() {
 		return
 	}
-	tui.currentAction = "print_tree"
 	tui.updateStatus("Printing tree structure...")
 	tui.writeOutput("[yellow]═══ Tree Structure ═══[white]")
-	tui.sendCommand("2")
+	tui.request("export", nil, func(result json.RawMessage) {
+		name, root, err := exportedRoot(result)
+		if err != nil {
+			tui.writeOutput(fmt.Sprintf("[red]✗ Unexpected reply: %v[white]", err))
+			return
+		}
+		tui.writeOutput(fmt.Sprintf("[cyan]%s[white] [green]Hash: %s[white]", tview.Escape(name), root.Hash))
+		tui.writeTreeLines(root, "")
+	})
 }
 
 func (tui *MerkleTUI) printFiles() {
-	if !tui.treeBuilt {
-		tui.writeOutput("[red]✗ Build the tree first (option 1).[white]")
+	if !tui.requireTree() {
 		return
 	}
-	tui.currentAction = "print_files"
 	tui.updateStatus("Printing file objects...")
 	tui.writeOutput("[yellow]═══ File Objects ═══[white]")
-	tui.sendCommand("3")
+	tui.request("export", nil, func(result json.RawMessage) {
+		name, root, err := exportedRoot(result)
+		if err != nil {
+			tui.writeOutput(fmt.Sprintf("[red]✗ Unexpected reply: %v[white]", err))
+			return
+		}
+		tui.writeFileLines(root, name)
+	})
 }
 
 func (tui *MerkleTUI) showStats() {
-	if !tui.treeBuilt {
-		tui.writeOutput("[red]✗ Build the tree first (option 1).[white]")
+	if !tui.requireTree() {
 		return
 	}
-	tui.currentAction = "stats"
 	tui.updateStatus("Showing statistics...")
 	tui.writeOutput("[yellow]═══ Tree Statistics ═══[white]")
-	tui.sendCommand("4")
+	tui.request("stats", nil, tui.showTreeStats)
 }
 
 func (tui *MerkleTUI) verifyTree() {
-	if !tui.treeBuilt {
-		tui.writeOutput("[red]✗ Build the tree first (option 1).[white]")
+	if !tui.requireTree() {
 		return
 	}
-	tui.currentAction = "verify"
 	tui.updateStatus("Verifying tree integrity...")
 	tui.writeOutput("[yellow]═══ Tree Verification ═══[white]")
-	tui.sendCommand("5")
+	tui.startJob("verify", "Verifying tree integrity", nil, func(result json.RawMessage) {
+		var reply struct {
+			Valid bool `json:"valid"`
+		}
+		json.Unmarshal(result, &reply)
+		if reply.Valid {
+			tui.writeOutput("[green]✓ Tree integrity verified: OK[white]")
+			tui.writeOutput("[green]All hashes are valid and consistent.[white]")
+		} else {
+			tui.writeOutput("[red]✗ Tree integrity check FAILED![white]")
+			tui.writeOutput("[red]Some hashes are invalid or inconsistent.[white]")
+		}
+	})
 }
 
 func (tui *MerkleTUI) exportJSON() {
-	if !tui.treeBuilt {
-		tui.writeOutput("[red]✗ Build the tree first (option 1).[white]")
+	if !tui.requireTree() {
 		return
 	}
-	tui.currentAction = "export"
 	tui.updateStatus("Exporting to JSON...")
 	tui.writeOutput("[yellow]═══ JSON Export ═══[white]")
-	tui.sendCommand("6")
+	tui.ask("export", "Export file: ")
 }
 
 func (tui *MerkleTUI) setChunkSize() {
-	tui.currentAction = "chunk"
 	tui.updateStatus("Setting chunk size...")
 	tui.writeOutput("[yellow]═══ Chunk Size Configuration ═══[white]")
-	tui.sendCommand("7")
-	tui.input.SetLabel("Chunk size (bytes): ")
-	tui.app.SetFocus(tui.input)
+	tui.ask("chunk", "Chunk size (bytes): ")
+}
+
+func (tui *MerkleTUI) setThreadCount() {
+	tui.updateStatus("Setting thread count...")
+	tui.writeOutput("[yellow]═══ Thread Count Configuration ═══[white]")
+	tui.ask("threads", "Thread count (0 = all cores): ")
+}
+
+func (tui *MerkleTUI) saveSnapshot() {
+	if !tui.requireTree() {
+		return
+	}
+	tui.updateStatus("Saving snapshot...")
+	tui.writeOutput("[yellow]═══ Save Snapshot ═══[white]")
+	tui.ask("save", "Snapshot path: ")
+}
+
+func (tui *MerkleTUI) loadSnapshot() {
+	tui.updateStatus("Loading snapshot...")
+	tui.writeOutput("[yellow]═══ Load Snapshot ═══[white]")
+	tui.ask("load", "Snapshot path: ")
+}
+
+func (tui *MerkleTUI) writeProof() {
+	if !tui.requireTree() {
+		return
+	}
+	tui.updateStatus("Writing inclusion proof...")
+	tui.writeOutput("[yellow]═══ Write Inclusion Proof ═══[white]")
+	tui.ask("prove", "Path in tree: ")
+}
+
+func (tui *MerkleTUI) verifyProof() {
+	tui.updateStatus("Verifying inclusion proof...")
+	tui.writeOutput("[yellow]═══ Verify Inclusion Proof ═══[white]")
+	tui.ask("check", "Root hash: ")
+}
+
+func (tui *MerkleTUI) diffSnapshot() {
+	if !tui.requireTree() {
+		return
+	}
+	tui.updateStatus("Comparing with snapshot...")
+	tui.writeOutput("[yellow]═══ Diff Against Snapshot ═══[white]")
+	tui.ask("diff", "Snapshot path: ")
+}
+
+func (tui *MerkleTUI) verifyContents() {
+	if !tui.requireTree() {
+		return
+	}
+	tui.updateStatus("Re-reading files...")
+	tui.writeOutput("[yellow]═══ Content Verification ═══[white]")
+	tui.startJob("verify_contents", "Re-reading files", nil, func(result json.RawMessage) {
+		var reply struct {
+			Issues []struct {
+				Path    string `json:"path"`
+				Problem string `json:"problem"`
+			} `json:"issues"`
+		}
+		json.Unmarshal(result, &reply)
+		for _, issue := range reply.Issues {
+			tui.writeOutput(fmt.Sprintf("[yellow]%s: %s[white]", tview.Escape(issue.Path), tview.Escape(issue.Problem)))
+		}
+		if len(reply.Issues) == 0 {
+			tui.writeOutput("[green]✓ Content check complete: 0 issues[white]")
+		} else {
+			tui.writeOutput(fmt.Sprintf("[red]✗ Content check complete: %d issues[white]", len(reply.Issues)))
+		}
+	})
+}
+
+func (tui *MerkleTUI) showProfile() {
+	tui.updateStatus("Reading build profile...")
+	tui.writeOutput("[yellow]═══ Build Profile ═══[white]")
+	if !tui.connected() {
+		return
+	}
+
+	go func() {
+		result, err := tui.client.Call("profile", nil)
+		if err != nil && strings.Contains(err.Error(), "Profiling is off") {
+			// Probes only record while profiling, so this covers the next build
+			_, err = tui.client.Call("configure", map[string]string{"profile": "true"})
+			tui.app.QueueUpdateDraw(func() {
+				if err != nil {
+					tui.writeOutput(fmt.Sprintf("[red]✗ Error: %s[white]", tview.Escape(err.Error())))
+				} else {
+					tui.writeOutput("[yellow]Profiling is now on; build the tree (option 1) to record a profile.[white]")
+				}
+				tui.updateStatus("Ready")
+			})
+			return
+		}
+		tui.app.QueueUpdateDraw(func() {
+			if err != nil {
+				tui.writeOutput(fmt.Sprintf("[red]✗ Error: %s[white]", tview.Escape(err.Error())))
+			} else {
+				tui.writeProfile(result)
+			}
+			tui.updateStatus("Ready")
+		})
+	}()
+}
+
+func (tui *MerkleTUI) writeProfile(result json.RawMessage) {
+	var profile struct {
+		WallNs   uint64            `json:"wall_ns"`
+		Threads  uint64            `json:"threads"`
+		Counters map[string]uint64 `json:"counters"`
+		PhaseNs  map[string]uint64 `json:"phase_ns"`
+	}
+	if err := json.Unmarshal(result, &profile); err != nil {
+		tui.writeOutput(fmt.Sprintf("[red]✗ Unexpected reply: %v[white]", err))
+		return
+	}
+
+	tui.writeOutput(fmt.Sprintf("[green]✓ Wall time: %.3f ms on %d threads[white]", float64(profile.WallNs)/1e6, profile.Threads))
+	tui.writeOutput("[yellow]Counters:[white]")
+	for _, name := range sortedKeys(profile.Counters) {
+		tui.writeOutput(fmt.Sprintf("  %s: %d", name, profile.Counters[name]))
+	}
+
+	// Phases are summed over threads, so with several threads they can exceed the wall time
+	tui.writeOutput("[yellow]Phases:[white]")
+	for _, name := range sortedKeys(profile.PhaseNs) {
+		line := fmt.Sprintf("  %s: %.3f ms", name, float64(profile.PhaseNs[name])/1e6)
+		if profile.WallNs > 0 {
+			line += fmt.Sprintf(" (%d%% of wall)", 100*profile.PhaseNs[name]/profile.WallNs)
+		}
+		tui.writeOutput(line)
+	}
+}
+
+func sortedKeys(values map[string]uint64) []string {
+	names := make([]string, 0, len(values))
+	for name := range values {
+		names = append(names, name)
+	}
+	sort.Strings(names)
+	return names
 }
 
 func (tui *MerkleTUI) exit() {
 	tui.updateStatus("Exiting...")
 	tui.writeOutput("[yellow]═══ Exiting Application ═══[white]")
-	tui.sendCommand("8")
-	time.Sleep(100 * time.Millisecond) // Give time for cleanup
 	tui.app.Stop()
 }
 
 func (tui *MerkleTUI) handleInput() {
 	inputText := tui.input.GetText()
 	tui.input.SetText("")
-	
-	switch tui.currentAction {
-	case "build":
-		tui.sendCommand(inputText)
-		tui.writeOutput(fmt.Sprintf("[blue]🔨 Building tree from: %s[white]", inputText))
-		tui.treeBuilt = true
-		tui.currentAction = ""
-		tui.input.SetLabel("Input: ")
-		tui.app.SetFocus(tui.menu)
-		
-	case "chunk":
-		// Validate chunk size
+	action := tui.currentAction
+
+	// A number that does not parse is asked for again
+	if action == "chunk" || action == "threads" {
 		if _, err := strconv.Atoi(inputText); err != nil {
-			tui.writeOutput("[red]✗ Invalid chunk size. Please enter a number.[white]")
+			if action == "chunk" {
+				tui.writeOutput("[red]✗ Invalid chunk size. Please enter a number.[white]")
+			} else {
+				tui.writeOutput("[red]✗ Invalid thread count. Please enter a number.[white]")
+			}
 			return
 		}
-		tui.sendCommand(inputText)
-		tui.writeOutput(fmt.Sprintf("[blue]🔧 Setting chunk size to: %s bytes[white]", inputText))
+	}
+
+	// Every prompt but the first of a proof ends the action
+	if action != "prove" && action != "check" {
 		tui.currentAction = ""
 		tui.input.SetLabel("Input: ")
 		tui.app.SetFocus(tui.menu)
-		
-	default:
-		// Handle general input
-		tui.sendCommand(inputText)
-		tui.app.SetFocus(tui.menu)
 	}
-	
+
+	switch action {
+	case "build":
+		tui.writeOutput(fmt.Sprintf("[blue]🔨 Building tree from: %s[white]", tview.Escape(inputText)))
+		tui.startJob("build", "Building tree", map[string]string{"path": inputText}, func(result json.RawMessage) {
+			tui.treeBuilt = true
+			tui.writeOutput("[green]✓ Merkle tree built successfully![white]")
+			tui.writeOutput("[blue]Tree is now ready for operations.[white]")
+			tui.showTreeStats(result)
+		})
+		return
+
+	case "export":
+		tui.writeOutput(fmt.Sprintf("[blue]📤 Export file: %s[white]", tview.Escape(inputText)))
+		tui.startJob("export", "Exporting to JSON", map[string]string{"path": inputText}, func(json.RawMessage) {
+			tui.writeOutput(fmt.Sprintf("[green]Export completed successfully: %s[white]", tview.Escape(inputText)))
+		})
+		return
+
+	case "chunk":
+		tui.writeOutput(fmt.Sprintf("[blue]🔧 Setting chunk size to: %s bytes[white]", inputText))
+		tui.request("configure", map[string]string{"chunk_size": inputText}, func(json.RawMessage) {
+			tui.writeOutput(fmt.Sprintf("[green]✓ Chunk size set to %s bytes[white]", inputText))
+		})
+		return
+
+	case "threads":
+		tui.writeOutput(fmt.Sprintf("[blue]🔧 Setting thread count to: %s[white]", inputText))
+		tui.request("configure", map[string]string{"threads": inputText}, func(json.RawMessage) {
+			tui.writeOutput(fmt.Sprintf("[green]✓ Thread count set to %s[white]", inputText))
+		})
+		return
+
+	case "diff":
+		tui.writeOutput(fmt.Sprintf("[blue]🔍 Comparing with: %s[white]", tview.Escape(inputText)))
+		tui.request("diff", map[string]string{"snapshot": inputText}, func(result json.RawMessage) {
+			var reply struct {
+				Changes []struct {
+					Type string `json:"type"`
+					Path string `json:"path"`
+				} `json:"changes"`
+			}
+			json.Unmarshal(result, &reply)
+			colors := map[string]string{"added": "green", "removed": "red"}
+			for _, change := range reply.Changes {
+				color, found := colors[change.Type]
+				if !found {
+					color = "yellow"
+				}
+				tui.writeOutput(fmt.Sprintf("[%s]%s %s[white]", color, change.Type, tview.Escape(change.Path)))
+			}
+			tui.writeOutput(fmt.Sprintf("[green]✓ Diff complete: %d changes[white]", len(reply.Changes)))
+		})
+		return
+
+	case "save":
+		tui.writeOutput(fmt.Sprintf("[blue]💾 Snapshot: %s[white]", tview.Escape(inputText)))
+		tui.request("save", map[string]string{"path": inputText}, func(json.RawMessage) {
+			tui.writeOutput(fmt.Sprintf("[green]✓ Snapshot saved to %s[white]", tview.Escape(inputText)))
+		})
+		return
+
+	case "load":
+		tui.writeOutput(fmt.Sprintf("[blue]💾 Snapshot: %s[white]", tview.Escape(inputText)))
+		tui.request("load", map[string]string{"path": inputText}, func(result json.RawMessage) {
+			tui.treeBuilt = true
+			tui.writeOutput(fmt.Sprintf("[green]✓ Snapshot loaded from %s[white]", tview.Escape(inputText)))
+			tui.showTreeStats(result)
+		})
+		return
+
+	case "prove", "check":
+		// Both ask a second question: where the proof is written or read
+		if action == "prove" {
+			tui.pendingArgs = map[string]string{"path": inputText}
+			tui.currentAction = "prove_out"
+		} else {
+			tui.pendingArgs = map[string]string{"root": inputText}
+			tui.currentAction = "check_proof"
+		}
+		tui.input.SetLabel("Proof file: ")
+		return
+
+	case "prove_out":
+		tui.writeOutput(fmt.Sprintf("[blue]🔏 Proof file: %s[white]", tview.Escape(inputText)))
+		tui.pendingArgs["out"] = inputText
+		tui.request("prove", tui.pendingArgs, func(result json.RawMessage) {
+			var reply struct {
+				RootHash string `json:"root_hash"`
+				Proof    string `json:"proof"`
+			}
+			json.Unmarshal(result, &reply)
+			tui.writeOutput(fmt.Sprintf("[green]✓ Proof written to %s (%d bytes) for root %s[white]",
+				tview.Escape(inputText), len(reply.Proof)/2, reply.RootHash))
+		})
+		return
+
+	case "check_proof":
+		tui.writeOutput(fmt.Sprintf("[blue]🔏 Proof file: %s[white]", tview.Escape(inputText)))
+		tui.pendingArgs["proof_file"] = inputText
+		tui.request("verify_proof", tui.pendingArgs, func(result json.RawMessage) {
+			var reply struct {
+				Valid bool `json:"valid"`
+			}
+			json.Unmarshal(result, &reply)
+			if reply.Valid {
+				tui.writeOutput("[green]✓ Proof verified: OK[white]")
+			} else {
+				tui.writeOutput("[red]✗ Proof verification FAILED[white]")
+			}
+		})
+		return
+	}
+
 	tui.updateStatus("Ready")
 }
 
@@ -407,24 +831,29 @@ func (tui *MerkleTUI) Run() error {
 }
 
 func (tui *MerkleTUI) cleanup() {
-	if tui.stdin != nil {
-		tui.stdin.Close()
-	}
-	if tui.stdout != nil {
-		tui.stdout.Close()
+	// The daemon removes its socket when it shuts down
+	if tui.client != nil {
+		tui.client.Call("shutdown", nil)
+		tui.client.Close()
 	}
-	if tui.cppProcess != nil {
-		tui.cppProcess.Process.Kill()
-		tui.cppProcess.Wait()
+	if tui.daemon != nil {
+		done := make(chan error, 1)
+		go func() { done <- tui.daemon.Wait() }()
+		select {
+		case <-done:
+		case <-time.After(2 * time.Second):
+			tui.daemon.Process.Kill()
+			<-done
+		}
 	}
 }
 
 func main() {
 	tui := NewMerkleTUI()
 	defer tui.cleanup()
-	
+
 	if err := tui.Run(); err != nil {
 		fmt.Fprintf(os.Stderr, "Error running TUI: %v\n", err)
 		os.Exit(1)
 	}
-}
\ No newline at end of file
+}